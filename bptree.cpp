@@ -135,11 +135,63 @@ void test_scan()
 
 }
 
+// keys 2n and 2n+1 fall in the same range
+int pair_compare(bptree_key_t a, bptree_key_t b)
+{
+   return a.key_size / 2 - b.key_size / 2;
+}
+
+void test_seek()
+{
+   bptree t = {3, 0, size_compare};
+   bptree_iterator it;
+
+   int found = bptree_seek(&t, int_key(0), &it);
+   assert(!found);
+
+   // every key twice, so duplicates straddle leaf splits
+   int keys = 40;
+   for (int i = 0; i < keys; i++) {
+      bptree_insert(&t, int_key(i / 2 * 2), (void*)(uintptr_t)i);
+   }
+
+   for (int i = -1; i <= keys; i++) {
+      found = bptree_seek(&t, int_key(i), &it);
+      assert(found);
+      int want = i < 0 ? 0 : (i + 1) / 2 * 2;
+      if (want >= keys) {
+         assert(bptree_iterator_is_end(&it));
+      } else {
+         assert(bptree_key(&it).key_size == want);
+         int n = 0;
+         while (!bptree_iterator_is_end(&it) && bptree_key(&it).key_size == want) {
+            n++;
+            bptree_iterator_next(&it);
+         }
+         assert(n == 2);
+      }
+
+      // bptree_scan stops after every equal key
+      found = bptree_scan(&t, int_key(i), &it);
+      assert(found);
+      want = i < 0 ? 0 : (i + 2) / 2 * 2;
+      assert(want >= keys ? bptree_iterator_is_end(&it) : bptree_key(&it).key_size == want);
+   }
+
+   // a coarser compare seeks to the start of its range
+   t.compare = pair_compare;
+   for (int i = 0; i < keys; i++) {
+      found = bptree_seek(&t, int_key(i), &it);
+      assert(found && bptree_key(&it).key_size == i / 2 * 2);
+   }
+}
+
 int main(int argc, char** argv)
 {
 
 //   test_find_first_less_than();
    test_scan();
+   test_seek();
 
 #if 0
    bptree t = {7, 0, size_compare};
@@ -56,6 +56,25 @@ int bptree_find_first_less_than(bptree_key_t* keys, int keys_count, bptree_key_t
    return low;
 }
 
+// return keys_count(one past the end) if all keys are less than key.
+int bptree_find_first_not_less_than(bptree_key_t* keys, int keys_count, bptree_key_t key, bptree_key_compare_fn compare)
+{
+   int low = 0;
+   int high = keys_count;
+
+   while (low != high) {
+      int mid = (low + high) / 2;
+      int cmp = compare(keys[mid], key);
+      if (cmp < 0) {
+         low = mid + 1;
+      } else {
+         high = mid;
+      }
+   }
+
+   return low;
+}
+
 int bptree_find_key(bptree_key_t* keys, int keys_count, bptree_key_t key, bptree_key_compare_fn compare)
 {
    int low = 0;
@@ -319,6 +338,15 @@ void* bptree_value(bptree_iterator* it)
    return it->n->pointers[it->key_idx];
 }
 
+// one past the last key of a leaf is the first key of the next leaf
+void bptree_iterator_settle(bptree_iterator* it)
+{
+   if (it->key_idx == it->n->count && it->n->next) {
+      it->n = it->n->next;
+      it->key_idx = 0;
+   }
+}
+
 int bptree_scan(bptree* t, bptree_key_t after, bptree_iterator* it)
 {
    if (t->root) {
@@ -330,6 +358,7 @@ int bptree_scan(bptree* t, bptree_key_t after, bptree_iterator* it)
          it->t = t;
          it->n = n;
          it->key_idx = idx;
+         bptree_iterator_settle(it);
          return 1;
       }
    }
@@ -337,6 +366,54 @@ int bptree_scan(bptree* t, bptree_key_t after, bptree_iterator* it)
    return 0;
 }
 
+// keys left of a separator are <= it, so the first separator not less
+// than key leads to the leftmost key not less than key
+bptree_node* bptree_seek_recur(bptree* t, bptree_node* n, bptree_key_t key)
+{
+   while (!n->is_leaf) {
+      int idx = bptree_find_first_not_less_than(n->keys, n->count, key, t->compare);
+      n = (bptree_node*)n->pointers[idx];
+   }
+   return n;
+}
+
+// position it at the first key not less than key. unlike bptree_scan this
+// finds keys equal to key, which lets a compare that matches a whole range
+// of keys (a prefix) seek to the start of that range.
+int bptree_seek(bptree* t, bptree_key_t key, bptree_iterator* it)
+{
+   if (t->root) {
+      bptree_node* n = bptree_seek_recur(t, t->root, key);
+
+      it->t = t;
+      it->n = n;
+      it->key_idx = bptree_find_first_not_less_than(n->keys, n->count, key, t->compare);
+      bptree_iterator_settle(it);
+      return 1;
+   }
+
+   return 0;
+}
+
+void bptree_free_node(bptree_node* n)
+{
+   if (!n->is_leaf) {
+      for (int i = 0; i <= n->count; i++) {
+         bptree_free_node((bptree_node*)n->pointers[i]);
+      }
+   }
+   free(n);
+}
+
+// drop every node, the keys and values are the caller's
+void bptree_clear(bptree* t)
+{
+   if (t->root) {
+      bptree_free_node(t->root);
+      t->root = 0;
+   }
+}
+
 
 
 
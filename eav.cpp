@@ -4,6 +4,13 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define HAMT_IMPLEMENATION
 #include "hamt.h"
@@ -53,11 +60,26 @@ memory_arena* create_arena(size_t page_size)
 
 void* arena_allocate(memory_arena* arena, size_t size)
 {
+   // keep every allocation pointer aligned, strings have odd sizes
+   size = (size + 7) & ~(size_t)7;
+
    size_t remaining = arena->page->end - arena->page->p;
 
+   size_t need = size + sizeof(memory_arena_page);
+
+   if (need > arena->page_size) {
+      // too big for a page, give it its own behind the current one
+      memory_arena_page* page = allocate_page(need);
+      page->next = arena->page->next;
+      arena->page->next = page;
+      arena->size += size;
+      page->p = page->end;
+      return page->data;
+   }
+
    if (remaining < size) {
       // make another page!
-      memory_arena_page* page = allocate_page(arena->page_size < size ? size : arena->page_size);
+      memory_arena_page* page = allocate_page(arena->page_size);
       page->next = arena->page;
       arena->page = page;
    }
@@ -69,6 +91,17 @@ void* arena_allocate(memory_arena* arena, size_t size)
    return p;
 }
 
+void destroy_arena(memory_arena* arena)
+{
+   // the arena itself lives in its first page, which is freed last
+   memory_arena_page* page = arena->page;
+   while (page) {
+      memory_arena_page* next = page->next;
+      free(page);
+      page = next;
+   }
+}
+
 #define push_struct(arena, type) (type *)arena_allocate(arena, sizeof(type))
 
 struct cons_cell
@@ -134,32 +167,61 @@ int compare_keyword(const keyword* a, const keyword* b)
 struct interned_keywords
 {
    memory_arena* arena;
-   hamt h;
+   hamt_concurrent h;
 };
 
-interned_keywords *global_keywords = 0;
+interned_keywords* create_interned_keywords()
+{
+   memory_arena* a = create_arena(4096);
+   interned_keywords* ikw = push_struct(a, interned_keywords);
+   ikw->arena = a;
+   hamt_concurrent_init(&ikw->h, hash_keyword, (compare_fn_t)compare_keyword);
 
-keyword* kw(const char* ns, const char* n)
+   return ikw;
+}
+
+interned_keywords* global_keywords()
 {
-   if (global_keywords == 0) {
-      memory_arena* a = create_arena(4096);
-      interned_keywords* ikw = push_struct(a, interned_keywords);
-      ikw->arena = a;
-      hamt_init(&ikw->h, hash_keyword, (compare_fn_t)compare_keyword);
+   static interned_keywords* ikw = create_interned_keywords();
+   return ikw;
+}
+
+// each thread interns through its own hamt handle and allocates its
+// keywords from its own arena
+struct keyword_thread
+{
+   hamt_thread* th;
+   memory_arena* arena;
 
-      global_keywords = ikw;
+   ~keyword_thread()
+   {
+      if (th) {
+         hamt_thread_detach(th);
+      }
+   }
+};
+
+static thread_local keyword_thread local_keywords;
+
+keyword* kw(const char* ns, const char* n)
+{
+   keyword_thread* kt = &local_keywords;
+   if (kt->th == 0) {
+      kt->th = hamt_thread_attach(&global_keywords()->h);
+      kt->arena = create_arena(4096);
    }
 
    keyword k = {ns, n};
 
-   keyword* found = (keyword*)hamt_find(&global_keywords->h, &k);
+   keyword* found = (keyword*)hamt_concurrent_find(kt->th, &k);
 
    if (!found) {
-      found = push_struct(global_keywords->arena, keyword);
-      found->ns = ns;
-      found->n = n;
+      keyword* nk = push_struct(kt->arena, keyword);
+      nk->ns = ns;
+      nk->n = n;
 
-      hamt_insert(&global_keywords->h, found, found);
+      // another thread may have interned it first, then nk is unused
+      found = (keyword*)hamt_concurrent_intern(kt->th, nk, nk);
    }
 
    return found;
@@ -187,23 +249,24 @@ enum value_type
    ref_value
 };
 
+// 32 bytes, the flags take the top byte of a and a string value is kept
+// out of line
 struct datom
 {
-   int32_t f; // flags (add/retract, type, etc)
    int64_t e;
-   int64_t a;
+   int64_t a : 56;
+   int64_t f : 8; // value type in the low 4 bits, every datom is an assertion
    int64_t t;
    union v {
       double f;
       int64_t i;
-      struct {
-         int32_t s;
-         char c[4];
-      } s;
+      const char* s;
       const keyword* kw;
    } v;
 };
 
+static_assert(sizeof(datom) == 32, "datom is packed into 32 bytes");
+
 void print_datom(datom* d)
 {
    value_type vtype = (value_type)(d->f & 0xf);
@@ -218,7 +281,7 @@ void print_datom(datom* d)
       printf("[%lli %lli %lf %lli]", d->e, d->a, d->v.f, d->t);
       break;
    case string_value:
-      printf("[%lli %lli \"%s\" %lli]", d->e, d->a, d->v.s.c, d->t);
+      printf("[%lli %lli \"%s\" %lli]", d->e, d->a, d->v.s, d->t);
       break;
    case ref_value:
       printf("[%lli %lli %lli %lli]", d->e, d->a, d->v.i, d->t);
@@ -232,469 +295,4009 @@ void print_datom(datom* d)
 
 #define key_to_datom(K) ((datom*)((K).key_data_p))
 
+#define DATOM_COMPONENTS 4
+
 bptree_key_t datom_to_key(datom* d)
 {
-   bptree_key_t k = {sizeof(datom), d};
+   bptree_key_t k = {DATOM_COMPONENTS, d};
+   return k;
+}
+
+// a probe on the first n components of d in index order, see compare_eavt
+bptree_key_t datom_prefix_key(datom* d, int n)
+{
+   bptree_key_t k = {n, d};
    return k;
 }
 
+inline
+int compare_id(int64_t a, int64_t b)
+{
+   return (a > b) - (a < b);
+}
+
+inline
+int key_components(bptree_key_t a, bptree_key_t b)
+{
+   return a.key_size < b.key_size ? a.key_size : b.key_size;
+}
+
+// ints and refs are both just numbers, to the indexes and to joins
+inline
+value_type value_class(value_type t)
+{
+   return t == ref_value ? int_value : t;
+}
+
+// a float as a number that sorts the way the index keys have it, -0 is 0
+// and every NaN is one value past infinity, so the order is total
+inline
+uint64_t float_order(double f)
+{
+   uint64_t u;
+   if (f != f) {
+      return ~(uint64_t)0;
+   }
+   f = f == 0 ? 0.0 : f;
+   memcpy(&u, &f, sizeof(u));
+   return (u >> 63) ? ~u : u ^ ((uint64_t)1 << 63);
+}
+
+inline
+int compare_float(double a, double b)
+{
+   uint64_t x = float_order(a);
+   uint64_t y = float_order(b);
+   return (x > y) - (x < y);
+}
+
 int compare_value(datom* a, datom* b)
 {
-   value_type a_type = (value_type)(a->f & 0xf);
-   value_type b_type = (value_type)(b->f & 0xf);
+   value_type a_type = value_class((value_type)(a->f & 0xf));
+   value_type b_type = value_class((value_type)(b->f & 0xf));
 
    if (a_type == b_type) {
       switch (a_type) {
          case int_value:
          case boolean_value:
          case ref_value:
-            return a->v.i - a->v.i;
+            return compare_id(a->v.i, b->v.i);
             break;
          case float_value:
-            // TODO: Not dumb float compare
-            return (int)(a->v.f - a->v.f);
+            return compare_float(a->v.f, b->v.f);
             break;
          case string_value:
             // TODO: don't use strcmp
-            return strcmp(a->v.s.c, b->v.s.c);
+            return strcmp(a->v.s, b->v.s);
             break;
          case keyword_value:
             return compare_keyword(a->v.kw, b->v.kw);
             break;
       }
-   } else {
-      // TODO ???
-      return 0;
    }
+
+   // values of different types order by type
+   return a_type < b_type ? -1 : 1;
 }
 
+// key_size is how many leading components of a key take part in the
+// compare. stored datoms carry all of them and a probe only its bound
+// prefix, so a probe is equal to every datom that starts with it and
+// bptree_seek finds the first of them.
 int compare_eavt(bptree_key_t ak, bptree_key_t bk)
 {
    datom* a = key_to_datom(ak);
    datom* b = key_to_datom(bk);
+   int n = key_components(ak, bk);
 
-   if (a->e == b->e) {
-      if (a->a == b->a) {
-         int vcmp = compare_value(a, b);
-         if (vcmp == 0) {
-            return a->t - b->t;
-         } else {
-            return vcmp;
-         }
-      } else {
-         return a->a - b->a;
-      }
-   } else {
-      return a->e - b->e;
+   int cmp = n > 0 ? compare_id(a->e, b->e) : 0;
+   if (cmp == 0 && n > 1) {
+      cmp = compare_id(a->a, b->a);
+   }
+   if (cmp == 0 && n > 2) {
+      cmp = compare_value(a, b);
+   }
+   if (cmp == 0 && n > 3) {
+      cmp = compare_id(a->t, b->t);
    }
+   return cmp;
 }
 
 int compare_aevt(bptree_key_t ak, bptree_key_t bk)
 {
    datom* a = key_to_datom(ak);
    datom* b = key_to_datom(bk);
+   int n = key_components(ak, bk);
 
-   if (a->a == b->a) {
-      if (a->e == b->e) {
-         int vcmp = compare_value(a, b);
-         if (vcmp == 0) {
-            return a->t - b->t;
-         } else {
-            return vcmp;
-         }
-      } else {
-         return a->e - b->e;
-      }
-   } else {
-      return a->a - b->a;
+   int cmp = n > 0 ? compare_id(a->a, b->a) : 0;
+   if (cmp == 0 && n > 1) {
+      cmp = compare_id(a->e, b->e);
+   }
+   if (cmp == 0 && n > 2) {
+      cmp = compare_value(a, b);
    }
+   if (cmp == 0 && n > 3) {
+      cmp = compare_id(a->t, b->t);
+   }
+   return cmp;
 }
 
 int compare_avet(bptree_key_t ak, bptree_key_t bk)
 {
    datom* a = key_to_datom(ak);
    datom* b = key_to_datom(bk);
+   int n = key_components(ak, bk);
 
-   if (a->a == b->a) {
-      int vcmp = compare_value(a, b);
-      if (vcmp == 0) {
-         if (a->e == b->e) {
-            return a->t - b->t;
-         } else {
-            return a->e - b->e;
-         }
-      } else {
-         return vcmp;
-      }
-   } else {
-      return a->a - b->a;
+   int cmp = n > 0 ? compare_id(a->a, b->a) : 0;
+   if (cmp == 0 && n > 1) {
+      cmp = compare_value(a, b);
    }
+   if (cmp == 0 && n > 2) {
+      cmp = compare_id(a->e, b->e);
+   }
+   if (cmp == 0 && n > 3) {
+      cmp = compare_id(a->t, b->t);
+   }
+   return cmp;
 }
 
 int compare_vaet(bptree_key_t ak, bptree_key_t bk)
 {
    datom* a = key_to_datom(ak);
    datom* b = key_to_datom(bk);
+   int n = key_components(ak, bk);
 
    // NOTE: vaet is only for ref types, so just use v.i
-   if (a->v.i == b->v.i) {
-      if (a->a == b->a) {
-         if (a->e == b->e) {
-            return a->t - b->t;
-         } else {
-            return a->e - b->e;
-         }
-      } else {
-         return a->a - b->a;
-      }
-   } else {
-      return a->v.i - b->v.i;
+   int cmp = n > 0 ? compare_id(a->v.i, b->v.i) : 0;
+   if (cmp == 0 && n > 1) {
+      cmp = compare_id(a->a, b->a);
+   }
+   if (cmp == 0 && n > 2) {
+      cmp = compare_id(a->e, b->e);
    }
+   if (cmp == 0 && n > 3) {
+      cmp = compare_id(a->t, b->t);
+   }
+   return cmp;
 }
 
-struct datom_index
+// Index keys
+//
+// The live trees hold each datom under a byte string that sorts the way
+// the datom does in the tree's index order, so the trees compare keys with
+// one memcmp. The components are written in index order:
+//
+//    e, a, t  8 bytes big-endian with the sign bit flipped
+//    v        its value class in one byte, then ints, refs and booleans
+//             like ids, a float as its float_order, a string with its 0
+//             terminator and a keyword as its terminated namespace and
+//             name
+//
+// vaet only holds refs, its v is the id alone. No encoding of a component
+// is a prefix of another, so two keys compare equal over the shorter one
+// exactly when one starts with the other. A probe on the first n
+// components is the first n encoded, as it is for compare_eavt.
+
+#define EAVT_COMPONENTS "eavt"
+#define AEVT_COMPONENTS "aevt"
+#define AVET_COMPONENTS "avet"
+#define VAET_COMPONENTS "raet"   // r is v as a ref
+
+// out may be 0 to only count the bytes
+inline
+size_t put_key_bytes(uint8_t* out, size_t at, const void* p, size_t n)
 {
-   bptree t;
-};
-
+   if (out) {
+      memcpy(out + at, p, n);
+   }
+   return at + n;
+}
 
-void init_index(datom_index* idx, int order, bptree_key_compare_fn cmp)
+inline
+size_t put_key_u64(uint8_t* out, size_t at, uint64_t u)
 {
-   idx->t.order = order;
-   idx->t.root = 0;
-   idx->t.compare = cmp;
+   if (out) {
+      for (int i = 0; i < 8; i++) {
+         out[at + i] = (uint8_t)(u >> (56 - 8 * i));
+      }
+   }
+   return at + 8;
 }
 
-struct segment;
-
-struct partition
+inline
+size_t put_key_id(uint8_t* out, size_t at, int64_t x)
 {
-   uint32_t id;
-   const keyword* name;
-   int32_t sequence;
-};
-
-struct attribute {
-   int64_t  id;
-   const keyword* ident;
-   const keyword* unique;
-   const keyword* valueType;
-   const char* doc;
-};
+   return put_key_u64(out, at, (uint64_t)x ^ ((uint64_t)1 << 63));
+}
 
-struct database
+size_t put_key_value(uint8_t* out, size_t at, const datom* d)
 {
-   memory_arena* arena;
-
-   datom_index eavt;
-   datom_index aevt;
-   datom_index vaet;
-   datom_index avet;
-   int partition_count;
-   struct partition partitions[3];
-   int attribute_count;
-   attribute installed_attributes[256];
-};
+   value_type type = value_class((value_type)(d->f & 0xf));
+   uint8_t tag = (uint8_t)type;
+   at = put_key_bytes(out, at, &tag, 1);
 
+   switch (type) {
+   case float_value:
+      return put_key_u64(out, at, float_order(d->v.f));
+   case string_value:
+      return put_key_bytes(out, at, d->v.s, strlen(d->v.s) + 1);
+   case keyword_value:
+      at = put_key_bytes(out, at, d->v.kw->ns, strlen(d->v.kw->ns) + 1);
+      return put_key_bytes(out, at, d->v.kw->n, strlen(d->v.kw->n) + 1);
+   default:
+      return put_key_id(out, at, d->v.i);
+   }
+}
 
-struct transaction
+// encode the first n components of d into out, or only count them
+size_t encode_key(const char* components, const datom* d, int n, uint8_t* out)
 {
-   memory_arena* arena;
-   uint64_t ts;
-   uint32_t txn_id;
-   int datom_count;
-   cons_cell* items;
-};
+   size_t at = 0;
+   for (int i = 0; i < n && components[i]; i++) {
+      switch (components[i]) {
+      case 'e': at = put_key_id(out, at, d->e); break;
+      case 'a': at = put_key_id(out, at, d->a); break;
+      case 't': at = put_key_id(out, at, d->t); break;
+      case 'r': at = put_key_id(out, at, d->v.i); break;
+      case 'v': at = put_key_value(out, at, d); break;
+      }
+   }
+   return at;
+}
 
-struct transaction_result
+// key_size is the length of the key
+int compare_index_keys(bptree_key_t a, bptree_key_t b)
 {
-   database* before;
-   database* after;
-   transaction* txn;
-};
+   int n = a.key_size < b.key_size ? a.key_size : b.key_size;
+   int cmp = memcmp(a.key_data_p, b.key_data_p, n);
+   return (cmp > 0) - (cmp < 0);
+}
 
-struct log
+// Segments
+//
+// A segment is a sorted, immutable run of one index. checkpoint writes
+// them to files, which are mapped back in when the database is opened
+// again, and the live trees are sealed into them in memory (see Runs)
+//
+//    header | datoms | strings | keywords
+//
+// Datoms are stored as they are in memory, 32 bytes one after the other,
+// so a seek binary searches them and a scan reads straight through. A
+// string value is stored as its offset in the strings, 0 terminated and
+// read right out of the mapping, and a keyword value as its number in
+// the keyword table at the end, which is interned when the segment is
+// opened.
+
+#define SEGMENT_MAGIC 0x53564145
+#define SEGMENT_VERSION 2
+#define INDEX_MAX_SEGMENTS 8
+
+struct segment_header
 {
-   struct log* next;
-   struct transaction txn;
-};
-
-const keyword* db_ident = kw("db", "ident");
-const keyword* db_id = kw("db", "id");
-const keyword* db_valueType = kw("db", "valueType");
-const keyword* db_doc = kw("db", "doc");
-
-const keyword* db_unique = kw("db", "unique");
-const keyword* db_unique_value = kw("db.unique", "value");
-const keyword* db_unique_identity = kw("db.unique", "identity");
-
-const keyword* db_valueType_string = kw("db.type", "string");
-const keyword* db_valueType_int = kw("db.type", "int");
-const keyword* db_valueType_keyword = kw("db.type", "keyword");
-const keyword* db_valueType_ref = kw("db.type", "ref");
-
-const keyword* db_part_db = kw("db.part", "db");
-const keyword* db_part_tx = kw("db.part", "tx");
-const keyword* db_part_user = kw("db.part", "user");
-
-static int64_t temp_id_sequence = -1;
-
-// builtin attribute dbids
-enum {
-   dbid_ident = 0,
-   dbid_unique,
-   dbid_doc,
-   dbid_valuetype
+   uint32_t magic;
+   uint32_t version;
+   uint32_t keyword_count;
+   uint32_t unused;
+   uint64_t count;
+   uint64_t strings_offset;   // also the end of the datoms
+   uint64_t keywords_offset;
 };
 
-enum {
-   DB_PART_DB = 0,
-   DB_PART_TX = 1,
-   DB_PART_USER
+struct segment
+{
+   char* path;
+   char* base;
+   size_t size;
+   const segment_header* header;
+   const datom* datoms;
+   const keyword** keywords;
+   bptree_key_compare_fn compare;
+   int mapped;    // else base is malloced
+   int refs;      // of the index and the snapshots holding it
 };
 
-struct temp_id
+// The live tree of an index comes in generations. A snapshot shares them
+// rather than copying them, so a write after a pin starts a new one and
+// leaves the pinned ones as they are. Each generation has its keys in an
+// arena of its own, freed with the tree once it is sealed and the last
+// snapshot holding it is unpinned.
+struct live_tree
 {
-   keyword* part;
-   int64_t s;
+   bptree t;   // of index keys
+   memory_arena* keys;
+   int refs;   // of the index and the snapshots holding it
 };
 
-temp_id tempid(keyword* part)
+#define LIVE_KEYS_PAGE_SIZE 65536
+#define INDEX_MAX_TREES 4
+
+live_tree* create_live_tree(int order)
 {
-   temp_id tid = {part, temp_id_sequence--};
-   return tid;
+   live_tree* l = (live_tree*)malloc(sizeof(live_tree));
+   l->t.order = order;
+   l->t.root = 0;
+   l->t.compare = compare_index_keys;
+   l->keys = create_arena(LIVE_KEYS_PAGE_SIZE);
+   l->refs = 1;
+   return l;
 }
 
-
-transaction* create_transaction()
+void live_tree_retain(live_tree* l)
 {
-   memory_arena* arena = create_arena(4096);
-
-   transaction* t = push_struct(arena, transaction);
-
-   t->arena = arena;
-
-   return t;
+   __atomic_fetch_add(&l->refs, 1, __ATOMIC_RELAXED);
 }
 
-bool add_datom(transaction* txn, datom* d)
+void live_tree_release(live_tree* l)
 {
-   cons_cell* c = push_struct(txn->arena, cons_cell);
-
-   c->car = d;
-   c->cdr = txn->items;
-
-   txn->items = c;
-
-   return true;
+   if (__atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      bptree_clear(&l->t);
+      destroy_arena(l->keys);
+      free(l);
+   }
 }
 
-datom* make_datom(memory_arena* arena, int64_t e, int64_t a, int64_t v, int64_t t = 0)
+struct datom_index
 {
-   datom* d = push_struct(arena, datom);
+   int order;   // of the trees
+   const char* components;
+   bptree_key_compare_fn compare;   // of datoms, for the segments
+
+   // the generations of the live tree, inserts go to the last, and the
+   // sealed runs, each datom is in one of them
+   int tree_count;
+   live_tree* trees[INDEX_MAX_TREES];
+   int segment_count;
+   segment* segments[INDEX_MAX_SEGMENTS];
+};
 
-   d->f = int_value;
-   d->e = e;
-   d->a = a;
-   d->t = t;
-   d->v.i = v;
 
-   return d;
+void init_index(datom_index* idx, int order, bptree_key_compare_fn cmp, const char* components)
+{
+   idx->order = order;
+   idx->components = components;
+   idx->compare = cmp;
+   idx->tree_count = 0;
+   idx->segment_count = 0;
 }
 
-datom* make_datom(memory_arena* arena, int64_t e, int64_t a, ref_t r, int64_t t = 0)
+// the key of d in idx's tree, a copy of d sits in front of it so a scan
+// of the tree reads the datom along with its key. The leaves only hold
+// the bptree_key_t, so a live datom costs each index 32 bytes for the
+// copy, its encoded key and 24 bytes of leaf slot.
+bptree_key_t index_key(memory_arena* arena, datom_index* idx, datom* d)
 {
-   datom* d = push_struct(arena, datom);
-
-   d->f = ref_value;
-   d->e = e;
-   d->a = a;
-   d->t = t;
-   d->v.i = r.r;
+   size_t size = encode_key(idx->components, d, DATOM_COMPONENTS, 0);
+   datom* p = (datom*)arena_allocate(arena, sizeof(datom) + size);
+   *p = *d;
+   encode_key(idx->components, d, DATOM_COMPONENTS, (uint8_t*)(p + 1));
 
-   return d;
+   bptree_key_t k = {(int)size, p + 1};
+   return k;
 }
 
-datom* make_datom(memory_arena* arena, int64_t e, int64_t a, const char* v, int64_t t = 0)
+datom* tree_datom(bptree_iterator* it)
 {
-   int len = strlen(v)+1;
-
-   datom* d = (datom*)arena_allocate(arena, sizeof(datom) + len - 4);
-
-   d->f = string_value;
-   d->e = e;
-   d->a = a;
-   d->t = t;
-   d->v.s.s = len;
-   strcpy(d->v.s.c, v);
-
-   return d;
+   return (datom*)bptree_key(it).key_data_p - 1;
 }
 
-datom* make_datom(memory_arena* arena, int64_t e, int64_t a, const keyword* kw, int64_t t = 0)
+// start idx over with one empty tree, the old ones go once no snapshot
+// has them
+void clear_live(datom_index* idx)
 {
-   datom* d = (datom*)arena_allocate(arena, sizeof(datom));
-
-   d->f = keyword_value;
-   d->e = e;
-   d->a = a;
-   d->t = t;
-   d->v.kw = kw;
-
-   return d;
+   for (int i = 0; i < idx->tree_count; i++) {
+      live_tree_release(idx->trees[i]);
+   }
+   idx->trees[0] = create_live_tree(idx->order);
+   idx->tree_count = 1;
 }
 
-bool add_fact(transaction* txn, int64_t e, int64_t a, int64_t v)
+int live_empty(datom_index* idx)
 {
-   return add_datom(txn, make_datom(txn->arena, e, a, v));
+   for (int i = 0; i < idx->tree_count; i++) {
+      if (idx->trees[i]->t.root) {
+         return 0;
+      }
+   }
+   return 1;
 }
 
-bool add_fact(transaction* txn, int64_t e, int64_t a, ref_t r)
+// copy every generation into one new tree, for when snapshots hold on to
+// INDEX_MAX_TREES of them
+void fold_live(datom_index* idx)
 {
-   return add_datom(txn, make_datom(txn->arena, e, a, r));
+   live_tree* l = create_live_tree(idx->order);
+   for (int i = 0; i < idx->tree_count; i++) {
+      bptree_iterator it;
+      if (!bptree_begin(&idx->trees[i]->t, &it)) {
+         continue;
+      }
+      for (; !bptree_iterator_is_end(&it); bptree_iterator_next(&it)) {
+         bptree_key_t k = bptree_key(&it);
+         datom* p = (datom*)arena_allocate(l->keys, sizeof(datom) + k.key_size);
+         memcpy(p, tree_datom(&it), sizeof(datom) + k.key_size);
+         k.key_data_p = p + 1;
+         bptree_insert(&l->t, k);
+      }
+   }
+   for (int i = 0; i < idx->tree_count; i++) {
+      live_tree_release(idx->trees[i]);
+   }
+   idx->trees[0] = l;
+   idx->tree_count = 1;
 }
 
-bool add_fact(transaction* txn, int64_t e, int64_t a, const char* v)
+// the tree inserts go to, a new generation once a snapshot holds the last
+// one. called with index_lock held exclusively, so no pin can come in.
+live_tree* writable_tree(datom_index* idx)
 {
-   return add_datom(txn, make_datom(txn->arena, e, a, v));
+   live_tree* l = idx->trees[idx->tree_count - 1];
+   if (__atomic_load_n(&l->refs, __ATOMIC_ACQUIRE) == 1) {
+      return l;
+   }
+   if (idx->tree_count == INDEX_MAX_TREES) {
+      fold_live(idx);
+   } else {
+      idx->trees[idx->tree_count++] = create_live_tree(idx->order);
+   }
+   return idx->trees[idx->tree_count - 1];
 }
 
-bool add_fact(transaction* txn, int64_t e, int64_t a, keyword* kw)
+void insert_datom(datom_index* idx, datom* d)
 {
-   return add_datom(txn, make_datom(txn->arena, e, a, kw));
+   live_tree* l = writable_tree(idx);
+   bptree_insert(&l->t, index_key(l->keys, idx, d));
 }
 
-transaction_result* transact(database* db, transaction* txn)
+struct probe_buffer
 {
-   cons_cell* seq = txn->items;
-   int cnt = 0;
+   uint8_t* data;
+   size_t cap;
 
-   while (seq) {
-      datom* d = (datom*)car(seq);
+   ~probe_buffer()
+   {
+      free(data);
+   }
+};
 
-      bptree_key_t k = datom_to_key(d);
+static thread_local probe_buffer local_probe;
 
-      bptree_insert(&db->eavt.t, k);
-      bptree_insert(&db->aevt.t, k);
+// a datom key as a key of idx's tree, good until the thread's next probe
+bptree_key_t index_probe(datom_index* idx, bptree_key_t key)
+{
+   datom* d = key_to_datom(key);
+   size_t size = encode_key(idx->components, d, key.key_size, 0);
+   probe_buffer* b = &local_probe;
+   if (!b->data || size > b->cap) {
+      b->cap = size < 64 ? 64 : size * 2;
+      b->data = (uint8_t*)realloc(b->data, b->cap);
+   }
+   encode_key(idx->components, d, key.key_size, b->data);
+
+   bptree_key_t k = {(int)size, b->data};
+   return k;
+}
+
+struct segment_iterator
+{
+   segment* s;
+   uint64_t at;   // the current datom, count at the end
+   datom d;       // the current datom with its string or keyword resolved
+};
+
+int segment_at_end(segment_iterator* it)
+{
+   return it->at >= it->s->header->count;
+}
+
+datom* segment_datom(segment_iterator* it)
+{
+   const datom* d = it->s->datoms + it->at;
+   switch (d->f & 0xf) {
+   case string_value:
+      it->d = *d;
+      it->d.v.s = it->s->base + it->s->header->strings_offset + d->v.i;
+      return &it->d;
+   case keyword_value:
+      it->d = *d;
+      it->d.v.kw = it->s->keywords[d->v.i];
+      return &it->d;
+   default:
+      return (datom*)d;
+   }
+}
+
+void segment_next(segment_iterator* it)
+{
+   it->at++;
+}
+
+// position it at the first datom not less than key, or the first one
+// greater than key if strict, like bptree_seek and bptree_scan
+void segment_seek(segment_iterator* it, segment* s, bptree_key_t key, int strict)
+{
+   it->s = s;
+
+   uint64_t lo = 0;
+   uint64_t hi = s->header->count;
+   while (lo < hi) {
+      it->at = lo + (hi - lo) / 2;
+      int cmp = s->compare(key, datom_to_key(segment_datom(it)));
+      if (cmp < 0 || (cmp == 0 && !strict)) {
+         hi = it->at;
+      } else {
+         lo = it->at + 1;
+      }
+   }
+   it->at = lo;
+}
+
+void close_segment(segment* s)
+{
+   if (s->mapped) {
+      munmap(s->base, s->size);
+   } else {
+      free(s->base);
+   }
+   free(s->keywords);
+   free(s->path);
+   free(s);
+}
+
+void segment_retain(segment* s)
+{
+   __atomic_fetch_add(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+// close s once nothing holds it, see pin_database
+void segment_release(segment* s)
+{
+   if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      close_segment(s);
+   }
+}
+
+// map the segment file at path, 0 if it is not one
+segment* open_segment(const char* path, bptree_key_compare_fn compare, memory_arena* arena)
+{
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+      return 0;
+   }
+
+   struct stat st;
+   void* base = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(segment_header)) {
+      base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if (base == MAP_FAILED) {
+      return 0;
+   }
+
+   const segment_header* h = (const segment_header*)base;
+   size_t size = st.st_size;
+   // the strings have to end in a terminator for none to run past them
+   if (h->magic != SEGMENT_MAGIC || h->version != SEGMENT_VERSION ||
+       h->count > (size - sizeof(segment_header)) / sizeof(datom) ||
+       h->strings_offset != sizeof(segment_header) + h->count * sizeof(datom) ||
+       h->keywords_offset < h->strings_offset || h->keywords_offset > size ||
+       (h->keywords_offset > h->strings_offset && ((const char*)base)[h->keywords_offset - 1] != 0)) {
+      munmap(base, size);
+      return 0;
+   }
+
+   segment* s = (segment*)calloc(1, sizeof(segment));
+   s->path = strdup(path);
+   s->base = (char*)base;
+   s->size = size;
+   s->header = h;
+   s->datoms = (const datom*)(s->base + sizeof(segment_header));
+   s->compare = compare;
+   s->mapped = 1;
+   s->refs = 1;
+
+   // the table is ns\0name\0 pairs, the strings are copied out so the
+   // interned keywords outlive the mapping
+   s->keywords = (const keyword**)calloc(h->keyword_count ? h->keyword_count : 1, sizeof(keyword*));
+   const char* p = s->base + h->keywords_offset;
+   const char* end = s->base + size;
+   for (uint32_t i = 0; i < h->keyword_count; i++) {
+      const char* ns = p;
+      const char* n = (const char*)memchr(ns, 0, end - ns);
+      const char* next = n ? (const char*)memchr(n + 1, 0, end - n - 1) : 0;
+      if (!next) {
+         close_segment(s);
+         return 0;
+      }
+      n++;
+      char* ns_copy = (char*)arena_allocate(arena, next - ns + 1);
+      memcpy(ns_copy, ns, next - ns + 1);
+      s->keywords[i] = kw(ns_copy, ns_copy + (n - ns));
+      p = next + 1;
+   }
+
+   // segment_datom follows string offsets and keyword numbers unchecked
+   uint64_t string_bytes = h->keywords_offset - h->strings_offset;
+   for (uint64_t i = 0; i < h->count; i++) {
+      const datom* d = s->datoms + i;
+      if (((d->f & 0xf) == string_value && (uint64_t)d->v.i >= string_bytes) ||
+          ((d->f & 0xf) == keyword_value && (uint64_t)d->v.i >= h->keyword_count)) {
+         close_segment(s);
+         return 0;
+      }
+   }
+
+   return s;
+}
+
+
+// Index cursors
+//
+// A cursor walks the datoms of an index that start with the first prefix
+// components (in index order) of a probe datom. A prefix of 0 is the whole
+// index. Every live tree and segment of the index is positioned on its
+// own and the cursor is on the least of them.
+
+struct index_cursor
+{
+   datom_index* idx;
+   bptree_key_t probe;
+   int64_t as_of;    // only datoms with since < t <= as_of are seen
+   int64_t since;
+   int valid;
+   int current;      // segment of the current datom, -1 - i for tree i
+   bptree_iterator its[INDEX_MAX_TREES];
+   int in_tree[INDEX_MAX_TREES];   // its[i] is on a datom
+   segment_iterator segs[INDEX_MAX_SEGMENTS];
+};
+
+datom* cursor_datom(index_cursor* c)
+{
+   if (c->current < 0) {
+      return tree_datom(&c->its[-1 - c->current]);
+   }
+   return segment_datom(&c->segs[c->current]);
+}
+
+void cursor_advance(index_cursor* c)
+{
+   if (c->current < 0) {
+      int i = -1 - c->current;
+      bptree_iterator_next(&c->its[i]);
+      c->in_tree[i] = !bptree_iterator_is_end(&c->its[i]);
+   } else {
+      segment_next(&c->segs[c->current]);
+   }
+}
+
+int cursor_pick(index_cursor* c)
+{
+   bptree_key_compare_fn compare = c->idx->compare;
+   datom* least;
+
+   for (;;) {
+      least = 0;
+      for (int i = 0; i < c->idx->tree_count; i++) {
+         if (c->in_tree[i]) {
+            datom* d = tree_datom(&c->its[i]);
+            if (!least || compare(datom_to_key(d), datom_to_key(least)) < 0) {
+               least = d;
+               c->current = -1 - i;
+            }
+         }
+      }
+      for (int i = 0; i < c->idx->segment_count; i++) {
+         if (!segment_at_end(&c->segs[i])) {
+            datom* d = segment_datom(&c->segs[i]);
+            if (!least || compare(datom_to_key(d), datom_to_key(least)) < 0) {
+               least = d;
+               c->current = i;
+            }
+         }
+      }
+
+      // skip what is outside the cursor's time range
+      if (!least || compare(c->probe, datom_to_key(least)) != 0 ||
+          (least->t <= c->as_of && least->t > c->since)) {
+         break;
+      }
+      cursor_advance(c);
+   }
+
+   c->valid = least && compare(c->probe, datom_to_key(least)) == 0;
+   return c->valid;
+}
+
+// position every source at the first datom not less than key, or greater
+// than it if strict, and check the result is still in the probe's range
+int cursor_position(index_cursor* c, bptree_key_t key, int strict)
+{
+   datom_index* idx = c->idx;
+
+   bptree_key_t probe = index_probe(idx, key);
+   for (int i = 0; i < idx->tree_count; i++) {
+      bptree* t = &idx->trees[i]->t;
+      int found = strict ? bptree_scan(t, probe, &c->its[i]) : bptree_seek(t, probe, &c->its[i]);
+      c->in_tree[i] = found && !bptree_iterator_is_end(&c->its[i]);
+   }
+
+   for (int i = 0; i < idx->segment_count; i++) {
+      segment_seek(&c->segs[i], idx->segments[i], key, strict);
+   }
+   return cursor_pick(c);
+}
+
+int cursor_seek(index_cursor* c, datom_index* idx, datom* probe, int prefix,
+                int64_t as_of = INT64_MAX, int64_t since = -1)
+{
+   c->idx = idx;
+   c->probe = datom_prefix_key(probe, prefix);
+   c->as_of = as_of;
+   c->since = since;
+   return cursor_position(c, c->probe, 0);
+}
+
+int cursor_next(index_cursor* c)
+{
+   cursor_advance(c);
+   return cursor_pick(c);
+}
+
+// move c on to a probe not less than its last one. only the sources still
+// before the probe are sought again, so a sorted batch of probes is one
+// pass over the index.
+int cursor_forward(index_cursor* c, datom* probe, int prefix)
+{
+   bptree_key_compare_fn compare = c->idx->compare;
+   c->probe = datom_prefix_key(probe, prefix);
+
+   for (int i = 0; i < c->idx->tree_count; i++) {
+      bptree_iterator* it = &c->its[i];
+      if (c->in_tree[i] && compare(datom_to_key(tree_datom(it)), c->probe) < 0) {
+         bptree_seek(&c->idx->trees[i]->t, index_probe(c->idx, c->probe), it);
+         c->in_tree[i] = !bptree_iterator_is_end(it);
+      }
+   }
+   for (int i = 0; i < c->idx->segment_count; i++) {
+      segment_iterator* it = &c->segs[i];
+      if (!segment_at_end(it) && compare(datom_to_key(segment_datom(it)), c->probe) < 0) {
+         segment_seek(it, c->idx->segments[i], c->probe, 0);
+      }
+   }
+   return cursor_pick(c);
+}
+
+struct transaction_log;
+struct db_snapshot;
+struct tempid_entry;
+
+struct partition
+{
+   uint32_t id;
+   const keyword* name;
+   int64_t sequence;   // below ENTITY_ID_LIMIT
+};
+
+struct attribute {
+   int64_t  id;
+   const keyword* ident;
+   const keyword* unique;
+   const keyword* valueType;
+   const char* doc;
+};
+
+struct database
+{
+   memory_arena* arena;
+
+   datom_index eavt;
+   datom_index aevt;
+   datom_index vaet;
+   datom_index avet;
+   int partition_count;
+   struct partition partitions[3];
+   int attribute_count;
+   attribute installed_attributes[256];
+
+   // transact is serialized on write_lock, and logged to log if set
+   pthread_mutex_t write_lock;
+   transaction_log* log;
+
+   // readers hold index_lock shared, writers take it to change the trees
+   // or the runs. basis_t is the t of the last transaction values see, the
+   // trees can be ahead of it, see Transaction log.
+   pthread_rwlock_t index_lock;
+   int64_t basis_t;
+
+   // queries run on a snapshot, see pin_database. writers drop it when
+   // they change the indexes.
+   pthread_mutex_t snapshot_lock;
+   db_snapshot* snapshot;
+
+   // of the last checkpoint
+   uint64_t generation;
+
+   // live trees are sealed at live_limit datoms, see Runs
+   int live_count;
+   int live_limit;
+   int merging;
+   int merger_running;
+   pthread_t merger;
+   pthread_cond_t merge_work;
+   pthread_cond_t merged;
+   uint64_t seals;
+   uint64_t merges;
+};
+
+
+struct transaction
+{
+   memory_arena* arena;
+   uint64_t ts;
+   int64_t txn_id;   // the t of its datoms, its entity is tx_entity(txn_id)
+   int datom_count;
+   cons_cell* items;
+
+   // set by transact, see resolve_tempid. the table is only there while
+   // transact resolves them and can't be copied, the ids are kept in the
+   // arena sorted by tempid.
+   hamt_int tempids;
+   int tempid_count;
+   tempid_entry* resolved;
+};
+
+// A database value is the database as of one transaction. Every datom is
+// an assertion, there are no retractions, and none is changed or removed
+// once indexed, so a value is just the database and a range of t, and the
+// cursors of queries run on it skip datoms outside that range. Every value
+// shares all of the indexes. Retractions would need the cursors to also
+// hide what was retracted by as_of.
+struct db_value
+{
+   database* db;
+   int64_t as_of;   // the datoms with since < t <= as_of
+   int64_t since;
+};
+
+db_value current(database* db)
+{
+   db_value v = {db, 0, -1};
+   pthread_rwlock_rdlock(&db->index_lock);
+   v.as_of = db->basis_t;
+   pthread_rwlock_unlock(&db->index_lock);
+   return v;
+}
+
+// v without what was transacted after t
+db_value as_of(db_value v, int64_t t)
+{
+   if (t < v.as_of) {
+      v.as_of = t;
+   }
+   return v;
+}
+
+// only what was transacted in v after t
+db_value since(db_value v, int64_t t)
+{
+   if (t > v.since) {
+      v.since = t;
+   }
+   return v;
+}
+
+// Snapshots
+//
+// A query runs on a snapshot of the indexes rather than holding
+// index_lock, so a long one doesn't stall the writers. The snapshot holds
+// a reference to each run, segment and live tree generation, nothing is
+// copied, see live_tree. It is taken under index_lock shared and cached on the database until a writer
+// changes the indexes, queries still on it keep it until they unpin it.
+
+struct db_snapshot
+{
+   int refs;
+   database db;   // the indexes, partitions and attributes, no locks
+};
+
+void copy_index(datom_index* to, datom_index* from)
+{
+   init_index(to, from->order, from->compare, from->components);
+
+   for (int i = 0; i < from->tree_count; i++) {
+      live_tree_retain(from->trees[i]);
+      to->trees[i] = from->trees[i];
+   }
+   to->tree_count = from->tree_count;
+   for (int i = 0; i < from->segment_count; i++) {
+      segment_retain(from->segments[i]);
+      to->segments[i] = from->segments[i];
+   }
+   to->segment_count = from->segment_count;
+}
+
+// a snapshot of db's indexes as they are now, unpin it when done
+db_snapshot* pin_database(database* db)
+{
+   pthread_rwlock_rdlock(&db->index_lock);
+   pthread_mutex_lock(&db->snapshot_lock);
+
+   db_snapshot* s = db->snapshot;
+   if (!s) {
+      s = (db_snapshot*)calloc(1, sizeof(db_snapshot));
+      s->refs = 1;   // the database's
+      s->db.arena = db->arena;
+      copy_index(&s->db.eavt, &db->eavt);
+      copy_index(&s->db.aevt, &db->aevt);
+      copy_index(&s->db.avet, &db->avet);
+      copy_index(&s->db.vaet, &db->vaet);
+      s->db.partition_count = db->partition_count;
+      memcpy(s->db.partitions, db->partitions, sizeof(db->partitions));
+      s->db.attribute_count = db->attribute_count;
+      memcpy(s->db.installed_attributes, db->installed_attributes,
+             sizeof(attribute) * db->attribute_count);
+      s->db.basis_t = db->basis_t;
+      db->snapshot = s;
+   }
+   __atomic_fetch_add(&s->refs, 1, __ATOMIC_RELAXED);
+
+   pthread_mutex_unlock(&db->snapshot_lock);
+   pthread_rwlock_unlock(&db->index_lock);
+   return s;
+}
+
+void unpin_database(db_snapshot* s)
+{
+   if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+      return;
+   }
+
+   datom_index* indexes[4] = {&s->db.eavt, &s->db.aevt, &s->db.avet, &s->db.vaet};
+   for (int i = 0; i < 4; i++) {
+      for (int j = 0; j < indexes[i]->tree_count; j++) {
+         live_tree_release(indexes[i]->trees[j]);
+      }
+      for (int j = 0; j < indexes[i]->segment_count; j++) {
+         segment_release(indexes[i]->segments[j]);
+      }
+   }
+   free(s);
+}
+
+// called by writers with index_lock held exclusively, before they change
+// the indexes
+void drop_snapshot(database* db)
+{
+   db_snapshot* s = db->snapshot;
+   db->snapshot = 0;
+   if (s) {
+      unpin_database(s);
+   }
+}
+
+struct transaction_result
+{
+   db_value before;
+   db_value after;
+   transaction* txn;
+};
+
+const keyword* db_ident = kw("db", "ident");
+const keyword* db_id = kw("db", "id");
+const keyword* db_valueType = kw("db", "valueType");
+const keyword* db_doc = kw("db", "doc");
+
+const keyword* db_unique = kw("db", "unique");
+const keyword* db_unique_value = kw("db.unique", "value");
+const keyword* db_unique_identity = kw("db.unique", "identity");
+
+const keyword* db_valueType_string = kw("db.type", "string");
+const keyword* db_valueType_int = kw("db.type", "int");
+const keyword* db_valueType_keyword = kw("db.type", "keyword");
+const keyword* db_valueType_ref = kw("db.type", "ref");
+
+const keyword* db_part_db = kw("db.part", "db");
+const keyword* db_part_tx = kw("db.part", "tx");
+const keyword* db_part_user = kw("db.part", "user");
+
+static int64_t temp_id_sequence = -1;
+
+// builtin attribute dbids
+enum {
+   dbid_ident = 0,
+   dbid_unique,
+   dbid_doc,
+   dbid_valuetype
+};
+
+enum {
+   DB_PART_DB = 0,
+   DB_PART_TX = 1,
+   DB_PART_USER
+};
+
+// Entity ids carry their partition above ENTITY_PART_SHIFT, ids of the
+// db partition are just their number.
+#define ENTITY_PART_SHIFT 42
+#define ENTITY_ID_LIMIT ((int64_t)1 << ENTITY_PART_SHIFT)
+
+inline
+int64_t entity_id(int part, int64_t n)
+{
+   assert(n >= 0 && n < ENTITY_ID_LIMIT);
+   return ((int64_t)part << ENTITY_PART_SHIFT) | n;
+}
+
+inline
+int entity_partition(int64_t e)
+{
+   return (int)(e >> ENTITY_PART_SHIFT);
+}
+
+// the entity of the transaction with basis t, in the tx partition so it
+// can't meet an entity of the db partition
+inline
+int64_t tx_entity(int64_t t)
+{
+   return entity_id(DB_PART_TX, t);
+}
+
+int partition_index(const keyword* part)
+{
+   if (part && compare_keyword(part, db_part_db) == 0) {
+      return DB_PART_DB;
+   }
+   if (part && compare_keyword(part, db_part_tx) == 0) {
+      return DB_PART_TX;
+   }
+   return DB_PART_USER;
+}
+
+// A tempid stands for a new entity in the datoms of a transaction, as e or
+// as a ref value, until transact gives it a real id. It is negative with
+// its partition in the low two bits of -s.
+struct temp_id
+{
+   const keyword* part;
+   int64_t s;
+};
+
+temp_id tempid(const keyword* part)
+{
+   int64_t n = __atomic_fetch_sub(&temp_id_sequence, 1, __ATOMIC_RELAXED);
+   temp_id tid = {part, n * 4 - partition_index(part)};
+   return tid;
+}
+
+inline
+int tempid_partition(int64_t s)
+{
+   return (int)(-s & 3);
+}
+
+inline
+ref_t ref(temp_id tid)
+{
+   return ref(tid.s);
+}
+
+
+transaction* create_transaction()
+{
+   memory_arena* arena = create_arena(4096);
+
+   transaction* t = push_struct(arena, transaction);
+   memset(t, 0, sizeof(transaction));
+
+   t->arena = arena;
+
+   return t;
+}
+
+bool add_datom(transaction* txn, datom* d)
+{
+   cons_cell* c = push_struct(txn->arena, cons_cell);
+
+   c->car = d;
+   c->cdr = txn->items;
+
+   txn->items = c;
+
+   return true;
+}
+
+datom* make_datom(memory_arena* arena, int64_t e, int64_t a, int64_t v, int64_t t = 0)
+{
+   datom* d = push_struct(arena, datom);
+
+   d->f = int_value;
+   d->e = e;
+   d->a = a;
+   d->t = t;
+   d->v.i = v;
+
+   return d;
+}
+
+datom* make_datom(memory_arena* arena, int64_t e, int64_t a, ref_t r, int64_t t = 0)
+{
+   datom* d = push_struct(arena, datom);
+
+   d->f = ref_value;
+   d->e = e;
+   d->a = a;
+   d->t = t;
+   d->v.i = r.r;
+
+   return d;
+}
+
+datom* make_datom(memory_arena* arena, int64_t e, int64_t a, const char* v, int64_t t = 0)
+{
+   int len = strlen(v)+1;
+
+   datom* d = (datom*)arena_allocate(arena, sizeof(datom) + len);
+   char* s = (char*)(d + 1);
+
+   d->f = string_value;
+   d->e = e;
+   d->a = a;
+   d->t = t;
+   d->v.s = s;
+   strcpy(s, v);
+
+   return d;
+}
+
+datom* make_datom(memory_arena* arena, int64_t e, int64_t a, const keyword* kw, int64_t t = 0)
+{
+   datom* d = (datom*)arena_allocate(arena, sizeof(datom));
+
+   d->f = keyword_value;
+   d->e = e;
+   d->a = a;
+   d->t = t;
+   d->v.kw = kw;
+
+   return d;
+}
+
+bool add_fact(transaction* txn, int64_t e, int64_t a, int64_t v)
+{
+   return add_datom(txn, make_datom(txn->arena, e, a, v));
+}
+
+bool add_fact(transaction* txn, int64_t e, int64_t a, ref_t r)
+{
+   return add_datom(txn, make_datom(txn->arena, e, a, r));
+}
+
+bool add_fact(transaction* txn, int64_t e, int64_t a, const char* v)
+{
+   return add_datom(txn, make_datom(txn->arena, e, a, v));
+}
+
+bool add_fact(transaction* txn, int64_t e, int64_t a, keyword* kw)
+{
+   return add_datom(txn, make_datom(txn->arena, e, a, kw));
+}
+
+template <typename V>
+bool add_fact(transaction* txn, temp_id e, int64_t a, V v)
+{
+   return add_fact(txn, e.s, a, v);
+}
+
+void index_datom(database* db, datom* d)
+{
+   insert_datom(&db->eavt, d);
+   insert_datom(&db->aevt, d);
+   insert_datom(&db->avet, d);
+   if ((d->f & 0xf) == ref_value) {
+      insert_datom(&db->vaet, d);
+   }
+   db->live_count++;
+}
+
+// Transaction log
+//
+// Every transaction is appended to one file as a record
+//
+//    uint32 size | uint32 crc | int64 t | uint32 count | count datoms
+//
+// size is the bytes of datoms and crc covers everything after itself. A
+// datom is its flags byte, e and a as zigzag varints, then the value: a
+// zigzag varint for ints, booleans and refs, 8 raw bytes for floats, a
+// length prefixed string for strings and two of them (ns, name) for
+// keywords. Its t is the record's.
+//
+// Records are appended to a buffer and whoever needs them on disk writes
+// the whole buffer, so every commit that queues up during one fsync shares
+// the next one. How long transact waits depends on the durability.
+//
+// Only transact is logged, install_ident and install_attribute are not,
+// the schema has to be installed again before the log is replayed.
+//
+// A transaction is appended before it is published. With LOG_SYNC_COMMIT
+// its datoms are indexed but basis_t only moves past them once the record
+// is synced, so no value shows a transaction the log may not have. The
+// other durabilities publish at once and may lose the last transactions
+// in a crash. Once writing the log failed the database takes no more
+// transactions, the log and the indexes can't be brought back in step.
+
+enum {
+   LOG_SYNC_COMMIT,   // transact returns once its record is synced
+   LOG_SYNC_INTERVAL, // a flusher thread syncs every interval_ms
+   LOG_SYNC_ASYNC     // a flusher thread writes, the OS syncs
+};
+
+#define LOG_HEADER_SIZE 20
+
+struct log_buffer
+{
+   char* data;
+   size_t len;
+   size_t cap;
+};
+
+struct transaction_log
+{
+   database* db;
+   int fd;
+   int durability;
+   int interval_ms;
+
+   pthread_mutex_t lock;
+   pthread_cond_t flushed;
+   pthread_cond_t work;
+   log_buffer pending;
+   log_buffer writing;
+   int flushing;
+   int error;
+
+   // file offsets
+   uint64_t appended;
+   uint64_t written;
+   uint64_t synced;
+
+   int running;
+   pthread_t flusher;
+
+   uint64_t commits;
+   uint64_t syncs;
+};
+
+uint32_t log_crc32(uint32_t crc, const void* p, size_t len)
+{
+   static uint32_t table[256];
+   static int init = 0;
+
+   if (!init) {
+      for (uint32_t i = 0; i < 256; i++) {
+         uint32_t c = i;
+         for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+         }
+         table[i] = c;
+      }
+      init = 1;
+   }
+
+   const uint8_t* b = (const uint8_t*)p;
+   crc = ~crc;
+   while (len--) {
+      crc = table[(crc ^ *b++) & 0xff] ^ (crc >> 8);
+   }
+   return ~crc;
+}
+
+void log_reserve(log_buffer* b, size_t n)
+{
+   if (b->len + n > b->cap) {
+      size_t cap = b->cap ? b->cap * 2 : 4096;
+      while (cap < b->len + n) {
+         cap *= 2;
+      }
+      b->data = (char*)realloc(b->data, cap);
+      b->cap = cap;
+   }
+}
+
+void put_bytes(log_buffer* b, const void* p, size_t n)
+{
+   log_reserve(b, n);
+   memcpy(b->data + b->len, p, n);
+   b->len += n;
+}
+
+void put_varint(log_buffer* b, uint64_t v)
+{
+   log_reserve(b, 10);
+   while (v >= 0x80) {
+      b->data[b->len++] = (char)(v | 0x80);
+      v >>= 7;
+   }
+   b->data[b->len++] = (char)v;
+}
+
+void put_zigzag(log_buffer* b, int64_t v)
+{
+   put_varint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void put_string(log_buffer* b, const char* s)
+{
+   size_t len = strlen(s);
+   put_varint(b, len);
+   put_bytes(b, s, len);
+}
+
+void encode_datom(log_buffer* b, datom* d)
+{
+   uint8_t f = (uint8_t)d->f;
+
+   put_bytes(b, &f, 1);
+   put_zigzag(b, d->e);
+   put_zigzag(b, d->a);
+
+   switch ((value_type)(d->f & 0xf)) {
+   case float_value:
+      put_bytes(b, &d->v.f, sizeof(double));
+      break;
+   case string_value:
+      put_string(b, d->v.s);
+      break;
+   case keyword_value:
+      put_string(b, d->v.kw->ns);
+      put_string(b, d->v.kw->n);
+      break;
+   default:
+      put_zigzag(b, d->v.i);
+      break;
+   }
+}
+
+struct log_reader
+{
+   const char* p;
+   const char* end;
+};
+
+int get_varint(log_reader* r, uint64_t* v)
+{
+   *v = 0;
+   for (int shift = 0; r->p < r->end && shift < 64; shift += 7) {
+      uint8_t c = (uint8_t)*r->p++;
+      *v |= (uint64_t)(c & 0x7f) << shift;
+      if (!(c & 0x80)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+int get_zigzag(log_reader* r, int64_t* v)
+{
+   uint64_t u;
+   if (!get_varint(r, &u)) {
+      return 0;
+   }
+   *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+   return 1;
+}
+
+// a string copied into arena, 0 if it runs past the record
+const char* get_string(log_reader* r, memory_arena* arena)
+{
+   uint64_t len;
+   if (!get_varint(r, &len) || len > (uint64_t)(r->end - r->p)) {
+      return 0;
+   }
+   char* s = (char*)arena_allocate(arena, len + 1);
+   memcpy(s, r->p, len);
+   s[len] = 0;
+   r->p += len;
+   return s;
+}
+
+datom* decode_datom(log_reader* r, memory_arena* arena, int64_t t)
+{
+   int64_t e, a, i;
+
+   if (r->p >= r->end) {
+      return 0;
+   }
+   uint8_t f = (uint8_t)*r->p++;
+   if (!get_zigzag(r, &e) || !get_zigzag(r, &a)) {
+      return 0;
+   }
+
+   switch ((value_type)(f & 0xf)) {
+   case float_value: {
+      double v;
+      if (r->end - r->p < (ptrdiff_t)sizeof(double)) {
+         return 0;
+      }
+      memcpy(&v, r->p, sizeof(double));
+      r->p += sizeof(double);
+      datom* d = make_datom(arena, e, a, (int64_t)0, t);
+      d->f = f;
+      d->v.f = v;
+      return d;
+   }
+   case string_value: {
+      uint64_t len;
+      if (!get_varint(r, &len) || len > (uint64_t)(r->end - r->p)) {
+         return 0;
+      }
+      datom* d = (datom*)arena_allocate(arena, sizeof(datom) + len + 1);
+      char* s = (char*)(d + 1);
+      d->f = f;
+      d->e = e;
+      d->a = a;
+      d->t = t;
+      d->v.s = s;
+      memcpy(s, r->p, len);
+      s[len] = 0;
+      r->p += len;
+      return d;
+   }
+   case keyword_value: {
+      const char* ns = get_string(r, arena);
+      const char* n = ns ? get_string(r, arena) : 0;
+      if (!n) {
+         return 0;
+      }
+      datom* d = make_datom(arena, e, a, kw(ns, n), t);
+      d->f = f;
+      return d;
+   }
+   default:
+      if (!get_zigzag(r, &i)) {
+         return 0;
+      }
+      datom* d = make_datom(arena, e, a, i, t);
+      d->f = f;
+      return d;
+   }
+}
+
+// append the datoms of txn as one record, returns the offset the log
+// has to be synced to for it to be durable
+uint64_t log_append(transaction_log* log, transaction* txn)
+{
+   pthread_mutex_lock(&log->lock);
+
+   log_buffer* b = &log->pending;
+   size_t start = b->len;
+   int64_t t = txn->txn_id;
+   uint32_t count = 0;
+
+   log_reserve(b, LOG_HEADER_SIZE);
+   b->len += LOG_HEADER_SIZE;
+
+   for (cons_cell* seq = txn->items; seq; seq = (cons_cell*)cdr(seq)) {
+      encode_datom(b, (datom*)car(seq));
+      count++;
+   }
+
+   char* h = b->data + start;
+   uint32_t size = (uint32_t)(b->len - start - LOG_HEADER_SIZE);
+   memcpy(h, &size, 4);
+   memcpy(h + 8, &t, 8);
+   memcpy(h + 16, &count, 4);
+   uint32_t crc = log_crc32(0, h + 8, b->len - start - 8);
+   memcpy(h + 4, &crc, 4);
+
+   log->appended += b->len - start;
+   log->commits++;
+   uint64_t lsn = log->appended;
+
+   if (log->durability == LOG_SYNC_ASYNC) {
+      pthread_cond_signal(&log->work);
+   }
+
+   pthread_mutex_unlock(&log->lock);
+   return lsn;
+}
+
+int log_fsync(int fd)
+{
+#if defined(__linux__)
+   return fdatasync(fd);
+#else
+   return fsync(fd);
+#endif
+}
+
+int write_fully(int fd, const char* p, size_t len)
+{
+   while (len) {
+      ssize_t n = write(fd, p, len);
+      if (n < 0) {
+         return 0;
+      }
+      p += n;
+      len -= n;
+   }
+   return 1;
+}
+
+// write out everything appended so far, called with the lock held. the
+// lock is dropped during the write, commits that come in meanwhile queue
+// up in the other buffer for the next flush.
+void log_flush(transaction_log* log, int sync)
+{
+   log_buffer b = log->writing;
+   log->writing = log->pending;
+   log->pending = b;
+
+   uint64_t end = log->appended;
+   log->flushing = 1;
+   pthread_mutex_unlock(&log->lock);
+
+   int ok = write_fully(log->fd, log->writing.data, log->writing.len);
+   if (ok && sync) {
+      ok = log_fsync(log->fd) == 0;
+   }
+
+   pthread_mutex_lock(&log->lock);
+   log->writing.len = 0;
+   log->flushing = 0;
+   if (!ok) {
+      log->error = 1;
+   } else {
+      log->written = end;
+      if (sync) {
+         log->synced = end;
+         log->syncs++;
+      }
+   }
+   pthread_cond_broadcast(&log->flushed);
+}
+
+// wait until the log is synced up to lsn, -1 if writing it failed. if
+// nobody is flushing this thread does it for everyone waiting.
+int log_wait(transaction_log* log, uint64_t lsn)
+{
+   pthread_mutex_lock(&log->lock);
+   while (log->synced < lsn && !log->error) {
+      if (log->flushing) {
+         pthread_cond_wait(&log->flushed, &log->lock);
+      } else {
+         log_flush(log, 1);
+      }
+   }
+   int r = log->error ? -1 : 0;
+   pthread_mutex_unlock(&log->lock);
+   return r;
+}
+
+int log_failed(transaction_log* log)
+{
+   pthread_mutex_lock(&log->lock);
+   int r = log->error;
+   pthread_mutex_unlock(&log->lock);
+   return r;
+}
+
+int log_sync(transaction_log* log)
+{
+   pthread_mutex_lock(&log->lock);
+   uint64_t lsn = log->appended;
+   pthread_mutex_unlock(&log->lock);
+   return log_wait(log, lsn);
+}
+
+void* log_flusher(void* arg)
+{
+   transaction_log* log = (transaction_log*)arg;
+
+   pthread_mutex_lock(&log->lock);
+   while (log->running) {
+      if (log->durability == LOG_SYNC_INTERVAL) {
+         timespec ts;
+         clock_gettime(CLOCK_REALTIME, &ts);
+         ts.tv_sec += log->interval_ms / 1000;
+         ts.tv_nsec += (long)(log->interval_ms % 1000) * 1000000;
+         if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+         }
+         pthread_cond_timedwait(&log->work, &log->lock, &ts);
+      } else if (log->pending.len == 0) {
+         pthread_cond_wait(&log->work, &log->lock);
+      }
+
+      if (log->pending.len && !log->flushing) {
+         log_flush(log, log->durability == LOG_SYNC_INTERVAL);
+      }
+   }
+   pthread_mutex_unlock(&log->lock);
+
+   return 0;
+}
+
+// Tempids
+//
+// transact resolves the tempids of a transaction before any of it is
+// indexed. One pass over the datoms gives each distinct tempid an entry in
+// a hash table. A tempid asserting a value of a db.unique/identity
+// attribute that some entity already has takes that entity's id, the rest
+// of each partition get one block of ids between them, and a second pass
+// rewrites e and ref values. The table goes once they are resolved,
+// resolve_tempid searches a sorted copy of its entries.
+
+inline
+int is_tempid(int64_t e)
+{
+   return e < 0;
+}
+
+// the value of a tempid in txn->tempids
+struct tempid_entry
+{
+   int64_t s;
+   int64_t id;    // -1 until it has one
+};
+
+// only for the tempids of txn's datoms, while they are resolved
+int64_t tempid_to_id(transaction* txn, int64_t s)
+{
+   if (tempid_partition(s) == DB_PART_TX) {
+      // the transaction itself
+      return tx_entity(txn->txn_id);
+   }
+   tempid_entry* t = (tempid_entry*)hamt_int_find(&txn->tempids, s);
+   assert(t);
+   return t->id;
+}
+
+void add_tempid(transaction* txn, int64_t s, cons_cell** pending)
+{
+   int part = tempid_partition(s);
+   if (part != DB_PART_TX && !hamt_int_find(&txn->tempids, s)) {
+      tempid_entry* t = push_struct(txn->arena, tempid_entry);
+      t->s = s;
+      t->id = -1;
+      hamt_int_insert(&txn->tempids, s, t);
+      txn->tempid_count++;
+
+      cons_cell* c = push_struct(txn->arena, cons_cell);
+      c->car = t;
+      c->cdr = pending[part];
+      pending[part] = c;
+   }
+}
+
+attribute* find_attribute(database* db, int64_t a)
+{
+   if (a < 0 || a >= db->attribute_count) {
+      return 0;
+   }
+   return &db->installed_attributes[a];
+}
+
+int compare_unique_probes(const void* a, const void* b)
+{
+   return compare_avet(datom_prefix_key(*(datom**)a, 2), datom_prefix_key(*(datom**)b, 2));
+}
+
+// the entity d is about as far as it is known yet
+int64_t unique_owner(transaction* txn, datom* d)
+{
+   if (is_tempid(d->e)) {
+      int64_t id = tempid_to_id(txn, d->e);
+      return id >= 0 ? id : d->e;
+   }
+   return d->e;
+}
+
+// upsert the tempids of unique identity values that are already in avet
+// and check that no value of a unique attribute ends up on two entities.
+// the probes are sorted in avet order and walk it once. returns -1 on a
+// conflict.
+int resolve_unique(database* db, transaction* txn, datom** probes, int count)
+{
+   qsort(probes, count, sizeof(datom*), compare_unique_probes);
+
+   int64_t* existing = (int64_t*)malloc(sizeof(int64_t) * count);
+   index_cursor c;
+   int r = 0;
+
+   for (int i = 0; i < count; i++) {
+      datom* d = probes[i];
+      if (i > 0 && compare_unique_probes(probes + i - 1, probes + i) == 0) {
+         existing[i] = existing[i - 1];
+      } else if (i == 0 ? cursor_seek(&c, &db->avet, d, 2) : cursor_forward(&c, d, 2)) {
+         existing[i] = cursor_datom(&c)->e;
+      } else {
+         existing[i] = -1;
+      }
+
+      if (existing[i] >= 0 && is_tempid(d->e) &&
+          find_attribute(db, d->a)->unique == db_unique_identity) {
+         tempid_entry* t = (tempid_entry*)hamt_int_find(&txn->tempids, d->e);
+         if (t && t->id < 0) {
+            t->id = existing[i];
+         } else if (t && t->id != existing[i]) {
+            // two identities of two entities
+            r = -1;
+         }
+      }
+   }
+
+   // every datom of a value is about its owner, the entity that already
+   // has it or else the first one asserting it
+   for (int i = 0; i < count && r == 0; i++) {
+      int64_t owner = existing[i];
+      if (i == 0 || compare_unique_probes(probes + i - 1, probes + i) != 0) {
+         owner = owner >= 0 ? owner : unique_owner(txn, probes[i]);
+         for (int j = i; j < count && compare_unique_probes(probes + i, probes + j) == 0; j++) {
+            if (unique_owner(txn, probes[j]) != owner) {
+               r = -1;
+               break;
+            }
+         }
+      }
+   }
+
+   free(existing);
+   return r;
+}
+
+int compare_tempid_entries(const void* a, const void* b)
+{
+   int64_t x = ((const tempid_entry*)a)->s;
+   int64_t y = ((const tempid_entry*)b)->s;
+   return x < y ? -1 : x > y;
+}
+
+// called with the write lock held, after txn_id is set. on a conflict with
+// a unique attribute, or when a partition runs out of ids, it returns -1
+// with no ids handed out.
+int resolve_tempids(database* db, transaction* txn)
+{
+   cons_cell* pending[3] = {};
+   datom** probes = 0;
+   int probe_count = 0;
+   int probe_max = 0;
+   hamt_int_init(&txn->tempids);
+
+   for (cons_cell* seq = txn->items; seq; seq = (cons_cell*)cdr(seq)) {
+      datom* d = (datom*)car(seq);
+      if (is_tempid(d->e)) {
+         add_tempid(txn, d->e, pending);
+      }
+      if ((d->f & 0xf) == ref_value && is_tempid(d->v.i)) {
+         add_tempid(txn, d->v.i, pending);
+      }
+
+      attribute* a = find_attribute(db, d->a);
+      if (a && a->unique) {
+         if (probe_count == probe_max) {
+            probe_max = probe_max ? probe_max * 2 : 64;
+            probes = (datom**)realloc(probes, sizeof(datom*) * probe_max);
+         }
+         probes[probe_count++] = d;
+      }
+   }
+
+   if (probe_count) {
+      int r = resolve_unique(db, txn, probes, probe_count);
+      free(probes);
+      if (r != 0) {
+         hamt_destroy(&txn->tempids.h);
+         return r;
+      }
+   }
+
+   int64_t next[3];
+   for (int part = 0; part < db->partition_count; part++) {
+      int64_t n = db->partitions[part].sequence;
+      for (cons_cell* c = pending[part]; c; c = (cons_cell*)cdr(c)) {
+         tempid_entry* t = (tempid_entry*)car(c);
+         if (t->id < 0) {
+            if (n == ENTITY_ID_LIMIT) {
+               hamt_destroy(&txn->tempids.h);
+               return -1;
+            }
+            t->id = entity_id(part, n++);
+         }
+      }
+      next[part] = n;
+   }
+   for (int part = 0; part < db->partition_count; part++) {
+      db->partitions[part].sequence = next[part];
+   }
+
+   for (cons_cell* seq = txn->items; seq; seq = (cons_cell*)cdr(seq)) {
+      datom* d = (datom*)car(seq);
+      if (is_tempid(d->e)) {
+         d->e = tempid_to_id(txn, d->e);
+      }
+      if ((d->f & 0xf) == ref_value && is_tempid(d->v.i)) {
+         d->v.i = tempid_to_id(txn, d->v.i);
+      }
+   }
+
+   // the entries are copied out sorted for resolve_tempid, the table goes
+   int n = 0;
+   txn->resolved = (tempid_entry*)arena_allocate(txn->arena, sizeof(tempid_entry) * (txn->tempid_count + 1));
+   for (int part = 0; part < db->partition_count; part++) {
+      for (cons_cell* c = pending[part]; c; c = (cons_cell*)cdr(c)) {
+         txn->resolved[n++] = *(tempid_entry*)car(c);
+      }
+   }
+   assert(n == txn->tempid_count);
+   qsort(txn->resolved, n, sizeof(tempid_entry), compare_tempid_entries);
+   hamt_destroy(&txn->tempids.h);
+   return 0;
+}
+
+// the id tid was given by the transaction of r, -1 if it isn't one of its
+// tempids
+int64_t resolve_tempid(transaction_result* r, temp_id tid)
+{
+   transaction* txn = r->txn;
+   if (tempid_partition(tid.s) == DB_PART_TX) {
+      return tx_entity(txn->txn_id);
+   }
+   tempid_entry key = {tid.s, -1};
+   tempid_entry* t = (tempid_entry*)bsearch(&key, txn->resolved, txn->tempid_count,
+                                            sizeof(tempid_entry), compare_tempid_entries);
+   return t ? t->id : -1;
+}
+
+// keep the sequence of e's partition past it, for datoms that come from
+// the log
+void reserve_entity(database* db, int64_t e)
+{
+   int part = entity_partition(e);
+   int64_t n = e & (ENTITY_ID_LIMIT - 1);
+   if (part != DB_PART_TX && part < db->partition_count && n >= db->partitions[part].sequence) {
+      db->partitions[part].sequence = n + 1;
+   }
+}
+
+// Runs
+//
+// transact only inserts into small live trees. Once they hold live_limit
+// datoms each one is sealed into a run, an immutable segment kept in
+// memory, and the trees start over empty. Once an index has
+// LSM_MERGE_RUNS runs they are merged into one, by the merge thread if
+// one was started with start_merger and otherwise by transact itself.
+// The segment a checkpoint left mapped is not merged, only the next
+// checkpoint replaces it.
+
+#define LSM_LIVE_LIMIT 4096
+#define LSM_MERGE_RUNS 4
+
+struct segment_writer
+{
+   log_buffer out;
+   log_buffer strings;
+   log_buffer keywords;
+   log_buffer keyword_ptrs;
+   hamt keyword_ids;
+   uint32_t keyword_count;
+   uint64_t count;
+};
+
+void segment_write_datom(segment_writer* w, datom* d)
+{
+   log_reserve(&w->out, sizeof(datom));
+   datom* copy = (datom*)(w->out.data + w->out.len);
+   *copy = *d;
+   w->out.len += sizeof(datom);
+   w->count++;
+
+   if ((d->f & 0xf) == string_value) {
+      copy->v.i = (int64_t)w->strings.len;
+      put_bytes(&w->strings, d->v.s, strlen(d->v.s) + 1);
+   } else if ((d->f & 0xf) == keyword_value) {
+      uintptr_t id = (uintptr_t)hamt_find(&w->keyword_ids, (void*)d->v.kw);
+      if (!id) {
+         // numbered from 1 and shifted, hamt values are 4 aligned
+         id = (uintptr_t)++w->keyword_count << 2;
+         hamt_insert(&w->keyword_ids, (void*)d->v.kw, (void*)id);
+         put_bytes(&w->keywords, d->v.kw->ns, strlen(d->v.kw->ns) + 1);
+         put_bytes(&w->keywords, d->v.kw->n, strlen(d->v.kw->n) + 1);
+         put_bytes(&w->keyword_ptrs, &d->v.kw, sizeof(keyword*));
+      }
+      copy->v.i = (int64_t)(id >> 2) - 1;
+   }
+}
+
+// the datoms of idx, its tree and segments merged, as a segment image in
+// w->out
+void build_segment(segment_writer* w, datom_index* idx)
+{
+   memset(w, 0, sizeof(segment_writer));
+   hamt_init(&w->keyword_ids, hash_keyword, (compare_fn_t)compare_keyword);
+
+   log_reserve(&w->out, sizeof(segment_header));
+   w->out.len = sizeof(segment_header);
+
+   index_cursor c;
+   datom all = {};
+   for (cursor_seek(&c, idx, &all, 0); c.valid; cursor_next(&c)) {
+      segment_write_datom(w, cursor_datom(&c));
+   }
+
+   segment_header h;
+   memset(&h, 0, sizeof(h));
+   h.magic = SEGMENT_MAGIC;
+   h.version = SEGMENT_VERSION;
+   h.keyword_count = w->keyword_count;
+   h.count = w->count;
+   h.strings_offset = w->out.len;
+   if (w->strings.len) {
+      put_bytes(&w->out, w->strings.data, w->strings.len);
+   }
+   h.keywords_offset = w->out.len;
+   if (w->keywords.len) {
+      put_bytes(&w->out, w->keywords.data, w->keywords.len);
+   }
+   memcpy(w->out.data, &h, sizeof(h));
+
+   hamt_destroy(&w->keyword_ids);
+   free(w->strings.data);
+   free(w->keywords.data);
+}
+
+// a run of idx's datoms, the keywords are the ones the datoms pointed to
+segment* build_run(datom_index* idx)
+{
+   segment_writer w;
+   build_segment(&w, idx);
+
+   segment* s = (segment*)calloc(1, sizeof(segment));
+   s->base = w.out.data;
+   s->size = w.out.len;
+   s->header = (const segment_header*)s->base;
+   s->datoms = (const datom*)(s->base + sizeof(segment_header));
+   s->keywords = (const keyword**)w.keyword_ptrs.data;
+   s->compare = idx->compare;
+   s->refs = 1;
+   return s;
+}
+
+int run_count(datom_index* idx)
+{
+   int n = 0;
+   for (int i = 0; i < idx->segment_count; i++) {
+      n += !idx->segments[i]->mapped;
+   }
+   return n;
+}
+
+// merge the runs of idx into one. with unlock the write lock is let go
+// while the merged run is built, the runs can not change meanwhile but
+// others can be added.
+void merge_runs(database* db, datom_index* idx, int unlock)
+{
+   datom_index runs;
+   init_index(&runs, idx->order, idx->compare, idx->components);
+   for (int i = 0; i < idx->segment_count; i++) {
+      if (!idx->segments[i]->mapped) {
+         runs.segments[runs.segment_count++] = idx->segments[i];
+      }
+   }
+   if (runs.segment_count < 2) {
+      return;
+   }
+
+   db->merging++;
+   if (unlock) {
+      pthread_mutex_unlock(&db->write_lock);
+   }
+   segment* merged = build_run(&runs);
+   if (unlock) {
+      pthread_mutex_lock(&db->write_lock);
+   }
+   db->merging--;
+
+   // runs sealed meanwhile stay, checkpoint waits for merges so the
+   // merged ones are all still there
+   segment* kept[INDEX_MAX_SEGMENTS];
+   int n = 0;
+   pthread_rwlock_wrlock(&db->index_lock);
+   drop_snapshot(db);
+   for (int i = 0; i < idx->segment_count; i++) {
+      int was_merged = 0;
+      for (int j = 0; j < runs.segment_count; j++) {
+         was_merged |= idx->segments[i] == runs.segments[j];
+      }
+      if (!was_merged) {
+         kept[n++] = idx->segments[i];
+      }
+   }
+   kept[n++] = merged;
+   memcpy(idx->segments, kept, sizeof(segment*) * n);
+   idx->segment_count = n;
+   pthread_rwlock_unlock(&db->index_lock);
+
+   for (int j = 0; j < runs.segment_count; j++) {
+      segment_release(runs.segments[j]);
+   }
+   db->merges++;
+   pthread_cond_broadcast(&db->merged);
+}
+
+// seal the live trees into runs once they are big enough, called with the
+// write lock held
+void seal_live(database* db)
+{
+   if (db->live_count < db->live_limit) {
+      return;
+   }
+
+   datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+   for (int i = 0; i < 4; i++) {
+      datom_index* idx = indexes[i];
+      if (live_empty(idx)) {
+         continue;
+      }
+
+      // no room for another run until the merge thread made some
+      while (idx->segment_count == INDEX_MAX_SEGMENTS) {
+         if (db->merger_running) {
+            pthread_cond_signal(&db->merge_work);
+            pthread_cond_wait(&db->merged, &db->write_lock);
+         } else {
+            merge_runs(db, idx, 0);
+         }
+      }
+
+      datom_index live = *idx;
+      live.segment_count = 0;
+      segment* run = build_run(&live);
+
+      pthread_rwlock_wrlock(&db->index_lock);
+      drop_snapshot(db);
+      idx->segments[idx->segment_count++] = run;
+      clear_live(idx);
+      pthread_rwlock_unlock(&db->index_lock);
+
+      if (!db->merger_running && run_count(idx) >= LSM_MERGE_RUNS) {
+         merge_runs(db, idx, 0);
+      }
+   }
+   db->live_count = 0;
+   db->seals++;
+
+   if (db->merger_running) {
+      pthread_cond_signal(&db->merge_work);
+   }
+}
+
+void* merger_main(void* arg)
+{
+   database* db = (database*)arg;
+   datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+
+   pthread_mutex_lock(&db->write_lock);
+   while (db->merger_running) {
+      datom_index* idx = 0;
+      for (int i = 0; i < 4 && !idx; i++) {
+         if (run_count(indexes[i]) >= LSM_MERGE_RUNS) {
+            idx = indexes[i];
+         }
+      }
+
+      if (idx) {
+         merge_runs(db, idx, 1);
+      } else {
+         pthread_cond_wait(&db->merge_work, &db->write_lock);
+      }
+   }
+   pthread_mutex_unlock(&db->write_lock);
+
+   return 0;
+}
+
+void start_merger(database* db)
+{
+   pthread_mutex_lock(&db->write_lock);
+   db->merger_running = 1;
+   pthread_create(&db->merger, 0, merger_main, db);
+   pthread_mutex_unlock(&db->write_lock);
+}
+
+void stop_merger(database* db)
+{
+   pthread_mutex_lock(&db->write_lock);
+   db->merger_running = 0;
+   pthread_cond_signal(&db->merge_work);
+   pthread_mutex_unlock(&db->write_lock);
+   pthread_join(db->merger, 0);
+}
+
+// apply the records from offset at on to db, up to the first one that is
+// torn or fails its checksum. returns the offset just past the last good
+// record.
+uint64_t replay_log(int fd, database* db, uint64_t at)
+{
+   struct stat st;
+   if (fstat(fd, &st) != 0 || (uint64_t)st.st_size <= at) {
+      return at;
+   }
+
+   size_t size = st.st_size - at;
+   char* data = (char*)malloc(size);
+   size_t got = 0;
+   while (got < size) {
+      ssize_t n = pread(fd, data + got, size - got, at + got);
+      if (n <= 0) {
+         break;
+      }
+      got += n;
+   }
+
+   size_t pos = 0;
+   while (pos + LOG_HEADER_SIZE <= got) {
+      const char* h = data + pos;
+      uint32_t rsize, crc, count;
+      int64_t t;
+
+      memcpy(&rsize, h, 4);
+      memcpy(&crc, h + 4, 4);
+      memcpy(&t, h + 8, 8);
+      memcpy(&count, h + 16, 4);
+
+      if (rsize > got - pos - LOG_HEADER_SIZE ||
+          crc != log_crc32(0, h + 8, LOG_HEADER_SIZE - 8 + rsize)) {
+         break;
+      }
+
+      // decode all of it before applying any of it
+      log_reader r = {h + LOG_HEADER_SIZE, h + LOG_HEADER_SIZE + rsize};
+      datom** datoms = (datom**)malloc(sizeof(datom*) * (count ? count : 1));
+      uint32_t n = 0;
+      while (n < count && (datoms[n] = decode_datom(&r, db->arena, t))) {
+         n++;
+      }
+      if (n == count) {
+         pthread_mutex_lock(&db->write_lock);
+         pthread_rwlock_wrlock(&db->index_lock);
+         drop_snapshot(db);
+         for (uint32_t i = 0; i < n; i++) {
+            index_datom(db, datoms[i]);
+            reserve_entity(db, datoms[i]->e);
+            if ((datoms[i]->f & 0xf) == ref_value) {
+               reserve_entity(db, datoms[i]->v.i);
+            }
+         }
+         if (t >= db->partitions[DB_PART_TX].sequence) {
+            db->partitions[DB_PART_TX].sequence = t + 1;
+         }
+         if (t > db->basis_t) {
+            db->basis_t = t;
+         }
+         pthread_rwlock_unlock(&db->index_lock);
+         seal_live(db);
+         pthread_mutex_unlock(&db->write_lock);
+      }
+      free(datoms);
+      if (n != count) {
+         break;
+      }
+
+      pos += LOG_HEADER_SIZE + rsize;
+   }
+
+   free(data);
+   return at + pos;
+}
+
+// open the log at path, replay it into db from offset from on, cut off a
+// torn last record and log every transact of db from here on
+transaction_log* open_log(database* db, const char* path, int durability, int interval_ms, uint64_t from = 0)
+{
+   int fd = open(path, O_RDWR | O_CREAT, 0644);
+   if (fd < 0) {
+      return 0;
+   }
+
+   // a checkpoint syncs the log first, it can not be shorter than that
+   struct stat st;
+   if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < from) {
+      close(fd);
+      return 0;
+   }
+
+   uint64_t end = replay_log(fd, db, from);
+   if (ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) < 0) {
+      close(fd);
+      return 0;
+   }
+
+   transaction_log* log = (transaction_log*)calloc(1, sizeof(transaction_log));
+   log->db = db;
+   log->fd = fd;
+   log->durability = durability;
+   log->interval_ms = interval_ms > 0 ? interval_ms : 1;
+   log->appended = log->written = log->synced = end;
+   pthread_mutex_init(&log->lock, 0);
+   pthread_cond_init(&log->flushed, 0);
+   pthread_cond_init(&log->work, 0);
+
+   if (durability != LOG_SYNC_COMMIT) {
+      log->running = 1;
+      pthread_create(&log->flusher, 0, log_flusher, log);
+   }
+
+   db->log = log;
+   return log;
+}
+
+// sync whatever is left and detach the log from its database
+int close_log(transaction_log* log)
+{
+   if (log->running) {
+      pthread_mutex_lock(&log->lock);
+      log->running = 0;
+      pthread_cond_signal(&log->work);
+      pthread_mutex_unlock(&log->lock);
+      pthread_join(log->flusher, 0);
+   }
+
+   int r = log_sync(log);
+
+   log->db->log = 0;
+   close(log->fd);
+   pthread_mutex_destroy(&log->lock);
+   pthread_cond_destroy(&log->flushed);
+   pthread_cond_destroy(&log->work);
+   free(log->pending.data);
+   free(log->writing.data);
+   free(log);
+
+   return r;
+}
+
+// move basis_t up to t, transactions synced together can get here in
+// any order
+void publish(database* db, int64_t t)
+{
+   pthread_rwlock_wrlock(&db->index_lock);
+   if (t > db->basis_t) {
+      db->basis_t = t;
+   }
+   pthread_rwlock_unlock(&db->index_lock);
+}
+
+// transactions are serialized on the write lock, which also keeps the log
+// in t order. with LOG_SYNC_COMMIT the wait for the sync happens after the
+// lock is released, so the commits behind this one can join it. 0 if the
+// transaction was refused or its record couldn't be synced, see
+// Transaction log.
+//
+// The result holds the database value before and after the transaction,
+// see db_value.
+transaction_result* transact(database* db, transaction* txn)
+{
+   int cnt = 0;
+   uint64_t lsn = 0;
+
+   pthread_mutex_lock(&db->write_lock);
+
+   // a transaction that breaks a unique attribute leaves no trace
+   txn->txn_id = db->partitions[DB_PART_TX].sequence;
+   if ((db->log && log_failed(db->log)) || resolve_tempids(db, txn) != 0) {
+      pthread_mutex_unlock(&db->write_lock);
+      return 0;
+   }
+   db->partitions[DB_PART_TX].sequence++;
+   int64_t basis = txn->txn_id - 1;
+   int wait = db->log && db->log->durability == LOG_SYNC_COMMIT;
+
+   if (db->log) {
+      lsn = log_append(db->log, txn);
+   }
+
+   pthread_rwlock_wrlock(&db->index_lock);
+   drop_snapshot(db);
+   for (cons_cell* seq = txn->items; seq; seq = (cons_cell*)cdr(seq)) {
+      datom* d = (datom*)car(seq);
+      d->t = txn->txn_id;
+      index_datom(db, d);
+      cnt++;
+   }
+   if (!wait) {
+      db->basis_t = txn->txn_id;
+   }
+   pthread_rwlock_unlock(&db->index_lock);
+
+   txn->datom_count = cnt;
+   seal_live(db);
+
+   pthread_mutex_unlock(&db->write_lock);
+
+   if (wait) {
+      if (log_wait(db->log, lsn) != 0) {
+         return 0;
+      }
+      publish(db, txn->txn_id);
+   }
+
+   transaction_result* result = push_struct(txn->arena, transaction_result);
+   result->before = as_of(current(db), basis);
+   result->after = as_of(current(db), txn->txn_id);
+   result->txn = txn;
+   return result;
+}
+
+ref_t lookup_ref(database* db, keyword* ident)
+{
+   index_cursor c;
+   datom d = {};
+
+   d.f = keyword_value;
+   d.a = dbid_ident;
+   d.v.kw = ident;
+
+   if (!cursor_seek(&c, &db->avet, &d, 2)) {
+      return ref(-1);
+   }
+   return ref(cursor_datom(&c)->e);
+}
+
+// installing is idempotent, a database opened from a checkpoint already
+// has everything that was installed when it was taken
+void install_ident(database* db, const keyword* ident)
+{
+   pthread_mutex_lock(&db->write_lock);
+   if (lookup_ref(db, (keyword*)ident).r >= 0) {
+      pthread_mutex_unlock(&db->write_lock);
+      return;
+   }
+
+   int64_t id = db->partitions[DB_PART_DB].sequence++;
+
+   datom* d = make_datom(db->arena, id, dbid_ident, ident);
+
+   pthread_rwlock_wrlock(&db->index_lock);
+   drop_snapshot(db);
+   insert_datom(&db->eavt, d);
+   insert_datom(&db->aevt, d);
+   insert_datom(&db->avet, d);
+   pthread_rwlock_unlock(&db->index_lock);
+   pthread_mutex_unlock(&db->write_lock);
+}
+
+void install_attribute(database* db, const keyword* ident, const keyword* unique, const keyword* valueType, const char* doc)
+{
+   pthread_mutex_lock(&db->write_lock);
+   for (int i = 0; i < db->attribute_count; i++) {
+      if (compare_keyword(db->installed_attributes[i].ident, ident) == 0) {
+         pthread_mutex_unlock(&db->write_lock);
+         return;
+      }
+   }
+
+   int id = db->attribute_count++;
+
+   db->installed_attributes[id].id = id;
+   db->installed_attributes[id].ident = ident;
+   db->installed_attributes[id].unique = unique;
+   db->installed_attributes[id].valueType = valueType;
+   db->installed_attributes[id].doc = doc;
+
+   datom* d = make_datom(db->arena, id, dbid_ident, ident);
+
+   pthread_rwlock_wrlock(&db->index_lock);
+   drop_snapshot(db);
+   insert_datom(&db->eavt, d);
+   insert_datom(&db->aevt, d);
+   insert_datom(&db->avet, d);
+
+   if (unique) {
+      datom* d = make_datom(db->arena, id, dbid_ident, ident);
+
+      insert_datom(&db->eavt, d);
+      insert_datom(&db->aevt, d);
+      insert_datom(&db->avet, d);
+   }
+   pthread_rwlock_unlock(&db->index_lock);
+   pthread_mutex_unlock(&db->write_lock);
+}
+
+void init_indexes(database* db)
+{
+   init_index(&db->eavt, 7, compare_eavt, EAVT_COMPONENTS);
+   init_index(&db->aevt, 7, compare_aevt, AEVT_COMPONENTS);
+   init_index(&db->avet, 7, compare_avet, AVET_COMPONENTS);
+   init_index(&db->vaet, 7, compare_vaet, VAET_COMPONENTS);
+   datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+   for (int i = 0; i < 4; i++) {
+      indexes[i]->trees[0] = create_live_tree(indexes[i]->order);
+      indexes[i]->tree_count = 1;
+   }
+
+   db->partitions[0].id = DB_PART_DB;
+   db->partitions[0].name = db_part_db;
+   db->partitions[0].sequence = 0;
+
+   db->partitions[1].id = DB_PART_TX;
+   db->partitions[1].name = db_part_tx;
+   db->partitions[1].sequence = 1;
+
+   db->partitions[2].id = DB_PART_USER;
+   db->partitions[2].name = db_part_user;
+   db->partitions[2].sequence = 1;
+
+   db->partition_count = 3;
+   pthread_mutex_init(&db->write_lock, 0);
+   pthread_rwlock_init(&db->index_lock, 0);
+   pthread_mutex_init(&db->snapshot_lock, 0);
+
+   db->live_limit = LSM_LIVE_LIMIT;
+   pthread_cond_init(&db->merge_work, 0);
+   pthread_cond_init(&db->merged, 0);
+}
+
+void install_builtins(database* db)
+{
+   install_ident(db, db_ident);
+   install_ident(db, db_id);
+   install_ident(db, db_valueType);
+   install_ident(db, db_doc);
+   install_ident(db, db_unique);
+   install_ident(db, db_unique_value);
+   install_ident(db, db_unique_identity);
+   install_ident(db, db_valueType_string);
+   install_ident(db, db_valueType_int);
+   install_ident(db, db_valueType_keyword);
+   install_ident(db, db_valueType_ref);
+   install_ident(db, db_part_db);
+   install_ident(db, db_part_tx);
+   install_ident(db, db_part_user);
+
+   install_attribute(db, db_ident, db_unique_identity, db_valueType_keyword, "The db/ident");
+   install_attribute(db, db_doc, 0, db_valueType_string, "The doc string");
+   install_attribute(db, db_valueType, 0, db_valueType_ref, "Ref to the type");
+}
+
+void init_database(database* db)
+{
+   init_indexes(db);
+   install_builtins(db);
+}
+
+database* create_database()
+{
+   memory_arena* arena = create_arena(409600);
+
+   database* db = push_struct(arena, database);
+   memset(db, 0, sizeof(database));
+
+   db->arena = arena;
+
+   init_database(db);
+
+   return db;
+}
+
+// Checkpoints
+//
+// checkpoint seals every index into a new generation of segments in the
+// database's directory, then writes dir/checkpoint naming the generation
+// and the log offset it covers, along with the partition sequences and
+// the installed attributes. That file is written last and renamed into
+// place, a crash before that leaves the previous checkpoint as it was.
+// open_database maps the segments it names and replays only the log
+// after the offset.
+//
+// The indexes start over from the new segments, the runs they replace
+// are freed and their trees only hold what was transacted since.
+
+#define CHECKPOINT_MAGIC 0x43564145
+#define CHECKPOINT_VERSION 1
+
+const char* segment_names[4] = {"eavt", "aevt", "avet", "vaet"};
+
+// write a whole file and sync it, -1 if that fails
+int write_file(const char* path, const char* data, size_t len)
+{
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      return -1;
+   }
+   int ok = write_fully(fd, data, len) && fsync(fd) == 0;
+   ok = close(fd) == 0 && ok;
+   return ok ? 0 : -1;
+}
+
+// a whole file in malloced memory, 0 if it can not be read
+char* read_file(const char* path, size_t* len)
+{
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+      return 0;
+   }
+
+   struct stat st;
+   char* data = 0;
+   if (fstat(fd, &st) == 0) {
+      data = (char*)malloc(st.st_size ? st.st_size : 1);
+      size_t got = 0;
+      while (got < (size_t)st.st_size) {
+         ssize_t n = read(fd, data + got, st.st_size - got);
+         if (n <= 0) {
+            break;
+         }
+         got += n;
+      }
+      if (got != (size_t)st.st_size) {
+         free(data);
+         data = 0;
+      }
+      *len = got;
+   }
+   close(fd);
+   return data;
+}
+
+// write the datoms of idx, its tree and segments merged, as a segment
+int write_segment(const char* path, datom_index* idx)
+{
+   segment_writer w;
+   build_segment(&w, idx);
+   int r = write_file(path, w.out.data, w.out.len);
+   free(w.out.data);
+   free(w.keyword_ptrs.data);
+   return r;
+}
+
+void segment_path(char* path, size_t size, const char* dir, int index, uint64_t generation)
+{
+   snprintf(path, size, "%s/%s.%llu", dir, segment_names[index], (unsigned long long)generation);
+}
+
+void put_keyword(log_buffer* b, const keyword* k)
+{
+   put_varint(b, k != 0);
+   if (k) {
+      put_string(b, k->ns);
+      put_string(b, k->n);
+   }
+}
+
+int get_keyword(log_reader* r, memory_arena* arena, const keyword** k)
+{
+   uint64_t present;
+   *k = 0;
+   if (!get_varint(r, &present)) {
+      return 0;
+   }
+   if (present) {
+      const char* ns = get_string(r, arena);
+      const char* n = ns ? get_string(r, arena) : 0;
+      if (!n) {
+         return 0;
+      }
+      *k = kw(ns, n);
+   }
+   return 1;
+}
+
+int write_checkpoint(database* db, const char* dir, uint64_t generation, uint64_t offset)
+{
+   log_buffer b = {};
+   uint32_t magic = CHECKPOINT_MAGIC;
+   uint32_t version = CHECKPOINT_VERSION;
+
+   put_bytes(&b, &magic, 4);
+   put_bytes(&b, &version, 4);
+   put_varint(&b, generation);
+   put_varint(&b, offset);
+
+   put_varint(&b, db->partition_count);
+   for (int i = 0; i < db->partition_count; i++) {
+      put_zigzag(&b, db->partitions[i].sequence);
+   }
+
+   put_varint(&b, db->attribute_count);
+   for (int i = 0; i < db->attribute_count; i++) {
+      attribute* a = db->installed_attributes + i;
+      put_zigzag(&b, a->id);
+      put_keyword(&b, a->ident);
+      put_keyword(&b, a->unique);
+      put_keyword(&b, a->valueType);
+      put_varint(&b, a->doc != 0);
+      if (a->doc) {
+         put_string(&b, a->doc);
+      }
+   }
+
+   uint32_t crc = log_crc32(0, b.data, b.len);
+   put_bytes(&b, &crc, 4);
+
+   char tmp[1024];
+   char path[1024];
+   snprintf(tmp, sizeof(tmp), "%s/checkpoint.tmp", dir);
+   snprintf(path, sizeof(path), "%s/checkpoint", dir);
+
+   int r = write_file(tmp, b.data, b.len);
+   free(b.data);
+   if (r == 0 && rename(tmp, path) != 0) {
+      r = -1;
+   }
+
+   // and the rename itself
+   int fd = r == 0 ? open(dir, O_RDONLY) : -1;
+   if (fd >= 0) {
+      r = fsync(fd) == 0 ? 0 : -1;
+      close(fd);
+   }
+   return r;
+}
+
+// restore db to the checkpoint in dir and set offset to where its log
+// goes on. 0 if there is no checkpoint, -1 if it can not be read.
+int load_checkpoint(database* db, const char* dir, uint64_t* offset)
+{
+   char path[1024];
+   snprintf(path, sizeof(path), "%s/checkpoint", dir);
+
+   size_t len;
+   char* data = read_file(path, &len);
+   if (!data) {
+      return access(path, F_OK) == 0 ? -1 : 0;
+   }
+
+   uint32_t magic = 0, version = 0, crc = 0;
+   if (len >= 12) {
+      memcpy(&magic, data, 4);
+      memcpy(&version, data + 4, 4);
+      memcpy(&crc, data + len - 4, 4);
+   }
+   if (magic != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION ||
+       crc != log_crc32(0, data, len - 4)) {
+      free(data);
+      return -1;
+   }
+
+   log_reader r = {data + 8, data + len - 4};
+   uint64_t generation, partition_count, attribute_count;
+   int64_t sequences[3];
+   attribute* attributes = (attribute*)calloc(256, sizeof(attribute));
+   int ok = get_varint(&r, &generation) && get_varint(&r, offset) &&
+            get_varint(&r, &partition_count) && partition_count == (uint64_t)db->partition_count;
+
+   for (uint64_t i = 0; ok && i < partition_count; i++) {
+      ok = get_zigzag(&r, sequences + i) && sequences[i] >= 0 && sequences[i] <= ENTITY_ID_LIMIT;
+   }
+
+   ok = ok && get_varint(&r, &attribute_count) && attribute_count <= 256;
+   for (uint64_t i = 0; ok && i < attribute_count; i++) {
+      attribute* a = attributes + i;
+      uint64_t has_doc;
+      ok = get_zigzag(&r, &a->id) &&
+           get_keyword(&r, db->arena, &a->ident) &&
+           get_keyword(&r, db->arena, &a->unique) &&
+           get_keyword(&r, db->arena, &a->valueType) &&
+           get_varint(&r, &has_doc);
+      a->doc = 0;
+      if (ok && has_doc) {
+         ok = (a->doc = get_string(&r, db->arena)) != 0;
+      }
+   }
+   free(data);
+
+   datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+   segment* segments[4] = {};
+   for (int i = 0; ok && i < 4; i++) {
+      segment_path(path, sizeof(path), dir, i, generation);
+      ok = (segments[i] = open_segment(path, indexes[i]->compare, db->arena)) != 0;
+   }
+   if (!ok) {
+      for (int i = 0; i < 4; i++) {
+         if (segments[i]) {
+            close_segment(segments[i]);
+         }
+      }
+      free(attributes);
+      return -1;
+   }
+
+   for (int i = 0; i < 4; i++) {
+      indexes[i]->segments[0] = segments[i];
+      indexes[i]->segment_count = 1;
+   }
+   for (uint64_t i = 0; i < partition_count; i++) {
+      db->partitions[i].sequence = sequences[i];
+   }
+   db->basis_t = db->partitions[DB_PART_TX].sequence - 1;
+   memcpy(db->installed_attributes, attributes, sizeof(attribute) * attribute_count);
+   free(attributes);
+   db->attribute_count = (int)attribute_count;
+   db->generation = generation;
+   return 1;
+}
+
+// seal the indexes of db into segments in dir and record them as its
+// checkpoint, -1 if that fails and the previous one stays
+int checkpoint(database* db, const char* dir)
+{
+   datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+   segment* sealed[4] = {};
+   char path[1024];
+   int r = 0;
+
+   pthread_mutex_lock(&db->write_lock);
+   while (db->merging) {
+      pthread_cond_wait(&db->merged, &db->write_lock);
+   }
+
+   // replay starts at offset, the log has to reach that far
+   uint64_t offset = 0;
+   if (db->log) {
+      r = log_sync(db->log);
+      offset = db->log->appended;
+   }
+
+   uint64_t generation = db->generation + 1;
+   for (int i = 0; i < 4 && r == 0; i++) {
+      segment_path(path, sizeof(path), dir, i, generation);
+      if (write_segment(path, indexes[i]) != 0 ||
+          !(sealed[i] = open_segment(path, indexes[i]->compare, db->arena))) {
+         unlink(path);
+         r = -1;
+      }
+   }
+   if (r == 0) {
+      r = write_checkpoint(db, dir, generation, offset);
+   }
+
+   pthread_rwlock_wrlock(&db->index_lock);
+   drop_snapshot(db);
+   for (int i = 0; i < 4; i++) {
+      datom_index* idx = indexes[i];
+      if (r != 0) {
+         if (sealed[i]) {
+            unlink(sealed[i]->path);
+            close_segment(sealed[i]);
+         }
+         continue;
+      }
+
+      for (int j = 0; j < idx->segment_count; j++) {
+         if (idx->segments[j]->mapped) {
+            unlink(idx->segments[j]->path);
+         }
+         segment_release(idx->segments[j]);
+      }
+      idx->segments[0] = sealed[i];
+      idx->segment_count = 1;
+      clear_live(idx);
+   }
+   pthread_rwlock_unlock(&db->index_lock);
+   if (r == 0) {
+      db->generation = generation;
+      db->live_count = 0;
+   }
+
+   pthread_mutex_unlock(&db->write_lock);
+   return r;
+}
+
+// open the database kept in dir, the segments of its last checkpoint and
+// the log written since, or an empty one to begin with. 0 if it can not
+// be read.
+database* open_database(const char* dir, int durability, int interval_ms)
+{
+   mkdir(dir, 0755);
+
+   memory_arena* arena = create_arena(409600);
+
+   database* db = push_struct(arena, database);
+   memset(db, 0, sizeof(database));
+
+   db->arena = arena;
+
+   init_indexes(db);
+
+   uint64_t offset = 0;
+   if (load_checkpoint(db, dir, &offset) < 0) {
+      datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+      for (int i = 0; i < 4; i++) {
+         for (int j = 0; j < indexes[i]->tree_count; j++) {
+            live_tree_release(indexes[i]->trees[j]);
+         }
+      }
+      destroy_arena(arena);
+      return 0;
+   }
+   install_builtins(db);
+
+   char path[1024];
+   snprintf(path, sizeof(path), "%s/log", dir);
+   if (!open_log(db, path, durability, interval_ms, offset)) {
+      datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+      for (int i = 0; i < 4; i++) {
+         for (int j = 0; j < indexes[i]->segment_count; j++) {
+            close_segment(indexes[i]->segments[j]);
+         }
+         for (int j = 0; j < indexes[i]->tree_count; j++) {
+            live_tree_release(indexes[i]->trees[j]);
+         }
+      }
+      destroy_arena(arena);
+      return 0;
+   }
+
+   return db;
+}
+
+// Queries
+//
+// [:find ?e ?n :where [?e :person/age 42] [?e :person/name ?n]]
+//
+// A clause is [e a v] where each term is a ?variable, _ or a constant.
+// Each clause scans the index whose leading components are its constants,
+// its rows are hash joined with everything bound so far on the variables
+// they share, and the find variables are projected out as a set.
+
+#define QUERY_MAX_VARS 24
+#define QUERY_MAX_CLAUSES 32
+
+struct query_value
+{
+   value_type type;
+   union {
+      double f;
+      int64_t i;
+      const char* s;
+      const keyword* kw;
+   };
+};
+
+struct query_term
+{
+   int var; // -1 for a constant
+   query_value c;
+};
+
+struct query_clause
+{
+   query_term e;
+   query_term a;
+   query_term v;
+};
+
+struct query
+{
+   memory_arena* arena;
+   int var_count;
+   const char* var_names[QUERY_MAX_VARS];
+   int find_count;
+   int find[QUERY_MAX_VARS];
+   int clause_count;
+   query_clause clauses[QUERY_MAX_CLAUSES];
+
+   // the time range of the database value it runs on
+   int64_t as_of;
+   int64_t since;
+};
+
+struct query_result
+{
+   memory_arena* arena;
+   int column_count;
+   int row_count;
+   query_value* rows;
+};
+
+query_value entity_value(int64_t id)
+{
+   query_value v;
+   v.type = ref_value;
+   v.i = id;
+   return v;
+}
+
+query_value datom_value(datom* d)
+{
+   query_value v;
+   v.type = (value_type)(d->f & 0xf);
+   switch (v.type) {
+   case float_value:
+      v.f = d->v.f;
+      break;
+   case string_value:
+      v.s = d->v.s;
+      break;
+   case keyword_value:
+      v.kw = d->v.kw;
+      break;
+   default:
+      v.i = d->v.i;
+      break;
+   }
+   return v;
+}
+
+int values_equal(const query_value* a, const query_value* b)
+{
+   if (value_class(a->type) != value_class(b->type)) {
+      return 0;
+   }
+
+   switch (a->type) {
+   case float_value:
+      return a->f == b->f;
+   case string_value:
+      return strcmp(a->s, b->s) == 0;
+   case keyword_value:
+      return compare_keyword(a->kw, b->kw) == 0;
+   default:
+      return a->i == b->i;
+   }
+}
+
+uint32_t hash_value(const query_value* v)
+{
+   switch (v->type) {
+   case float_value: {
+      int64_t bits;
+      memcpy(&bits, &v->f, sizeof(bits));
+      return hamt_int_hash(bits);
+   }
+   case string_value:
+      return hamt_hash_key(v->s, strlen(v->s), 0);
+   case keyword_value:
+      return hash_keyword((void*)v->kw, 0);
+   default:
+      return hamt_int_hash(v->i);
+   }
+}
+
+// signed, so as a hamt_int key it is a 32 bit id and can not collide
+int32_t hash_row(const query_value* row, uint32_t vars)
+{
+   uint32_t h = 0;
+   for (int i = 0; vars; i++, vars >>= 1) {
+      if (vars & 1) {
+         h = h * 31 + hash_value(row + i);
+      }
+   }
+   return (int32_t)h;
+}
+
+int rows_equal(const query_value* a, const query_value* b, uint32_t vars)
+{
+   for (int i = 0; vars; i++, vars >>= 1) {
+      if ((vars & 1) && !values_equal(a + i, b + i)) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+uint32_t clause_vars(query_clause* c)
+{
+   uint32_t vars = 0;
+   if (c->e.var >= 0) {
+      vars |= 1u << c->e.var;
+   }
+   if (c->a.var >= 0) {
+      vars |= 1u << c->a.var;
+   }
+   if (c->v.var >= 0) {
+      vars |= 1u << c->v.var;
+   }
+   return vars;
+}
+
+enum {
+   BOUND_E = 1,
+   BOUND_A = 2,
+   BOUND_V = 4
+};
+
+int clause_bound(query_clause* c)
+{
+   return (c->e.var < 0 ? BOUND_E : 0) |
+          (c->a.var < 0 ? BOUND_A : 0) |
+          (c->v.var < 0 ? BOUND_V : 0);
+}
+
+// the index whose leading components are bound, prefix is how many of
+// them the probe fixes. anything left over is filtered during the scan.
+datom_index* choose_index(database* db, int bound, value_type vtype, int* prefix)
+{
+   if (bound & BOUND_E) {
+      *prefix = (bound & BOUND_A) ? ((bound & BOUND_V) ? 3 : 2) : 1;
+      return &db->eavt;
+   }
+   if (bound & BOUND_A) {
+      *prefix = (bound & BOUND_V) ? 2 : 1;
+      return (bound & BOUND_V) ? &db->avet : &db->aevt;
+   }
+   if ((bound & BOUND_V) && vtype == ref_value) {
+      *prefix = 1;
+      return &db->vaet;
+   }
+   *prefix = 0;
+   return &db->eavt;
+}
+
+// a datom holding the constants of c, big enough for a string value
+datom* make_probe(memory_arena* arena, query_clause* c)
+{
+   int64_t e = c->e.var < 0 ? c->e.c.i : 0;
+   int64_t a = c->a.var < 0 ? c->a.c.i : 0;
+   query_value* v = &c->v.c;
+
+   if (c->v.var < 0 && v->type == string_value) {
+      return make_datom(arena, e, a, v->s);
+   }
+
+   datom* d = make_datom(arena, e, a, (int64_t)0);
+   if (c->v.var < 0) {
+      d->f = v->type;
+      if (v->type == float_value) {
+         d->v.f = v->f;
+      } else if (v->type == keyword_value) {
+         d->v.kw = v->kw;
+      } else {
+         d->v.i = v->i;
+      }
+   }
+   return d;
+}
+
+struct relation
+{
+   uint32_t vars; // variables bound in every row
+   int width;
+   int count;
+   int capacity;
+   query_value* rows;
+};
+
+void relation_init(relation* r, int width, uint32_t vars)
+{
+   r->vars = vars;
+   r->width = width > 0 ? width : 1;
+   r->count = 0;
+   r->capacity = 0;
+   r->rows = 0;
+}
+
+void relation_free(relation* r)
+{
+   free(r->rows);
+   r->rows = 0;
+}
+
+query_value* relation_row(relation* r, int i)
+{
+   return r->rows + (size_t)r->width * i;
+}
+
+query_value* relation_push(relation* r)
+{
+   if (r->count == r->capacity) {
+      r->capacity = r->capacity ? r->capacity * 2 : 64;
+      r->rows = (query_value*)realloc(r->rows, sizeof(query_value) * r->width * r->capacity);
+   }
+   return relation_row(r, r->count++);
+}
+
+// bind a term to x, 0 if x does not match its constant or the value the
+// variable already has in row
+int bind_term(query_term* t, const query_value* x, query_value* row, uint32_t* bound)
+{
+   if (t->var < 0) {
+      return values_equal(&t->c, x);
+   }
+
+   uint32_t bit = 1u << t->var;
+   if (*bound & bit) {
+      return values_equal(row + t->var, x);
+   }
+
+   row[t->var] = *x;
+   *bound |= bit;
+   return 1;
+}
+
+void scan_clause(database* db, query* q, query_clause* c, relation* out)
+{
+   int prefix;
+   datom_index* idx = choose_index(db, clause_bound(c), c->v.c.type, &prefix);
+   datom* probe = make_probe(q->arena, c);
+   query_value row[QUERY_MAX_VARS] = {};
+   index_cursor cur;
+
+   relation_init(out, q->var_count, clause_vars(c));
+
+   for (cursor_seek(&cur, idx, probe, prefix, q->as_of, q->since); cur.valid; cursor_next(&cur)) {
+      datom* d = cursor_datom(&cur);
+      query_value e = entity_value(d->e);
+      query_value a = entity_value(d->a);
+      query_value v = datom_value(d);
+      uint32_t bound = 0;
+
+      if (bind_term(&c->e, &e, row, &bound) &&
+          bind_term(&c->a, &a, row, &bound) &&
+          bind_term(&c->v, &v, row, &bound)) {
+         memcpy(relation_push(out), row, sizeof(query_value) * out->width);
+      }
+   }
+}
+
+// hash join a and b on the variables they share, building the table over
+// the smaller side. with nothing shared every row lands in one bucket and
+// this is the cross product.
+void join_relations(query* q, relation* a, relation* b, relation* out)
+{
+   if (a->count > b->count) {
+      relation* t = a;
+      a = b;
+      b = t;
+   }
+
+   uint32_t shared = a->vars & b->vars;
+   hamt_int table = {0};
+   hamt_int_init(&table);
+
+   for (int i = 0; i < a->count; i++) {
+      query_value* row = relation_row(a, i);
+      int64_t h = hash_row(row, shared);
+
+      cons_cell* c = push_struct(q->arena, cons_cell);
+      c->car = row;
+      c->cdr = hamt_int_find(&table, h);
+      hamt_int_insert(&table, h, c);
+   }
+
+   relation_init(out, a->width, a->vars | b->vars);
+
+   for (int i = 0; i < b->count; i++) {
+      query_value* row = relation_row(b, i);
+      cons_cell* c = (cons_cell*)hamt_int_find(&table, hash_row(row, shared));
+
+      for (; c; c = (cons_cell*)cdr(c)) {
+         query_value* match = (query_value*)car(c);
+         if (rows_equal(match, row, shared)) {
+            query_value* r = relation_push(out);
+            memcpy(r, row, sizeof(query_value) * out->width);
+            for (int v = 0; v < q->var_count; v++) {
+               if (a->vars & (1u << v)) {
+                  r[v] = match[v];
+               }
+            }
+         }
+      }
+   }
+
+   hamt_destroy(&table.h);
+}
+
+// start with the clause with the most constants, then keep taking the
+// most selective clause that shares a variable with what is bound so far
+int next_clause(query* q, uint32_t bound, int* done)
+{
+   int best = -1;
+   int best_score = -1;
+
+   for (int i = 0; i < q->clause_count; i++) {
+      if (done[i]) {
+         continue;
+      }
+      query_clause* c = q->clauses + i;
+      int b = clause_bound(c);
+      int score = (b & 1) + ((b >> 1) & 1) + ((b >> 2) & 1);
+      if (clause_vars(c) & bound) {
+         score += 4;
+      }
+      if (score > best_score) {
+         best = i;
+         best_score = score;
+      }
+   }
+
+   return best;
+}
+
+query_value* result_row(query_result* r, int i)
+{
+   return r->rows + (size_t)r->column_count * i;
+}
+
+// project the find variables out of rel without duplicates
+query_result* project_result(query* q, relation* rel)
+{
+   query_result* result = push_struct(q->arena, query_result);
+   int cols = q->find_count;
+   uint32_t all = (1u << cols) - 1;
+
+   result->arena = q->arena;
+   result->column_count = cols;
+   result->row_count = 0;
+   result->rows = (query_value*)arena_allocate(q->arena, sizeof(query_value) * (cols ? cols : 1) * (rel->count ? rel->count : 1));
+
+   hamt_int seen = {0};
+   hamt_int_init(&seen);
+
+   for (int i = 0; i < rel->count; i++) {
+      query_value* src = relation_row(rel, i);
+      query_value* dst = result_row(result, result->row_count);
+
+      for (int c = 0; c < cols; c++) {
+         dst[c] = src[q->find[c]];
+      }
+
+      int64_t h = hash_row(dst, all);
+      cons_cell* dup = (cons_cell*)hamt_int_find(&seen, h);
+      while (dup && !rows_equal((query_value*)car(dup), dst, all)) {
+         dup = (cons_cell*)cdr(dup);
+      }
+
+      if (!dup) {
+         // strings are copied, the runs they are in can be merged away
+         for (int c = 0; c < cols; c++) {
+            if (dst[c].type == string_value) {
+               size_t len = strlen(dst[c].s) + 1;
+               char* s = (char*)arena_allocate(q->arena, len);
+               memcpy(s, dst[c].s, len);
+               dst[c].s = s;
+            }
+         }
+
+         cons_cell* c = push_struct(q->arena, cons_cell);
+         c->car = dst;
+         c->cdr = hamt_int_find(&seen, h);
+         hamt_int_insert(&seen, h, c);
+         result->row_count++;
+      }
+   }
+
+   hamt_destroy(&seen.h);
+   return result;
+}
 
-      seq = (cons_cell*)cdr(seq);
+query_result* hash_join_query(database* db, query* q)
+{
+   int done[QUERY_MAX_CLAUSES] = {};
+   relation rel;
 
-      cnt++;
+   relation_init(&rel, q->var_count, 0);
+
+   for (int n = 0; n < q->clause_count; n++) {
+      int i = next_clause(q, rel.vars, done);
+      done[i] = 1;
+
+      relation r;
+      scan_clause(db, q, q->clauses + i, &r);
+
+      if (n == 0) {
+         rel = r;
+      } else {
+         relation joined;
+         join_relations(q, &rel, &r, &joined);
+         relation_free(&rel);
+         relation_free(&r);
+         rel = joined;
+      }
+
+      if (rel.count == 0) {
+         break;
+      }
+   }
+
+   query_result* result = project_result(q, &rel);
+   relation_free(&rel);
+   return result;
+}
+
+// Leapfrog triejoin
+//
+// Instead of joining clauses pairwise, bind one variable at a time in a
+// fixed order. Every clause reads an index whose components are its
+// constants followed by its variables in that order, so a clause is a trie
+// over its variables, and the values of a variable are the intersection of
+// the sorted keys of every clause it appears in, found by leapfrogging
+// seeks between them. Cyclic queries never build the intermediate results
+// a pairwise join would.
+
+#define LEAPFROG_MAX_VARS 8
+#define LEAPFROG_MIN_CLAUSES 4
+
+static const int index_orders[4][3] = {
+   {BOUND_E, BOUND_A, BOUND_V}, // eavt
+   {BOUND_A, BOUND_E, BOUND_V}, // aevt
+   {BOUND_A, BOUND_V, BOUND_E}, // avet
+   {BOUND_V, BOUND_A, BOUND_E}, // vaet
+};
+
+int compare_values(const query_value* a, const query_value* b)
+{
+   value_type a_type = value_class(a->type);
+   value_type b_type = value_class(b->type);
+
+   if (a_type != b_type) {
+      return a_type < b_type ? -1 : 1;
+   }
+
+   switch (a_type) {
+   case float_value:
+      return compare_float(a->f, b->f);
+   case string_value:
+      return strcmp(a->s, b->s);
+   case keyword_value:
+      return compare_keyword(a->kw, b->kw);
+   default:
+      return compare_id(a->i, b->i);
+   }
+}
+
+query_term* clause_term(query_clause* c, int position)
+{
+   return position == BOUND_E ? &c->e : position == BOUND_A ? &c->a : &c->v;
+}
+
+struct trie_iterator
+{
+   datom_index* idx;
+   int positions[3];  // components in index order
+   int consts;        // how many of them are constants
+   int level;         // the component being iterated
+   datom* probe;      // the fixed components
+   index_cursor cur;
+   index_cursor saved[3];
+};
+
+query_value trie_key(trie_iterator* it)
+{
+   datom* d = cursor_datom(&it->cur);
+   switch (it->positions[it->level]) {
+   case BOUND_E:
+      return entity_value(d->e);
+   case BOUND_A:
+      return entity_value(d->a);
+   default:
+      return datom_value(d);
+   }
+}
+
+// a string is not copied, it stays where the query or the index has it
+void probe_set(trie_iterator* it, int position, const query_value* x)
+{
+   datom* d = it->probe;
+
+   if (position == BOUND_E) {
+      d->e = x->i;
+   } else if (position == BOUND_A) {
+      d->a = x->i;
+   } else {
+      d->f = x->type;
+      if (x->type == string_value) {
+         d->v.s = x->s;
+      } else if (x->type == float_value) {
+         d->v.f = x->f;
+      } else if (x->type == keyword_value) {
+         d->v.kw = x->kw;
+      } else {
+         d->v.i = x->i;
+      }
+   }
+}
+
+// position the cursor with the probe fixed through level, then check it
+// is still inside the range of the levels above
+void trie_position(trie_iterator* it, int seek)
+{
+   it->cur.probe = datom_prefix_key(it->probe, it->level);
+   cursor_position(&it->cur, datom_prefix_key(it->probe, it->level + 1), !seek);
+}
+
+int trie_at_end(trie_iterator* it)
+{
+   return !it->cur.valid;
+}
+
+// descend to the next component below the current key
+void trie_open(trie_iterator* it)
+{
+   if (it->level >= it->consts) {
+      query_value k = trie_key(it);
+      probe_set(it, it->positions[it->level], &k);
+      it->saved[it->level] = it->cur;
+   }
+   it->level++;
+   it->cur.probe = datom_prefix_key(it->probe, it->level);
+   cursor_position(&it->cur, it->cur.probe, 0);
+}
+
+void trie_up(trie_iterator* it)
+{
+   it->level--;
+   if (it->level >= it->consts) {
+      it->cur = it->saved[it->level];
+      it->cur.probe = datom_prefix_key(it->probe, it->level);
+      it->cur.valid = 1;
    }
+}
+
+// the next distinct key at this level
+void trie_next(trie_iterator* it)
+{
+   query_value k = trie_key(it);
+   probe_set(it, it->positions[it->level], &k);
+   trie_position(it, 0);
+}
+
+// the first key at this level not less than x
+void trie_seek(trie_iterator* it, const query_value* x)
+{
+   probe_set(it, it->positions[it->level], x);
+   trie_position(it, 1);
+}
+
+// the index that lists the clause constants first and then its variables
+// in rank order, 0 if there is none
+int trie_index(database* db, query_clause* c, const int* rank, trie_iterator* it)
+{
+   datom_index* indexes[4] = {&db->eavt, &db->aevt, &db->avet, &db->vaet};
+   int bound = clause_bound(c);
+   int consts = (bound & 1) + ((bound >> 1) & 1) + ((bound >> 2) & 1);
+
+   for (int i = 0; i < 4; i++) {
+      // vaet only has refs
+      if (i == 3 && !((bound & BOUND_V) && c->v.c.type == ref_value)) {
+         continue;
+      }
+
+      const int* order = index_orders[i];
+      int ok = 1;
+      for (int j = 0; j < 3 && ok; j++) {
+         if (j < consts) {
+            ok = (bound & order[j]) != 0;
+         } else if (j > consts) {
+            ok = rank[clause_term(c, order[j - 1])->var] < rank[clause_term(c, order[j])->var];
+         }
+      }
 
-   printf("Transacted %d datoms\n", cnt);
+      if (ok) {
+         it->idx = indexes[i];
+         it->cur.idx = it->idx;
+         memcpy(it->positions, order, sizeof(it->positions));
+         it->consts = consts;
+         return 1;
+      }
+   }
 
    return 0;
 }
 
-void install_ident(database* db, const keyword* ident)
+struct leapfrog
 {
-   int64_t id = db->partitions[DB_PART_DB].sequence++;
+   database* db;
+   query* q;
+   int order[QUERY_MAX_VARS];
+   trie_iterator iters[QUERY_MAX_CLAUSES];
+   trie_iterator* at[QUERY_MAX_VARS][QUERY_MAX_CLAUSES]; // per level
+   int at_count[QUERY_MAX_VARS];
+   query_value row[QUERY_MAX_VARS];
+   relation* out;
+};
 
-   datom* d = make_datom(db->arena, id, dbid_ident, ident);
-   bptree_key_t k = datom_to_key(d);
+int leapfrog_try_order(leapfrog* lf)
+{
+   query* q = lf->q;
+   int rank[QUERY_MAX_VARS];
 
-   bptree_insert(&db->eavt.t, k);
-   bptree_insert(&db->aevt.t, k);
-   bptree_insert(&db->avet.t, k);
+   for (int i = 0; i < q->var_count; i++) {
+      rank[lf->order[i]] = i;
+   }
+   for (int i = 0; i < q->clause_count; i++) {
+      query_clause* c = q->clauses + i;
+      if (clause_vars(c) && !trie_index(lf->db, c, rank, lf->iters + i)) {
+         return 0;
+      }
+   }
+   return 1;
 }
 
-ref_t lookup_ref(database* db, keyword* ident)
+int leapfrog_permute(leapfrog* lf, int* candidates, int n, int at)
 {
-   bptree_iterator it;
-   datom d = {};
+   if (at == n) {
+      return leapfrog_try_order(lf);
+   }
 
-   d.f = keyword_value;
-   d.e = -1;
-   d.a = dbid_ident;
-   d.v.kw = ident;
+   for (int i = 0; i < n; i++) {
+      if (candidates[i] < 0) {
+         continue;
+      }
+      lf->order[at] = candidates[i];
+      candidates[i] = -1;
+      int found = leapfrog_permute(lf, candidates, n, at + 1);
+      candidates[i] = lf->order[at];
+      if (found) {
+         return 1;
+      }
+   }
+   return 0;
+}
 
-   bptree_scan(&db->avet.t, datom_to_key(&d), &it);
-   if (bptree_iterator_is_end(&it)) {
-      return ref(-1);
+// find a variable order every clause has an index for. variables that
+// appear next to constants are tried first, they bind the fewest values.
+int leapfrog_plan(leapfrog* lf)
+{
+   query* q = lf->q;
+   int weight[QUERY_MAX_VARS] = {};
+
+   if (q->var_count > LEAPFROG_MAX_VARS) {
+      return 0;
+   }
+
+   for (int i = 0; i < q->clause_count; i++) {
+      query_clause* c = q->clauses + i;
+      int vars = (c->e.var >= 0) + (c->a.var >= 0) + (c->v.var >= 0);
+      uint32_t cv = clause_vars(c);
+
+      // a variable twice in one clause is not a trie
+      if (__builtin_popcount(cv) != vars) {
+         return 0;
+      }
+      for (int v = 0; v < q->var_count; v++) {
+         if (cv & (1u << v)) {
+            weight[v] += 1 + 4 * (3 - vars);
+         }
+      }
    }
-   datom* a = key_to_datom(bptree_key(&it));
-   return ref(a->e);
+
+   int candidates[QUERY_MAX_VARS];
+   for (int i = 0; i < q->var_count; i++) {
+      int v = i;
+      int j = i;
+      for (; j > 0 && weight[candidates[j - 1]] < weight[v]; j--) {
+         candidates[j] = candidates[j - 1];
+      }
+      candidates[j] = v;
+   }
+
+   return leapfrog_permute(lf, candidates, q->var_count, 0);
 }
 
-void install_attribute(database* db, const keyword* ident, const keyword* unique, const keyword* valueType, const char* doc)
+void leapfrog_level(leapfrog* lf, int level)
 {
-   int id = db->attribute_count++;
+   if (level == lf->q->var_count) {
+      memcpy(relation_push(lf->out), lf->row, sizeof(query_value) * lf->out->width);
+      return;
+   }
 
-   db->installed_attributes[id].id = id;
-   db->installed_attributes[id].ident = ident;
-   db->installed_attributes[id].unique = unique;
-   db->installed_attributes[id].valueType = valueType;
-   db->installed_attributes[id].doc = doc;
+   int k = lf->at_count[level];
+   trie_iterator* its[QUERY_MAX_CLAUSES];
+   int end = 0;
 
-   datom* d = make_datom(db->arena, id, dbid_ident, ident);
-   bptree_key_t k = datom_to_key(d);
+   for (int i = 0; i < k; i++) {
+      trie_open(lf->at[level][i]);
+      end |= trie_at_end(lf->at[level][i]);
+   }
+
+   if (!end) {
+      // sort by key, then the previous iterator always has the largest
+      for (int i = 0; i < k; i++) {
+         trie_iterator* it = lf->at[level][i];
+         query_value key = trie_key(it);
+         int j = i;
+         for (; j > 0; j--) {
+            query_value other = trie_key(its[j - 1]);
+            if (compare_values(&other, &key) <= 0) {
+               break;
+            }
+            its[j] = its[j - 1];
+         }
+         its[j] = it;
+      }
 
-   bptree_insert(&db->eavt.t, k);
-   bptree_insert(&db->aevt.t, k);
-   bptree_insert(&db->avet.t, k);
+      int var = lf->order[level];
+      int p = 0;
+      for (;;) {
+         query_value max = trie_key(its[(p + k - 1) % k]);
+         query_value key = trie_key(its[p]);
 
-   if (unique) {
-      datom* d = make_datom(db->arena, id, dbid_ident, ident);
-      bptree_key_t k = datom_to_key(d);
+         if (compare_values(&key, &max) == 0) {
+            lf->row[var] = key;
+            leapfrog_level(lf, level + 1);
+            trie_next(its[p]);
+         } else {
+            trie_seek(its[p], &max);
+         }
+
+         if (trie_at_end(its[p])) {
+            break;
+         }
+         p = (p + 1) % k;
+      }
+   }
 
-      bptree_insert(&db->eavt.t, k);
-      bptree_insert(&db->aevt.t, k);
-      bptree_insert(&db->avet.t, k);
+   for (int i = 0; i < k; i++) {
+      trie_up(lf->at[level][i]);
    }
 }
 
-void init_database(database* db)
+// 0 if the query has no variable order every clause can be read in
+query_result* leapfrog_query(database* db, query* q)
 {
-   init_index(&db->eavt, 7, compare_eavt);
-   init_index(&db->aevt, 7, compare_aevt);
-   init_index(&db->avet, 7, compare_avet);
-   init_index(&db->vaet, 7, compare_vaet);
+   leapfrog* lf = push_struct(q->arena, leapfrog);
+   memset(lf, 0, sizeof(leapfrog));
+   lf->db = db;
+   lf->q = q;
 
-   db->partitions[0].id = DB_PART_DB;
-   db->partitions[0].name = db_part_db;
-   db->partitions[0].sequence = 0;
+   if (!leapfrog_plan(lf)) {
+      return 0;
+   }
 
-   db->partitions[1].id = DB_PART_TX;
-   db->partitions[1].name = db_part_tx;
-   db->partitions[1].sequence = 1;
+   relation rel;
+   relation_init(&rel, q->var_count, (1u << q->var_count) - 1);
+   lf->out = &rel;
+
+   int empty = 0;
+   for (int i = 0; i < q->clause_count; i++) {
+      query_clause* c = q->clauses + i;
+      trie_iterator* it = lf->iters + i;
+
+      // a clause of constants only has to exist
+      if (!clause_vars(c)) {
+         relation r;
+         scan_clause(db, q, c, &r);
+         empty |= r.count == 0;
+         relation_free(&r);
+         continue;
+      }
 
-   db->partitions[1].id = DB_PART_USER;
-   db->partitions[1].name = db_part_user;
-   db->partitions[1].sequence = 1;
+      it->probe = push_struct(q->arena, datom);
+      memset(it->probe, 0, sizeof(datom));
+      it->cur.as_of = q->as_of;
+      it->cur.since = q->since;
+      for (int j = 0; j < it->consts; j++) {
+         probe_set(it, it->positions[j], &clause_term(c, it->positions[j])->c);
+      }
+      it->level = it->consts - 1;
 
-   install_ident(db, db_ident);
-   install_ident(db, db_id);
-   install_ident(db, db_valueType);
-   install_ident(db, db_doc);
-   install_ident(db, db_unique);
-   install_ident(db, db_unique_value);
-   install_ident(db, db_unique_identity);
-   install_ident(db, db_valueType_string);
-   install_ident(db, db_valueType_int);
-   install_ident(db, db_valueType_keyword);
-   install_ident(db, db_valueType_ref);
-   install_ident(db, db_part_db);
-   install_ident(db, db_part_tx);
-   install_ident(db, db_part_user);
+      for (int level = 0; level < q->var_count; level++) {
+         if (clause_vars(c) & (1u << lf->order[level])) {
+            lf->at[level][lf->at_count[level]++] = it;
+         }
+      }
+   }
+
+   if (!empty) {
+      leapfrog_level(lf, 0);
+   }
+
+   query_result* result = project_result(q, &rel);
+   relation_free(&rel);
+   return result;
+}
+
+// a query is cyclic when some clause connects variables that other
+// clauses have already connected
+int query_is_cyclic(query* q)
+{
+   int parent[QUERY_MAX_VARS];
+   for (int i = 0; i < q->var_count; i++) {
+      parent[i] = i;
+   }
+
+   for (int i = 0; i < q->clause_count; i++) {
+      query_clause* c = q->clauses + i;
+      int vars[3] = {c->e.var, c->a.var, c->v.var};
+      int root = -1;
+
+      for (int j = 0; j < 3; j++) {
+         if (vars[j] < 0) {
+            continue;
+         }
+         int r = vars[j];
+         while (parent[r] != r) {
+            r = parent[r];
+         }
+         if (root < 0) {
+            root = r;
+         } else if (r == root) {
+            return 1;
+         } else {
+            parent[r] = root;
+         }
+      }
+   }
+
+   return 0;
+}
+
+// cyclic and long queries run as a leapfrog triejoin, everything else and
+// whatever the triejoin can not order as pairwise hash joins
+query_result* run_query(database* db, query* q)
+{
+   if (query_is_cyclic(q) || q->clause_count >= LEAPFROG_MIN_CLAUSES) {
+      query_result* r = leapfrog_query(db, q);
+      if (r) {
+         return r;
+      }
+   }
+   return hash_join_query(db, q);
+}
+
+struct query_parser
+{
+   const char* p;
+   database* db;
+   query* q;
+};
+
+void skip_space(query_parser* qp)
+{
+   while (*qp->p == ' ' || *qp->p == '\t' || *qp->p == '\n' || *qp->p == '\r' || *qp->p == ',') {
+      qp->p++;
+   }
+}
+
+int expect(query_parser* qp, char c)
+{
+   skip_space(qp);
+   if (*qp->p == c) {
+      qp->p++;
+      return 1;
+   }
+   return 0;
+}
+
+char* copy_token(memory_arena* arena, const char* start, size_t len)
+{
+   char* s = (char*)arena_allocate(arena, len + 1);
+   memcpy(s, start, len);
+   s[len] = 0;
+   return s;
+}
+
+// the next symbol, number or keyword, 0 at a delimiter
+char* parse_symbol(query_parser* qp)
+{
+   skip_space(qp);
+   const char* start = qp->p;
+   while (*qp->p && !strchr(" \t\r\n,[]\"", *qp->p)) {
+      qp->p++;
+   }
+   if (qp->p == start) {
+      return 0;
+   }
+   return copy_token(qp->q->arena, start, qp->p - start);
+}
+
+int query_var(query* q, const char* name)
+{
+   // every _ is a variable of its own
+   if (strcmp(name, "_") != 0) {
+      for (int i = 0; i < q->var_count; i++) {
+         if (strcmp(q->var_names[i], name) == 0) {
+            return i;
+         }
+      }
+   }
+   if (q->var_count == QUERY_MAX_VARS) {
+      return -1;
+   }
+   q->var_names[q->var_count] = name;
+   return q->var_count++;
+}
+
+// sym is :ns/name or :name, split in place
+keyword* parse_keyword(memory_arena* arena, char* sym)
+{
+   keyword* k = push_struct(arena, keyword);
+   char* slash = strchr(sym + 1, '/');
+   if (slash) {
+      *slash = 0;
+      k->ns = sym + 1;
+      k->n = slash + 1;
+   } else {
+      k->ns = "";
+      k->n = sym + 1;
+   }
+   return k;
+}
+
+int parse_term(query_parser* qp, query_term* t, int position)
+{
+   memset(t, 0, sizeof(query_term));
+   t->var = -1;
+
+   skip_space(qp);
+   if (*qp->p == '"') {
+      const char* start = ++qp->p;
+      while (*qp->p && *qp->p != '"') {
+         qp->p++;
+      }
+      if (!*qp->p) {
+         return 0;
+      }
+      t->c.type = string_value;
+      t->c.s = copy_token(qp->q->arena, start, qp->p - start);
+      qp->p++;
+      return 1;
+   }
+
+   char* sym = parse_symbol(qp);
+   if (!sym) {
+      return 0;
+   }
+
+   if (sym[0] == '?' || strcmp(sym, "_") == 0) {
+      t->var = query_var(qp->q, sym);
+      return t->var >= 0;
+   }
+
+   if (sym[0] == ':') {
+      keyword* k = parse_keyword(qp->q->arena, sym);
+      if (position == BOUND_V) {
+         t->c.type = keyword_value;
+         t->c.kw = k;
+         return 1;
+      }
+      // idents name entities and attributes
+      t->c.type = ref_value;
+      t->c.i = lookup_ref(qp->db, k).r;
+      return t->c.i >= 0;
+   }
+
+   if (strcmp(sym, "true") == 0 || strcmp(sym, "false") == 0) {
+      t->c.type = boolean_value;
+      t->c.i = sym[0] == 't';
+      return 1;
+   }
+
+   char* end;
+   if (strchr(sym, '.')) {
+      t->c.type = float_value;
+      t->c.f = strtod(sym, &end);
+   } else {
+      t->c.type = int_value;
+      t->c.i = strtoll(sym, &end, 10);
+   }
+   return *end == 0;
+}
+
+attribute* clause_attribute(database* db, query_clause* c)
+{
+   if (c->a.var < 0 && c->a.c.i >= 0 && c->a.c.i < db->attribute_count) {
+      return db->installed_attributes + c->a.c.i;
+   }
+   return 0;
+}
+
+// the value of a ref attribute can be written as an id or an ident
+int resolve_ref_value(query_parser* qp, query_clause* c)
+{
+   attribute* attr = clause_attribute(qp->db, c);
+
+   if (c->v.var < 0 && attr && attr->valueType == db_valueType_ref) {
+      if (c->v.c.type == keyword_value) {
+         c->v.c.i = lookup_ref(qp->db, (keyword*)c->v.c.kw).r;
+         if (c->v.c.i < 0) {
+            return 0;
+         }
+      }
+      c->v.c.type = ref_value;
+   }
+   return 1;
+}
+
+// parse [:find ?var ... :where [e a v] ...], 0 if it is malformed or names
+// an ident that does not exist
+query* parse_query(database* db, memory_arena* arena, const char* text)
+{
+   query* q = push_struct(arena, query);
+   memset(q, 0, sizeof(query));
+   q->as_of = INT64_MAX;
+   q->since = -1;
+   q->arena = arena;
+
+   query_parser qp = {text, db, q};
+
+   if (!expect(&qp, '[')) {
+      return 0;
+   }
+
+   char* sym = parse_symbol(&qp);
+   if (!sym || strcmp(sym, ":find") != 0) {
+      return 0;
+   }
+
+   for (;;) {
+      sym = parse_symbol(&qp);
+      if (!sym || sym[0] == '_' || (sym[0] != '?' && strcmp(sym, ":where") != 0)) {
+         return 0;
+      }
+      if (sym[0] != '?') {
+         break;
+      }
+      int var = query_var(q, sym);
+      if (var < 0) {
+         return 0;
+      }
+      q->find[q->find_count++] = var;
+   }
 
-   install_attribute(db, db_ident, db_unique_identity, db_valueType_keyword, "The db/ident");
-   install_attribute(db, db_doc, 0, db_valueType_string, "The doc string");
-   install_attribute(db, db_valueType, 0, db_valueType_ref, "Ref to the type");
+   while (expect(&qp, '[')) {
+      if (q->clause_count == QUERY_MAX_CLAUSES) {
+         return 0;
+      }
+      query_clause* c = q->clauses + q->clause_count++;
+      if (!parse_term(&qp, &c->e, BOUND_E) ||
+          !parse_term(&qp, &c->a, BOUND_A) ||
+          !parse_term(&qp, &c->v, BOUND_V) ||
+          !expect(&qp, ']') ||
+          !resolve_ref_value(&qp, c)) {
+         return 0;
+      }
+   }
+
+   if (!expect(&qp, ']') || q->clause_count == 0) {
+      return 0;
+   }
+
+   // every find variable has to be bound by some clause
+   uint32_t vars = 0;
+   for (int i = 0; i < q->clause_count; i++) {
+      vars |= clause_vars(q->clauses + i);
+   }
+   for (int i = 0; i < q->find_count; i++) {
+      if (!(vars & (1u << q->find[i]))) {
+         return 0;
+      }
+   }
 
+   return q;
 }
 
-database* create_database()
+// 0 if the query does not parse, free the result with free_query_result.
+// it runs on a snapshot, see pin_database, and the strings it returns are
+// copied out of it since its runs can be closed once it is unpinned.
+query_result* run_query(db_value v, const char* text)
 {
-   memory_arena* arena = create_arena(409600);
-
-   database* db = push_struct(arena, database);
+   memory_arena* arena = create_arena(4096);
+   query_result* r = 0;
+
+   db_snapshot* s = pin_database(v.db);
+   query* q = parse_query(&s->db, arena, text);
+   if (q) {
+      q->as_of = v.as_of;
+      q->since = v.since;
+      r = run_query(&s->db, q);
+   }
+   if (r) {
+      for (int i = 0; i < r->row_count * r->column_count; i++) {
+         query_value* x = r->rows + i;
+         if (x->type == string_value) {
+            x->s = copy_token(r->arena, x->s, strlen(x->s));
+         }
+      }
+   }
+   unpin_database(s);
 
-   db->arena = arena;
+   if (!q) {
+      destroy_arena(arena);
+   }
+   return r;
+}
 
-   init_database(db);
+query_result* run_query(database* db, const char* text)
+{
+   return run_query(current(db), text);
+}
 
-   return db;
+void free_query_result(query_result* r)
+{
+   destroy_arena(r->arena);
 }
 
 void test_simple_transaction()
@@ -717,10 +4320,10 @@ void test_simple_transaction()
    printf("scan eavt\n");
    datom q = {0};
    bptree_iterator it;
-   bptree_scan(&db->eavt.t, datom_to_key(&q), &it);
+   bptree_scan(&db->eavt.trees[0]->t, index_probe(&db->eavt, datom_to_key(&q)), &it);
 
    while (!bptree_iterator_is_end(&it)) {
-      datom* d = key_to_datom(bptree_key(&it));
+      datom* d = tree_datom(&it);
 
       print_datom(d);
       printf("\n");
@@ -731,10 +4334,10 @@ void test_simple_transaction()
    printf("scan aevt\n");
 
    //q.a = 1;
-   bptree_scan(&db->aevt.t, datom_to_key(&q), &it);
+   bptree_scan(&db->aevt.trees[0]->t, index_probe(&db->aevt, datom_to_key(&q)), &it);
 
    while (!bptree_iterator_is_end(&it)) {
-      datom* d = key_to_datom(bptree_key(&it));
+      datom* d = tree_datom(&it);
 
       print_datom(d);
       printf("\n");
@@ -756,10 +4359,10 @@ void test_simple_transaction()
    transact(db, txn);
 
    printf("scan eavt 2\n");
-   bptree_scan(&db->eavt.t, datom_to_key(&q), &it);
+   bptree_scan(&db->eavt.trees[0]->t, index_probe(&db->eavt, datom_to_key(&q)), &it);
 
    while (!bptree_iterator_is_end(&it)) {
-      datom* d = key_to_datom(bptree_key(&it));
+      datom* d = tree_datom(&it);
 
       print_datom(d);
       printf("\n");
@@ -769,10 +4372,10 @@ void test_simple_transaction()
 
    printf("scan aevt 2\n");
 
-   bptree_scan(&db->aevt.t, datom_to_key(&q), &it);
+   bptree_scan(&db->aevt.trees[0]->t, index_probe(&db->aevt, datom_to_key(&q)), &it);
 
    while (!bptree_iterator_is_end(&it)) {
-      datom* d = key_to_datom(bptree_key(&it));
+      datom* d = tree_datom(&it);
 
       print_datom(d);
       printf("\n");
@@ -815,6 +4418,104 @@ void test_interning_keywords()
 
 }
 
+void* intern_keywords_worker(void* arg)
+{
+   keyword** out = (keyword**)arg;
+   char* names = (char*)malloc(64 * 8);
+
+   for (int i = 0; i < 64; i++) {
+      char* n = names + i * 8;
+      snprintf(n, 8, "k%d", i);
+      out[i] = kw("threaded", n);
+   }
+
+   return 0;
+}
+
+void test_interning_keywords_threaded()
+{
+   pthread_t threads[4];
+   keyword* results[4][64];
+
+   for (int i = 0; i < 4; i++) {
+      pthread_create(threads + i, 0, intern_keywords_worker, results[i]);
+   }
+   for (int i = 0; i < 4; i++) {
+      pthread_join(threads[i], 0);
+   }
+
+   for (int i = 0; i < 64; i++) {
+      assert(results[0][i]);
+      for (int j = 1; j < 4; j++) {
+         assert(results[0][i] == results[j][i]);
+      }
+      assert(kw("threaded", results[0][i]->n) == results[0][i]);
+   }
+}
+
+// every index's key encoding orders like its compare, prefixes included
+void test_index_keys()
+{
+   memory_arena* arena = create_arena(4096);
+   const int count = 400;
+   const char* strings[] = {"", "a", "ab", "abc", "b", "\x7f", "\xff"};
+   keyword* keywords[] = {kw("a", "b"), kw("a", "bc"), kw("ab", "a"), kw("b", ""), kw("db", "ident")};
+   double floats[] = {-NAN, -INFINITY, -1e300, -2.5, -1, -0.0, 0, 1e-300, 1, 2.5, 1e300, INFINITY, NAN};
+   int64_t ids[] = {INT64_MIN, -70000, -1, 0, 1, 255, 256, 70000, INT64_MAX};
+
+   datom* datoms[count];
+   srand(49);
+   for (int i = 0; i < count; i++) {
+      int64_t e = ids[rand() % 9];
+      int64_t a = ids[rand() % 9];
+      int64_t t = ids[rand() % 9];
+      switch (rand() % 5) {
+      case 0: datoms[i] = make_datom(arena, e, a, ids[rand() % 9], t); break;
+      case 1: datoms[i] = make_datom(arena, e, a, ref(ids[rand() % 9]), t); break;
+      case 2:
+         datoms[i] = make_datom(arena, e, a, (int64_t)0, t);
+         datoms[i]->f = float_value;
+         datoms[i]->v.f = floats[rand() % 13];
+         break;
+      case 3: datoms[i] = make_datom(arena, e, a, strings[rand() % 7], t); break;
+      case 4: datoms[i] = make_datom(arena, e, a, keywords[rand() % 5], t); break;
+      }
+   }
+
+   datom_index indexes[4];
+   init_index(indexes + 0, 7, compare_eavt, EAVT_COMPONENTS);
+   init_index(indexes + 1, 7, compare_aevt, AEVT_COMPONENTS);
+   init_index(indexes + 2, 7, compare_avet, AVET_COMPONENTS);
+   init_index(indexes + 3, 7, compare_vaet, VAET_COMPONENTS);
+
+   bptree_key_t keys[count];
+   uint8_t probe[256];
+   for (int x = 0; x < 4; x++) {
+      datom_index* idx = indexes + x;
+      for (int i = 0; i < count; i++) {
+         keys[i] = index_key(arena, idx, datoms[i]);
+      }
+      for (int i = 0; i < count; i++) {
+         for (int j = 0; j < count; j++) {
+            datom* a = datoms[i];
+            datom* b = datoms[j];
+            if (x == 3 && ((a->f & 0xf) != ref_value || (b->f & 0xf) != ref_value)) {
+               continue;
+            }
+            int cmp = idx->compare(datom_to_key(a), datom_to_key(b));
+            assert(compare_index_keys(keys[i], keys[j]) == (cmp > 0) - (cmp < 0));
+
+            for (int n = 0; n < DATOM_COMPONENTS; n++) {
+               bptree_key_t kp = {(int)encode_key(idx->components, b, n, probe), probe};
+               cmp = idx->compare(datom_to_key(a), datom_prefix_key(b, n));
+               assert(compare_index_keys(keys[i], kp) == (cmp > 0) - (cmp < 0));
+            }
+         }
+      }
+   }
+   destroy_arena(arena);
+}
+
 void test_init_database()
 {
    database* db = create_database();
@@ -825,11 +4526,10 @@ void test_init_database()
 
    bptree_iterator it;
 
-   bptree_begin(&db->eavt.t, &it);
+   bptree_begin(&db->eavt.trees[0]->t, &it);
 
    while (!bptree_iterator_is_end(&it)) {
-      bptree_key_t k = bptree_key(&it);
-      print_datom(key_to_datom(k));
+      print_datom(tree_datom(&it));
       printf("\n");
 
       bptree_iterator_next(&it);
@@ -837,14 +4537,1011 @@ void test_init_database()
 
 }
 
+int has_row(query_result* r, const query_value* want)
+{
+   for (int i = 0; i < r->row_count; i++) {
+      if (rows_equal(result_row(r, i), want, (1u << r->column_count) - 1)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+query_value string_val(const char* s)
+{
+   query_value v;
+   v.type = string_value;
+   v.s = s;
+   return v;
+}
+
+void test_query()
+{
+   database* db = create_database();
+
+   install_attribute(db, kw("person", "name"), 0, db_valueType_string, "A person's name");
+   install_attribute(db, kw("person", "age"), 0, db_valueType_int, "A person's age");
+   install_attribute(db, kw("person", "friend"), 0, db_valueType_ref, "Someone they know");
+
+   int64_t name = lookup_ref(db, kw("person", "name")).r;
+   int64_t age = lookup_ref(db, kw("person", "age")).r;
+   int64_t friend_attr = lookup_ref(db, kw("person", "friend")).r;
+   assert(name >= 0 && age >= 0 && friend_attr >= 0);
+   assert(lookup_ref(db, kw("person", "nobody")).r == -1);
+
+   // a ring of friends, the even ones are 30
+   const char* names[] = {"ann", "bob", "cat", "dan", "eve"};
+   transaction* txn = create_transaction();
+   for (int i = 0; i < 5; i++) {
+      add_fact(txn, 100 + i, name, names[i]);
+      add_fact(txn, 100 + i, age, 30 + i % 2);
+      add_fact(txn, 100 + i, friend_attr, ref(100 + (i + 1) % 5));
+   }
+   add_fact(txn, 105, name, "eve");
+   add_fact(txn, 105, age, 30);
+   transact(db, txn);
+
+   int prefix;
+   assert(choose_index(db, BOUND_E | BOUND_A, int_value, &prefix) == &db->eavt && prefix == 2);
+   assert(choose_index(db, BOUND_A | BOUND_V, int_value, &prefix) == &db->avet && prefix == 2);
+   assert(choose_index(db, BOUND_A, int_value, &prefix) == &db->aevt && prefix == 1);
+   assert(choose_index(db, BOUND_V, ref_value, &prefix) == &db->vaet && prefix == 1);
+   assert(choose_index(db, BOUND_V, int_value, &prefix) == &db->eavt && prefix == 0);
+
+   query_result* r = run_query(db, "[:find ?n :where [?e :person/age 30] [?e :person/name ?n]]");
+   assert(r && r->column_count == 1);
+   // the two eves are one row
+   assert(r->row_count == 3);
+   for (int i = 0; i < 5; i += 2) {
+      query_value want = string_val(names[i]);
+      assert(has_row(r, &want));
+   }
+   free_query_result(r);
+
+   // a chain through a ref attribute
+   r = run_query(db, "[:find ?n ?fn :where [?e :person/name ?n] [?e :person/friend ?f] [?f :person/name ?fn]]");
+   assert(r && r->column_count == 2 && r->row_count == 5);
+   for (int i = 0; i < 5; i++) {
+      query_value want[2] = {string_val(names[i]), string_val(names[(i + 1) % 5])};
+      assert(has_row(r, want));
+   }
+   free_query_result(r);
+
+   r = run_query(db, "[:find ?e :where [?e :person/name \"dan\"]]");
+   assert(r && r->row_count == 1 && result_row(r, 0)->i == 103);
+   free_query_result(r);
+
+   r = run_query(db, "[:find ?a :where [103 ?a 104]]");
+   assert(r && r->row_count == 1 && result_row(r, 0)->i == friend_attr);
+   free_query_result(r);
+
+   r = run_query(db, "[:find ?e :where [?e :person/friend 100] [?e :person/age 31]]");
+   assert(r && r->row_count == 0);
+   free_query_result(r);
+
+   r = run_query(db, "[:find ?a :where [_ :person/age ?a]]");
+   assert(r && r->row_count == 2);
+   free_query_result(r);
+
+   query_result* bad = run_query(db, "[:find ?x :where [?e :person/name ?n]]");
+   assert(!bad);
+   bad = run_query(db, "[:find ?n :where [?e :person/nobody ?n]]");
+   assert(!bad);
+   bad = run_query(db, "[:find ?n :where [?e :person/name ?n]");
+   assert(!bad);
+}
+
+int same_results(query_result* a, query_result* b)
+{
+   if (a->row_count != b->row_count || a->column_count != b->column_count) {
+      return 0;
+   }
+   for (int i = 0; i < a->row_count; i++) {
+      if (!has_row(b, result_row(a, i))) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+void test_leapfrog()
+{
+   database* db = create_database();
+
+   install_attribute(db, kw("person", "name"), 0, db_valueType_string, "A person's name");
+   install_attribute(db, kw("person", "friend"), 0, db_valueType_ref, "Someone they know");
+
+   int64_t name = lookup_ref(db, kw("person", "name")).r;
+   int64_t friend_attr = lookup_ref(db, kw("person", "friend")).r;
+
+   const int n = 40;
+   const int steps[] = {1, 2, -3, 5, -1};
+   char adj[n][n] = {};
+   char names[n][8];
+
+   transaction* txn = create_transaction();
+   for (int i = 0; i < n; i++) {
+      snprintf(names[i], sizeof(names[i]), "p%d", i);
+      add_fact(txn, 1000 + i, name, names[i]);
+      for (int s = 0; s < 5; s++) {
+         // only the even ones know who is behind them
+         if (steps[s] < 0 && i % 2) {
+            continue;
+         }
+         int j = (i + steps[s] + n) % n;
+         adj[i][j] = 1;
+         add_fact(txn, 1000 + i, friend_attr, ref(1000 + j));
+      }
+   }
+   transact(db, txn);
+
+   int triangles = 0;
+   int mutual = 0;
+   for (int a = 0; a < n; a++) {
+      for (int b = 0; b < n; b++) {
+         mutual += adj[a][b] && adj[b][a];
+         for (int c = 0; c < n; c++) {
+            triangles += adj[a][b] && adj[b][c] && adj[c][a];
+         }
+      }
+   }
+   assert(triangles > 0 && mutual > 0);
+
+   memory_arena* arena = create_arena(4096);
+
+   query* q = parse_query(db, arena, "[:find ?a ?b ?c :where [?a :person/friend ?b] [?b :person/friend ?c] [?c :person/friend ?a]]");
+   assert(q && query_is_cyclic(q));
+   query_result* lf = leapfrog_query(db, q);
+   query_result* hj = hash_join_query(db, q);
+   assert(lf && lf->row_count == triangles);
+   assert(same_results(lf, hj));
+
+   // four clauses, with strings in the tries
+   q = parse_query(db, arena, "[:find ?n ?m :where [?a :person/name ?n] [?b :person/name ?m] [?a :person/friend ?b] [?b :person/friend ?a]]");
+   assert(q);
+   lf = leapfrog_query(db, q);
+   hj = hash_join_query(db, q);
+   assert(lf && lf->row_count == mutual);
+   assert(same_results(lf, hj));
+
+   q = parse_query(db, arena, "[:find ?b :where [?a :person/name \"p4\"] [?a :person/friend ?b] [?b :person/friend ?c] [?c :person/friend ?a]]");
+   assert(q);
+   lf = leapfrog_query(db, q);
+   hj = hash_join_query(db, q);
+   assert(lf && same_results(lf, hj));
+
+   // a constant clause that matches nothing empties the result
+   q = parse_query(db, arena, "[:find ?b :where [1000 :person/name \"nobody\"] [?a :person/friend ?b] [?b :person/friend ?a]]");
+   assert(q);
+   lf = leapfrog_query(db, q);
+   assert(lf && lf->row_count == 0);
+
+   // a variable twice in a clause has no trie order
+   q = parse_query(db, arena, "[:find ?a :where [?a :person/friend ?a] [?a :person/name ?n]]");
+   assert(q);
+   lf = leapfrog_query(db, q);
+   hj = run_query(db, q);
+   assert(!lf && hj->row_count == 0);
+
+   q = parse_query(db, arena, "[:find ?n :where [?a :person/friend ?b] [?b :person/name ?n]]");
+   assert(q && !query_is_cyclic(q));
+
+   destroy_arena(arena);
+}
+
+struct item_schema
+{
+   int64_t n;
+   int64_t label;
+   int64_t kind;
+   int64_t weight;
+   int64_t next;
+};
+
+item_schema install_item_schema(database* db)
+{
+   install_attribute(db, kw("item", "n"), 0, db_valueType_int, "A number");
+   install_attribute(db, kw("item", "label"), 0, db_valueType_string, "A label");
+   install_attribute(db, kw("item", "kind"), 0, db_valueType_keyword, "A kind");
+   install_attribute(db, kw("item", "weight"), 0, 0, "A float");
+   install_attribute(db, kw("item", "next"), 0, db_valueType_ref, "The next item");
+
+   item_schema s;
+   s.n = lookup_ref(db, kw("item", "n")).r;
+   s.label = lookup_ref(db, kw("item", "label")).r;
+   s.kind = lookup_ref(db, kw("item", "kind")).r;
+   s.weight = lookup_ref(db, kw("item", "weight")).r;
+   s.next = lookup_ref(db, kw("item", "next")).r;
+   return s;
+}
+
+int count_rows(db_value v, const char* text)
+{
+   query_result* r = run_query(v, text);
+   int n = r ? r->row_count : -1;
+   if (r) {
+      free_query_result(r);
+   }
+   return n;
+}
+
+int count_rows(database* db, const char* text)
+{
+   return count_rows(current(db), text);
+}
+
+transaction* item_transaction(item_schema* s, int64_t e, int i)
+{
+   transaction* txn = create_transaction();
+   char label[32];
+   snprintf(label, sizeof(label), "item %d", i);
+
+   add_fact(txn, e, s->n, (int64_t)i * 1000000007LL);
+   add_fact(txn, e, s->label, label);
+   add_fact(txn, e, s->kind, kw("kind", i % 2 ? "odd" : "even"));
+
+   datom* d = make_datom(txn->arena, e, s->weight, (int64_t)0);
+   d->f = float_value;
+   d->v.f = i * 0.5;
+   add_datom(txn, d);
+
+   return txn;
+}
+
+struct log_writer_arg
+{
+   database* db;
+   item_schema* schema;
+   int64_t base;
+};
+
+void* log_writer(void* p)
+{
+   log_writer_arg* arg = (log_writer_arg*)p;
+   for (int i = 0; i < 25; i++) {
+      transaction_result* committed = transact(arg->db, item_transaction(arg->schema, arg->base + i, i));
+      assert(committed);
+   }
+   return 0;
+}
+
+void test_log()
+{
+   const char* path = "eav_test.log";
+   remove(path);
+
+   database* db = create_database();
+   item_schema schema = install_item_schema(db);
+
+   transaction_log* log = open_log(db, path, LOG_SYNC_COMMIT, 0);
+   assert(log && log->appended == 0);
+
+   for (int i = 0; i < 10; i++) {
+      transaction* txn = item_transaction(&schema, 500 + i, i);
+      add_fact(txn, 500 + i, schema.next, ref(500 + (i + 1) % 10));
+      transaction_result* committed = transact(db, txn);
+      assert(committed);
+   }
+   // alone, every commit waits for its own sync
+   assert(log->commits == 10 && log->syncs == 10);
+
+   // concurrent commits share syncs
+   pthread_t threads[4];
+   log_writer_arg args[4];
+   for (int i = 0; i < 4; i++) {
+      args[i].db = db;
+      args[i].schema = &schema;
+      args[i].base = 1000 * (i + 1);
+      pthread_create(threads + i, 0, log_writer, args + i);
+   }
+   for (int i = 0; i < 4; i++) {
+      pthread_join(threads[i], 0);
+   }
+   assert(log->commits == 110 && log->syncs <= log->commits);
+   printf("log: %d commits, %d syncs\n", (int)log->commits, (int)log->syncs);
+   int64_t last_t = db->partitions[DB_PART_TX].sequence;
+   int closed = close_log(log);
+   assert(closed == 0 && db->log == 0);
+
+   // replay into a fresh database
+   database* db2 = create_database();
+   install_item_schema(db2);
+   log = open_log(db2, path, LOG_SYNC_ASYNC, 0);
+   assert(log && log->appended > 0);
+   assert(db2->partitions[DB_PART_TX].sequence == last_t);
+   assert(count_rows(db2, "[:find ?e ?v :where [?e :item/n ?v]]") == 110);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/next 500]]") == 1);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/kind :kind/odd]]") == 53);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/label \"item 24\"]]") == 4);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/weight 1.5]]") == 5);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/n 9000000063]]") == 5);
+
+   // async commits are written by the flusher, one sync covers them all
+   for (int i = 0; i < 3; i++) {
+      transaction_result* committed = transact(db2, item_transaction(&schema, 600 + i, i));
+      assert(committed);
+   }
+   int synced = log_sync(log);
+   assert(synced == 0 && log->syncs == 1);
+   uint64_t end = log->appended;
+   closed = close_log(log);
+   assert(closed == 0);
+
+   // a torn record at the end is cut off
+   int fd = open(path, O_WRONLY | O_APPEND);
+   assert(fd >= 0);
+   ssize_t written = write(fd, "\x10\0\0\0torn", 8);
+   assert(written == 8);
+   close(fd);
+
+   database* db3 = create_database();
+   install_item_schema(db3);
+   log = open_log(db3, path, LOG_SYNC_INTERVAL, 2);
+   assert(log && log->appended == end);
+   assert(count_rows(db3, "[:find ?e :where [?e :item/n _]]") == 113);
+   transaction_result* committed = transact(db3, item_transaction(&schema, 700, 7));
+   assert(committed);
+   closed = close_log(log);
+   assert(closed == 0);
+
+   database* db4 = create_database();
+   install_item_schema(db4);
+   log = open_log(db4, path, LOG_SYNC_COMMIT, 0);
+   assert(count_rows(db4, "[:find ?e :where [?e :item/n _]]") == 114);
+
+   // a transaction whose record can't be written is never seen, and the
+   // database takes none after it
+   int full = open("/dev/full", O_WRONLY);
+   if (full >= 0) {
+      dup2(full, log->fd);
+      close(full);
+      int64_t basis = current(db4).as_of;
+      transaction_result* lost = transact(db4, item_transaction(&schema, 800, 8));
+      assert(!lost && current(db4).as_of == basis);
+      assert(count_rows(db4, "[:find ?e :where [?e :item/n _]]") == 114);
+      lost = transact(db4, item_transaction(&schema, 801, 9));
+      assert(!lost && log->commits == 1);
+   }
+   close_log(log);
+
+   remove(path);
+}
+
+int count_tree(bptree* t)
+{
+   bptree_iterator it;
+   int n = 0;
+   if (bptree_begin(t, &it)) {
+      for (; !bptree_iterator_is_end(&it); bptree_iterator_next(&it)) {
+         n++;
+      }
+   }
+   return n;
+}
+
+int count_index(datom_index* idx)
+{
+   index_cursor c;
+   datom probe = {};
+   int n = 0;
+   for (int valid = cursor_seek(&c, idx, &probe, 0); valid; valid = cursor_next(&c)) {
+      n++;
+   }
+   return n;
+}
+
+void remove_test_database(const char* dir)
+{
+   char path[1024];
+   for (int g = 1; g <= 3; g++) {
+      for (int i = 0; i < 4; i++) {
+         segment_path(path, sizeof(path), dir, i, g);
+         remove(path);
+      }
+   }
+   snprintf(path, sizeof(path), "%s/checkpoint", dir);
+   remove(path);
+   snprintf(path, sizeof(path), "%s/log", dir);
+   remove(path);
+   rmdir(dir);
+}
+
+void test_checkpoint()
+{
+   const char* dir = "eav_test_db";
+   remove_test_database(dir);
+
+   database* db = open_database(dir, LOG_SYNC_COMMIT, 0);
+   assert(db && db->log && db->generation == 0);
+   item_schema schema = install_item_schema(db);
+
+   for (int i = 0; i < 200; i++) {
+      transaction* txn = item_transaction(&schema, 500 + i, i);
+      add_fact(txn, 500 + i, schema.next, ref(500 + (i + 1) % 200));
+      transaction_result* committed = transact(db, txn);
+      assert(committed);
+   }
+
+   const char* queries[] = {
+      "[:find ?e ?v :where [?e :item/n ?v]]",
+      "[:find ?e :where [?e :item/kind :kind/odd]]",
+      "[:find ?e :where [?e :item/label \"item 24\"]]",
+      "[:find ?e ?w :where [?e :item/next 510] [?e :item/weight ?w]]",
+      "[:find ?e ?k :where [?e :item/next ?x] [?x :item/next ?y] [?y :item/kind ?k] [?e :item/n _]]",
+      "[:find ?e ?i :where [?e :db/ident ?i]]",
+   };
+   const int query_count = sizeof(queries) / sizeof(queries[0]);
+   query_result* before[query_count];
+   query_result* after[query_count];
+
+   for (int i = 0; i < query_count; i++) {
+      before[i] = run_query(db, queries[i]);
+      assert(before[i]);
+   }
+
+   // everything moves to the segments, the same queries read them
+   int saved = checkpoint(db, dir);
+   assert(saved == 0 && db->generation == 1);
+   assert(db->eavt.segment_count == 1 && live_empty(&db->eavt));
+   assert(db->eavt.segments[0]->header->count > 1000);
+   assert(db->eavt.segments[0]->header->count == db->aevt.segments[0]->header->count);
+   for (int i = 0; i < query_count; i++) {
+      query_result* r = run_query(db, queries[i]);
+      assert(r && same_results(before[i], r));
+      free_query_result(r);
+   }
+
+   // and these only to the trees and the log
+   for (int i = 200; i < 250; i++) {
+      transaction* txn = item_transaction(&schema, 500 + i, i);
+      add_fact(txn, 500 + i, schema.next, ref(500 + i - 190));
+      transaction_result* committed = transact(db, txn);
+      assert(committed);
+   }
+   for (int i = 0; i < query_count; i++) {
+      after[i] = run_query(db, queries[i]);
+      assert(after[i]);
+   }
+   assert(after[0]->row_count == 250 && after[3]->row_count == 2);
+   int64_t last_t = db->partitions[DB_PART_TX].sequence;
+   int closed = close_log(db->log);
+   assert(closed == 0);
+
+   // reopened, the tail of the log goes back into the trees
+   database* db2 = open_database(dir, LOG_SYNC_COMMIT, 0);
+   assert(db2 && db2->generation == 1);
+   assert(db2->partitions[DB_PART_TX].sequence == last_t);
+   assert(db2->attribute_count == db->attribute_count);
+   item_schema schema2 = install_item_schema(db2);
+   assert(schema2.n == schema.n && schema2.next == schema.next);
+   assert(db2->attribute_count == db->attribute_count);
+   assert(count_tree(&db2->eavt.trees[0]->t) == 50 * 5);
+   for (int i = 0; i < query_count; i++) {
+      query_result* r = run_query(db2, queries[i]);
+      assert(r && same_results(after[i], r));
+      free_query_result(r);
+   }
+
+   query_result* r = run_query(db2, "[:find ?n :where [501 :item/label ?n]]");
+   assert(r && r->row_count == 1 && strcmp(result_row(r, 0)->s, "item 1") == 0);
+   free_query_result(r);
+
+   // the next checkpoint merges segments and trees and drops the old ones
+   transaction_result* committed = transact(db2, item_transaction(&schema2, 900, 9));
+   assert(committed);
+   saved = checkpoint(db2, dir);
+   assert(saved == 0 && db2->generation == 2);
+   char path[1024];
+   segment_path(path, sizeof(path), dir, 0, 1);
+   assert(access(path, F_OK) != 0);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/n _]]") == 251);
+   closed = close_log(db2->log);
+   assert(closed == 0);
+
+   database* db3 = open_database(dir, LOG_SYNC_ASYNC, 0);
+   assert(db3 && db3->generation == 2 && live_empty(&db3->eavt));
+   install_item_schema(db3);
+   assert(live_empty(&db3->eavt));
+   assert(count_rows(db3, "[:find ?e :where [?e :item/n _]]") == 251);
+   assert(count_rows(db3, "[:find ?e :where [?e :item/kind :kind/odd]]") == 126);
+   closed = close_log(db3->log);
+   assert(closed == 0);
+
+   // a string offset or keyword number out of its table doesn't open
+   segment* eavt = db3->eavt.segments[0];
+   const datom* string_datom = 0;
+   const datom* keyword_datom = 0;
+   for (uint64_t i = 0; i < eavt->header->count; i++) {
+      const datom* d = eavt->datoms + i;
+      if ((d->f & 0xf) == string_value && !string_datom) {
+         string_datom = d;
+      } else if ((d->f & 0xf) == keyword_value && !keyword_datom) {
+         keyword_datom = d;
+      }
+   }
+   assert(string_datom && keyword_datom);
+   size_t len = 0;
+   segment_path(path, sizeof(path), dir, 0, 2);
+   char* image = read_file(path, &len);
+   assert(image && len == eavt->size);
+   snprintf(path, sizeof(path), "%s/corrupt", dir);
+   const datom* bad[2] = {string_datom, keyword_datom};
+   for (int i = 0; i < 2; i++) {
+      datom* d = (datom*)(image + ((const char*)bad[i] - eavt->base));
+      int64_t v = d->v.i;
+      d->v.i = i ? eavt->header->keyword_count : eavt->header->keywords_offset - eavt->header->strings_offset;
+      int written = write_file(path, image, len);
+      assert(written == 0);
+      segment* opened = open_segment(path, compare_eavt, db3->arena);
+      assert(!opened);
+      d->v.i = v;
+   }
+   int written = write_file(path, image, len);
+   segment* opened = open_segment(path, compare_eavt, db3->arena);
+   assert(written == 0 && opened);
+   close_segment(opened);
+   unlink(path);
+   free(image);
+
+   for (int i = 0; i < query_count; i++) {
+      free_query_result(before[i]);
+      free_query_result(after[i]);
+   }
+   remove_test_database(dir);
+}
+
+void test_lsm()
+{
+   // the same items into one database that never seals and one that
+   // seals every few transactions and merges the runs itself
+   database* all = create_database();
+   all->live_limit = 1 << 30;
+   database* db = create_database();
+   db->live_limit = 64;
+   item_schema all_schema = install_item_schema(all);
+   item_schema schema = install_item_schema(db);
+
+   for (int i = 0; i < 300; i++) {
+      transaction* txn = item_transaction(&all_schema, 500 + i, i);
+      add_fact(txn, 500 + i, all_schema.next, ref(500 + (i + 7) % 300));
+      transaction_result* committed = transact(all, txn);
+      assert(committed);
+
+      txn = item_transaction(&schema, 500 + i, i);
+      add_fact(txn, 500 + i, schema.next, ref(500 + (i + 7) % 300));
+      committed = transact(db, txn);
+      assert(committed);
+   }
+   assert(all->seals == 0 && db->seals > 10 && db->merges > 0);
+   // the sealed keys were freed, only the ones since the last seal are left
+   assert(db->eavt.trees[0]->keys->size * 10 < all->eavt.trees[0]->keys->size);
+   assert(run_count(&db->eavt) > 0 && run_count(&db->eavt) < LSM_MERGE_RUNS);
+   assert(run_count(&db->vaet) > 0);
+
+   const char* queries[] = {
+      "[:find ?e ?v :where [?e :item/n ?v]]",
+      "[:find ?e :where [?e :item/kind :kind/even]]",
+      "[:find ?e ?n :where [?e :item/label ?n]]",
+      "[:find ?e :where [?e :item/next 507]]",
+      "[:find ?e ?k :where [?e :item/next ?x] [?x :item/next ?y] [?y :item/kind ?k] [?e :item/n _]]",
+      "[:find ?e ?i :where [?e :db/ident ?i]]",
+   };
+   for (int i = 0; i < (int)(sizeof(queries) / sizeof(queries[0])); i++) {
+      query_result* a = run_query(all, queries[i]);
+      query_result* b = run_query(db, queries[i]);
+      assert(a && b && a->row_count > 0 && same_results(a, b));
+      free_query_result(a);
+      free_query_result(b);
+   }
+
+   // concurrent writers with a merge thread, the runs get merged in the
+   // background
+   database* db2 = create_database();
+   db2->live_limit = 32;
+   schema = install_item_schema(db2);
+   start_merger(db2);
+
+   pthread_t threads[4];
+   log_writer_arg args[4];
+   for (int i = 0; i < 4; i++) {
+      args[i].db = db2;
+      args[i].schema = &schema;
+      args[i].base = 1000 * (i + 1);
+      pthread_create(threads + i, 0, log_writer, args + i);
+   }
+   for (int i = 0; i < 4; i++) {
+      pthread_join(threads[i], 0);
+   }
+   stop_merger(db2);
+
+   assert(db2->seals > 0 && db2->merges > 0 && db2->merging == 0);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/n _]]") == 100);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/kind :kind/odd]]") == 48);
+   assert(count_rows(db2, "[:find ?e :where [?e :item/label \"item 24\"]]") == 4);
+}
+
+struct snapshot_reader_arg
+{
+   db_value v;
+   int rows;
+};
+
+void* snapshot_reader(void* p)
+{
+   snapshot_reader_arg* arg = (snapshot_reader_arg*)p;
+   for (int i = 0; i < 50; i++) {
+      assert(count_rows(arg->v, "[:find ?e ?l :where [?e :item/n _] [?e :item/label ?l]]") == arg->rows);
+   }
+   return 0;
+}
+
+void test_time_travel()
+{
+   database* db = create_database();
+   db->live_limit = 40;
+   item_schema schema = install_item_schema(db);
+   db_value empty = current(db);
+
+   transaction_result* results[30];
+   for (int i = 0; i < 30; i++) {
+      results[i] = transact(db, item_transaction(&schema, 500 + i, i));
+      assert(results[i] && results[i]->after.as_of == results[i]->txn->txn_id);
+      assert(i == 0 || results[i]->before.as_of == results[i - 1]->after.as_of);
+   }
+   assert(db->seals > 0);
+
+   const char* all = "[:find ?e :where [?e :item/n _]]";
+   assert(count_rows(empty, all) == 0);
+   assert(count_rows(results[9]->after, all) == 10);
+   assert(count_rows(results[9]->before, all) == 9);
+   assert(count_rows(as_of(current(db), results[4]->after.as_of), "[:find ?e :where [?e :item/kind :kind/odd]]") == 2);
+   assert(count_rows(since(current(db), results[19]->after.as_of), all) == 10);
+   assert(count_rows(since(results[19]->after, results[9]->after.as_of), all) == 10);
+   assert(count_rows(since(results[9]->after, results[9]->after.as_of), all) == 0);
+
+   query_result* r = run_query(since(results[29]->before, 0), "[:find ?l :where [529 :item/label ?l]]");
+   assert(r && r->row_count == 0);
+   free_query_result(r);
+   r = run_query(since(results[29]->after, 0), "[:find ?l :where [529 :item/label ?l]]");
+   assert(r && r->row_count == 1 && strcmp(result_row(r, 0)->s, "item 29") == 0);
+   free_query_result(r);
+
+   // a value reads the same while writers go on and runs are sealed and
+   // merged under it
+   start_merger(db);
+   snapshot_reader_arg snapshot = {current(db), 30};
+
+   pthread_t readers[2];
+   pthread_t writers[4];
+   log_writer_arg args[4];
+   for (int i = 0; i < 2; i++) {
+      pthread_create(readers + i, 0, snapshot_reader, &snapshot);
+   }
+   for (int i = 0; i < 4; i++) {
+      args[i].db = db;
+      args[i].schema = &schema;
+      args[i].base = 1000 * (i + 1);
+      pthread_create(writers + i, 0, log_writer, args + i);
+   }
+   for (int i = 0; i < 4; i++) {
+      pthread_join(writers[i], 0);
+   }
+   for (int i = 0; i < 2; i++) {
+      pthread_join(readers[i], 0);
+   }
+   stop_merger(db);
+
+   assert(db->merges > 0);
+   assert(count_rows(snapshot.v, all) == 30);
+   assert(count_rows(db, all) == 130);
+
+   // a pinned snapshot is shared until a write, doesn't hold the writers
+   // up and keeps the runs they merge away
+   db_snapshot* pinned = pin_database(db);
+   db_snapshot* again = pin_database(db);
+   assert(again == pinned);
+   unpin_database(again);
+   int datoms = count_index(&pinned->db.eavt);
+   uint64_t merges = db->merges;
+   for (int i = 0; i < 60; i++) {
+      transaction_result* committed = transact(db, item_transaction(&schema, 9000 + i, i));
+      assert(committed);
+   }
+   assert(db->merges > merges);
+
+   db_snapshot* later = pin_database(db);
+   assert(later != pinned && count_index(&later->db.eavt) == datoms + 240);
+   assert(count_index(&pinned->db.eavt) == datoms);
+   unpin_database(later);
+   unpin_database(pinned);
+   assert(count_rows(db, all) == 190);
+
+   // snapshots share the live trees, a write after a pin starts a new
+   // one, and once there are too many they are folded into one again
+   database* shared = create_database();
+   shared->live_limit = 1 << 30;
+   item_schema shared_schema = install_item_schema(shared);
+   db_snapshot* pins[INDEX_MAX_TREES + 1];
+   int counts[INDEX_MAX_TREES + 1];
+   for (int i = 0; i < INDEX_MAX_TREES + 1; i++) {
+      for (int j = 0; j < 5; j++) {
+         transaction_result* committed = transact(shared, item_transaction(&shared_schema, 500 + 5 * i + j, j));
+         assert(committed);
+      }
+      assert(shared->eavt.tree_count <= INDEX_MAX_TREES);
+      pins[i] = pin_database(shared);
+      datom_index* idx = &pins[i]->db.eavt;
+      assert(idx->trees[idx->tree_count - 1] == shared->eavt.trees[shared->eavt.tree_count - 1]);
+      counts[i] = count_index(idx);
+      assert(i == 0 || counts[i] == counts[i - 1] + 20);
+   }
+   assert(pins[INDEX_MAX_TREES]->db.eavt.tree_count < INDEX_MAX_TREES);
+   for (int i = 0; i < INDEX_MAX_TREES + 1; i++) {
+      assert(count_index(&pins[i]->db.eavt) == counts[i]);
+      unpin_database(pins[i]);
+   }
+   assert(count_rows(shared, all) == 5 * (INDEX_MAX_TREES + 1));
+}
+
+void test_tempids()
+{
+   const char* path = "eav_tempid_test.log";
+   remove(path);
+
+   database* db = create_database();
+   item_schema schema = install_item_schema(db);
+   transaction_log* log = open_log(db, path, LOG_SYNC_COMMIT, 0);
+   assert(log);
+
+   // a ring of three new items, the last only ever referenced, and a
+   // label on the transaction itself
+   temp_id a = tempid(db_part_user);
+   temp_id b = tempid(db_part_user);
+   temp_id c = tempid(db_part_user);
+   temp_id tx = tempid(db_part_tx);
+   assert(tempid_partition(a.s) == DB_PART_USER && tempid_partition(tx.s) == DB_PART_TX);
+
+   transaction* txn = create_transaction();
+   add_fact(txn, a, schema.label, "a");
+   add_fact(txn, a, schema.next, ref(b));
+   add_fact(txn, b, schema.label, "b");
+   add_fact(txn, b, schema.next, ref(c));
+   add_fact(txn, tx, schema.label, "import");
+   transaction_result* r = transact(db, txn);
+   assert(r);
+
+   int64_t ea = resolve_tempid(r, a);
+   int64_t eb = resolve_tempid(r, b);
+   int64_t ec = resolve_tempid(r, c);
+   assert(entity_partition(ea) == DB_PART_USER && entity_partition(ec) == DB_PART_USER);
+   assert(ea != eb && eb != ec && ea != ec);
+   int64_t etx = resolve_tempid(r, tx);
+   assert(etx == tx_entity(txn->txn_id) && entity_partition(etx) == DB_PART_TX);
+
+   char text[128];
+   snprintf(text, sizeof(text), "[:find ?x :where [%lld :item/next ?x]]", (long long)ea);
+   query_result* qr = run_query(db, text);
+   assert(qr && qr->row_count == 1 && result_row(qr, 0)->i == eb);
+   free_query_result(qr);
+
+   snprintf(text, sizeof(text), "[:find ?l :where [%lld :item/label ?l]]", (long long)etx);
+   assert(count_rows(db, text) == 1);
+
+   // the label is all the tx entity has, it doesn't share an id with the
+   // schema's entities
+   snprintf(text, sizeof(text), "[:find ?a ?v :where [%lld ?a ?v]]", (long long)etx);
+   assert(count_rows(db, text) == 1);
+   snprintf(text, sizeof(text), "[:find ?i :where [%lld :db/ident ?i]]", (long long)etx);
+   assert(count_rows(db, text) == 0);
+
+   // a big import takes one block of ids
+   const int count = 100000;
+   txn = create_transaction();
+   temp_id* ids = (temp_id*)malloc(sizeof(temp_id) * count);
+   for (int i = 0; i < count; i++) {
+      ids[i] = tempid(db_part_user);
+      add_fact(txn, ids[i], schema.n, (int64_t)i);
+      if (i) {
+         add_fact(txn, ids[i], schema.next, ref(ids[i - 1]));
+      }
+   }
+   r = transact(db, txn);
+   assert(r);
+   int64_t lo = INT64_MAX;
+   int64_t hi = 0;
+   for (int i = 0; i < count; i++) {
+      int64_t e = resolve_tempid(r, ids[i]);
+      lo = e < lo ? e : lo;
+      hi = e > hi ? e : hi;
+   }
+   assert(lo > ec && hi - lo == count - 1);
+   assert(count_rows(db, "[:find ?e :where [?e :item/n _]]") == count);
+   assert(count_rows(db, "[:find ?e ?x :where [?e :item/next ?x]]") == count + 1);
+   free(ids);
+   int closed = close_log(log);
+   assert(closed == 0);
+
+   // ids of replayed datoms are not handed out again
+   database* db2 = create_database();
+   install_item_schema(db2);
+   log = open_log(db2, path, LOG_SYNC_COMMIT, 0);
+   assert(log);
+   txn = create_transaction();
+   temp_id d = tempid(db_part_user);
+   add_fact(txn, d, schema.label, "d");
+   r = transact(db2, txn);
+   assert(r && resolve_tempid(r, d) == hi + 1);
+   assert(resolve_tempid(r, a) == -1);
+   close_log(log);
+
+   remove(path);
+
+   // a partition hands out ids up to the limit and no further, a
+   // transaction that would go past it fails as a whole
+   database* db3 = create_database();
+   install_item_schema(db3);
+   db3->partitions[DB_PART_USER].sequence = ENTITY_ID_LIMIT - 1;
+   int64_t db_sequence = db3->partitions[DB_PART_DB].sequence;
+   txn = create_transaction();
+   add_fact(txn, tempid(db_part_db), schema.label, "x");
+   add_fact(txn, tempid(db_part_user), schema.label, "y");
+   add_fact(txn, tempid(db_part_user), schema.label, "z");
+   transaction_result* committed = transact(db3, txn);
+   assert(!committed);
+   assert(db3->partitions[DB_PART_USER].sequence == ENTITY_ID_LIMIT - 1);
+   assert(db3->partitions[DB_PART_DB].sequence == db_sequence);
+
+   txn = create_transaction();
+   temp_id last = tempid(db_part_user);
+   add_fact(txn, last, schema.label, "y");
+   r = transact(db3, txn);
+   assert(r && resolve_tempid(r, last) == entity_id(DB_PART_USER, ENTITY_ID_LIMIT - 1));
+   assert(entity_partition(resolve_tempid(r, last)) == DB_PART_USER);
+   assert(count_rows(db3, "[:find ?e :where [?e :item/label _]]") == 1);
+}
+
+int64_t user_with_email(database* db, const char* email)
+{
+   char text[128];
+   snprintf(text, sizeof(text), "[:find ?e :where [?e :user/email \"%s\"]]", email);
+   query_result* r = run_query(db, text);
+   int64_t e = r && r->row_count == 1 ? result_row(r, 0)->i : -1;
+   free_query_result(r);
+   return e;
+}
+
+void test_upsert()
+{
+   database* db = create_database();
+   db->live_limit = 64;
+   install_attribute(db, kw("user", "email"), db_unique_identity, db_valueType_string, "An email");
+   install_attribute(db, kw("user", "handle"), db_unique_value, db_valueType_string, "A handle");
+   install_attribute(db, kw("user", "friend"), 0, db_valueType_ref, "A friend");
+   int64_t email = lookup_ref(db, kw("user", "email")).r;
+   int64_t handle = lookup_ref(db, kw("user", "handle")).r;
+   int64_t friend_ = lookup_ref(db, kw("user", "friend")).r;
+
+   temp_id a = tempid(db_part_user);
+   temp_id b = tempid(db_part_user);
+   transaction* txn = create_transaction();
+   add_fact(txn, a, email, "a@x");
+   add_fact(txn, b, email, "b@x");
+   add_fact(txn, b, handle, "bee");
+   transaction_result* r = transact(db, txn);
+   assert(r);
+   int64_t ea = resolve_tempid(r, a);
+   int64_t eb = resolve_tempid(r, b);
+
+   // known emails are the entities that have them, refs follow
+   temp_id a2 = tempid(db_part_user);
+   temp_id b2 = tempid(db_part_user);
+   temp_id c = tempid(db_part_user);
+   txn = create_transaction();
+   add_fact(txn, a2, email, "a@x");
+   add_fact(txn, a2, friend_, ref(b2));
+   add_fact(txn, b2, email, "b@x");
+   add_fact(txn, b2, handle, "bee");
+   add_fact(txn, c, email, "c@x");
+   add_fact(txn, c, email, "c@x");
+   r = transact(db, txn);
+   assert(r);
+   assert(resolve_tempid(r, a2) == ea && resolve_tempid(r, b2) == eb);
+   int64_t ec = resolve_tempid(r, c);
+   assert(ec != ea && ec != eb && user_with_email(db, "c@x") == ec);
+   assert(count_rows(db, "[:find ?e :where [?e :user/email _]]") == 3);
+   char text[128];
+   snprintf(text, sizeof(text), "[:find ?f :where [%lld :user/friend ?f]]", (long long)ea);
+   query_result* qr = run_query(db, text);
+   assert(qr && qr->row_count == 1 && result_row(qr, 0)->i == eb);
+   free_query_result(qr);
+
+   // conflicts leave nothing behind, not even the t
+   int64_t t = r->txn->txn_id;
+   int datoms = count_rows(db, "[:find ?e ?v :where [?e :user/handle ?v]]");
+
+   txn = create_transaction();
+   add_fact(txn, tempid(db_part_user), handle, "bee");
+   transaction_result* committed = transact(db, txn);
+   assert(!committed);
+
+   txn = create_transaction();
+   add_fact(txn, ec, handle, "bee");
+   committed = transact(db, txn);
+   assert(!committed);
+
+   txn = create_transaction();
+   add_fact(txn, tempid(db_part_user), handle, "new");
+   add_fact(txn, tempid(db_part_user), handle, "new");
+   committed = transact(db, txn);
+   assert(!committed);
+
+   txn = create_transaction();
+   add_fact(txn, tempid(db_part_user), email, "d@x");
+   add_fact(txn, tempid(db_part_user), email, "d@x");
+   committed = transact(db, txn);
+   assert(!committed);
+
+   txn = create_transaction();
+   temp_id both = tempid(db_part_user);
+   add_fact(txn, both, email, "a@x");
+   add_fact(txn, both, email, "b@x");
+   committed = transact(db, txn);
+   assert(!committed);
+
+   assert(count_rows(db, "[:find ?e ?v :where [?e :user/handle ?v]]") == datoms);
+   assert(user_with_email(db, "d@x") == -1);
+   txn = create_transaction();
+   add_fact(txn, ec, handle, "sea");
+   r = transact(db, txn);
+   assert(r && r->txn->txn_id == t + 1);
+
+   // a batch half of known emails, probed through sealed runs
+   const int count = 1000;
+   char address[32];
+   txn = create_transaction();
+   for (int i = 0; i < count / 2; i++) {
+      snprintf(address, sizeof(address), "u%d@x", i);
+      add_fact(txn, tempid(db_part_user), email, address);
+   }
+   committed = transact(db, txn);
+   assert(committed);
+   assert(db->seals > 0);
+   int64_t known = user_with_email(db, "u7@x");
+
+   temp_id* ids = (temp_id*)malloc(sizeof(temp_id) * count);
+   txn = create_transaction();
+   for (int i = 0; i < count; i++) {
+      ids[i] = tempid(db_part_user);
+      snprintf(address, sizeof(address), "u%d@x", i);
+      add_fact(txn, ids[i], email, address);
+   }
+   r = transact(db, txn);
+   assert(r && resolve_tempid(r, ids[7]) == known);
+   assert(count_rows(db, "[:find ?e :where [?e :user/email _]]") == count + 3);
+   for (int i = 0; i < count; i++) {
+      snprintf(address, sizeof(address), "u%d@x", i);
+      assert(user_with_email(db, address) == resolve_tempid(r, ids[i]));
+   }
+   free(ids);
+}
+
 int main(int argc, char** argv)
 {
    test_interning_keywords();
+   test_interning_keywords_threaded();
    test_memory_arena();
    //test_simple_transaction();
 
    test_init_database();
-
+   test_index_keys();
+   test_query();
+   test_leapfrog();
+   test_log();
+   test_checkpoint();
+   test_lsm();
+   test_time_travel();
+   test_tempids();
+   test_upsert();
 
    return 0;
 }
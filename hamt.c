@@ -8,99 +8,36 @@
 #include <string.h>
 #include <memory.h>
 #include <assert.h>
-
-void visit_entry(hamt_entry* e, void(*f)(void*, int, hamt_entry*), void* arg, int level)
-{
-   f(arg, level, e);
-   if (e->p & 0x2) {
-      hamt_entry* se = (hamt_entry*)ptoptr(e->p);
-      for (int i = 0; i < HAMT_T; i++) {
-         if (e->korm & (uintptr_t)(1 << i)) {
-            visit_entry(se++, f, arg, level+1);
-         }
-      }
-   }
-}
-
-void visit(hamt* t, void(*f)(void*, int, hamt_entry*), void* arg)
-{
-   for (int i = 0; i < HAMT_T; i++) {
-      if (t->entries[i].p) {
-         visit_entry(t->entries + i, f, arg, 0);
-      }
-   }
-}
-
-int count_list(hamt_freelist_node* n)
-{
-   int cnt = 0;
-   while (n) {
-      ++cnt;
-      n = n->next;
-   }
-   return cnt;
-}
-
-typedef struct amt_stats
-{
-   int entry_count;
-   int key_count;
-   int subtree_count;
-   int max_level;
-} amt_stats;
-
-static int print_keys = 0;
-
-void stat_visit(void* p, int level, hamt_entry* e)
-{
-   amt_stats* s = (amt_stats*)p;
-   s->entry_count++;
-   if (level > s->max_level) {
-      s->max_level = level;
-   }
-   if (e->p & 0x1) {
-      if (print_keys) {
-         printf("key: %s\n", (char*)e->korm);
-      }
-      s->key_count++;
-   } else if (e->p & 2) {
-      s->subtree_count++;
-   }
-}
+#include <pthread.h>
 
 void print_stats(hamt* t)
 {
-   amt_stats stats = {0};
-   size_t freelist_mem = 0;
-   size_t page_cnt = 0;
+   hamt_stats stats;
+   hamt_stats_full(t, &stats);
+
    printf("Freelists:\n");
-   for (int i = 0; i < HAMT_T; i++) {
-      printf("%3i ", i+1);
+   for (int i = 1; i < HAMT_STATS_TABLE_SIZES; i++) {
+      printf("%3i ", i);
    }
    printf("\n");
-   for (int i = 0; i < HAMT_T; i++) {
-      int c = count_list(t->freelists[i]);
-      freelist_mem += (i+1) * c * sizeof(hamt_freelist_node);
-      printf("%3i ", c);
+   for (int i = 1; i < HAMT_STATS_TABLE_SIZES; i++) {
+      printf("%3zu ", stats.freelist_bytes[i] / (i * sizeof(hamt_entry)));
    }
    printf("\n");
 
-   hamt_entry_pool* p = t->pool;
-   while (p) {
-      page_cnt++;
-      p = p->next;
-   }
-
-   visit(t, stat_visit, &stats);
-
-   if (stats.entry_count) {
-      printf("max level: %i\n", stats.max_level);
-      printf("entry count: %i\n", stats.entry_count);
-      printf("key count: %i\n", stats.key_count);
-      printf("subtree count: %i\n", stats.subtree_count);
-      printf("tree ratio: %f\n", (float)stats.subtree_count / (float)stats.key_count);
-      printf("freelist memory: %lld\n", freelist_mem);
-      printf("allocd pages: %zd(%zd bytes)\n", page_cnt, page_cnt*HAMT_ENTRY_POOL_SIZE);
+   if (stats.key_count) {
+      printf("max level: %i\n", stats.max_depth);
+      printf("keys by level:");
+      for (int i = 0; i <= stats.max_depth && i < HAMT_STATS_DEPTH; i++) {
+         printf(" %zu", stats.depth_keys[i]);
+      }
+      printf("\n");
+      printf("key count: %zu\n", stats.key_count);
+      printf("subtree count: %zu\n", stats.subtable_count);
+      printf("tree ratio: %f\n", (float)stats.subtable_count / (float)stats.key_count);
+      printf("freelist memory: %zu\n", stats.free_bytes);
+      printf("allocd pages: %zu(%zu bytes)\n", stats.pool_count, stats.pool_bytes);
+      printf("pool utilization: %.1f%%\n", stats.utilization * 100.0);
    } else {
       printf("empty\n");
    }
@@ -113,7 +50,7 @@ void insert_cstr(hamt* t, const char* s)
 
 char* random_string(char* buff, int len)
 {
-   static char* chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+   static const char* chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
    char* b = buff;
    for (int i = 0; i < len; i++) {
       *b++ = chars[rand() % 52];
@@ -246,21 +183,1391 @@ void test_iterator(hamt* h, int cnt)
    }
 }
 
-int main(int argc, char** argv)
+void check_keys(hamt* h, char** keys, int from, int to, const char* what);
+
+// no subtable may be left holding a single leaf and nothing else
+int check_canonical_entry(hamt_entry* e)
 {
-   printf("T: %i\n", HAMT_T);
-   printf("T_BITS: %i\n", HAMT_T_BITS);
-   printf("T_ENTRIES: %i\n", HAMT_T_ENTRIES);
-   printf("T_MASK: 0x%x\n", HAMT_T_MASK);
-   printf("hamt_entry size: %lld\n", sizeof(hamt_entry));
+   if (!(e->p & 0x2)) {
+      return 1;
+   }
+   if (hamt_datamap(e->korm) & hamt_nodemap(e->korm)) {
+      return 0;
+   }
+   if (hamt_nodemap(e->korm) == 0 && ctpop(hamt_datamap(e->korm)) == 1) {
+      return 0;
+   }
+   hamt_entry* se = (hamt_entry*)ptoptr(e->p);
+   int data_count = ctpop(hamt_datamap(e->korm));
+   for (int i = 0; i < hamt_table_size(e->korm); i++) {
+      if ((i < data_count) != ((se[i].p & 0x1) != 0)) {
+         return 0;
+      }
+      if (!check_canonical_entry(se + i)) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+int check_canonical(hamt* t)
+{
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(t); i++) {
+      if (!check_canonical_entry(t->entries + i)) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+void test_canonical(int cnt)
+{
+   hamt a = {0};
+   hamt b = {0};
+   hamt_init(&a, hash_string_key, compare_string_key);
+   hamt_init(&b, hash_string_key, compare_string_key);
+   char** keys = make_random_keys(cnt * 2, 32);
+
+   printf("\n\nTesting canonical layout with %i keys\n", cnt);
+
+   // a gets the keys in order, b in reverse with extra keys added and removed
+   for (int i = 0; i < cnt; i++) {
+      insert_cstr(&a, keys[i]);
+   }
+   for (int i = cnt * 2 - 1; i >= 0; i--) {
+      insert_cstr(&b, keys[i]);
+   }
+   for (int i = cnt; i < cnt * 2; i++) {
+      hamt_remove(&b, keys[i]);
+   }
+
+   assert(check_canonical(&a));
+   assert(check_canonical(&b));
+   assert(hamt_equals(&a, &b));
+
+   hamt_remove(&b, keys[cnt / 2]);
+   assert(check_canonical(&b));
+   assert(!hamt_equals(&a, &b));
+
+   insert_cstr(&b, keys[cnt / 2]);
+   assert(hamt_equals(&a, &b));
+
+   printf("Done!\n");
+
+   free(keys);
+}
+
+void test_build(int cnt)
+{
+   hamt a = {0};
+   hamt b = {0};
+   hamt_init(&a, hash_string_key, compare_string_key);
+   hamt_init(&b, hash_string_key, compare_string_key);
+   char** keys = make_random_keys(cnt, 32);
+   void** values = (void**)malloc(sizeof(void*) * (cnt + 1));
+   void** bkeys = (void**)malloc(sizeof(void*) * (cnt + 1));
+
+   printf("\n\nTesting build with %i keys\n", cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      insert_cstr(&a, keys[i]);
+      bkeys[i] = keys[i];
+      values[i] = keys[i];
+   }
+
+   // a duplicate key, the last value wins
+   bkeys[cnt] = keys[0];
+   values[cnt] = keys[1];
+   hamt_insert(&a, keys[0], keys[1]);
+
+   hamt_build(&b, bkeys, values, cnt + 1);
+
+   assert(check_canonical(&b));
+   assert(hamt_equals(&a, &b));
+   check_keys(&b, keys, 1, cnt, "build");
+   assert(hamt_find(&b, keys[0]) == keys[1]);
+
+   for (int i = 0; i < cnt; i++) {
+      if (!hamt_remove(&b, keys[i])) {
+         printf("build: failed to remove %s\n", keys[i]);
+      }
+   }
+
+   printf("Done!\n");
+
+   free(bkeys);
+   free(values);
+   free(keys);
+}
+
+void test_wide_root(int cnt, int root_bits)
+{
+   hamt a = {0};
+   hamt b = {0};
+   hamt n = {0};
+   hamt_init(&a, hash_string_key, compare_string_key, root_bits);
+   hamt_init(&b, hash_string_key, compare_string_key, root_bits);
+   hamt_init(&n, hash_string_key, compare_string_key);
+   char** keys = make_random_keys(cnt, 32);
+
+   printf("\n\nTesting a %i bit root with %i keys\n", root_bits, cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      insert_cstr(&a, keys[i]);
+      insert_cstr(&n, keys[i]);
+   }
+   check_keys(&a, keys, 0, cnt, "wide root");
+
+   hamt_build(&b, (void**)keys, (void**)keys, cnt);
+   assert(check_canonical(&b));
+   assert(hamt_equals(&a, &b));
+   assert(hamt_equals(&a, &n));
+   assert(hamt_equals(&n, &a));
+
+   int c = 0;
+   hamt_iterator it;
+   hamt_iterator_begin(&it, &a);
+   while (!hamt_iterator_is_end(&it)) {
+      c++;
+      hamt_iterator_next(&it);
+   }
+   assert(c == cnt);
+
+   for (int i = 0; i < cnt; i += 2) {
+      if (!hamt_remove(&a, keys[i])) {
+         printf("wide root: failed to remove %s\n", keys[i]);
+      }
+   }
+   assert(check_canonical(&a));
+   assert(!hamt_equals(&a, &n));
+   hamt_compact(&a);
+   for (int i = 0; i < cnt; i++) {
+      void* v = hamt_find(&a, keys[i]);
+      if (v != ((i % 2) ? keys[i] : 0)) {
+         printf("wide root: key %i %s expected %p\n", i, keys[i], (i % 2) ? keys[i] : 0);
+      }
+   }
+
+   printf("Done!\n");
+
+   free(keys);
+}
+
+// multiples of 4 up to bit 62
+uintptr_t mapped_value(int i)
+{
+   return ((uintptr_t)(i + 1) * 4) | ((uintptr_t)(i & 7) << 58);
+}
+
+void test_mapped(int cnt, int root_bits)
+{
+   hamt a = {0};
+   hamt_init(&a, hash_string_key, compare_string_key, root_bits);
+   int misses = cnt / 4 + 4;
+   char** keys = make_random_keys(cnt + misses, 32);
+   const char* path = "hamt_test.img";
+
+   printf("\n\nTesting mapped image with %i keys\n", cnt);
+
+   // values keep all but the tag bits
+   for (int i = 0; i < cnt; i++) {
+      hamt_insert(&a, keys[i], (void*)mapped_value(i));
+   }
+
+   if (hamt_save(&a, path) != 0) {
+      printf("mapped: failed to save %s\n", path);
+      return;
+   }
+
+   hamt_mapped* m = hamt_open_mapped(path);
+   assert(m);
+   assert(hamt_mapped_count(m) == (uint32_t)cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      if (hamt_mapped_find(m, keys[i]) != (void*)mapped_value(i)) {
+         printf("mapped: couldn't find key %i: %s\n", i, keys[i]);
+      }
+   }
+   for (int i = cnt; i < cnt + misses; i++) {
+      if (hamt_mapped_find(m, keys[i])) {
+         printf("mapped: found missing key %i: %s\n", i, keys[i]);
+      }
+   }
+   hamt_close_mapped(m);
+
+   // offsets pointing out of the image are not followed
+   FILE* f = fopen(path, "r+b");
+   hamt_image_header h;
+   if (fread(&h, sizeof(h), 1, f) != 1) {
+      printf("mapped: couldn't read back %s\n", path);
+   }
+   for (uint32_t i = 0; i < ((uint32_t)1 << root_bits); i++) {
+      hamt_entry e;
+      long at = (long)(sizeof(h) + sizeof(e) * i);
+      fseek(f, at, SEEK_SET);
+      if (fread(&e, sizeof(e), 1, f) != 1) {
+         break;
+      }
+      if (e.p & 0x2) {
+         e.p = (uintptr_t)(h.size + sizeof(e) * (i & 1 ? 1 : 1000)) | 0x2;
+      } else if (e.p & 0x1) {
+         e.korm = h.size - 1;
+      }
+      fseek(f, at, SEEK_SET);
+      fwrite(&e, sizeof(e), 1, f);
+   }
+   fclose(f);
+   m = hamt_open_mapped(path);
+   assert(m);
+   for (int i = 0; i < cnt; i++) {
+      if (hamt_mapped_find(m, keys[i])) {
+         printf("mapped: found key %i through a bad offset\n", i);
+      }
+   }
+   hamt_close_mapped(m);
+
+   // not an image
+   f = fopen(path, "wb");
+   fputs("not a hamt image, just some text that is long enough", f);
+   fclose(f);
+   assert(!hamt_open_mapped(path));
+
+   remove(path);
+   printf("Done!\n");
+
+   free(keys);
+}
+
+typedef struct parallel_sum
+{
+   int64_t count;
+   int64_t sum;
+} parallel_sum;
+
+void parallel_visit(void* key, void* value, void* arg)
+{
+   parallel_sum* ps = (parallel_sum*)arg;
+   __atomic_fetch_add(&ps->count, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&ps->sum, (int64_t)(uintptr_t)value, __ATOMIC_RELAXED);
+}
+
+// every key lands in root slot 0, so splitting has to go below the root
+uint32_t skewed_hash(void* key, int level)
+{
+   return (uint32_t)(uintptr_t)key << HAMT_T_BITS;
+}
+
+int compare_int_key(void* a, void* b)
+{
+   return a != b;
+}
+
+void test_parallel_for_each(int cnt, int nthreads)
+{
+   hamt_int ht = {0};
+   hamt skewed = {0};
+   hamt_int_init(&ht);
+   hamt_init(&skewed, skewed_hash, compare_int_key);
+
+   printf("\n\nTesting parallel for each with %i keys and %i threads\n", cnt, nthreads);
+
+   int64_t sum = 0;
+   for (int i = 0; i < cnt; i++) {
+      hamt_int_insert(&ht, i, (void*)(uintptr_t)((i + 1) * 4));
+      hamt_insert(&skewed, (void*)(uintptr_t)i, (void*)(uintptr_t)((i + 1) * 4));
+      sum += (i + 1) * 4;
+   }
+
+   parallel_sum ps = {0, 0};
+   hamt_parallel_for_each(&ht.h, nthreads, parallel_visit, &ps);
+   if (ps.count != cnt || ps.sum != sum) {
+      printf("parallel: expected %i keys got %lld\n", cnt, (long long)ps.count);
+   }
+
+   ps.count = ps.sum = 0;
+   hamt_parallel_for_each(&skewed, nthreads, parallel_visit, &ps);
+   if (ps.count != cnt || ps.sum != sum) {
+      printf("parallel: expected %i skewed keys got %lld\n", cnt, (long long)ps.count);
+   }
+
+   // splits cover the trie exactly once, even when it is all one subtable
+   hamt_iterator parts[16];
+   int part_count = 1;
+   hamt_iterator_begin(parts, &skewed);
+   for (int i = 0; part_count < 16 && i < part_count; i++) {
+      while (part_count < 16 && hamt_iterator_split(parts + i, parts + part_count)) {
+         part_count++;
+      }
+   }
+   int c = 0;
+   int nonempty = 0;
+   for (int i = 0; i < part_count; i++) {
+      nonempty += !hamt_iterator_is_end(parts + i);
+      for (; !hamt_iterator_is_end(parts + i); hamt_iterator_next(parts + i)) {
+         c++;
+      }
+   }
+   if (c != cnt) {
+      printf("parallel: split iterators expected %i keys got %i\n", cnt, c);
+   }
+   if (cnt > 100 && nonempty < 2) {
+      printf("parallel: failed to split a skewed trie\n");
+   }
+
+   printf("Done!\n");
+}
+
+// the freelists walked, to check the counts kept for the stats
+size_t walk_free_bytes(hamt* t)
+{
+   size_t bytes = 0;
+   for (int i = 0; i < HAMT_T; i++) {
+      for (hamt_freelist_node* n = t->freelists[i]; n; n = n->next) {
+         bytes += (i+1) * sizeof(hamt_entry);
+      }
+   }
+   return bytes;
+}
+
+void test_stats(int cnt)
+{
+   hamt a = {0};
+   hamt_init(&a, hash_string_key, compare_string_key);
+   char** keys = make_random_keys(cnt, 32);
+   hamt_stats stats;
+
+   printf("\n\nTesting stats with %i keys\n", cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      insert_cstr(&a, keys[i]);
+   }
+   for (int i = 0; i < cnt; i += 2) {
+      hamt_remove(&a, keys[i]);
+   }
 
+   hamt_stats_full(&a, &stats);
+
+   size_t keys_by_depth = 0;
+   for (int i = 0; i < HAMT_STATS_DEPTH; i++) {
+      keys_by_depth += stats.depth_keys[i];
+   }
+   size_t tables = 0;
+   size_t table_bytes = 0;
+   for (int i = 0; i < HAMT_STATS_TABLE_SIZES; i++) {
+      tables += stats.table_sizes[i];
+      table_bytes += stats.table_sizes[i] * hamt_size_class(i) * sizeof(hamt_entry);
+   }
+
+   if (stats.key_count != (size_t)(cnt / 2) || keys_by_depth != stats.key_count) {
+      printf("stats: expected %i keys got %zu\n", cnt / 2, stats.key_count);
+   }
+   if (tables != stats.subtable_count || table_bytes != stats.live_bytes) {
+      printf("stats: expected %zu live bytes got %zu\n", table_bytes, stats.live_bytes);
+   }
+   if (stats.live_bytes + stats.free_bytes + stats.unused_bytes > stats.pool_bytes ||
+       stats.utilization < 0.0 || stats.utilization > 1.0) {
+      printf("stats: pool accounting failed\n");
+   }
+
+   // the memory half agrees with the full walk
+   hamt_stats memory;
+   hamt_stats_memory(&a, &memory);
+   if (memory.live_bytes != stats.live_bytes || memory.free_bytes != stats.free_bytes || memory.key_count) {
+      printf("stats: memory stats failed\n");
+   }
+   if (memory.free_bytes != walk_free_bytes(&a)) {
+      printf("stats: expected %zu free bytes got %zu\n", walk_free_bytes(&a), memory.free_bytes);
+   }
+
+   // and still once compaction dropped nodes from the freelists
+   for (int i = 1; i < cnt; i += 4) {
+      hamt_remove(&a, keys[i]);
+   }
+   while (hamt_compact_step(&a, 64)) {
+   }
+   hamt_stats_memory(&a, &memory);
+   if (memory.free_bytes != walk_free_bytes(&a)) {
+      printf("stats: expected %zu free bytes after compaction got %zu\n", walk_free_bytes(&a), memory.free_bytes);
+   }
+
+   printf("Done!\n");
+
+   free(keys);
+}
+
+void test_find_many(hamt* h, int cnt)
+{
+   char** keys = make_random_keys(cnt, 32);
+   char** missing = make_random_keys(cnt, 31);
+   void** probe = (void**)malloc(sizeof(void*) * cnt * 2);
+   void** found = (void**)malloc(sizeof(void*) * cnt * 2);
+
+   printf("\n\nTesting find_many with %i keys\n", cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      insert_cstr(h, keys[i]);
+   }
+
+   // interleave hits and misses
+   for (int i = 0; i < cnt; i++) {
+      probe[i*2] = keys[i];
+      probe[i*2+1] = missing[i];
+   }
+
+   hamt_find_many(h, probe, cnt * 2, found);
+
+   for (int i = 0; i < cnt; i++) {
+      if (found[i*2] != keys[i]) {
+         printf("find_many: couldn't find key %i: %s\n", i, keys[i]);
+      }
+      if (found[i*2+1]) {
+         printf("find_many: found missing key %i: %s\n", i, missing[i]);
+      }
+   }
+
+   for (int i = 0; i < cnt; i++) {
+      hamt_remove(h, keys[i]);
+   }
+
+   printf("Done!\n");
+
+   free(found);
+   free(probe);
+   free(missing);
+   free(keys);
+}
+
+int count_pools(hamt* t)
+{
+   int cnt = 0;
+   for (hamt_entry_pool* p = t->pool; p; p = p->next) {
+      cnt++;
+   }
+   return cnt;
+}
+
+void check_keys(hamt* h, char** keys, int from, int to, const char* what)
+{
+   for (int i = from; i < to; i++) {
+      void* t = hamt_find(h, keys[i]);
+      if (t != keys[i]) {
+         printf("%s: couldn't find key %i: %s\n", what, i, keys[i]);
+      }
+   }
+}
+
+void test_incremental_compact(int cnt)
+{
    hamt ht = {0};
    hamt* h = hamt_init(&ht, hash_string_key, compare_string_key);
+   char** keys = make_random_keys(cnt, 32);
 
-   test_iterator(h, 5);
-   test_iterator(h, 100);
-   test_iterator(h, 1000);
-   test_iterator(h, 5000);
+   printf("\n\nTesting incremental compaction with %i keys\n", cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      insert_cstr(h, keys[i]);
+   }
+
+   // keep every fourth key so most pools are left sparse
+   for (int i = 0; i < cnt; i++) {
+      if (i % 4) {
+         hamt_remove(h, keys[i]);
+      }
+   }
+
+   int before = count_pools(h);
+   int steps = 0;
+   while (hamt_compact_step(h, 8)) {
+      steps++;
+      // the trie changes between steps
+      insert_cstr(h, keys[1 + (steps % (cnt/4)) * 4]);
+      hamt_remove(h, keys[1 + (steps % (cnt/4)) * 4]);
+      assert(steps < cnt * 4);
+   }
+   int after = count_pools(h);
+
+   printf("pools before: %i after: %i in %i steps\n", before, after, steps);
+   assert(before == 1 || after < before);
+
+   for (int i = 0; i < cnt; i += 4) {
+      if (hamt_find(h, keys[i]) != keys[i]) {
+         printf("incremental: couldn't find key %i: %s\n", i, keys[i]);
+      }
+   }
+
+   // compact a little on every insert and remove while churning
+   hamt_set_compact_budget(h, 4);
+   for (int round = 0; round < 4; round++) {
+      for (int i = 0; i < cnt; i++) {
+         if (i % 4) {
+            insert_cstr(h, keys[i]);
+         }
+      }
+      check_keys(h, keys, 0, cnt, "churn insert");
+      for (int i = 0; i < cnt; i++) {
+         if (i % 4) {
+            hamt_remove(h, keys[i]);
+         }
+      }
+   }
+
+   for (int i = 0; i < cnt; i++) {
+      void* t = hamt_find(h, keys[i]);
+      if ((i % 4) == 0 && t != keys[i]) {
+         printf("churn: couldn't find key %i: %s\n", i, keys[i]);
+      } else if ((i % 4) && t) {
+         printf("churn: still found key %i: %s\n", i, keys[i]);
+      }
+   }
+
+   printf("pools after churn: %i\n", count_pools(h));
+   printf("Done!\n");
+
+   free(keys);
+}
+
+void test_int_keys(int cnt)
+{
+   hamt_int ht = {0};
+   hamt_int* h = hamt_int_init(&ht);
+   int64_t* keys = (int64_t*)malloc(sizeof(int64_t) * cnt);
+
+   printf("\n\nTesting int keys with %i keys\n", cnt);
+
+   // sequential ids, negative ids and ids above 32 bits
+   for (int i = 0; i < cnt; i++) {
+      switch (i % 3) {
+      case 0: keys[i] = i; break;
+      case 1: keys[i] = -(int64_t)i; break;
+      case 2: keys[i] = ((int64_t)i << 40) + i; break;
+      }
+   }
+
+   for (int i = 0; i < cnt; i++) {
+      hamt_int_insert(h, keys[i], (void*)(uintptr_t)((i + 1) * 4));
+   }
+
+   for (int i = 0; i < cnt; i++) {
+      void* v = hamt_int_find(h, keys[i]);
+      if (v != (void*)(uintptr_t)((i + 1) * 4)) {
+         printf("int: couldn't find key %i: %lld\n", i, (long long)keys[i]);
+      }
+   }
+
+   // replace values
+   for (int i = 0; i < cnt; i += 2) {
+      hamt_int_insert(h, keys[i], (void*)(uintptr_t)((i + 2) * 4));
+   }
+
+   int c = 0;
+   hamt_iterator it;
+   hamt_iterator_begin(&it, &h->h);
+   while (!hamt_iterator_is_end(&it)) {
+      int64_t k = hamt_int_key(&it);
+      assert(hamt_int_find(h, k) == hamt_value(&it));
+      c++;
+      hamt_iterator_next(&it);
+   }
+   assert(c == cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      uintptr_t expect = (i % 2) ? (i + 1) * 4 : (i + 2) * 4;
+      void* v = hamt_int_remove(h, keys[i]);
+      if (v != (void*)expect) {
+         printf("int: failed to remove %lld\n", (long long)keys[i]);
+      }
+   }
+
+   for (int i = 0; i < cnt; i++) {
+      if (hamt_int_find(h, keys[i])) {
+         printf("int: still found key %lld\n", (long long)keys[i]);
+      }
+   }
+
+   printf("Done!\n");
+
+   free(keys);
+}
+
+uint64_t splitmix64(uint64_t x)
+{
+   x += 0x9e3779b97f4a7c15ull;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+   return x ^ (x >> 31);
+}
+
+// a key whose hamt_int_hash is the same for every hi given the same mix
+int64_t int_key_with_mix(uint32_t mix, uint32_t hi)
+{
+   uint32_t lo = mix ^ (hi * 0x85ebca6bu);
+   uint32_t top = hi + (uint32_t)((int32_t)lo >> 31);
+   return (int64_t)(((uint64_t)top << 32) | lo);
+}
+
+// random 64 bit keys collide on the 32 bit hash, plus groups of keys made
+// to share a hash
+void test_int_collisions(int cnt, int root_bits)
+{
+   hamt_int ht = {0};
+   hamt_int* h = hamt_int_init(&ht, root_bits);
+   int groups = cnt / 100;
+   int n = cnt + groups * 4;
+   int64_t* keys = (int64_t*)malloc(sizeof(int64_t) * n);
+
+   printf("\n\nTesting int collisions with %i keys, root bits %i\n", n, root_bits);
+
+   // splitmix64 is a bijection, so the keys are distinct
+   for (int i = 0; i < cnt; i++) {
+      keys[i] = (int64_t)splitmix64(i);
+   }
+   for (int g = 0; g < groups; g++) {
+      uint32_t mix = (uint32_t)splitmix64(cnt + g);
+      for (int j = 0; j < 4; j++) {
+         keys[cnt + g * 4 + j] = int_key_with_mix(mix, g * 4 + j + 1);
+      }
+      assert(hamt_int_hash(keys[cnt + g * 4]) == hamt_int_hash(keys[cnt + g * 4 + 3]));
+   }
+
+   for (int i = 0; i < n; i++) {
+      hamt_int_insert(h, keys[i], (void*)(uintptr_t)((i + 1) * 4));
+   }
+   for (int i = 0; i < n; i++) {
+      void* v = hamt_int_find(h, keys[i]);
+      if (v != (void*)(uintptr_t)((i + 1) * 4)) {
+         printf("int collisions: couldn't find key %i: %lld\n", i, (long long)keys[i]);
+      }
+   }
+
+   hamt_stats stats;
+   hamt_stats_full(&h->h, &stats);
+   assert(stats.key_count == (size_t)n);
+   assert(check_canonical(&h->h));
+
+   int c = 0;
+   hamt_iterator it;
+   for (hamt_iterator_begin(&it, &h->h); !hamt_iterator_is_end(&it); hamt_iterator_next(&it)) {
+      assert(hamt_int_find(h, hamt_int_key(&it)) == hamt_value(&it));
+      c++;
+   }
+   assert(c == n);
+
+   // built, and split into halves and put back together
+   hamt_int b = {0}, odd = {0}, even = {0}, u = {0}, d = {0};
+   void** bkeys = (void**)malloc(sizeof(void*) * n);
+   void** values = (void**)malloc(sizeof(void*) * n);
+   hamt_int_init(&b, root_bits);
+   hamt_int_init(&odd, root_bits);
+   hamt_int_init(&even, root_bits);
+   for (int i = 0; i < n; i++) {
+      bkeys[i] = (void*)(uintptr_t)keys[i];
+      values[i] = (void*)(uintptr_t)((i + 1) * 4);
+      hamt_int_insert((i & 1) ? &odd : &even, keys[i], values[i]);
+   }
+   hamt_build(&b.h, bkeys, values, n);
+   if (!hamt_equals(&b.h, &h->h)) {
+      printf("int collisions: build failed\n");
+   }
+   hamt_int_union(hamt_int_init(&u, root_bits), &odd, &even);
+   if (!hamt_equals(&u.h, &h->h)) {
+      printf("int collisions: union failed\n");
+   }
+   hamt_int_difference(hamt_int_init(&d, root_bits), h, &odd);
+   if (!hamt_equals(&d.h, &even.h)) {
+      printf("int collisions: difference failed\n");
+   }
+   assert(check_canonical(&u.h) && check_canonical(&d.h));
+
+   for (int i = 0; i < n; i += 2) {
+      if (hamt_int_remove(h, keys[i]) != (void*)(uintptr_t)((i + 1) * 4)) {
+         printf("int collisions: failed to remove %lld\n", (long long)keys[i]);
+      }
+   }
+   assert(check_canonical(&h->h));
+   for (int i = 0; i < n; i++) {
+      void* v = hamt_int_find(h, keys[i]);
+      if ((i & 1) ? v != (void*)(uintptr_t)((i + 1) * 4) : v != 0) {
+         printf("int collisions: wrong value for key %i after remove\n", i);
+      }
+   }
+   if (!hamt_equals(&h->h, &odd.h)) {
+      printf("int collisions: remove failed\n");
+   }
+
+   printf("Done!\n");
+
+   hamt_destroy(&d.h);
+   hamt_destroy(&u.h);
+   hamt_destroy(&even.h);
+   hamt_destroy(&odd.h);
+   hamt_destroy(&b.h);
+   hamt_destroy(&h->h);
+   free(values);
+   free(bkeys);
+   free(keys);
+}
+
+uint32_t hash_string_key_weak(void* k, int level)
+{
+   return hash_string_key(k, level) & 0xfff;
+}
+
+// every key has the same hash, so they all go in one chain of buckets
+uint32_t hash_string_key_same(void* k, int level)
+{
+   return 7;
+}
+
+// string keys with only 4096 hashes, most keys share theirs
+void test_collisions(int cnt, hash_fn_t hash)
+{
+   hamt a = {0};
+   hamt b = {0};
+   hamt_init(&a, hash, compare_string_key, 1);
+   hamt_init(&b, hash, compare_string_key, 1);
+   char** keys = make_random_keys(cnt, 32);
+   void** found = (void**)malloc(sizeof(void*) * cnt);
+
+   printf("\n\nTesting collisions with %i keys\n", cnt);
+
+   for (int i = 0; i < cnt; i++) {
+      insert_cstr(&a, keys[i]);
+   }
+   check_keys(&a, keys, 0, cnt, "collisions");
+   hamt_find_many(&a, (void**)keys, cnt, found);
+   for (int i = 0; i < cnt; i++) {
+      if (found[i] != keys[i]) {
+         printf("collisions: find_many couldn't find %s\n", keys[i]);
+      }
+   }
+
+   int seen = 0;
+   hamt_iterator it;
+   for (hamt_iterator_begin(&it, &a); !hamt_iterator_is_end(&it); hamt_iterator_next(&it)) {
+      seen++;
+   }
+   if (seen != cnt) {
+      printf("collisions: iterated %i of %i keys\n", seen, cnt);
+   }
+
+   hamt_build(&b, (void**)keys, (void**)keys, cnt);
+   assert(check_canonical(&b));
+   if (!hamt_equals(&a, &b) || !hamt_equals(&b, &a)) {
+      printf("collisions: build failed\n");
+   }
+
+   for (int i = 0; i < cnt; i += 2) {
+      if (hamt_remove(&a, keys[i]) != keys[i]) {
+         printf("collisions: failed to remove %s\n", keys[i]);
+      }
+   }
+   assert(check_canonical(&a));
+   for (int i = 0; i < cnt; i++) {
+      if ((hamt_find(&a, keys[i]) != 0) != (i & 1)) {
+         printf("collisions: wrong find after remove %s\n", keys[i]);
+      }
+   }
+
+   // the odd keys and the rest of b give the keys back
+   hamt u = {0};
+   hamt d = {0};
+   hamt_init(&u, hash, compare_string_key, 1);
+   hamt_init(&d, hash, compare_string_key, 1);
+   hamt_difference(&d, &b, &a);
+   hamt_union(&u, &a, &d);
+   assert(check_canonical(&d));
+   assert(check_canonical(&u));
+   if (!hamt_equals(&u, &b)) {
+      printf("collisions: union of the difference failed\n");
+   }
+   for (int i = 0; i < cnt; i++) {
+      if ((hamt_find(&d, keys[i]) != 0) != !(i & 1)) {
+         printf("collisions: wrong difference %s\n", keys[i]);
+      }
+   }
+
+   for (int i = 1; i < cnt; i += 2) {
+      if (hamt_remove(&a, keys[i]) != keys[i]) {
+         printf("collisions: failed to remove %s\n", keys[i]);
+      }
+   }
+   hamt_iterator_begin(&it, &a);
+   if (!hamt_iterator_is_end(&it)) {
+      printf("collisions: keys left after removing all\n");
+   }
+
+   printf("Done!\n");
+
+   hamt_destroy(&d);
+   hamt_destroy(&u);
+   hamt_destroy(&b);
+   hamt_destroy(&a);
+   free(found);
+   free(keys);
+}
+
+typedef struct point3
+{
+   int x, y, z;
+} point3;
+
+struct point3_hash
+{
+   uint32_t operator()(const point3& p) const { return hamt_int_hash((int64_t)(((uint64_t)p.x << 42) ^ ((uint64_t)(uint32_t)p.y << 21) ^ (uint32_t)p.z)); }
+};
+
+struct point3_equal
+{
+   bool operator()(const point3& a, const point3& b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+};
+
+struct weak_int_hash
+{
+   uint32_t operator()(int64_t k) const { return hamt_int_hash(k) & 0xfff; }
+};
+
+struct same_int_hash
+{
+   uint32_t operator()(int64_t k) const { return 7; }
+};
+
+// a holds multiples of 2 and b multiples of 3, each with its own values
+void test_set_algebra(int cnt)
+{
+   hamt_int a = {0}, b = {0}, u = {0}, i = {0}, d = {0};
+   hamt_int eu = {0}, ei = {0}, ed = {0}, empty = {0};
+   hamt_int r1 = {0}, r2 = {0}, r3 = {0};
+
+   printf("\n\nTesting set algebra with %i keys\n", cnt);
+
+   hamt_int_init(&a);
+   hamt_int_init(&b);
+   hamt_int_init(&eu);
+   hamt_int_init(&ei);
+   hamt_int_init(&ed);
+   hamt_int_init(&empty);
+
+   for (int64_t k = 0; k < cnt; k++) {
+      void* av = (void*)(uintptr_t)((k + 1) * 4);
+      void* bv = (void*)(uintptr_t)((k + 1) * 8);
+      int ina = k % 2 == 0;
+      int inb = k % 3 == 0;
+
+      if (ina) {
+         hamt_int_insert(&a, k, av);
+      }
+      if (inb) {
+         hamt_int_insert(&b, k, bv);
+      }
+      if (ina || inb) {
+         hamt_int_insert(&eu, k, ina ? av : bv);
+      }
+      if (ina && inb) {
+         hamt_int_insert(&ei, k, av);
+      }
+      if (ina && !inb) {
+         hamt_int_insert(&ed, k, av);
+      }
+   }
+
+   hamt_int_union(hamt_int_init(&u), &a, &b);
+   hamt_int_intersect(hamt_int_init(&i), &a, &b);
+   hamt_int_difference(hamt_int_init(&d), &a, &b);
+
+   if (!hamt_equals(&u.h, &eu.h)) {
+      printf("set algebra: union failed\n");
+   }
+   if (!hamt_equals(&i.h, &ei.h)) {
+      printf("set algebra: intersect failed\n");
+   }
+   if (!hamt_equals(&d.h, &ed.h)) {
+      printf("set algebra: difference failed\n");
+   }
+   assert(check_canonical(&u.h));
+   assert(check_canonical(&i.h));
+   assert(check_canonical(&d.h));
+
+   // the inputs are untouched
+   for (int64_t k = 0; k < cnt; k++) {
+      if (hamt_int_find(&a, k) != ((k % 2 == 0) ? (void*)(uintptr_t)((k + 1) * 4) : 0)) {
+         printf("set algebra: input a changed at %lld\n", (long long)k);
+      }
+   }
+
+   hamt_int_intersect(hamt_int_init(&r1), &a, &empty);
+   if (!hamt_equals(&r1.h, &empty.h)) {
+      printf("set algebra: intersect with empty failed\n");
+   }
+   hamt_int_union(hamt_int_init(&r2), &empty, &a);
+   if (!hamt_equals(&r2.h, &a.h)) {
+      printf("set algebra: union with empty failed\n");
+   }
+   hamt_int_difference(hamt_int_init(&r3), &a, &a);
+   if (!hamt_equals(&r3.h, &empty.h)) {
+      printf("set algebra: difference with self failed\n");
+   }
+}
+
+void test_typed_map(int cnt)
+{
+   printf("\n\nTesting typed map with %i keys\n", cnt);
+
+   // inline key, shifted value
+   hamt_map<int64_t, int32_t> ints;
+   hamt_init(&ints);
+   for (int i = 0; i < cnt; i++) {
+      hamt_insert(&ints, (int64_t)i * 3, -i);
+   }
+   for (int i = 0; i < cnt; i++) {
+      int32_t v = 0;
+      if (!hamt_find(&ints, (int64_t)i * 3, &v) || v != -i) {
+         printf("typed: couldn't find int key %i\n", i);
+      }
+      assert(!hamt_find(&ints, (int64_t)i * 3 + 1, &v));
+   }
+   int sum = 0;
+   hamt_for_each(&ints, [&](int64_t k, int32_t v) { sum += (int)(k / 3) + v; });
+   assert(sum == 0);
+   for (int i = 0; i < cnt; i += 2) {
+      int32_t v = 0;
+      if (!hamt_remove(&ints, (int64_t)i * 3, &v) || v != -i) {
+         printf("typed: failed to remove int key %i\n", i);
+      }
+   }
+   for (int i = 0; i < cnt; i++) {
+      assert(hamt_find(&ints, (int64_t)i * 3, (int32_t*)0) == (i & 1));
+   }
+   hamt_destroy(&ints);
+
+   // string keys with boxed values
+   char** keys = make_random_keys(cnt, 16);
+   hamt_map<const char*, const char*> strs;
+   hamt_init(&strs);
+   for (int i = 0; i < cnt; i++) {
+      hamt_insert(&strs, (const char*)keys[i], (const char*)keys[cnt - i - 1]);
+   }
+   for (int i = 0; i < cnt; i++) {
+      char copy[17];
+      strcpy(copy, keys[i]);
+      const char* v = 0;
+      if (!hamt_find(&strs, (const char*)copy, &v) || v != keys[cnt - i - 1]) {
+         printf("typed: couldn't find string key %s\n", keys[i]);
+      }
+   }
+   hamt_compact(&strs.h);
+   for (int i = 0; i < cnt; i++) {
+      if (!hamt_remove(&strs, (const char*)keys[i])) {
+         printf("typed: failed to remove string key %s\n", keys[i]);
+      }
+   }
+   hamt_destroy(&strs);
+   free(keys);
+
+   // boxed keys with custom functors
+   hamt_map<point3, double, point3_hash, point3_equal> points;
+   hamt_init(&points);
+   for (int i = 0; i < cnt; i++) {
+      point3 p = {i, -i, i * 7};
+      hamt_insert(&points, p, i * 0.5);
+   }
+   for (int i = 0; i < cnt; i++) {
+      point3 p = {i, -i, i * 7};
+      double v = 0;
+      if (!hamt_find(&points, p, &v) || v != i * 0.5) {
+         printf("typed: couldn't find point key %i\n", i);
+      }
+   }
+   hamt_destroy(&points);
+
+   // random 64 bit keys collide on the hash, and a weak hash makes most of
+   // the keys share one
+   hamt_map<int64_t, int32_t> wide;
+   hamt_map<int64_t, int32_t, weak_int_hash> weak;
+   hamt_init(&wide);
+   hamt_init(&weak);
+   for (int i = 0; i < cnt * 10; i++) {
+      hamt_insert(&wide, (int64_t)splitmix64(i), i);
+   }
+   for (int i = 0; i < cnt; i++) {
+      hamt_insert(&weak, (int64_t)splitmix64(i), i);
+   }
+   for (int i = 0; i < cnt * 10; i++) {
+      int32_t v = -1;
+      if (!hamt_find(&wide, (int64_t)splitmix64(i), &v) || v != i) {
+         printf("typed: couldn't find wide key %i\n", i);
+      }
+   }
+   for (int i = 0; i < cnt; i += 2) {
+      int32_t v = -1;
+      if (!hamt_remove(&weak, (int64_t)splitmix64(i), &v) || v != i) {
+         printf("typed: failed to remove weak key %i\n", i);
+      }
+   }
+   for (int i = 0; i < cnt; i++) {
+      int32_t v = -1;
+      if (hamt_find(&weak, (int64_t)splitmix64(i), &v) != (i & 1) || ((i & 1) && v != i)) {
+         printf("typed: wrong weak key %i after remove\n", i);
+      }
+   }
+
+   // with one hash for all the keys the bucket is chained
+   hamt_map<int64_t, int32_t, same_int_hash> same;
+   hamt_init(&same);
+   for (int i = 0; i < 100; i++) {
+      hamt_insert(&same, (int64_t)splitmix64(i), i);
+   }
+   for (int i = 0; i < 100; i += 3) {
+      int32_t v = -1;
+      if (!hamt_remove(&same, (int64_t)splitmix64(i), &v) || v != i) {
+         printf("typed: failed to remove same key %i\n", i);
+      }
+   }
+   for (int i = 0; i < 100; i++) {
+      int32_t v = -1;
+      if (hamt_find(&same, (int64_t)splitmix64(i), &v) != (i % 3 != 0) || (i % 3 && v != i)) {
+         printf("typed: wrong same key %i after remove\n", i);
+      }
+   }
+   hamt_destroy(&same);
+
+   // moving keeps the root with the map
+   hamt_map<int64_t, int32_t, weak_int_hash> moved(static_cast<hamt_map<int64_t, int32_t, weak_int_hash>&&>(weak));
+   assert(!hamt_find(&weak, (int64_t)splitmix64(1), (int32_t*)0));
+   assert(moved.h.entries == moved.h.root);
+   weak = static_cast<hamt_map<int64_t, int32_t, weak_int_hash>&&>(moved);
+   for (int i = 1; i < cnt; i += 2) {
+      int32_t v = -1;
+      if (!hamt_find(&weak, (int64_t)splitmix64(i), &v) || v != i) {
+         printf("typed: couldn't find weak key %i after move\n", i);
+      }
+   }
+   hamt_destroy(&moved);
+   hamt_destroy(&weak);
+   hamt_destroy(&wide);
+
+   // words are inline unless they use the top bits, the destructor frees
+   // the boxed ones
+   {
+      typedef hamt_map<int64_t, int64_t> word_map;
+      uintptr_t small = word_map::value_slot::store(-5);
+      uintptr_t large = word_map::value_slot::store(INT64_MIN);
+      assert((small & HAMT_VALUE_INLINE) && word_map::value_slot::load(small) == -5);
+      assert(!(large & HAMT_VALUE_INLINE) && word_map::value_slot::load(large) == INT64_MIN);
+      word_map::value_slot::release(large);
+
+      word_map words;
+      hamt_init(&words);
+      for (int i = 0; i < cnt; i++) {
+         hamt_insert(&words, (int64_t)i, (int64_t)splitmix64(i));
+         hamt_insert(&words, (int64_t)-i - 1, (int64_t)-i);
+      }
+      for (int i = 0; i < cnt; i++) {
+         int64_t v = 0;
+         if (!hamt_find(&words, (int64_t)i, &v) || v != (int64_t)splitmix64(i) ||
+             !hamt_find(&words, (int64_t)-i - 1, &v) || v != -i) {
+            printf("typed: couldn't find word key %i\n", i);
+         }
+      }
+   }
+
+   printf("Done!\n");
+}
+
+typedef struct cache_test
+{
+   int evicted;
+} cache_test;
+
+void cache_evicted(void* key, void* value, void* arg)
+{
+   cache_test* ct = (cache_test*)arg;
+   assert(value == (void*)(((uintptr_t)key + 1) * 4));
+   ct->evicted++;
+}
+
+size_t cache_entry_size(void* key, void* value)
+{
+   return 100;
+}
+
+void test_cache(int cnt)
+{
+   hamt_cache c;
+   cache_test ct = {0};
+   int cap = cnt / 10 + 1;
+
+   printf("\n\nTesting cache with %i keys\n", cnt);
+
+   // entry capacity
+   hamt_cache_init(&c, hamt_int_hash_fn, hamt_int_compare_fn, cap, 0);
+   hamt_cache_on_evict(&c, 0, cache_evicted, &ct);
+   for (uintptr_t k = 0; k < (uintptr_t)cnt; k++) {
+      hamt_cache_insert(&c, (void*)k, (void*)((k + 1) * 4));
+      if (hamt_cache_count(&c) > (size_t)cap) {
+         printf("cache: %zu entries over capacity %i\n", hamt_cache_count(&c), cap);
+      }
+   }
+   int present = 0;
+   for (uintptr_t k = 0; k < (uintptr_t)cnt; k++) {
+      void* v = hamt_cache_find(&c, (void*)k);
+      if (v) {
+         assert(v == (void*)((k + 1) * 4));
+         present++;
+      }
+   }
+   if (present != cap || ct.evicted != cnt - cap) {
+      printf("cache: expected %i entries got %i, %i evicted\n", cap, present, ct.evicted);
+   }
+   assert(check_canonical(&c.t));
+   hamt_cache_destroy(&c);
+
+   // second chance, referenced entries outlive unreferenced ones
+   hamt_cache_init(&c, hamt_int_hash_fn, hamt_int_compare_fn, 100, 0);
+   for (uintptr_t k = 0; k <= 100; k++) {
+      hamt_cache_insert(&c, (void*)k, (void*)((k + 1) * 4));
+   }
+   int hot[50];
+   int hot_cnt = 0;
+   for (uintptr_t k = 0; k < 50; k++) {
+      if (hamt_cache_find(&c, (void*)k)) {
+         hot[hot_cnt++] = (int)k;
+      }
+   }
+   for (uintptr_t k = 1000; k < 1040; k++) {
+      hamt_cache_insert(&c, (void*)k, (void*)((k + 1) * 4));
+   }
+   for (int i = 0; i < hot_cnt; i++) {
+      if (!hamt_cache_find(&c, (void*)(uintptr_t)hot[i])) {
+         printf("cache: referenced key %i was evicted\n", hot[i]);
+      }
+   }
+   void* removed = hamt_cache_remove(&c, (void*)(uintptr_t)hot[0]);
+   assert(removed == (void*)(((uintptr_t)hot[0] + 1) * 4));
+   assert(!hamt_cache_find(&c, (void*)(uintptr_t)hot[0]));
+   assert(hamt_cache_count(&c) == 99);
+   hamt_cache_destroy(&c);
+
+   // byte capacity, tables plus 100 bytes an entry
+   size_t max_bytes = (size_t)cap * 200;
+   hamt_cache_init(&c, hamt_int_hash_fn, hamt_int_compare_fn, 0, max_bytes);
+   hamt_cache_on_evict(&c, cache_entry_size, 0, 0);
+   for (uintptr_t k = 0; k < (uintptr_t)cnt; k++) {
+      hamt_cache_insert(&c, (void*)k, (void*)((k + 1) * 4));
+      if (hamt_cache_bytes(&c) > max_bytes) {
+         printf("cache: %zu bytes over capacity %zu\n", hamt_cache_bytes(&c), max_bytes);
+      }
+   }
+   if (hamt_cache_count(&c) < (size_t)cap) {
+      printf("cache: expected at least %i entries in %zu bytes got %zu\n", cap, max_bytes, hamt_cache_count(&c));
+   }
+   hamt_cache_destroy(&c);
+
+   printf("Done!\n");
+}
+
+typedef struct sharded_test
+{
+   hamt_sharded* s;
+   int cnt;
+   int nthreads;
+   int id;
+} sharded_test;
+
+// with locks thread id takes every nthreads'th key, owned threads take
+// the keys of the shards they own
+int sharded_takes(sharded_test* st, int64_t k)
+{
+   if (st->s->mode == HAMT_SHARD_OWNED) {
+      return hamt_sharded_shard(st->s, (void*)(uintptr_t)k) % st->nthreads == st->id;
+   }
+   return k % st->nthreads == st->id;
+}
+
+void* sharded_worker(void* arg)
+{
+   sharded_test* st = (sharded_test*)arg;
+   for (int64_t k = 0; k < st->cnt; k++) {
+      if (sharded_takes(st, k)) {
+         hamt_sharded_insert(st->s, (void*)(uintptr_t)k, (void*)(uintptr_t)((k + 1) * 4));
+      }
+   }
+   for (int64_t k = 0; k < st->cnt; k += 3) {
+      if (sharded_takes(st, k)) {
+         hamt_sharded_remove(st->s, (void*)(uintptr_t)k);
+      }
+   }
+   return 0;
+}
+
+void test_sharded(int cnt, int nthreads, int shard_bits, int mode)
+{
+   hamt_sharded s;
+   hamt_sharded_init(&s, hamt_int_hash_fn, hamt_int_compare_fn, shard_bits, mode);
+
+   printf("\n\nTesting %s sharded hamt with %i keys, %i threads and %i shards\n",
+          mode == HAMT_SHARD_OWNED ? "owned" : "locked", cnt, nthreads, 1 << shard_bits);
+
+   pthread_t threads[16];
+   sharded_test args[16];
+   assert(nthreads <= 16);
+   for (int i = 0; i < nthreads; i++) {
+      args[i].s = &s;
+      args[i].cnt = cnt;
+      args[i].nthreads = nthreads;
+      args[i].id = i;
+      pthread_create(threads + i, 0, sharded_worker, args + i);
+   }
+   for (int i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], 0);
+   }
+
+   int expect = 0;
+   for (int64_t k = 0; k < cnt; k++) {
+      void* v = hamt_sharded_find(&s, (void*)(uintptr_t)k);
+      void* want = (k % 3) ? (void*)(uintptr_t)((k + 1) * 4) : 0;
+      expect += want != 0;
+      if (v != want) {
+         printf("sharded: key %lld expected %p got %p\n", (long long)k, want, v);
+      }
+   }
+
+   int c = 0;
+   hamt_sharded_iterator it;
+   for (hamt_sharded_begin(&it, &s); !hamt_sharded_is_end(&it); hamt_sharded_next(&it)) {
+      int64_t k = (int64_t)(uintptr_t)hamt_sharded_key(&it);
+      if (k % 3 == 0 || hamt_sharded_value(&it) != (void*)(uintptr_t)((k + 1) * 4)) {
+         printf("sharded: iterator returned %lld\n", (long long)k);
+      }
+      c++;
+   }
+   if (c != expect) {
+      printf("sharded: iterator expected %i keys got %i\n", expect, c);
+   }
+
+   hamt_sharded_destroy(&s);
+   printf("Done!\n");
+}
+
+typedef struct concurrent_test
+{
+   hamt_concurrent* t;
+   char** shared;
+   char** own;
+   int cnt;
+   int id;
+} concurrent_test;
+
+void* concurrent_worker(void* arg)
+{
+   concurrent_test* ct = (concurrent_test*)arg;
+   hamt_thread* th = hamt_thread_attach(ct->t);
+
+   for (int i = 0; i < ct->cnt; i++) {
+      // every thread interns the same keys, starting at a different offset
+      char* k = ct->shared[(i + ct->id * 97) % ct->cnt];
+      char* v = (char*)hamt_concurrent_intern(th, k, k);
+      if (strcmp(v, k)) {
+         printf("CONCURRENT(%i): interned %s but got %s\n", ct->id, k, v);
+      }
+
+      hamt_concurrent_insert(th, ct->own[i], ct->own[i]);
+   }
+
+   for (int i = 0; i < ct->cnt; i++) {
+      if (hamt_concurrent_find(th, ct->own[i]) != ct->own[i]) {
+         printf("CONCURRENT(%i): couldn't find %s\n", ct->id, ct->own[i]);
+      }
+      if (!hamt_concurrent_find(th, ct->shared[i])) {
+         printf("CONCURRENT(%i): couldn't find shared %s\n", ct->id, ct->shared[i]);
+      }
+   }
+
+   for (int i = 0; i < ct->cnt; i += 2) {
+      if (hamt_concurrent_remove(th, ct->own[i]) != ct->own[i]) {
+         printf("CONCURRENT(%i): failed to remove %s\n", ct->id, ct->own[i]);
+      }
+   }
+
+   hamt_thread_detach(th);
+   return 0;
+}
+
+void test_concurrent(int nthreads, int cnt, hash_fn_t hash)
+{
+   hamt_concurrent t;
+   hamt_concurrent_init(&t, hash, compare_string_key);
+
+   char** shared = make_random_keys(cnt, 32);
+   char** own[16];
+   pthread_t threads[16];
+   concurrent_test tests[16];
+
+   assert(nthreads <= 16);
+
+   printf("\n\nTesting concurrent with %i threads and %i keys\n", nthreads, cnt);
+
+   for (int i = 0; i < nthreads; i++) {
+      own[i] = make_random_keys(cnt, 32);
+      tests[i].t = &t;
+      tests[i].shared = shared;
+      tests[i].own = own[i];
+      tests[i].cnt = cnt;
+      tests[i].id = i;
+      pthread_create(threads + i, 0, concurrent_worker, tests + i);
+   }
+
+   for (int i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], 0);
+   }
+
+   hamt_thread* th = hamt_thread_attach(&t);
+   for (int i = 0; i < cnt; i++) {
+      if (hamt_concurrent_find(th, shared[i]) != shared[i]) {
+         printf("couldn't find shared key %i: %s\n", i, shared[i]);
+      }
+      for (int j = 0; j < nthreads; j++) {
+         void* v = hamt_concurrent_find(th, own[j][i]);
+         if ((i & 1) && v != own[j][i]) {
+            printf("couldn't find key %i: %s\n", i, own[j][i]);
+         } else if (!(i & 1) && v) {
+            printf("still found key %i: %s\n", i, own[j][i]);
+         }
+      }
+   }
+   // a shared key interned twice would still be found
+   for (int i = 0; i < cnt; i++) {
+      hamt_concurrent_remove(th, shared[i]);
+      if (hamt_concurrent_find(th, shared[i])) {
+         printf("still found shared key %i: %s\n", i, shared[i]);
+      }
+   }
+   hamt_thread_detach(th);
+
+   hamt_concurrent_destroy(&t);
+
+   for (int i = 0; i < nthreads; i++) {
+      free(own[i]);
+   }
+   free(shared);
+
+   printf("Done!\n");
+}
+
+int main(int argc, char** argv)
+{
+   printf("T: %i\n", HAMT_T);
+   printf("T_BITS: %i\n", HAMT_T_BITS);
+   printf("T_ENTRIES: %i\n", HAMT_T_ENTRIES);
+   printf("T_MASK: 0x%x\n", HAMT_T_MASK);
+   printf("hamt_entry size: %lld\n", sizeof(hamt_entry));
+
+   hamt ht = {0};
+   hamt* h = hamt_init(&ht, hash_string_key, compare_string_key);
+
+   test_iterator(h, 5);
+   test_iterator(h, 100);
+   test_iterator(h, 1000);
+   test_iterator(h, 5000);
 
    test_random_keys(h, 10);
    test_random_keys(h, 100);
@@ -272,6 +1579,64 @@ int main(int argc, char** argv)
    test_random_keys(h, 100);
    test_random_keys(h, 10);
 
+   test_canonical(10);
+   test_canonical(5000);
+
+   test_build(4);
+   test_build(10);
+   test_build(20000);
+
+   test_wide_root(10, 12);
+   test_wide_root(20000, 12);
+   test_wide_root(20000, 16);
+
+   test_mapped(4, 5);
+   test_mapped(10000, 5);
+   test_mapped(10000, 12);
+
+   test_parallel_for_each(10, 4);
+   test_parallel_for_each(50000, 1);
+   test_parallel_for_each(50000, 4);
+
+   test_stats(10);
+   test_stats(20000);
+
+   test_find_many(h, 7);
+   test_find_many(h, 1000);
+   test_find_many(h, 5000);
+
+   test_int_keys(10);
+   test_int_keys(30000);
+   test_int_collisions(1000, 5);
+   test_int_collisions(200000, 5);
+   test_int_collisions(50000, 1);
+   test_collisions(10, hash_string_key_weak);
+   test_collisions(20000, hash_string_key_weak);
+   test_collisions(33, hash_string_key_same);
+   test_collisions(200, hash_string_key_same);
+   test_set_algebra(10);
+   test_set_algebra(30000);
+
+   test_typed_map(10);
+   test_typed_map(20000);
+
+   test_incremental_compact(1000);
+   test_incremental_compact(20000);
+
+   test_concurrent(1, 1000, hash_string_key);
+   test_concurrent(4, 5000, hash_string_key);
+   test_concurrent(8, 2000, hash_string_key);
+   test_concurrent(4, 5000, hash_string_key_weak);
+   test_concurrent(4, 100, hash_string_key_same);
+
+   test_sharded(10, 1, 0, HAMT_SHARD_LOCKS);
+   test_sharded(20000, 4, 3, HAMT_SHARD_LOCKS);
+   test_sharded(20000, 4, 4, HAMT_SHARD_OWNED);
+   test_sharded(5000, 3, 2, HAMT_SHARD_OWNED);
+
+   test_cache(10);
+   test_cache(20000);
+
    hamt_compact(h);
    print_stats(h);
 
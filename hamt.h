@@ -1,546 +1,3995 @@
-#ifndef _HAMT_H_
-#define _HAMT_H_
-
-#include <stdint.h>
-#include <assert.h>
-
-typedef uint32_t (*hash_fn_t)(void*,int);
-typedef int (*compare_fn_t)(void*,void*);
-
-typedef struct hamt hamt;
-typedef struct hamt_iterator hamt_iterator;
-
-uint32_t hamt_hash_key(const char* key, uint32_t len, int level);
-
-hamt* hamt_init(hamt*, hash_fn_t f, compare_fn_t c);
-void hamt_compact(hamt* t);
-
-void hamt_insert(hamt*, void* key, void* value);
-void* hamt_find(hamt* t, void* key);
-void* hamt_remove(hamt* t, void* key);
-
-
-int hamt_iterator_is_end(hamt_iterator* it);
-void hamt_iterator_next(hamt_iterator* it);
-hamt_iterator* hamt_iterator_begin(hamt_iterator* it, hamt* t);
-void* hamt_key(hamt_iterator* it);
-void* hamt_value(hamt_iterator* it);
-
-#endif
-
-// Implementation
-
-#ifdef HAMT_IMPLEMENATION
-
-#define HAMT_T 32
-#define HAMT_T_BITS 5
-#define HAMT_T_ENTRIES (1 << HAMT_T_BITS)
-#define HAMT_T_MASK (HAMT_T_ENTRIES - 1)
-#define HAMT_ENTRY_POOL_SIZE 4096
-#define TOIDX(h) (h >> shift_bits) & HAMT_T_MASK
-#define HAMT_ITERATOR_STACK_DEPTH 8
-
-typedef struct hamt_entry
-{
-   uintptr_t korm;
-   uintptr_t p;
-} hamt_entry;
-
-typedef union hamt_freelist_node
-{
-   union hamt_freelist_node* next;
-   hamt_entry entry;
-} hamt_freelist_node;
-
-typedef struct hamt_entry_pool
-{
-   struct hamt_entry_pool* next;
-   char* b;
-   char* p;
-   char* e;
-} hamt_entry_pool;
-
-struct hamt
-{
-   hamt_entry entries[HAMT_T_ENTRIES];
-   hamt_freelist_node* freelists[HAMT_T_ENTRIES];
-   hash_fn_t hash_fn;
-   compare_fn_t compare_fn;
-   hamt_entry_pool* pool;
-};
-
-#ifdef _MSC_VER
-#include <nmmintrin.h>
-int _mm_popcnt_u32(unsigned int);
-
-static inline int ctpop(uintptr_t v)
-{
-   return _mm_popcnt_u32(v & 0xffffffff);
-}
-
-#else
-#include <x86intrin.h>
-
-static inline int ctpop(uintptr_t v)
-{
-   return __builtin_popcount(v & 0xffffffff);
-}
-
-inline
-uint64_t clocks()
-{
-   unsigned int aux;
-   return __rdtscp(&aux);
-}
-
-#endif
-
-char* hamt_advance_to_alignment(char* p, uintptr_t align)
-{
-   uintptr_t v = (uintptr_t)p;
-   return p + (align - (v & (align-1)));
-}
-
-hamt_entry_pool* hamt_alloc_pool(size_t size)
-{
-   char* p = (char*)malloc(size);
-   hamt_entry_pool* result = (hamt_entry_pool*)p;
-   result->next = 0;
-   result->b = hamt_advance_to_alignment(p + sizeof(hamt_entry_pool), 16);
-   result->e = p + size;
-   result->p = result->b;
-
-   return result;
-}
-
-uint32_t hamt_hash_key(uint32_t h, const char* key, uint32_t len, int level)
-{
-   uint32_t a = 31415;
-   uint32_t b = 27183;
-   uint32_t l = level + 1;
-
-   while (len--) {
-      h = a * h *l + *key++;
-      a *= b;
-   }
-   return h;
-}
-
-uint32_t hamt_hash_key(const char* key, uint32_t len, int level)
-{
-   return hamt_hash_key(0, key, len, level);
-}
-
-int compare_string_key(void* a, void* b)
-{
-   return strcmp((char*)a, (char*)b);
-}
-
-// level 0 is most significant 5 bits
-uint32_t level_index(uint32_t k, int level)
-{
-   return HAMT_T_MASK & (k >> (HAMT_T - (HAMT_T_BITS * (level + 1))));
-}
-
-// remove the ptr tags that identify the type of p (value or base pointer)
-void* ptoptr(uintptr_t p)
-{
-   return (void*)(p & ~0x3);
-}
-
-// alloc a subtree node of length len
-hamt_entry* hamt_alloc_node(hamt* t, int len)
-{
-   hamt_entry* result = 0;
-   hamt_freelist_node* next = t->freelists[len-1];
-
-   if (!next) {
-      size_t size = sizeof(hamt_entry)*len;
-      size_t rem = t->pool->e - t->pool->p;
-      if (rem < size) {
-         hamt_entry_pool* newpool = hamt_alloc_pool(HAMT_ENTRY_POOL_SIZE);
-         newpool->next = t->pool;
-         t->pool = newpool;
-      }
-
-      result = (hamt_entry*)t->pool->p;
-      t->pool->p += size;
-   } else {
-      hamt_freelist_node* nnext = next->next;
-      t->freelists[len-1] = nnext;
-      result = &next->entry;
-   }
-   memset(result, 0, sizeof(hamt_entry)*len);
-   return result;
-}
-
-void hamt_free_node(hamt* t, void* e, int len)
-{
-   hamt_freelist_node* n = (hamt_freelist_node*)e;
-
-   n->next = t->freelists[len-1];
-   t->freelists[len-1] = n;
-}
-
-void hamt_compact_entry(hamt* t, hamt_entry* e)
-{
-   uint32_t table_size = ctpop(e->korm);
-   hamt_entry* otable = (hamt_entry*)ptoptr(e->p);
-   hamt_entry* ntable = hamt_alloc_node(t, table_size);
-
-   for (uint32_t i = 0; i < table_size; i++) {
-      hamt_entry* c = otable + i;
-      hamt_entry* d = ntable + i;
-
-      d->korm = c->korm;
-      d->p = c->p;
-
-      if (d->p & 0x2) {
-         hamt_compact_entry(t, d);
-      }
-   }
-
-   e->p = (uintptr_t)ntable | 0x2;
-}
-
-hamt* hamt_init(hamt* result, hash_fn_t f, compare_fn_t c)
-{
-   result->hash_fn = f;
-   result->compare_fn = c;
-   result->pool = hamt_alloc_pool(HAMT_ENTRY_POOL_SIZE);
-   return result;
-}
-
-void hamt_compact(hamt* t)
-{
-   hamt_entry_pool* p = t->pool;
-
-   t->pool = hamt_alloc_pool(HAMT_ENTRY_POOL_SIZE);
-
-   // clear the free list so new tables are allocated from new pools
-   for (int i = 0; i < HAMT_T_ENTRIES; i++) {
-      t->freelists[i] = 0;
-   }
-
-   for (int i = 0; i < HAMT_T_ENTRIES; i++) {
-      hamt_entry* e = t->entries + i;
-      if (e->p & 0x2) {
-         hamt_compact_entry(t, e);
-      }
-   }
-
-   while (p) {
-      hamt_entry_pool* tmp = p->next;
-      free(p);
-      p = tmp;
-   }
-}
-
-
-void hamt_insert_recur(hamt* t, hamt_entry* e, uint32_t shift_bits, uint32_t hash, void* key, void* value)
-{
-   if (e->p & 0x1) {
-      uint32_t ehash = t->hash_fn((void*)e->korm, 0);
-      if (ehash == hash) {
-         if (t->compare_fn((void*)e->korm, key) == 0) {
-            e->p = ((uintptr_t)value & 0x1);
-            return;
-         } else {
-            // TODO(cmcfarlen): handle hash collision
-            assert(0);
-         }
-      }
-
-      hamt_entry* ntable = hamt_alloc_node(t, 1);
-      uint32_t eidx = TOIDX(ehash);
-      ntable->korm = e->korm;
-      ntable->p = e->p;
-      e->korm = (uintptr_t)(1 << eidx);
-      e->p = ((uintptr_t)ntable) | 0x2;
-
-      hamt_insert_recur(t, e, shift_bits, hash, key, value);
-   } else {
-      uint32_t idx = TOIDX(hash);
-      uint32_t collides = (uintptr_t)(1 << idx) & e->korm;
-
-      if (collides) {
-         hamt_entry* se = (hamt_entry*)ptoptr(e->p);
-         e = se + ctpop(e->korm & (collides-1));
-         hamt_insert_recur(t, e, shift_bits + HAMT_T_BITS, hash, key, value);
-      } else {
-         // add bit
-         uint32_t table_size = ctpop(e->korm);
-         hamt_entry* ntable = hamt_alloc_node(t, table_size+1);
-         hamt_entry* te = ntable;
-         hamt_entry* oe = (hamt_entry*)ptoptr(e->p);
-         for (uint32_t i = 0; i < HAMT_T; i++) {
-            if (i == idx) {
-               te->korm = (uintptr_t)key;
-               te->p = ((uintptr_t)value | 0x1);
-               te++;
-            } else if (e->korm & (uintptr_t)(1 << i)) {
-               te->korm = oe->korm;
-               te->p = oe->p;
-               te++;
-               oe++;
-            }
-         }
-
-         e->korm |= (uintptr_t)(1 << idx);
-         hamt_free_node(t, ptoptr(e->p), table_size);
-         e->p = ((uintptr_t)ntable | 0x2);
-      }
-   }
-}
-
-void hamt_insert(hamt* t, void* key, void* value)
-{
-   uint32_t shift_bits = 0;
-   uint32_t hash_level = 0;
-   uint32_t hash = t->hash_fn(key, hash_level);
-
-   uint32_t idx = TOIDX(hash);
-   hamt_entry* e = t->entries + idx;
-
-   if (e->p == 0) {
-      e->korm = (uintptr_t)key;
-      e->p = ((uintptr_t)value) | 0x1;
-   } else {
-      hamt_insert_recur(t, e, shift_bits + HAMT_T_BITS, hash, key, value);
-   }
-}
-
-void* hamt_find_recur(hamt* t, hamt_entry* e, uint32_t shift_bits, uint32_t hash, void* key)
-{
-   void* result = 0;
-   if (e->p & 0x1) {
-      if (t->compare_fn((void*)e->korm, key) == 0) {
-         result = (void*)ptoptr(e->p);
-      }
-   } else {
-      uint32_t idx = TOIDX(hash);
-      uint32_t collides = (uintptr_t)(1 << idx) & e->korm;
-      if (collides) {
-         hamt_entry* se = (hamt_entry*)ptoptr(e->p);
-         e = se + ctpop(e->korm & (collides-1));
-         result = hamt_find_recur(t, e, shift_bits + HAMT_T_BITS, hash, key);
-      }
-   }
-
-   return result;
-}
-
-void* hamt_find(hamt* t, void* key)
-{
-   uint32_t shift_bits = 0;
-   uint32_t hash_level = 0;
-   uint32_t hash = t->hash_fn(key, hash_level);
-
-   uint32_t idx = TOIDX(hash);
-   hamt_entry* e = t->entries + idx;
-   void* result = 0;
-
-   if (e->p) {
-      result = hamt_find_recur(t, e, shift_bits + HAMT_T_BITS, hash, key);
-   }
-   return result;
-}
-
-void* hamt_remove_recur(hamt* t, hamt_entry* p, uint32_t idx, hamt_entry* e, uint32_t shift_bits, uint32_t hash, void* key)
-{
-   void* result = 0;
-   if (e->p & 0x1) {
-      if (t->compare_fn((void*)e->korm, key) == 0) {
-         result = (void*)ptoptr(e->p);
-         if (p) {
-            int table_size = ctpop(p->korm);
-            hamt_entry* table = (hamt_entry*)ptoptr(p->p);
-
-            // unpossible!
-            assert(table_size != 1);
-
-            if (table_size > 2) {
-               // reduce subtable size
-               hamt_entry* ntable = hamt_alloc_node(t, table_size-1);
-               hamt_entry* te = ntable;
-               hamt_entry* oe = table;
-               for (uint32_t i = 0; i < HAMT_T; i++) {
-                  if (i == idx) {
-                     oe++;
-                  } else if (p->korm & (uintptr_t)(1 << i)) {
-                     te->korm = oe->korm;
-                     te->p = oe->p;
-                     te++;
-                     oe++;
-                  }
-               }
-
-               uintptr_t mask = (uintptr_t)(1 << idx);
-               p->korm ^= mask;
-               p->p = ((uintptr_t)ntable | 0x2);
-            } else {
-               // replace parent with other entry
-               hamt_entry* oe = table;
-               if (e == table) {
-                  oe = table + 1;
-               }
-
-               if (oe->p & 0x1) {
-                  p->korm = oe->korm;
-                  p->p = oe->p;
-               } else {
-                  // if the other entry is a mask entry, then the heigh of the tree must be maintained
-                  hamt_entry* ntable = hamt_alloc_node(t, 1);
-                  ntable->korm = oe->korm;
-                  ntable->p = oe->p;
-
-                  uintptr_t mask = (uintptr_t)(1 << idx);
-                  p->korm ^= mask;
-                  p->p = ((uintptr_t)ntable | 0x2);
-               }
-            }
-            hamt_free_node(t, (void*)table, table_size);
-         } else {
-            // key is in the root, just mark empty
-            e->p = 0;
-            e->korm = 0;
-         }
-      }
-   } else {
-      uint32_t eidx = TOIDX(hash);
-      uint32_t collides = (uintptr_t)(1 << eidx) & e->korm;
-      if (collides) {
-         hamt_entry* se = (hamt_entry*)ptoptr(e->p);
-         result = hamt_remove_recur(t, e, eidx, se + ctpop(e->korm & (collides-1)), shift_bits + HAMT_T_BITS, hash, key);
-
-         if (e->p & 0x1 && p) {
-            int table_size = ctpop(p->korm);
-            if (table_size == 1) {
-               hamt_entry* table = (hamt_entry*)ptoptr(p->p);
-               p->korm = table->korm;
-               p->p = table->p;
-               hamt_free_node(t, (void*)table, table_size);
-            }
-         }
-      }
-   }
-
-   return result;
-}
-
-void* hamt_remove(hamt* t, void* key)
-{
-   uint32_t shift_bits = 0;
-   uint32_t hash_level = 0;
-   uint32_t hash = t->hash_fn(key, hash_level);
-
-   uint32_t idx = TOIDX(hash);
-   hamt_entry* e = t->entries + idx;
-   void* result = 0;
-
-   if (e->p) {
-      result = hamt_remove_recur(t, 0, 0, e, shift_bits + HAMT_T_BITS, hash, key);
-   }
-   return result;
-}
-
-typedef struct hamt_iterator_entry
-{
-   hamt_entry* table;
-   int table_idx;
-   int table_size;
-} hamt_iterator_entry;
-
-typedef struct hamt_iterator
-{
-   hamt* t;
-   hamt_iterator_entry stack[HAMT_ITERATOR_STACK_DEPTH];
-   int stack_idx;
-} hamt_iterator;
-
-int hamt_iterator_is_end(hamt_iterator* it)
-{
-   return (it->stack_idx == 0) &&
-          (it->stack->table_idx == it->stack->table_size);
-}
-
-void hamt_iterator_next(hamt_iterator* it)
-{
-   if (!hamt_iterator_is_end(it)) {
-      hamt_iterator_entry* e = it->stack + it->stack_idx;
-
-      do {
-         e->table_idx++;
-         while (e->table_idx == e->table_size) {
-            if (it->stack_idx > 0) {
-               it->stack_idx--;
-               e--;
-               e->table_idx++;
-            } else {
-               e = 0;
-               break;
-            }
-         }
-
-         while (e && e->table[e->table_idx].p & 0x2) {
-            assert(it->stack_idx+1 < HAMT_ITERATOR_STACK_DEPTH);
-
-            int table_size = ctpop(e->table[e->table_idx].korm);
-            hamt_entry* newtable = (hamt_entry*)ptoptr(e->table[e->table_idx].p);
-            e++;
-            e->table = newtable;
-            e->table_size = table_size;
-            e->table_idx = 0;
-            it->stack_idx++;
-         }
-      } while (e && (e->table[e->table_idx].p & 0x1) == 0);
-   }
-}
-
-hamt_iterator* hamt_iterator_begin(hamt_iterator* it, hamt* t)
-{
-   it->t = t;
-   it->stack_idx = 0;
-
-   hamt_iterator_entry* e = it->stack;
-
-
-   e->table = t->entries;
-   e->table_size = 32;
-   e->table_idx = -1;
-
-   hamt_iterator_next(it);
-
-   return it;
-}
-
-void* hamt_key(hamt_iterator* it)
-{
-   if (!hamt_iterator_is_end(it)) {
-      hamt_iterator_entry* e = it->stack + it->stack_idx;
-      hamt_entry* p = e->table + e->table_idx;
-
-      assert(p->p & 0x1);
-
-      return (void*)p->korm;
-   }
-   return 0;
-}
-
-void* hamt_value(hamt_iterator* it)
-{
-   if (!hamt_iterator_is_end(it)) {
-      hamt_iterator_entry* e = it->stack + it->stack_idx;
-      hamt_entry* p = e->table + e->table_idx;
-
-      assert(p->p & 0x1);
-
-      return (void*)ptoptr(p->p);
-   }
-   return 0;
-}
-
-
-
-#endif
-
+#ifndef _HAMT_H_
+#define _HAMT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+
+typedef uint32_t (*hash_fn_t)(void*,int);
+typedef int (*compare_fn_t)(void*,void*);
+
+typedef struct hamt hamt;
+typedef struct hamt_iterator hamt_iterator;
+
+// root width in bits, the root is directly indexed by the low hash bits
+#define HAMT_ROOT_BITS_DEFAULT 5
+#define HAMT_ROOT_BITS_MAX 24
+
+uint32_t hamt_hash_key(const char* key, uint32_t len, int level);
+
+hamt* hamt_init(hamt*, hash_fn_t f, compare_fn_t c, int root_bits = HAMT_ROOT_BITS_DEFAULT);
+void hamt_destroy(hamt* t);
+void hamt_compact(hamt* t);
+int hamt_compact_step(hamt* t, int budget);
+void hamt_set_compact_budget(hamt* t, int budget);
+
+// Values share their word with the leaf tag, so their low two bits and bit
+// 63 must be clear: pointers, or ids and offsets that are multiples of 4.
+void hamt_insert(hamt*, void* key, void* value);
+void* hamt_find(hamt* t, void* key);
+void hamt_find_many(hamt* t, void** keys, int n, void** out);
+int hamt_equals(hamt* a, hamt* b);
+void hamt_build(hamt* t, void** keys, void** values, int n);
+
+// out is an empty trie with the same hash and compare functions and root
+// width as a and b. Values
+// come from a for keys in both.
+void hamt_union(hamt* out, hamt* a, hamt* b);
+void hamt_intersect(hamt* out, hamt* a, hamt* b);
+void hamt_difference(hamt* out, hamt* a, hamt* b);
+void* hamt_remove(hamt* t, void* key);
+
+// Stats. hamt_stats_memory only walks the pool list and reads the freelist
+// counts, so it is cheap enough to sample. hamt_stats_full also walks the
+// trie for the shape.
+#define HAMT_STATS_DEPTH 8
+#define HAMT_STATS_TABLE_SIZES 33
+
+typedef struct hamt_entry hamt_entry;
+
+typedef struct hamt_stats
+{
+   // shape, filled by hamt_stats_full
+   size_t key_count;
+   size_t subtable_count;
+   int max_depth; // 0 when every key is in a root slot
+   size_t depth_keys[HAMT_STATS_DEPTH]; // keys at each depth
+   size_t table_sizes[HAMT_STATS_TABLE_SIZES]; // subtables by entry count
+
+   // memory
+   size_t pool_count;
+   size_t pool_bytes; // mapped for pools
+   size_t live_bytes; // in allocated tables, rounded up to their size class
+   size_t free_bytes; // on the freelists
+   size_t freelist_bytes[HAMT_STATS_TABLE_SIZES]; // by table size class
+   size_t unused_bytes; // never handed out at the end of pools
+   double utilization; // live_bytes over the usable pool bytes
+} hamt_stats;
+
+void hamt_stats_memory(hamt* t, hamt_stats* s);
+void hamt_stats_full(hamt* t, hamt_stats* s);
+void hamt_visit(hamt* t, void(*f)(void*, int, hamt_entry*), void* arg);
+
+// Read only images. hamt_save writes a trie with NUL terminated string keys
+// to one relocatable file, hamt_open_mapped maps it and hamt_mapped_find
+// queries it in place. Values are stored as the same tagged words as in the
+// trie, so they should be ids or offsets (multiples of 4, see hamt_insert)
+// rather than pointers. hamt_save returns 0 on success.
+typedef struct hamt_mapped hamt_mapped;
+
+int hamt_save(hamt* t, const char* path);
+hamt_mapped* hamt_open_mapped(const char* path);
+void* hamt_mapped_find(hamt_mapped* m, const char* key);
+uint32_t hamt_mapped_count(hamt_mapped* m);
+void hamt_close_mapped(hamt_mapped* m);
+
+int hamt_iterator_is_end(hamt_iterator* it);
+void hamt_iterator_next(hamt_iterator* it);
+hamt_iterator* hamt_iterator_begin(hamt_iterator* it, hamt* t);
+int hamt_iterator_split(hamt_iterator* it, hamt_iterator* out);
+void* hamt_key(hamt_iterator* it);
+void* hamt_value(hamt_iterator* it);
+
+// calls fn(key, value, arg) for every entry from nthreads threads at once
+typedef void (*hamt_visit_fn_t)(void* key, void* value, void* arg);
+void hamt_parallel_for_each(hamt* t, int nthreads, hamt_visit_fn_t fn, void* arg);
+
+// Integer keys stored inline in the entries, no hash or compare callbacks.
+// Iterate with the hamt_iterator functions on &t->h and hamt_int_key.
+typedef struct hamt_int hamt_int;
+
+uint32_t hamt_int_hash(int64_t key);
+
+hamt_int* hamt_int_init(hamt_int* t, int root_bits = HAMT_ROOT_BITS_DEFAULT);
+void hamt_int_insert(hamt_int* t, int64_t key, void* value);
+void* hamt_int_find(hamt_int* t, int64_t key);
+void* hamt_int_remove(hamt_int* t, int64_t key);
+int64_t hamt_int_key(hamt_iterator* it);
+void hamt_int_union(hamt_int* out, hamt_int* a, hamt_int* b);
+void hamt_int_intersect(hamt_int* out, hamt_int* a, hamt_int* b);
+void hamt_int_difference(hamt_int* out, hamt_int* a, hamt_int* b);
+
+// The sharded and concurrent variants need pthreads and the GCC atomics,
+// they are left out under _MSC_VER.
+#ifndef _MSC_VER
+
+// Sharded variant. 1 << shard_bits independent hamts, picked by the top
+// hash bits. With HAMT_SHARD_LOCKS every call takes the shard's lock. With
+// HAMT_SHARD_OWNED nothing is locked: each shard must have a single writer
+// (route with hamt_sharded_shard) and readers must not overlap writers.
+typedef struct hamt_sharded hamt_sharded;
+typedef struct hamt_sharded_iterator hamt_sharded_iterator;
+
+enum
+{
+   HAMT_SHARD_LOCKS,
+   HAMT_SHARD_OWNED
+};
+
+hamt_sharded* hamt_sharded_init(hamt_sharded* s, hash_fn_t f, compare_fn_t c, int shard_bits, int mode);
+void hamt_sharded_destroy(hamt_sharded* s);
+int hamt_sharded_shard(hamt_sharded* s, void* key);
+void hamt_sharded_insert(hamt_sharded* s, void* key, void* value);
+void* hamt_sharded_find(hamt_sharded* s, void* key);
+void* hamt_sharded_remove(hamt_sharded* s, void* key);
+
+// merged read view over every shard, not safe against concurrent writers
+hamt_sharded_iterator* hamt_sharded_begin(hamt_sharded_iterator* it, hamt_sharded* s);
+int hamt_sharded_is_end(hamt_sharded_iterator* it);
+void hamt_sharded_next(hamt_sharded_iterator* it);
+void* hamt_sharded_key(hamt_sharded_iterator* it);
+void* hamt_sharded_value(hamt_sharded_iterator* it);
+
+#endif
+
+// Cache mode. A hamt with a capacity in entries and/or bytes (0 for no
+// limit) that evicts with a clock hand. Hits set a reference bit on the
+// leaf; the hand clears set bits and evicts leaves whose bit is clear.
+// Bytes are the trie's live tables plus size_fn(key, value) per entry.
+// evict_fn is called for evicted and replaced entries. Values must be
+// pointers, bit 63 of a leaf holds the reference bit.
+typedef struct hamt_cache hamt_cache;
+typedef size_t (*hamt_size_fn_t)(void* key, void* value);
+typedef void (*hamt_evict_fn_t)(void* key, void* value, void* arg);
+
+hamt_cache* hamt_cache_init(hamt_cache* c, hash_fn_t f, compare_fn_t cmp, size_t max_entries, size_t max_bytes);
+void hamt_cache_on_evict(hamt_cache* c, hamt_size_fn_t size_fn, hamt_evict_fn_t evict_fn, void* arg);
+void hamt_cache_destroy(hamt_cache* c);
+void hamt_cache_insert(hamt_cache* c, void* key, void* value);
+void* hamt_cache_find(hamt_cache* c, void* key);
+void* hamt_cache_remove(hamt_cache* c, void* key);
+size_t hamt_cache_count(hamt_cache* c);
+size_t hamt_cache_bytes(hamt_cache* c);
+
+// Concurrent variant (Ctrie style). Readers never block, writers CAS new
+// subtables into place. Each thread attaches once and passes its handle.
+#ifndef _MSC_VER
+typedef struct hamt_concurrent hamt_concurrent;
+typedef struct hamt_thread hamt_thread;
+
+hamt_concurrent* hamt_concurrent_init(hamt_concurrent* t, hash_fn_t f, compare_fn_t c);
+void hamt_concurrent_destroy(hamt_concurrent* t);
+
+hamt_thread* hamt_thread_attach(hamt_concurrent* t);
+void hamt_thread_detach(hamt_thread* th);
+
+void* hamt_concurrent_find(hamt_thread* th, void* key);
+void hamt_concurrent_insert(hamt_thread* th, void* key, void* value);
+void* hamt_concurrent_intern(hamt_thread* th, void* key, void* value);
+void* hamt_concurrent_remove(hamt_thread* th, void* key);
+
+#endif
+
+#endif
+
+// Implementation
+
+#ifdef HAMT_IMPLEMENATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <malloc.h>
+#endif
+
+#define HAMT_T 32
+#define HAMT_T_BITS 5
+#define HAMT_T_ENTRIES (1 << HAMT_T_BITS)
+#define HAMT_T_MASK (HAMT_T_ENTRIES - 1)
+// pools are aligned to their size, which must be a power of two. With
+// HAMT_HUGE_PAGE_POOLS it should be a multiple of the 2MB huge page.
+#ifndef HAMT_ENTRY_POOL_SIZE
+#ifdef HAMT_HUGE_PAGE_POOLS
+#define HAMT_ENTRY_POOL_SIZE (2 * 1024 * 1024)
+#else
+#define HAMT_ENTRY_POOL_SIZE 4096
+#endif
+#endif
+// pools with less than this percentage in use are evacuated by hamt_compact_step
+#define HAMT_COMPACT_THRESHOLD 50
+#define TOIDX(h) (((h) >> shift_bits) & HAMT_T_MASK)
+#define HAMT_ROOT_SIZE(t) ((uint32_t)1 << (t)->root_bits)
+#define HAMT_ROOT_IDX(t, h) ((h) & (HAMT_ROOT_SIZE(t) - 1))
+// the root, a table per level down to a 1 bit root and a collision bucket
+#define HAMT_ITERATOR_STACK_DEPTH 9
+#define HAMT_FIND_BATCH 16
+
+struct hamt_entry
+{
+   uintptr_t korm;
+   uintptr_t p;
+};
+
+typedef union hamt_freelist_node
+{
+   union hamt_freelist_node* next;
+   hamt_entry entry;
+} hamt_freelist_node;
+
+typedef struct hamt_entry_pool
+{
+   struct hamt_entry_pool* next;
+   char* b;
+   char* p;
+   char* e;
+   size_t live; // bytes in allocated nodes
+   int evacuating;
+} hamt_entry_pool;
+
+enum hamt_compact_phase
+{
+   HAMT_COMPACT_IDLE = 0,
+   HAMT_COMPACT_PURGE,
+   HAMT_COMPACT_MIGRATE
+};
+
+// A hamt must not be copied or moved once initialized: for the default
+// root width entries points at root inside the struct, and a copy would
+// keep writing to the original's root. The same holds for the structs
+// that embed one (hamt_int, hamt_cache, hamt_map is move-only).
+struct hamt
+{
+   hamt_entry* entries; // the root, HAMT_ROOT_SIZE(t) slots
+   uint32_t root_bits;
+   hamt_entry root[HAMT_T_ENTRIES]; // root storage for the default width
+   hamt_freelist_node* freelists[HAMT_T_ENTRIES];
+   uint32_t free_counts[HAMT_T_ENTRIES]; // nodes on each freelist
+   hash_fn_t hash_fn;
+   compare_fn_t compare_fn;
+   hamt_entry_pool* pool;
+   size_t live_bytes; // in allocated tables
+
+   // incremental compaction state
+   int compact_phase;
+   int compact_budget; // subtables migrated per insert/remove, 0 for none
+   int compact_purge_idx;
+   int compact_depth;
+   uint32_t compact_cursor[HAMT_ITERATOR_STACK_DEPTH];
+};
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <nmmintrin.h>
+int _mm_popcnt_u32(unsigned int);
+
+static inline int ctpop(uintptr_t v)
+{
+   return _mm_popcnt_u32(v & 0xffffffff);
+}
+
+static inline int ctz(uint32_t v)
+{
+   unsigned long i;
+   _BitScanForward(&i, v);
+   return (int)i;
+}
+
+#define hamt_prefetch(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+
+#else
+#include <x86intrin.h>
+
+static inline int ctpop(uintptr_t v)
+{
+   return __builtin_popcount(v & 0xffffffff);
+}
+
+static inline int ctz(uint32_t v)
+{
+   return __builtin_ctz(v);
+}
+
+#define hamt_prefetch(p) __builtin_prefetch(p)
+
+inline
+uint64_t clocks()
+{
+   unsigned int aux;
+   return __rdtscp(&aux);
+}
+
+#endif
+
+char* hamt_advance_to_alignment(char* p, uintptr_t align)
+{
+   uintptr_t v = (uintptr_t)p;
+   return p + (align - (v & (align-1)));
+}
+
+// pool memory comes straight from the OS so an evacuated pool is returned
+// to it when freed
+#ifndef _MSC_VER
+char* hamt_map_aligned(size_t size, size_t align)
+{
+   // over map so the memory can be aligned, then trim
+   char* m = (char*)mmap(0, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   assert(m != MAP_FAILED);
+   char* p = (char*)(((uintptr_t)m + align - 1) & ~(uintptr_t)(align - 1));
+   if (p != m) {
+      munmap(m, p - m);
+   }
+   munmap(p + size, (m + size + align) - (p + size));
+   return p;
+}
+#endif
+
+// Small pools are carved from chunks of HAMT_POOL_CHUNK_POOLS so the mmap and
+// trims are paid once per chunk. Each pool is still unmapped on its own.
+#ifndef HAMT_POOL_CHUNK_POOLS
+#define HAMT_POOL_CHUNK_POOLS 64
+#endif
+
+#ifndef _MSC_VER
+static pthread_mutex_t hamt_pool_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* hamt_pool_chunk_p;
+static char* hamt_pool_chunk_e;
+#endif
+
+char* hamt_alloc_pool_memory(size_t size)
+{
+#ifdef _MSC_VER
+   return (char*)_aligned_malloc(size, size);
+#else
+   char* p = 0;
+#ifdef HAMT_HUGE_PAGE_POOLS
+   p = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if (p != MAP_FAILED) {
+      return p;
+   }
+   p = hamt_map_aligned(size, size);
+   madvise(p, size, MADV_HUGEPAGE);
+   return p;
+#else
+   if (size != HAMT_ENTRY_POOL_SIZE) {
+      return hamt_map_aligned(size, size);
+   }
+
+   pthread_mutex_lock(&hamt_pool_chunk_lock);
+   if (hamt_pool_chunk_p == hamt_pool_chunk_e) {
+      hamt_pool_chunk_p = hamt_map_aligned(size * HAMT_POOL_CHUNK_POOLS, size);
+      hamt_pool_chunk_e = hamt_pool_chunk_p + size * HAMT_POOL_CHUNK_POOLS;
+   }
+   p = hamt_pool_chunk_p;
+   hamt_pool_chunk_p += size;
+   pthread_mutex_unlock(&hamt_pool_chunk_lock);
+   return p;
+#endif
+#endif
+}
+
+hamt_entry_pool* hamt_alloc_pool(size_t size)
+{
+   char* p = hamt_alloc_pool_memory(size);
+   hamt_entry_pool* result = (hamt_entry_pool*)p;
+   result->next = 0;
+   result->b = hamt_advance_to_alignment(p + sizeof(hamt_entry_pool), 16);
+   result->e = p + size;
+   result->p = result->b;
+   result->live = 0;
+   result->evacuating = 0;
+
+   return result;
+}
+
+void hamt_free_pool(hamt_entry_pool* p)
+{
+#ifdef _MSC_VER
+   _aligned_free(p);
+#else
+   munmap(p, p->e - (char*)p);
+#endif
+}
+
+hamt_entry_pool* hamt_pool_of(void* node)
+{
+   return (hamt_entry_pool*)((uintptr_t)node & ~(uintptr_t)(HAMT_ENTRY_POOL_SIZE - 1));
+}
+
+uint32_t hamt_hash_key(uint32_t h, const char* key, uint32_t len, int level)
+{
+   uint32_t a = 31415;
+   uint32_t b = 27183;
+   uint32_t l = level + 1;
+
+   while (len--) {
+      h = a * h *l + *key++;
+      a *= b;
+   }
+   return h;
+}
+
+uint32_t hamt_hash_key(const char* key, uint32_t len, int level)
+{
+   return hamt_hash_key(0, key, len, level);
+}
+
+int compare_string_key(void* a, void* b)
+{
+   return strcmp((char*)a, (char*)b);
+}
+
+// reference bit of a cache leaf, above any user space pointer
+#define HAMT_LEAF_REFERENCED ((uintptr_t)1 << 63)
+
+// remove the ptr tags that identify the type of p (value or base pointer)
+void* ptoptr(uintptr_t p)
+{
+   return (void*)(p & ~((uintptr_t)0x3 | HAMT_LEAF_REFERENCED));
+}
+
+// p of a leaf holding value, which must not use the tag bits
+static inline uintptr_t hamt_leaf_p(void* value)
+{
+   assert(((uintptr_t)value & ((uintptr_t)0x3 | HAMT_LEAF_REFERENCED)) == 0);
+   return (uintptr_t)value | 0x1;
+}
+
+// Subtables use the CHAMP layout. The korm of a subtable entry holds two
+// bitmaps: datamap in the low 32 bits for the leaves and nodemap in the
+// high 32 bits for the child subtables. The table holds the leaves in bit
+// order followed by the children in bit order. A subtable that would be
+// left with a single leaf and no children is inlined into its parent, so
+// the shape of the trie only depends on the keys.
+static_assert(sizeof(uintptr_t) == 8, "the CHAMP bitmaps need a 64 bit korm");
+
+static inline uint32_t hamt_datamap(uintptr_t korm)
+{
+   return (uint32_t)korm;
+}
+
+static inline uint32_t hamt_nodemap(uintptr_t korm)
+{
+   return (uint32_t)(korm >> 32);
+}
+
+static inline int hamt_table_size(uintptr_t korm)
+{
+   return ctpop(hamt_datamap(korm)) + ctpop(hamt_nodemap(korm));
+}
+
+// collision buckets, see Collisions
+static inline int hamt_is_bucket(uint32_t shift_bits)
+{
+   return shift_bits >= HAMT_T;
+}
+
+#define HAMT_BUCKET_CHAINED ((((uintptr_t)1 << (HAMT_T - 1)) - 1) | ((uintptr_t)1 << (HAMT_T - 1 + 32)))
+
+// the bucket chained behind e, or 0
+static inline hamt_entry* hamt_bucket_next(hamt_entry* e)
+{
+   return hamt_nodemap(e->korm) ? (hamt_entry*)ptoptr(e->p) + (HAMT_T - 1) : 0;
+}
+
+// Tables are allocated at a size class, so a table that grows or shrinks
+// by a slot mostly stays in place instead of leaving a node of every size
+// on the freelists. Callers pass the table size, not the class.
+static const uint8_t hamt_size_classes[HAMT_T_ENTRIES+1] = {
+   0, 1, 2, 3, 4, 6, 6, 8, 8, 12, 12, 12, 12, 16, 16, 16, 16,
+   24, 24, 24, 24, 24, 24, 24, 24, 32, 32, 32, 32, 32, 32, 32, 32
+};
+
+static inline int hamt_size_class(int len)
+{
+   return hamt_size_classes[len];
+}
+
+// alloc a subtree node of length len
+hamt_entry* hamt_alloc_node(hamt* t, int len)
+{
+   len = hamt_size_class(len);
+   hamt_entry* result = 0;
+   hamt_freelist_node* next = t->freelists[len-1];
+
+   // nodes of an evacuating pool are dropped, not reused
+   while (next && hamt_pool_of(next)->evacuating) {
+      next = next->next;
+      t->freelists[len-1] = next;
+      t->free_counts[len-1]--;
+   }
+
+   if (!next) {
+      size_t size = sizeof(hamt_entry)*len;
+      size_t rem = t->pool->e - t->pool->p;
+      if (rem < size) {
+         hamt_entry_pool* newpool = hamt_alloc_pool(HAMT_ENTRY_POOL_SIZE);
+         newpool->next = t->pool;
+         t->pool = newpool;
+      }
+
+      result = (hamt_entry*)t->pool->p;
+      t->pool->p += size;
+   } else {
+      hamt_freelist_node* nnext = next->next;
+      t->freelists[len-1] = nnext;
+      t->free_counts[len-1]--;
+      result = &next->entry;
+   }
+   hamt_pool_of(result)->live += sizeof(hamt_entry)*len;
+   t->live_bytes += sizeof(hamt_entry)*len;
+   memset(result, 0, sizeof(hamt_entry)*len);
+   return result;
+}
+
+void hamt_free_node(hamt* t, void* e, int len)
+{
+   len = hamt_size_class(len);
+   hamt_freelist_node* n = (hamt_freelist_node*)e;
+   hamt_entry_pool* pool = hamt_pool_of(e);
+
+   pool->live -= sizeof(hamt_entry)*len;
+   t->live_bytes -= sizeof(hamt_entry)*len;
+   if (pool->evacuating) {
+      return;
+   }
+
+   n->next = t->freelists[len-1];
+   t->freelists[len-1] = n;
+   t->free_counts[len-1]++;
+}
+
+void hamt_compact_entry(hamt* t, hamt_entry* e)
+{
+   uint32_t table_size = hamt_table_size(e->korm);
+   uint32_t data_count = ctpop(hamt_datamap(e->korm));
+   hamt_entry* otable = (hamt_entry*)ptoptr(e->p);
+   hamt_entry* ntable = hamt_alloc_node(t, table_size);
+
+   memcpy(ntable, otable, sizeof(hamt_entry) * table_size);
+   for (uint32_t i = data_count; i < table_size; i++) {
+      hamt_compact_entry(t, ntable + i);
+   }
+
+   e->p = (uintptr_t)ntable | 0x2;
+}
+
+hamt* hamt_init(hamt* result, hash_fn_t f, compare_fn_t c, int root_bits)
+{
+   assert(root_bits >= 1 && root_bits <= HAMT_ROOT_BITS_MAX);
+   result->root_bits = root_bits;
+   if (root_bits <= HAMT_ROOT_BITS_DEFAULT) {
+      result->entries = result->root;
+   } else {
+      result->entries = (hamt_entry*)calloc(HAMT_ROOT_SIZE(result), sizeof(hamt_entry));
+   }
+   result->hash_fn = f;
+   result->compare_fn = c;
+   result->pool = hamt_alloc_pool(HAMT_ENTRY_POOL_SIZE);
+   memset(result->freelists, 0, sizeof(result->freelists));
+   memset(result->free_counts, 0, sizeof(result->free_counts));
+   result->live_bytes = 0;
+   result->compact_phase = HAMT_COMPACT_IDLE;
+   result->compact_budget = 0;
+   return result;
+}
+
+// catches a hamt that was copied after hamt_init, see struct hamt
+static inline void hamt_assert_in_place(hamt* t)
+{
+   assert(t->root_bits > HAMT_ROOT_BITS_DEFAULT || t->entries == t->root);
+}
+
+// release the pools and a wide root, keys and values belong to the caller
+void hamt_destroy(hamt* t)
+{
+   hamt_entry_pool* p = t->pool;
+   while (p) {
+      hamt_entry_pool* tmp = p->next;
+      hamt_free_pool(p);
+      p = tmp;
+   }
+   if (t->entries != t->root) {
+      free(t->entries);
+   }
+   memset(t, 0, sizeof(hamt));
+}
+
+void hamt_compact(hamt* t)
+{
+   hamt_entry_pool* p = t->pool;
+
+   t->pool = hamt_alloc_pool(HAMT_ENTRY_POOL_SIZE);
+   t->compact_phase = HAMT_COMPACT_IDLE;
+   t->live_bytes = 0;
+
+   // clear the free list so new tables are allocated from new pools
+   for (int i = 0; i < HAMT_T_ENTRIES; i++) {
+      t->freelists[i] = 0;
+      t->free_counts[i] = 0;
+   }
+
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(t); i++) {
+      hamt_entry* e = t->entries + i;
+      if (e->p & 0x2) {
+         hamt_compact_entry(t, e);
+      }
+   }
+
+   while (p) {
+      hamt_entry_pool* tmp = p->next;
+      hamt_free_pool(p);
+      p = tmp;
+   }
+}
+
+// Incremental compaction
+//
+// A cycle picks the sparse pools (except the one being bump allocated
+// from), marks them evacuating and then, a bounded amount per step,
+// drops their nodes from the freelists and copies their live subtables
+// into other pools. The walk resumes from a path of bit positions rather
+// than pointers, so the trie may change between steps. A pool is given
+// back to the OS once the walk is done and nothing in it is live.
+
+int hamt_compact_begin(hamt* t)
+{
+   int cnt = 0;
+   for (hamt_entry_pool* p = t->pool->next; p; p = p->next) {
+      size_t capacity = p->e - p->b;
+      if (p->live * 100 < capacity * HAMT_COMPACT_THRESHOLD) {
+         p->evacuating = 1;
+         cnt++;
+      }
+   }
+
+   if (cnt) {
+      t->compact_phase = HAMT_COMPACT_PURGE;
+      t->compact_purge_idx = 0;
+      t->compact_depth = 0;
+      t->compact_cursor[0] = 0;
+   }
+   return cnt;
+}
+
+// drop evacuating nodes from one freelist, returns the nodes walked
+int hamt_compact_purge(hamt* t, int idx)
+{
+   int cnt = 0;
+   hamt_freelist_node** n = t->freelists + idx;
+   while (*n) {
+      if (hamt_pool_of(*n)->evacuating) {
+         *n = (*n)->next;
+         t->free_counts[idx]--;
+      } else {
+         n = &(*n)->next;
+      }
+      cnt++;
+   }
+   return cnt;
+}
+
+void hamt_compact_release(hamt* t)
+{
+   hamt_entry_pool** p = &t->pool;
+   while (*p) {
+      hamt_entry_pool* pool = *p;
+      if (pool->evacuating && pool->live == 0) {
+         *p = pool->next;
+         hamt_free_pool(pool);
+      } else {
+         // nothing should be left, but keep the pool if something is
+         pool->evacuating = 0;
+         p = &pool->next;
+      }
+   }
+   t->compact_phase = HAMT_COMPACT_IDLE;
+}
+
+// copy the table of the subtable entry e out of an evacuating pool
+hamt_entry* hamt_compact_move(hamt* t, hamt_entry* e, int* budget)
+{
+   uint32_t table_size = hamt_table_size(e->korm);
+   hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+
+   if (hamt_pool_of(table)->evacuating) {
+      hamt_entry* ntable = hamt_alloc_node(t, table_size);
+      memcpy(ntable, table, sizeof(hamt_entry) * table_size);
+      hamt_free_node(t, table, table_size);
+      e->p = (uintptr_t)ntable | 0x2;
+      table = ntable;
+      (*budget)--;
+   }
+   return table;
+}
+
+// e is a subtable entry at depth (root entries are depth 0). Returns 0 when
+// the budget ran out, with the resume path in compact_cursor.
+int hamt_compact_visit(hamt* t, hamt_entry* e, int depth, int resume, int* budget)
+{
+   hamt_entry* table = hamt_compact_move(t, e, budget);
+
+   // a chain of buckets is moved in one go, the cursor has no room for it
+   if (hamt_is_bucket(t->root_bits + HAMT_T_BITS * (depth - 1))) {
+      for (hamt_entry* n = hamt_bucket_next(e); n; n = hamt_bucket_next(n)) {
+         hamt_compact_move(t, n, budget);
+      }
+      return 1;
+   }
+
+   // only the children need visiting, they follow the leaves
+   uint32_t start = resume ? t->compact_cursor[depth] : 0;
+   uint32_t nodemap = hamt_nodemap(e->korm);
+   hamt_entry* c = table + ctpop(hamt_datamap(e->korm)) + ctpop(nodemap & (uint32_t)(((uint64_t)1 << start) - 1));
+   for (uint32_t i = start; i < HAMT_T; i++) {
+      if (!(nodemap & ((uint32_t)1 << i))) {
+         continue;
+      }
+
+      int resume_child = resume && i == start && depth < t->compact_depth;
+      if (!hamt_compact_visit(t, c, depth + 1, resume_child, budget)) {
+         t->compact_cursor[depth] = i;
+         return 0;
+      }
+      c++;
+
+      if (*budget <= 0) {
+         t->compact_cursor[depth] = i + 1;
+         t->compact_depth = depth;
+         return 0;
+      }
+   }
+   return 1;
+}
+
+int hamt_compact_migrate(hamt* t, int* budget)
+{
+   uint32_t start = t->compact_cursor[0];
+   for (uint32_t i = start; i < HAMT_ROOT_SIZE(t); i++) {
+      hamt_entry* e = t->entries + i;
+      if (e->p & 0x2) {
+         int resume = i == start && t->compact_depth > 0;
+         if (!hamt_compact_visit(t, e, 1, resume, budget)) {
+            t->compact_cursor[0] = i;
+            return 0;
+         }
+      }
+      if (*budget <= 0 && i + 1 < HAMT_ROOT_SIZE(t)) {
+         t->compact_cursor[0] = i + 1;
+         t->compact_depth = 0;
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Do a bounded amount of compaction work, about budget subtables copied or
+// freelist nodes walked. Returns 1 while a compaction cycle is in progress.
+int hamt_compact_step(hamt* t, int budget)
+{
+   if (t->compact_phase == HAMT_COMPACT_IDLE) {
+      if (!hamt_compact_begin(t)) {
+         return 0;
+      }
+   }
+
+   while (t->compact_phase == HAMT_COMPACT_PURGE && budget > 0) {
+      budget -= hamt_compact_purge(t, t->compact_purge_idx++);
+      if (t->compact_purge_idx == HAMT_T_ENTRIES) {
+         t->compact_phase = HAMT_COMPACT_MIGRATE;
+      }
+   }
+
+   if (t->compact_phase == HAMT_COMPACT_MIGRATE && budget > 0) {
+      if (hamt_compact_migrate(t, &budget)) {
+         hamt_compact_release(t);
+      }
+   }
+
+   return t->compact_phase != HAMT_COMPACT_IDLE;
+}
+
+// run a compaction step of budget after every insert and remove
+void hamt_set_compact_budget(hamt* t, int budget)
+{
+   t->compact_budget = budget;
+}
+
+
+// table position of bit idx in a subtable with bitmaps korm, or -1
+static inline int hamt_child_pos(uintptr_t korm, uint32_t idx)
+{
+   uint32_t bit = (uint32_t)1 << idx;
+   uint32_t datamap = hamt_datamap(korm);
+
+   if (datamap & bit) {
+      return ctpop(datamap & (bit-1));
+   }
+
+   uint32_t nodemap = hamt_nodemap(korm);
+   if (nodemap & bit) {
+      return ctpop(datamap) + ctpop(nodemap & (bit-1));
+   }
+   return -1;
+}
+
+// entry for bit idx in the subtable of e, or 0
+static inline hamt_entry* hamt_child(hamt_entry* e, uint32_t idx)
+{
+   int pos = hamt_child_pos(e->korm, idx);
+   return pos < 0 ? 0 : (hamt_entry*)ptoptr(e->p) + pos;
+}
+
+// add a leaf at bit idx of the subtable entry e
+void hamt_table_add(hamt* t, hamt_entry* e, uint32_t idx, uintptr_t korm, uintptr_t p)
+{
+   uint32_t bit = (uint32_t)1 << idx;
+   int table_size = hamt_table_size(e->korm);
+   int pos = ctpop(hamt_datamap(e->korm) & (bit-1));
+   hamt_entry* otable = (hamt_entry*)ptoptr(e->p);
+
+   if (hamt_size_class(table_size+1) == hamt_size_class(table_size) && !hamt_pool_of(otable)->evacuating) {
+      memmove(otable + pos + 1, otable + pos, sizeof(hamt_entry) * (table_size - pos));
+      otable[pos].korm = korm;
+      otable[pos].p = p;
+      e->korm |= (uintptr_t)bit;
+      return;
+   }
+
+   hamt_entry* ntable = hamt_alloc_node(t, table_size+1);
+
+   memcpy(ntable, otable, sizeof(hamt_entry) * pos);
+   ntable[pos].korm = korm;
+   ntable[pos].p = p;
+   memcpy(ntable + pos + 1, otable + pos, sizeof(hamt_entry) * (table_size - pos));
+
+   e->korm |= (uintptr_t)bit;
+   hamt_free_node(t, otable, table_size);
+   e->p = ((uintptr_t)ntable | 0x2);
+}
+
+// remove the leaf at bit idx of the subtable entry e
+void hamt_table_remove(hamt* t, hamt_entry* e, uint32_t idx)
+{
+   uint32_t bit = (uint32_t)1 << idx;
+   int table_size = hamt_table_size(e->korm);
+   int pos = ctpop(hamt_datamap(e->korm) & (bit-1));
+   hamt_entry* otable = (hamt_entry*)ptoptr(e->p);
+
+   // unpossible! a lone leaf would have been inlined into the parent
+   assert(table_size > 1);
+
+   if (hamt_size_class(table_size-1) == hamt_size_class(table_size) && !hamt_pool_of(otable)->evacuating) {
+      memmove(otable + pos, otable + pos + 1, sizeof(hamt_entry) * (table_size - pos - 1));
+      e->korm &= ~(uintptr_t)bit;
+      return;
+   }
+
+   hamt_entry* ntable = hamt_alloc_node(t, table_size-1);
+   memcpy(ntable, otable, sizeof(hamt_entry) * pos);
+   memcpy(ntable + pos, otable + pos + 1, sizeof(hamt_entry) * (table_size - pos - 1));
+
+   e->korm &= ~(uintptr_t)bit;
+   hamt_free_node(t, otable, table_size);
+   e->p = ((uintptr_t)ntable | 0x2);
+}
+
+// replace the leaf at bit idx of e's table with the subtable entry n. The
+// table keeps its size, so the entries between the leaf and the new child
+// are shifted in place.
+void hamt_table_to_node(hamt_entry* e, uint32_t idx, hamt_entry n)
+{
+   uint32_t bit = (uint32_t)1 << idx;
+   uint32_t datamap = hamt_datamap(e->korm);
+   uint32_t nodemap = hamt_nodemap(e->korm);
+   hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+   int pos = ctpop(datamap & (bit-1));
+   int npos = ctpop(datamap) - 1 + ctpop(nodemap & (bit-1));
+
+   memmove(table + pos, table + pos + 1, sizeof(hamt_entry) * (npos - pos));
+   table[npos] = n;
+
+   e->korm = (e->korm & ~(uintptr_t)bit) | ((uintptr_t)bit << 32);
+}
+
+// the child at bit idx of e's table is down to a single leaf, move the
+// leaf up into e's table and free the child's table
+void hamt_table_inline(hamt* t, hamt_entry* e, uint32_t idx)
+{
+   uint32_t bit = (uint32_t)1 << idx;
+   uint32_t datamap = hamt_datamap(e->korm);
+   uint32_t nodemap = hamt_nodemap(e->korm);
+   hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+   int pos = ctpop(datamap & (bit-1));
+   int npos = ctpop(datamap) + ctpop(nodemap & (bit-1));
+   hamt_entry* ctable = (hamt_entry*)ptoptr(table[npos].p);
+   hamt_entry leaf = *ctable;
+
+   hamt_free_node(t, ctable, 1);
+   memmove(table + pos + 1, table + pos, sizeof(hamt_entry) * (npos - pos));
+   table[pos] = leaf;
+
+   e->korm = (e->korm | (uintptr_t)bit) & ~((uintptr_t)bit << 32);
+}
+
+static inline int hamt_is_single_leaf(hamt_entry* e)
+{
+   return (e->p & 0x2) && hamt_nodemap(e->korm) == 0 && ctpop(hamt_datamap(e->korm)) == 1;
+}
+
+// pull a subtable that is down to a single leaf into the root slot e
+void hamt_root_inline(hamt* t, hamt_entry* e)
+{
+   if (hamt_is_single_leaf(e)) {
+      hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+      *e = *table;
+      hamt_free_node(t, table, 1);
+   }
+}
+
+// Collisions
+//
+// Keys whose hashes are equal end up in a bucket, the subtable below the
+// last level the hash indexes. A bucket only holds leaves, at bits 0 to
+// count-1 in insertion order, and is searched by comparing keys.
+//
+// A bucket that outgrows HAMT_T keys is chained: it keeps HAMT_T-1 leaves
+// and its last entry (nodemap bit HAMT_T-1) is the next bucket. To the code
+// that walks tables without knowing the level the link is just a child.
+// Removing pulls leaves forward, so every bucket but the last stays full
+// and the last keeps two or more.
+
+size_t hamt_bucket_count(hamt_entry* e)
+{
+   size_t n = 0;
+   for (; e; e = hamt_bucket_next(e)) {
+      n += ctpop(hamt_datamap(e->korm));
+   }
+   return n;
+}
+
+// the leaf of key in the chain from e, or 0
+hamt_entry* hamt_bucket_find(hamt* t, hamt_entry* e, void* key)
+{
+   for (; e; e = hamt_bucket_next(e)) {
+      hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+      int n = ctpop(hamt_datamap(e->korm));
+      for (int i = 0; i < n; i++) {
+         if (t->compare_fn((void*)table[i].korm, key) == 0) {
+            return table + i;
+         }
+      }
+   }
+   return 0;
+}
+
+void hamt_bucket_add(hamt* t, hamt_entry* e, hamt_entry leaf)
+{
+   while (hamt_bucket_next(e)) {
+      e = hamt_bucket_next(e);
+   }
+
+   int n = ctpop(hamt_datamap(e->korm));
+   if (n < HAMT_T) {
+      hamt_table_add(t, e, n, leaf.korm, leaf.p);
+      return;
+   }
+
+   // full, the last leaf moves on with the new one
+   hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+   hamt_entry* next = hamt_alloc_node(t, 2);
+   next[0] = table[HAMT_T - 1];
+   next[1] = leaf;
+   table[HAMT_T - 1].korm = 0x3;
+   table[HAMT_T - 1].p = (uintptr_t)next | 0x2;
+   e->korm = HAMT_BUCKET_CHAINED;
+}
+
+// remove leaf idx of the bucket e, which is chained behind prev (or 0)
+void hamt_bucket_remove_at(hamt* t, hamt_entry* prev, hamt_entry* e, int idx)
+{
+   hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+   hamt_entry* next = hamt_bucket_next(e);
+
+   if (next) {
+      memmove(table + idx, table + idx + 1, sizeof(hamt_entry) * (HAMT_T - 2 - idx));
+      table[HAMT_T - 2] = *(hamt_entry*)ptoptr(next->p);
+      hamt_bucket_remove_at(t, e, next, 0);
+      return;
+   }
+
+   int n = ctpop(hamt_datamap(e->korm));
+   if (n == 2 && prev) {
+      // the last leaf takes the place of the link, e, so a chain always
+      // holds more than HAMT_T keys like the ones hamt_build makes
+      hamt_entry last = table[1 - idx];
+      hamt_free_node(t, table, 2);
+      *e = last;
+      prev->korm = (uintptr_t)(((uint64_t)1 << HAMT_T) - 1);
+      return;
+   }
+
+   // the bucket stays packed at the low bits
+   hamt_table_remove(t, e, idx);
+   e->korm = ((uintptr_t)1 << (n - 1)) - 1;
+}
+
+// remove leaf, found in the chain from e
+void hamt_bucket_remove(hamt* t, hamt_entry* e, hamt_entry* leaf)
+{
+   hamt_entry* prev = 0;
+   for (;;) {
+      hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+      if (leaf >= table && leaf < table + ctpop(hamt_datamap(e->korm))) {
+         hamt_bucket_remove_at(t, prev, e, (int)(leaf - table));
+         return;
+      }
+      prev = e;
+      e = hamt_bucket_next(e);
+   }
+}
+
+// make out the subtable entry holding leaves a and b, whose hashes agree
+// on every level above shift_bits
+void hamt_make_pair(hamt* t, hamt_entry* out, hamt_entry a, uint32_t ahash, hamt_entry b, uint32_t bhash, uint32_t shift_bits)
+{
+   if (hamt_is_bucket(shift_bits)) {
+      hamt_entry* table = hamt_alloc_node(t, 2);
+      table[0] = a;
+      table[1] = b;
+      out->korm = 0x3;
+      out->p = (uintptr_t)table | 0x2;
+      return;
+   }
+
+   uint32_t aidx = TOIDX(ahash);
+   uint32_t bidx = TOIDX(bhash);
+
+   if (aidx == bidx) {
+      hamt_entry* table = hamt_alloc_node(t, 1);
+      hamt_make_pair(t, table, a, ahash, b, bhash, shift_bits + HAMT_T_BITS);
+      out->korm = (uintptr_t)1 << (aidx + 32);
+      out->p = (uintptr_t)table | 0x2;
+   } else {
+      hamt_entry* table = hamt_alloc_node(t, 2);
+      table[aidx < bidx ? 0 : 1] = a;
+      table[aidx < bidx ? 1 : 0] = b;
+      out->korm = ((uintptr_t)1 << aidx) | ((uintptr_t)1 << bidx);
+      out->p = (uintptr_t)table | 0x2;
+   }
+}
+
+// Insert leaf below the free standing entry e (a root slot or a result
+// being assembled), whose table is indexed at shift_bits. An existing key
+// gets the new value when replace is set.
+void hamt_slot_insert(hamt* t, hamt_entry* e, uint32_t shift_bits, uint32_t hash, hamt_entry leaf, int replace)
+{
+   if (e->p == 0) {
+      *e = leaf;
+   } else if (e->p & 0x1) {
+      if (t->compare_fn((void*)e->korm, (void*)leaf.korm) == 0) {
+         if (replace) {
+            e->p = leaf.p;
+         }
+      } else {
+         hamt_make_pair(t, e, *e, t->hash_fn((void*)e->korm, 0), leaf, hash, shift_bits);
+      }
+   } else {
+      for (;;) {
+         if (hamt_is_bucket(shift_bits)) {
+            hamt_entry* l = hamt_bucket_find(t, e, (void*)leaf.korm);
+            if (!l) {
+               hamt_bucket_add(t, e, leaf);
+            } else if (replace) {
+               l->p = leaf.p;
+            }
+            break;
+         }
+
+         uint32_t idx = TOIDX(hash);
+         hamt_entry* c = hamt_child(e, idx);
+
+         if (!c) {
+            hamt_table_add(t, e, idx, leaf.korm, leaf.p);
+            break;
+         }
+
+         if (c->p & 0x2) {
+            e = c;
+            shift_bits += HAMT_T_BITS;
+            continue;
+         }
+
+         if (t->compare_fn((void*)c->korm, (void*)leaf.korm) == 0) {
+            if (replace) {
+               c->p = leaf.p;
+            }
+         } else {
+            hamt_entry n;
+            hamt_make_pair(t, &n, *c, t->hash_fn((void*)c->korm, 0), leaf, hash, shift_bits + HAMT_T_BITS);
+            hamt_table_to_node(e, idx, n);
+         }
+         break;
+      }
+   }
+}
+
+// the leaf for key below the free standing entry e, or 0
+hamt_entry* hamt_slot_find(hamt* t, hamt_entry* e, uint32_t shift_bits, uint32_t hash, void* key)
+{
+   if (!e->p) {
+      return 0;
+   }
+
+   while (e->p & 0x2) {
+      if (hamt_is_bucket(shift_bits)) {
+         return hamt_bucket_find(t, e, key);
+      }
+      e = hamt_child(e, TOIDX(hash));
+      if (!e) {
+         return 0;
+      }
+      shift_bits += HAMT_T_BITS;
+   }
+
+   if (t->compare_fn((void*)e->korm, key) == 0) {
+      return e;
+   }
+   return 0;
+}
+
+void hamt_insert(hamt* t, void* key, void* value)
+{
+   hamt_assert_in_place(t);
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash_level = 0;
+   uint32_t hash = t->hash_fn(key, hash_level);
+
+   uint32_t idx = HAMT_ROOT_IDX(t, hash);
+   hamt_entry leaf = {(uintptr_t)key, hamt_leaf_p(value)};
+
+   hamt_slot_insert(t, t->entries + idx, shift_bits, hash, leaf, 1);
+
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+}
+
+void* hamt_find(hamt* t, void* key)
+{
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash_level = 0;
+   uint32_t hash = t->hash_fn(key, hash_level);
+
+   uint32_t idx = HAMT_ROOT_IDX(t, hash);
+   hamt_entry* e = hamt_slot_find(t, t->entries + idx, shift_bits, hash, key);
+
+   return e ? ptoptr(e->p) : 0;
+}
+
+// Look up n keys at once. The probes of a batch advance one level per pass
+// and the next entry of each probe is prefetched before any of them is
+// read, so the cache misses of independent lookups overlap.
+void hamt_find_many(hamt* t, void** keys, int n, void** out)
+{
+   uint32_t hashes[HAMT_FIND_BATCH];
+   uint32_t shifts[HAMT_FIND_BATCH];
+   hamt_entry* entries[HAMT_FIND_BATCH];
+   int active[HAMT_FIND_BATCH];
+
+   for (int base = 0; base < n; base += HAMT_FIND_BATCH) {
+      int cnt = n - base < HAMT_FIND_BATCH ? n - base : HAMT_FIND_BATCH;
+      void** k = keys + base;
+      void** o = out + base;
+
+      for (int i = 0; i < cnt; i++) {
+         hashes[i] = t->hash_fn(k[i], 0);
+      }
+
+      int active_cnt = 0;
+      for (int i = 0; i < cnt; i++) {
+         hamt_entry* e = t->entries + HAMT_ROOT_IDX(t, hashes[i]);
+         o[i] = 0;
+         if (e->p) {
+            shifts[i] = t->root_bits;
+            entries[i] = e;
+            active[active_cnt++] = i;
+         }
+      }
+
+      while (active_cnt) {
+         int still_active = 0;
+         for (int a = 0; a < active_cnt; a++) {
+            int i = active[a];
+            hamt_entry* e = entries[i];
+
+            if (e->p & 0x1) {
+               if (t->compare_fn((void*)e->korm, k[i]) == 0) {
+                  o[i] = ptoptr(e->p);
+               }
+               continue;
+            }
+
+            uint32_t shift_bits = shifts[i];
+            if (hamt_is_bucket(shift_bits)) {
+               hamt_entry* l = hamt_bucket_find(t, e, k[i]);
+               if (l) {
+                  o[i] = ptoptr(l->p);
+               }
+               continue;
+            }
+            e = hamt_child(e, TOIDX(hashes[i]));
+            if (e) {
+               hamt_prefetch(e);
+               entries[i] = e;
+               shifts[i] = shift_bits + HAMT_T_BITS;
+               active[still_active++] = i;
+            }
+         }
+         active_cnt = still_active;
+      }
+   }
+}
+
+// remove key from below the subtable entry e, inlining any child that is
+// left with a single leaf
+void* hamt_remove_recur(hamt* t, hamt_entry* e, uint32_t shift_bits, uint32_t hash, void* key)
+{
+   void* result = 0;
+
+   if (hamt_is_bucket(shift_bits)) {
+      hamt_entry* l = hamt_bucket_find(t, e, key);
+      if (l) {
+         result = ptoptr(l->p);
+         hamt_bucket_remove(t, e, l);
+      }
+      return result;
+   }
+
+   uint32_t idx = TOIDX(hash);
+   hamt_entry* c = hamt_child(e, idx);
+
+   if (!c) {
+      return 0;
+   }
+
+   if (c->p & 0x2) {
+      result = hamt_remove_recur(t, c, shift_bits + HAMT_T_BITS, hash, key);
+      if (result && hamt_is_single_leaf(c)) {
+         hamt_table_inline(t, e, idx);
+      }
+   } else if (t->compare_fn((void*)c->korm, key) == 0) {
+      result = ptoptr(c->p);
+      hamt_table_remove(t, e, idx);
+   }
+
+   return result;
+}
+
+// remove key below the free standing entry e, leaving e empty, a leaf or
+// a canonical subtable
+void* hamt_slot_remove(hamt* t, hamt_entry* e, uint32_t shift_bits, uint32_t hash, void* key)
+{
+   void* result = 0;
+
+   if (e->p & 0x1) {
+      if (t->compare_fn((void*)e->korm, key) == 0) {
+         result = ptoptr(e->p);
+         e->p = 0;
+         e->korm = 0;
+      }
+   } else if (e->p & 0x2) {
+      result = hamt_remove_recur(t, e, shift_bits, hash, key);
+      if (result) {
+         hamt_root_inline(t, e);
+      }
+   }
+
+   return result;
+}
+
+void* hamt_remove(hamt* t, void* key)
+{
+   hamt_assert_in_place(t);
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash_level = 0;
+   uint32_t hash = t->hash_fn(key, hash_level);
+
+   uint32_t idx = HAMT_ROOT_IDX(t, hash);
+   void* result = hamt_slot_remove(t, t->entries + idx, shift_bits, hash, key);
+
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+   return result;
+}
+
+int hamt_equals_entry(hamt* t, hamt_entry* a, hamt_entry* b, uint32_t shift_bits)
+{
+   if ((a->p & 0x3) != (b->p & 0x3)) {
+      return 0;
+   }
+
+   if (a->p & 0x1) {
+      return ptoptr(a->p) == ptoptr(b->p) && t->compare_fn((void*)a->korm, (void*)b->korm) == 0;
+   }
+
+   if (!(a->p & 0x2) || a->p == b->p) {
+      return 1;
+   }
+
+   // buckets are in insertion order
+   if (hamt_is_bucket(shift_bits)) {
+      if (hamt_bucket_count(a) != hamt_bucket_count(b)) {
+         return 0;
+      }
+      for (hamt_entry* ab = a; ab; ab = hamt_bucket_next(ab)) {
+         hamt_entry* at = (hamt_entry*)ptoptr(ab->p);
+         for (int i = 0; i < ctpop(hamt_datamap(ab->korm)); i++) {
+            hamt_entry* l = hamt_bucket_find(t, b, (void*)at[i].korm);
+            if (!l || ptoptr(l->p) != ptoptr(at[i].p)) {
+               return 0;
+            }
+         }
+      }
+      return 1;
+   }
+
+   // canonical tries with the same keys have the same bitmaps
+   if (a->korm != b->korm) {
+      return 0;
+   }
+
+   int data_count = ctpop(hamt_datamap(a->korm));
+   int table_size = hamt_table_size(a->korm);
+   hamt_entry* at = (hamt_entry*)ptoptr(a->p);
+   hamt_entry* bt = (hamt_entry*)ptoptr(b->p);
+
+   for (int i = 0; i < data_count; i++) {
+      if (ptoptr(at[i].p) != ptoptr(bt[i].p) || t->compare_fn((void*)at[i].korm, (void*)bt[i].korm) != 0) {
+         return 0;
+      }
+   }
+   for (int i = data_count; i < table_size; i++) {
+      if (!hamt_equals_entry(t, at + i, bt + i, shift_bits + HAMT_T_BITS)) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+int hamt_count_entry(hamt_entry* e)
+{
+   if (e->p & 0x1) {
+      return 1;
+   }
+   int n = 0;
+   if (e->p & 0x2) {
+      for (int i = 0; i < hamt_table_size(e->korm); i++) {
+         n += hamt_count_entry((hamt_entry*)ptoptr(e->p) + i);
+      }
+   }
+   return n;
+}
+
+// count the leaves below e that b maps to the same value, -1 on a mismatch
+int hamt_contains_entry(hamt* b, hamt_entry* e)
+{
+   if (e->p & 0x1) {
+      return hamt_find(b, (void*)e->korm) == ptoptr(e->p) ? 1 : -1;
+   }
+   int n = 0;
+   if (e->p & 0x2) {
+      for (int i = 0; i < hamt_table_size(e->korm); i++) {
+         int c = hamt_contains_entry(b, (hamt_entry*)ptoptr(e->p) + i);
+         if (c < 0) {
+            return -1;
+         }
+         n += c;
+      }
+   }
+   return n;
+}
+
+// same keys mapped to the same value pointers, using a's compare_fn
+int hamt_equals(hamt* a, hamt* b)
+{
+   // different root widths lay the keys out differently
+   if (a->root_bits != b->root_bits) {
+      int n = 0;
+      for (uint32_t i = 0; i < HAMT_ROOT_SIZE(b); i++) {
+         n += hamt_count_entry(b->entries + i);
+      }
+      for (uint32_t i = 0; i < HAMT_ROOT_SIZE(a); i++) {
+         int c = hamt_contains_entry(b, a->entries + i);
+         if (c < 0) {
+            return 0;
+         }
+         n -= c;
+      }
+      return n == 0;
+   }
+
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(a); i++) {
+      if (!hamt_equals_entry(a, a->entries + i, b->entries + i, a->root_bits)) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Stats
+
+void hamt_visit_entry(hamt_entry* e, void(*f)(void*, int, hamt_entry*), void* arg, int level)
+{
+   f(arg, level, e);
+   if (e->p & 0x2) {
+      hamt_entry* se = (hamt_entry*)ptoptr(e->p);
+      for (int i = 0; i < hamt_table_size(e->korm); i++) {
+         hamt_visit_entry(se + i, f, arg, level+1);
+      }
+   }
+}
+
+// call f(arg, depth, entry) for every leaf and subtable entry
+void hamt_visit(hamt* t, void(*f)(void*, int, hamt_entry*), void* arg)
+{
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(t); i++) {
+      if (t->entries[i].p) {
+         hamt_visit_entry(t->entries + i, f, arg, 0);
+      }
+   }
+}
+
+void hamt_stats_memory(hamt* t, hamt_stats* s)
+{
+   memset(s, 0, sizeof(hamt_stats));
+
+   size_t usable = 0;
+   for (hamt_entry_pool* p = t->pool; p; p = p->next) {
+      s->pool_count++;
+      s->pool_bytes += p->e - (char*)p;
+      s->live_bytes += p->live;
+      s->unused_bytes += p->e - p->p;
+      usable += p->e - p->b;
+   }
+
+   for (int i = 0; i < HAMT_T; i++) {
+      size_t bytes = (i+1) * sizeof(hamt_entry) * t->free_counts[i];
+      s->freelist_bytes[i+1] = bytes;
+      s->free_bytes += bytes;
+   }
+
+   s->utilization = usable ? (double)s->live_bytes / (double)usable : 0.0;
+}
+
+void hamt_stats_visit(void* p, int level, hamt_entry* e)
+{
+   hamt_stats* s = (hamt_stats*)p;
+   if (level > s->max_depth) {
+      s->max_depth = level;
+   }
+   if (e->p & 0x1) {
+      s->key_count++;
+      s->depth_keys[level < HAMT_STATS_DEPTH ? level : HAMT_STATS_DEPTH - 1]++;
+   } else if (e->p & 0x2) {
+      s->subtable_count++;
+      s->table_sizes[hamt_table_size(e->korm)]++;
+   }
+}
+
+void hamt_stats_full(hamt* t, hamt_stats* s)
+{
+   hamt_stats_memory(t, s);
+   hamt_visit(t, hamt_stats_visit, s);
+}
+
+// Set algebra
+//
+// Both tries hash the same way, so their subtables line up level by level.
+// Children are combined bit by bit: an intersection only descends into
+// bits set on both sides, and a subtree present on one side only is copied
+// (union, difference) or skipped (intersection) without looking at its
+// keys. Only a leaf facing a subtable costs a lookup. Results are built
+// canonical, with values taken from a when a key is in both.
+
+enum
+{
+   HAMT_SET_UNION,
+   HAMT_SET_INTERSECT,
+   HAMT_SET_DIFFERENCE
+};
+
+// deep copy the free standing entry src into dst, allocating from t
+void hamt_copy_slot(hamt* t, hamt_entry* dst, hamt_entry* src)
+{
+   *dst = *src;
+   if (src->p & 0x2) {
+      int table_size = hamt_table_size(src->korm);
+      int data_count = ctpop(hamt_datamap(src->korm));
+      hamt_entry* table = hamt_alloc_node(t, table_size);
+      memcpy(table, ptoptr(src->p), sizeof(hamt_entry) * data_count);
+      for (int i = data_count; i < table_size; i++) {
+         hamt_copy_slot(t, table + i, (hamt_entry*)ptoptr(src->p) + i);
+      }
+      dst->p = (uintptr_t)table | 0x2;
+   }
+}
+
+void hamt_set_combine(hamt* t, int op, hamt_entry* a, hamt_entry* b, uint32_t shift_bits, hamt_entry* result)
+{
+   result->korm = 0;
+   result->p = 0;
+
+   if (!a->p) {
+      if (op == HAMT_SET_UNION) {
+         hamt_copy_slot(t, result, b);
+      }
+      return;
+   }
+
+   if (!b->p) {
+      if (op != HAMT_SET_INTERSECT) {
+         hamt_copy_slot(t, result, a);
+      }
+      return;
+   }
+
+   if (a->p & 0x1) {
+      uint32_t hash = t->hash_fn((void*)a->korm, 0);
+      switch (op) {
+      case HAMT_SET_UNION:
+         hamt_copy_slot(t, result, b);
+         hamt_slot_insert(t, result, shift_bits, hash, *a, 1);
+         break;
+      case HAMT_SET_INTERSECT:
+         if (hamt_slot_find(t, b, shift_bits, hash, (void*)a->korm)) {
+            *result = *a;
+         }
+         break;
+      case HAMT_SET_DIFFERENCE:
+         if (!hamt_slot_find(t, b, shift_bits, hash, (void*)a->korm)) {
+            *result = *a;
+         }
+         break;
+      }
+      return;
+   }
+
+   if (b->p & 0x1) {
+      uint32_t hash = t->hash_fn((void*)b->korm, 0);
+      hamt_entry* found = 0;
+      switch (op) {
+      case HAMT_SET_UNION:
+         hamt_copy_slot(t, result, a);
+         hamt_slot_insert(t, result, shift_bits, hash, *b, 0);
+         break;
+      case HAMT_SET_INTERSECT:
+         found = hamt_slot_find(t, a, shift_bits, hash, (void*)b->korm);
+         if (found) {
+            *result = *found;
+         }
+         break;
+      case HAMT_SET_DIFFERENCE:
+         hamt_copy_slot(t, result, a);
+         hamt_slot_remove(t, result, shift_bits, hash, (void*)b->korm);
+         break;
+      }
+      return;
+   }
+
+   // both are buckets, combine leaf by leaf
+   if (hamt_is_bucket(shift_bits)) {
+      if (op == HAMT_SET_UNION) {
+         hamt_copy_slot(t, result, b);
+      }
+      for (hamt_entry* ab = a; ab; ab = hamt_bucket_next(ab)) {
+         hamt_entry* at = (hamt_entry*)ptoptr(ab->p);
+         for (int i = 0; i < ctpop(hamt_datamap(ab->korm)); i++) {
+            int found = hamt_bucket_find(t, b, (void*)at[i].korm) != 0;
+            if (op == HAMT_SET_UNION || (op == HAMT_SET_INTERSECT) == found) {
+               hamt_slot_insert(t, result, shift_bits, 0, at[i], 1);
+            }
+         }
+      }
+      return;
+   }
+
+   // both are subtables
+   uint32_t amap = hamt_datamap(a->korm) | hamt_nodemap(a->korm);
+   uint32_t bmap = hamt_datamap(b->korm) | hamt_nodemap(b->korm);
+   uint32_t bits = op == HAMT_SET_UNION ? amap | bmap : op == HAMT_SET_INTERSECT ? amap & bmap : amap;
+
+   hamt_entry parts[HAMT_T_ENTRIES];
+   hamt_entry empty = {0, 0};
+   uint32_t datamap = 0;
+   uint32_t nodemap = 0;
+
+   for (uint32_t i = 0; i < HAMT_T; i++) {
+      if (!(bits & ((uint32_t)1 << i))) {
+         continue;
+      }
+
+      hamt_entry* ac = hamt_child(a, i);
+      hamt_entry* bc = hamt_child(b, i);
+      hamt_set_combine(t, op, ac ? ac : &empty, bc ? bc : &empty, shift_bits + HAMT_T_BITS, parts + i);
+
+      if (parts[i].p & 0x1) {
+         datamap |= (uint32_t)1 << i;
+      } else if (parts[i].p & 0x2) {
+         nodemap |= (uint32_t)1 << i;
+      }
+   }
+
+   int data_count = ctpop(datamap);
+   int table_size = data_count + ctpop(nodemap);
+
+   if (table_size == 0) {
+      return;
+   }
+
+   if (table_size == 1 && data_count == 1) {
+      *result = parts[ctz((uint32_t)datamap)];
+      return;
+   }
+
+   hamt_entry* table = hamt_alloc_node(t, table_size);
+   hamt_entry* d = table;
+   hamt_entry* c = table + data_count;
+   for (uint32_t i = 0; i < HAMT_T; i++) {
+      if (datamap & ((uint32_t)1 << i)) {
+         *d++ = parts[i];
+      } else if (nodemap & ((uint32_t)1 << i)) {
+         *c++ = parts[i];
+      }
+   }
+
+   result->korm = (uintptr_t)datamap | ((uintptr_t)nodemap << 32);
+   result->p = (uintptr_t)table | 0x2;
+}
+
+// out must be empty and use the same hash and compare as a and b
+void hamt_set_op(hamt* out, int op, hamt* a, hamt* b)
+{
+   assert(a->root_bits == b->root_bits && out->root_bits == a->root_bits);
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(a); i++) {
+      hamt_set_combine(out, op, a->entries + i, b->entries + i, a->root_bits, out->entries + i);
+   }
+}
+
+void hamt_union(hamt* out, hamt* a, hamt* b)
+{
+   hamt_set_op(out, HAMT_SET_UNION, a, b);
+}
+
+void hamt_intersect(hamt* out, hamt* a, hamt* b)
+{
+   hamt_set_op(out, HAMT_SET_INTERSECT, a, b);
+}
+
+void hamt_difference(hamt* out, hamt* a, hamt* b)
+{
+   hamt_set_op(out, HAMT_SET_DIFFERENCE, a, b);
+}
+
+// Bulk build
+//
+// The hashes are radix sorted by their level digits, root digit first, so
+// every subtable's keys form one contiguous run. Each table is then
+// allocated once at its final size and filled, instead of growing a slot
+// at a time through hamt_insert.
+
+typedef struct hamt_build_item
+{
+   uint32_t order; // level digits, root digit most significant
+   uint32_t hash;
+   void* key;
+   void* value;
+} hamt_build_item;
+
+// the root digit goes to the top root_bits bits, then each 5 bit level
+// digit below it, the last bits of the hash end up at the bottom
+uint32_t hamt_build_order(uint32_t hash, uint32_t root_bits)
+{
+   uint32_t order = hash & (((uint32_t)1 << root_bits) - 1);
+   for (uint32_t shift_bits = root_bits; shift_bits < HAMT_T; shift_bits += HAMT_T_BITS) {
+      uint32_t bits = HAMT_T - shift_bits < HAMT_T_BITS ? HAMT_T - shift_bits : HAMT_T_BITS;
+      order = (order << bits) | TOIDX(hash);
+   }
+   return order;
+}
+
+// stable LSD radix sort on order, 8 bits per pass
+void hamt_build_sort(hamt_build_item* items, hamt_build_item* tmp, int n)
+{
+   for (int pass = 0; pass < 4; pass++) {
+      int counts[257] = {0};
+      int shift = pass * 8;
+
+      for (int i = 0; i < n; i++) {
+         counts[((items[i].order >> shift) & 0xff) + 1]++;
+      }
+      for (int i = 0; i < 256; i++) {
+         counts[i+1] += counts[i];
+      }
+      for (int i = 0; i < n; i++) {
+         tmp[counts[(items[i].order >> shift) & 0xff]++] = items[i];
+      }
+
+      hamt_build_item* swap = items;
+      items = tmp;
+      tmp = swap;
+   }
+   // an even number of passes leaves the result in items
+}
+
+// fill e with the subtable for items [0, n), which agree on every level
+// above shift_bits
+void hamt_build_table(hamt* t, hamt_entry* e, hamt_build_item* items, int n, uint32_t shift_bits)
+{
+   if (hamt_is_bucket(shift_bits)) {
+      int leaves = n <= HAMT_T ? n : HAMT_T - 1;
+      hamt_entry* table = hamt_alloc_node(t, n <= HAMT_T ? n : HAMT_T);
+      for (int i = 0; i < leaves; i++) {
+         table[i].korm = (uintptr_t)items[i].key;
+         table[i].p = hamt_leaf_p(items[i].value);
+      }
+      e->korm = (uintptr_t)(((uint64_t)1 << leaves) - 1);
+      e->p = (uintptr_t)table | 0x2;
+      if (n > HAMT_T) {
+         hamt_build_table(t, table + leaves, items + leaves, n - leaves, shift_bits + HAMT_T_BITS);
+         e->korm = HAMT_BUCKET_CHAINED;
+      }
+      return;
+   }
+
+   uint32_t datamap = 0;
+   uint32_t nodemap = 0;
+
+   for (int i = 0; i < n;) {
+      uint32_t idx = TOIDX(items[i].hash);
+      int j = i + 1;
+      while (j < n && TOIDX(items[j].hash) == idx) {
+         j++;
+      }
+      if (j - i == 1) {
+         datamap |= (uint32_t)1 << idx;
+      } else {
+         nodemap |= (uint32_t)1 << idx;
+      }
+      i = j;
+   }
+
+   int data_count = ctpop(datamap);
+   hamt_entry* table = hamt_alloc_node(t, data_count + ctpop(nodemap));
+   hamt_entry* d = table;
+   hamt_entry* c = table + data_count;
+
+   for (int i = 0; i < n;) {
+      uint32_t idx = TOIDX(items[i].hash);
+      int j = i + 1;
+      while (j < n && TOIDX(items[j].hash) == idx) {
+         j++;
+      }
+      if (j - i == 1) {
+         d->korm = (uintptr_t)items[i].key;
+         d->p = hamt_leaf_p(items[i].value);
+         d++;
+      } else {
+         hamt_build_table(t, c, items + i, j - i, shift_bits + HAMT_T_BITS);
+         c++;
+      }
+      i = j;
+   }
+
+   e->korm = (uintptr_t)datamap | ((uintptr_t)nodemap << 32);
+   e->p = (uintptr_t)table | 0x2;
+}
+
+// Insert n keys into an empty trie in one pass. Later duplicates of a key
+// win, as with hamt_insert. Falls back to hamt_insert when t is not empty.
+void hamt_build(hamt* t, void** keys, void** values, int n)
+{
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(t); i++) {
+      if (t->entries[i].p) {
+         for (int j = 0; j < n; j++) {
+            hamt_insert(t, keys[j], values[j]);
+         }
+         return;
+      }
+   }
+
+   hamt_build_item* items = (hamt_build_item*)malloc(sizeof(hamt_build_item) * n * 2);
+   hamt_build_item* tmp = items + n;
+
+   for (int i = 0; i < n; i++) {
+      items[i].hash = t->hash_fn(keys[i], 0);
+      items[i].order = hamt_build_order(items[i].hash, t->root_bits);
+      items[i].key = keys[i];
+      items[i].value = values[i];
+   }
+
+   hamt_build_sort(items, tmp, n);
+
+   // equal hashes are adjacent, keep the last of equal keys
+   int cnt = 0;
+   int run = 0; // first kept item with the current hash
+   for (int i = 0; i < n; i++) {
+      if (cnt && items[cnt-1].hash != items[i].hash) {
+         run = cnt;
+      }
+      int j = run;
+      while (j < cnt && t->compare_fn(items[j].key, items[i].key) != 0) {
+         j++;
+      }
+      items[j] = items[i];
+      if (j == cnt) {
+         cnt++;
+      }
+   }
+
+   for (int i = 0; i < cnt;) {
+      uint32_t idx = HAMT_ROOT_IDX(t, items[i].hash);
+      int j = i + 1;
+      while (j < cnt && HAMT_ROOT_IDX(t, items[j].hash) == idx) {
+         j++;
+      }
+
+      hamt_entry* e = t->entries + idx;
+      if (j - i == 1) {
+         e->korm = (uintptr_t)items[i].key;
+         e->p = hamt_leaf_p(items[i].value);
+      } else {
+         hamt_build_table(t, e, items + i, j - i, t->root_bits);
+      }
+      i = j;
+   }
+
+   free(items);
+}
+
+typedef struct hamt_iterator_entry
+{
+   hamt_entry* table;
+   int table_idx;
+   int table_size;
+   int data_count;
+} hamt_iterator_entry;
+
+typedef struct hamt_iterator
+{
+   hamt* t;
+   hamt_iterator_entry stack[HAMT_ITERATOR_STACK_DEPTH];
+   int stack_idx;
+} hamt_iterator;
+
+int hamt_iterator_is_end(hamt_iterator* it)
+{
+   return (it->stack_idx == 0) &&
+          (it->stack->table_idx == it->stack->table_size);
+}
+
+// the leaves of a subtable come first, so only the root slots need their
+// tags checked
+void hamt_iterator_next(hamt_iterator* it)
+{
+   if (hamt_iterator_is_end(it)) {
+      return;
+   }
+
+   hamt_iterator_entry* e = it->stack + it->stack_idx;
+
+   for (;;) {
+      e->table_idx++;
+
+      if (e->table_idx == e->table_size) {
+         if (it->stack_idx == 0) {
+            return;
+         }
+         it->stack_idx--;
+         e--;
+         continue;
+      }
+
+      hamt_entry* c = e->table + e->table_idx;
+      if (it->stack_idx == 0) {
+         if (c->p & 0x1) {
+            return;
+         }
+         if (!(c->p & 0x2)) {
+            continue;
+         }
+      } else if (e->table_idx < e->data_count) {
+         return;
+      }
+
+      // a last child takes over its parent's frame, which has nothing
+      // left, so a chain of buckets doesn't need a frame per bucket
+      if (it->stack_idx == 0 || e->table_idx + 1 < e->table_size) {
+         assert(it->stack_idx+1 < HAMT_ITERATOR_STACK_DEPTH);
+         e++;
+         it->stack_idx++;
+      }
+      e->table = (hamt_entry*)ptoptr(c->p);
+      e->table_size = hamt_table_size(c->korm);
+      e->data_count = ctpop(hamt_datamap(c->korm));
+      e->table_idx = -1;
+   }
+}
+
+// iterate the n free standing entries starting at table. Every entry of a
+// table is tagged, so any slice of the root or a subtable works.
+hamt_iterator* hamt_iterator_begin_slice(hamt_iterator* it, hamt* t, hamt_entry* table, int n)
+{
+   it->t = t;
+   it->stack_idx = 0;
+
+   hamt_iterator_entry* e = it->stack;
+
+   e->table = table;
+   e->table_size = n;
+   e->data_count = 0;
+   e->table_idx = -1;
+
+   hamt_iterator_next(it);
+
+   return it;
+}
+
+hamt_iterator* hamt_iterator_begin(hamt_iterator* it, hamt* t)
+{
+   return hamt_iterator_begin_slice(it, t, t->entries, HAMT_ROOT_SIZE(t));
+}
+
+// Hand the upper half of it's remaining entries to out. The shallowest
+// level with unvisited entries is split, so a skewed trie is split inside
+// its big subtable once the root slots run out. Returns 0 when there is
+// nothing left to split off.
+int hamt_iterator_split(hamt_iterator* it, hamt_iterator* out)
+{
+   if (hamt_iterator_is_end(it)) {
+      return 0;
+   }
+
+   for (int i = 0; i <= it->stack_idx; i++) {
+      hamt_iterator_entry* e = it->stack + i;
+      int first = e->table_idx + 1;
+      int left = e->table_size - first;
+      if (left > 0) {
+         int mid = first + left / 2;
+         hamt_iterator_begin_slice(out, it->t, e->table + mid, e->table_size - mid);
+         e->table_size = mid;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+void* hamt_key(hamt_iterator* it)
+{
+   if (!hamt_iterator_is_end(it)) {
+      hamt_iterator_entry* e = it->stack + it->stack_idx;
+      hamt_entry* p = e->table + e->table_idx;
+
+      assert(p->p & 0x1);
+
+      return (void*)p->korm;
+   }
+   return 0;
+}
+
+void* hamt_value(hamt_iterator* it)
+{
+   if (!hamt_iterator_is_end(it)) {
+      hamt_iterator_entry* e = it->stack + it->stack_idx;
+      hamt_entry* p = e->table + e->table_idx;
+
+      assert(p->p & 0x1);
+
+      return (void*)ptoptr(p->p);
+   }
+   return 0;
+}
+
+// Parallel iteration
+//
+// The trie is split into several iterators per thread up front and the
+// workers take them off a shared counter, so a thread that gets a big
+// subtable doesn't hold the others up.
+
+#define HAMT_PARALLEL_SPLITS 8
+
+typedef struct hamt_parallel_job
+{
+   hamt_iterator* parts;
+   int part_count;
+   int next_part;
+   hamt_visit_fn_t fn;
+   void* arg;
+} hamt_parallel_job;
+
+void* hamt_parallel_worker(void* p)
+{
+   hamt_parallel_job* job = (hamt_parallel_job*)p;
+   for (;;) {
+#ifdef _MSC_VER
+      int i = job->next_part++;   // only ever the one worker
+#else
+      int i = __atomic_fetch_add(&job->next_part, 1, __ATOMIC_RELAXED);
+#endif
+      if (i >= job->part_count) {
+         return 0;
+      }
+      hamt_iterator* it = job->parts + i;
+      for (; !hamt_iterator_is_end(it); hamt_iterator_next(it)) {
+         job->fn(hamt_key(it), hamt_value(it), job->arg);
+      }
+   }
+}
+
+void hamt_parallel_for_each(hamt* t, int nthreads, hamt_visit_fn_t fn, void* arg)
+{
+   if (nthreads < 1) {
+      nthreads = 1;
+   }
+
+   int max_parts = nthreads * HAMT_PARALLEL_SPLITS;
+   hamt_parallel_job job;
+   job.parts = (hamt_iterator*)malloc(sizeof(hamt_iterator) * max_parts);
+   job.part_count = 1;
+   job.next_part = 0;
+   job.fn = fn;
+   job.arg = arg;
+
+   hamt_iterator_begin(job.parts, t);
+   if (nthreads > 1) {
+      int split = 1;
+      while (split && job.part_count < max_parts) {
+         split = 0;
+         int cnt = job.part_count;
+         for (int i = 0; i < cnt && job.part_count < max_parts; i++) {
+            if (hamt_iterator_split(job.parts + i, job.parts + job.part_count)) {
+               job.part_count++;
+               split = 1;
+            }
+         }
+      }
+   }
+
+#ifdef _MSC_VER
+   hamt_parallel_worker(&job);
+#else
+   pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+   for (int i = 1; i < nthreads; i++) {
+      pthread_create(threads + i, 0, hamt_parallel_worker, &job);
+   }
+   hamt_parallel_worker(&job);
+   for (int i = 1; i < nthreads; i++) {
+      pthread_join(threads[i], 0);
+   }
+   free(threads);
+#endif
+
+   free(job.parts);
+}
+
+// Mapped images
+//
+// header | root | strings | tables. Entries have the same CHAMP layout as a
+// live trie but p and a leaf's korm hold offsets from the start of the
+// image instead of pointers. Keys are rehashed with hamt_hash_key and laid
+// out like hamt_build does, so a reader needs no callbacks.
+
+#define HAMT_IMAGE_MAGIC 0x544d4148 // "HAMT"
+#define HAMT_IMAGE_VERSION 1
+
+typedef struct hamt_image_header
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t root_bits;
+   uint32_t count;
+   uint64_t size; // bytes in the image
+   uint64_t tables; // offset of the first table
+} hamt_image_header;
+
+struct hamt_mapped
+{
+   char* base;
+   size_t size;
+   hamt_image_header* header;
+   hamt_entry* entries;
+};
+
+typedef struct hamt_image_writer
+{
+   char* b;
+   size_t cap;
+   size_t strings; // next free byte in the string section
+   size_t tables; // next free byte in the table section
+} hamt_image_writer;
+
+size_t hamt_image_reserve(hamt_image_writer* w, size_t bytes)
+{
+   size_t result = w->tables;
+   w->tables += bytes;
+   if (w->tables > w->cap) {
+      while (w->tables > w->cap) {
+         w->cap *= 2;
+      }
+      w->b = (char*)realloc(w->b, w->cap);
+   }
+   return result;
+}
+
+void hamt_image_leaf(hamt_image_writer* w, size_t at, hamt_build_item* item)
+{
+   size_t len = strlen((const char*)item->key) + 1;
+   memcpy(w->b + w->strings, item->key, len);
+
+   hamt_entry* e = (hamt_entry*)(w->b + at);
+   e->korm = w->strings;
+   e->p = (uintptr_t)item->value | 0x1;
+   w->strings += len;
+}
+
+// hamt_build_table, writing the table for items [0, n) at offsets
+void hamt_image_table(hamt_image_writer* w, size_t at, hamt_build_item* items, int n, uint32_t shift_bits)
+{
+   if (hamt_is_bucket(shift_bits)) {
+      int leaves = n <= HAMT_T ? n : HAMT_T - 1;
+      size_t table = hamt_image_reserve(w, sizeof(hamt_entry) * (n <= HAMT_T ? n : HAMT_T));
+      for (int i = 0; i < leaves; i++) {
+         hamt_image_leaf(w, table + sizeof(hamt_entry) * i, items + i);
+      }
+      // the next bucket is reserved after this one, see hamt_mapped_find
+      if (n > HAMT_T) {
+         hamt_image_table(w, table + sizeof(hamt_entry) * leaves, items + leaves, n - leaves, shift_bits + HAMT_T_BITS);
+      }
+      hamt_entry* e = (hamt_entry*)(w->b + at);
+      e->korm = n <= HAMT_T ? (uintptr_t)(((uint64_t)1 << n) - 1) : HAMT_BUCKET_CHAINED;
+      e->p = (uintptr_t)table | 0x2;
+      return;
+   }
+
+   uint32_t datamap = 0;
+   uint32_t nodemap = 0;
+
+   for (int i = 0; i < n;) {
+      uint32_t idx = TOIDX(items[i].hash);
+      int j = i + 1;
+      while (j < n && TOIDX(items[j].hash) == idx) {
+         j++;
+      }
+      if (j - i == 1) {
+         datamap |= (uint32_t)1 << idx;
+      } else {
+         nodemap |= (uint32_t)1 << idx;
+      }
+      i = j;
+   }
+
+   int data_count = ctpop(datamap);
+   size_t table = hamt_image_reserve(w, sizeof(hamt_entry) * (data_count + ctpop(nodemap)));
+   size_t d = table;
+   size_t c = table + sizeof(hamt_entry) * data_count;
+
+   for (int i = 0; i < n;) {
+      uint32_t idx = TOIDX(items[i].hash);
+      int j = i + 1;
+      while (j < n && TOIDX(items[j].hash) == idx) {
+         j++;
+      }
+      if (j - i == 1) {
+         hamt_image_leaf(w, d, items + i);
+         d += sizeof(hamt_entry);
+      } else {
+         hamt_image_table(w, c, items + i, j - i, shift_bits + HAMT_T_BITS);
+         c += sizeof(hamt_entry);
+      }
+      i = j;
+   }
+
+   hamt_entry* e = (hamt_entry*)(w->b + at);
+   e->korm = (uintptr_t)datamap | ((uintptr_t)nodemap << 32);
+   e->p = (uintptr_t)table | 0x2;
+}
+
+int hamt_save(hamt* t, const char* path)
+{
+   int n = 0;
+   size_t string_bytes = 0;
+   hamt_iterator it;
+   for (hamt_iterator_begin(&it, t); !hamt_iterator_is_end(&it); hamt_iterator_next(&it)) {
+      string_bytes += strlen((const char*)hamt_key(&it)) + 1;
+      n++;
+   }
+
+   hamt_build_item* items = (hamt_build_item*)malloc(sizeof(hamt_build_item) * (n * 2 + 1));
+   hamt_build_item* tmp = items + n;
+   int i = 0;
+   for (hamt_iterator_begin(&it, t); !hamt_iterator_is_end(&it); hamt_iterator_next(&it)) {
+      const char* key = (const char*)hamt_key(&it);
+      items[i].hash = hamt_hash_key(key, (uint32_t)strlen(key), 0);
+      items[i].order = hamt_build_order(items[i].hash, t->root_bits);
+      items[i].key = (void*)key;
+      items[i].value = hamt_value(&it);
+      i++;
+   }
+   hamt_build_sort(items, tmp, n);
+
+   size_t root = sizeof(hamt_image_header);
+   size_t strings = root + sizeof(hamt_entry) * HAMT_ROOT_SIZE(t);
+   size_t tables = (strings + string_bytes + 15) & ~(size_t)15;
+
+   hamt_image_writer w;
+   w.cap = tables + sizeof(hamt_entry) * 2 * (n + 1);
+   w.b = (char*)calloc(1, w.cap);
+   w.strings = strings;
+   w.tables = tables;
+
+   uint32_t shift_bits = t->root_bits;
+   for (int i = 0; i < n;) {
+      uint32_t idx = HAMT_ROOT_IDX(t, items[i].hash);
+      int j = i + 1;
+      while (j < n && HAMT_ROOT_IDX(t, items[j].hash) == idx) {
+         j++;
+      }
+
+      size_t at = root + sizeof(hamt_entry) * idx;
+      if (j - i == 1) {
+         hamt_image_leaf(&w, at, items + i);
+      } else {
+         hamt_image_table(&w, at, items + i, j - i, shift_bits);
+      }
+      i = j;
+   }
+   free(items);
+
+   hamt_image_header* h = (hamt_image_header*)w.b;
+   h->magic = HAMT_IMAGE_MAGIC;
+   h->version = HAMT_IMAGE_VERSION;
+   h->root_bits = t->root_bits;
+   h->count = n;
+   h->size = w.tables;
+   h->tables = tables;
+
+   int result = -1;
+   FILE* f = fopen(path, "wb");
+   if (f) {
+      if (fwrite(w.b, 1, w.tables, f) == w.tables) {
+         result = 0;
+      }
+      if (fclose(f) != 0) {
+         result = -1;
+      }
+   }
+   free(w.b);
+   return result;
+}
+
+// returns 0 when the file can't be read or is not an image
+hamt_mapped* hamt_open_mapped(const char* path)
+{
+   char* base = 0;
+   size_t size = 0;
+
+#ifdef _MSC_VER
+   FILE* f = fopen(path, "rb");
+   if (!f) {
+      return 0;
+   }
+   fseek(f, 0, SEEK_END);
+   size = (size_t)ftell(f);
+   fseek(f, 0, SEEK_SET);
+   base = (char*)_aligned_malloc(size ? size : 1, 16);
+   if (fread(base, 1, size, f) != size) {
+      size = 0;
+   }
+   fclose(f);
+#else
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+      return 0;
+   }
+   struct stat st;
+   if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(hamt_image_header)) {
+      size = (size_t)st.st_size;
+      base = (char*)mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED) {
+         base = 0;
+      }
+   }
+   close(fd);
+   if (!base) {
+      return 0;
+   }
+#endif
+
+   hamt_image_header* h = (hamt_image_header*)base;
+   if (size < sizeof(hamt_image_header) || h->magic != HAMT_IMAGE_MAGIC ||
+       h->version != HAMT_IMAGE_VERSION || h->size != size ||
+       h->root_bits < 1 || h->root_bits > HAMT_ROOT_BITS_MAX ||
+       h->tables > size || h->tables < sizeof(hamt_image_header) + sizeof(hamt_entry) * ((size_t)1 << h->root_bits)) {
+#ifdef _MSC_VER
+      _aligned_free(base);
+#else
+      munmap(base, size);
+#endif
+      return 0;
+   }
+
+   hamt_mapped* m = (hamt_mapped*)malloc(sizeof(hamt_mapped));
+   m->base = base;
+   m->size = size;
+   m->header = h;
+   m->entries = (hamt_entry*)(base + sizeof(hamt_image_header));
+   return m;
+}
+
+// The offsets come from the file, so each is checked against the image
+// before it is followed.
+
+// the n entries of the table at offset p, or 0 when they are not in the
+// table section
+hamt_entry* hamt_mapped_table(hamt_mapped* m, uintptr_t p, int n)
+{
+   size_t at = (size_t)(uintptr_t)ptoptr(p);
+   if (at < m->header->tables || at > m->size || at % sizeof(hamt_entry) ||
+       (m->size - at) / sizeof(hamt_entry) < (size_t)n) {
+      return 0;
+   }
+   return (hamt_entry*)(m->base + at);
+}
+
+// whether the leaf e holds key, whose length is len
+int hamt_mapped_match(hamt_mapped* m, hamt_entry* e, const char* key, size_t len)
+{
+   size_t at = (size_t)e->korm;
+   return at < m->header->tables && m->header->tables - at > len &&
+          memcmp(m->base + at, key, len + 1) == 0;
+}
+
+void* hamt_mapped_find(hamt_mapped* m, const char* key)
+{
+   size_t len = strlen(key);
+   uint32_t hash = hamt_hash_key(key, (uint32_t)len, 0);
+   uint32_t shift_bits = m->header->root_bits;
+   hamt_entry* e = m->entries + (hash & (((uint32_t)1 << shift_bits) - 1));
+
+   while (e->p & 0x2) {
+      if (hamt_is_bucket(shift_bits)) {
+         // a chained bucket only links forward, so a corrupt one can't loop
+         hamt_entry* prev = 0;
+         while (e && (e->p & 0x2)) {
+            int n = hamt_table_size(e->korm);
+            hamt_entry* table = hamt_mapped_table(m, e->p, n);
+            if (!table || table <= prev) {
+               return 0;
+            }
+            for (int i = 0; i < ctpop(hamt_datamap(e->korm)); i++) {
+               if (hamt_mapped_match(m, table + i, key, len)) {
+                  return ptoptr(table[i].p);
+               }
+            }
+            prev = table;
+            e = hamt_nodemap(e->korm) ? table + (n - 1) : 0;
+         }
+         return 0;
+      }
+      int pos = hamt_child_pos(e->korm, TOIDX(hash));
+      if (pos < 0) {
+         return 0;
+      }
+      hamt_entry* table = hamt_mapped_table(m, e->p, pos + 1);
+      if (!table) {
+         return 0;
+      }
+      e = table + pos;
+      shift_bits += HAMT_T_BITS;
+   }
+
+   if ((e->p & 0x1) && hamt_mapped_match(m, e, key, len)) {
+      return ptoptr(e->p);
+   }
+   return 0;
+}
+
+uint32_t hamt_mapped_count(hamt_mapped* m)
+{
+   return m->header->count;
+}
+
+void hamt_close_mapped(hamt_mapped* m)
+{
+#ifdef _MSC_VER
+   _aligned_free(m->base);
+#else
+   munmap(m->base, m->size);
+#endif
+   free(m);
+}
+
+// Integer key hamt
+//
+// Same tables and allocator as hamt, the key is stored in korm itself.
+// The hash folds whatever the high word adds beyond sign extending the low
+// word into it and multiplies by an odd constant. That is a bijection for
+// ids that fit in 32 bits, so they never collide, and sequential ids
+// spread evenly over the root. Wider keys can collide and go to a bucket.
+
+struct hamt_int
+{
+   hamt h;
+};
+
+uint32_t hamt_int_hash(int64_t key)
+{
+   uint64_t k = (uint64_t)key;
+   uint32_t lo = (uint32_t)k;
+   uint32_t hi = (uint32_t)(k >> 32) - (uint32_t)((int32_t)lo >> 31);
+   return (lo ^ (hi * 0x85ebca6bu)) * 0x9e3779b1u;
+}
+
+// the generic functions (hamt_build, hamt_equals, set algebra) see the
+// key itself as the void* key
+uint32_t hamt_int_hash_fn(void* key, int level)
+{
+   return hamt_int_hash((int64_t)(uintptr_t)key);
+}
+
+int hamt_int_compare_fn(void* a, void* b)
+{
+   return a != b;
+}
+
+hamt_int* hamt_int_init(hamt_int* t, int root_bits)
+{
+   hamt_init(&t->h, hamt_int_hash_fn, hamt_int_compare_fn, root_bits);
+   return t;
+}
+
+void hamt_int_union(hamt_int* out, hamt_int* a, hamt_int* b)
+{
+   hamt_union(&out->h, &a->h, &b->h);
+}
+
+void hamt_int_intersect(hamt_int* out, hamt_int* a, hamt_int* b)
+{
+   hamt_intersect(&out->h, &a->h, &b->h);
+}
+
+void hamt_int_difference(hamt_int* out, hamt_int* a, hamt_int* b)
+{
+   hamt_difference(&out->h, &a->h, &b->h);
+}
+
+void hamt_int_insert(hamt_int* ti, int64_t key, void* value)
+{
+   hamt* t = &ti->h;
+   hamt_assert_in_place(t);
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash = hamt_int_hash(key);
+   uint32_t idx = HAMT_ROOT_IDX(t, hash);
+   hamt_entry* e = t->entries + idx;
+   hamt_entry leaf = {(uintptr_t)key, hamt_leaf_p(value)};
+
+   if (e->p == 0) {
+      *e = leaf;
+   } else if (e->p & 0x1) {
+      if ((int64_t)e->korm == key) {
+         e->p = leaf.p;
+      } else {
+         hamt_make_pair(t, e, *e, hamt_int_hash((int64_t)e->korm), leaf, hash, shift_bits);
+      }
+   } else {
+      for (;;) {
+         if (hamt_is_bucket(shift_bits)) {
+            hamt_entry* l = hamt_bucket_find(t, e, (void*)leaf.korm);
+            if (!l) {
+               hamt_bucket_add(t, e, leaf);
+            } else {
+               l->p = leaf.p;
+            }
+            break;
+         }
+
+         idx = TOIDX(hash);
+         hamt_entry* c = hamt_child(e, idx);
+
+         if (!c) {
+            hamt_table_add(t, e, idx, leaf.korm, leaf.p);
+            break;
+         }
+
+         if (c->p & 0x2) {
+            e = c;
+            shift_bits += HAMT_T_BITS;
+            continue;
+         }
+
+         if ((int64_t)c->korm == key) {
+            c->p = leaf.p;
+         } else {
+            hamt_entry n;
+            hamt_make_pair(t, &n, *c, hamt_int_hash((int64_t)c->korm), leaf, hash, shift_bits + HAMT_T_BITS);
+            hamt_table_to_node(e, idx, n);
+         }
+         break;
+      }
+   }
+
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+}
+
+void* hamt_int_find(hamt_int* ti, int64_t key)
+{
+   hamt* t = &ti->h;
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash = hamt_int_hash(key);
+   hamt_entry* e = t->entries + HAMT_ROOT_IDX(t, hash);
+
+   if (!e->p) {
+      return 0;
+   }
+
+   while (e->p & 0x2) {
+      if (hamt_is_bucket(shift_bits)) {
+         hamt_entry* l = hamt_bucket_find(t, e, (void*)(uintptr_t)key);
+         return l ? ptoptr(l->p) : 0;
+      }
+      e = hamt_child(e, TOIDX(hash));
+      if (!e) {
+         return 0;
+      }
+      shift_bits += HAMT_T_BITS;
+   }
+
+   if ((int64_t)e->korm == key) {
+      return ptoptr(e->p);
+   }
+   return 0;
+}
+
+void* hamt_int_remove_recur(hamt* t, hamt_entry* e, uint32_t shift_bits, uint32_t hash, int64_t key)
+{
+   if (hamt_is_bucket(shift_bits)) {
+      return hamt_remove_recur(t, e, shift_bits, hash, (void*)(uintptr_t)key);
+   }
+
+   void* result = 0;
+   uint32_t idx = TOIDX(hash);
+   hamt_entry* c = hamt_child(e, idx);
+
+   if (!c) {
+      return 0;
+   }
+
+   if (c->p & 0x2) {
+      result = hamt_int_remove_recur(t, c, shift_bits + HAMT_T_BITS, hash, key);
+      if (result && hamt_is_single_leaf(c)) {
+         hamt_table_inline(t, e, idx);
+      }
+   } else if ((int64_t)c->korm == key) {
+      result = ptoptr(c->p);
+      hamt_table_remove(t, e, idx);
+   }
+
+   return result;
+}
+
+void* hamt_int_remove(hamt_int* ti, int64_t key)
+{
+   hamt* t = &ti->h;
+   hamt_assert_in_place(t);
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash = hamt_int_hash(key);
+   hamt_entry* e = t->entries + HAMT_ROOT_IDX(t, hash);
+   void* result = 0;
+
+   if (e->p & 0x1) {
+      if ((int64_t)e->korm == key) {
+         result = ptoptr(e->p);
+         e->p = 0;
+         e->korm = 0;
+      }
+   } else if (e->p & 0x2) {
+      result = hamt_int_remove_recur(t, e, shift_bits, hash, key);
+      if (result) {
+         hamt_root_inline(t, e);
+      }
+   }
+
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+   return result;
+}
+
+int64_t hamt_int_key(hamt_iterator* it)
+{
+   return (int64_t)(uintptr_t)hamt_key(it);
+}
+
+#ifndef _MSC_VER
+
+// Sharded hamt
+//
+// Each shard is a plain hamt with its own pools and freelists, so writers
+// to different shards share nothing. Shards are picked by the top hash
+// bits while the tries index from the low bits, so the key is hashed once
+// and handed to the slot functions directly.
+
+#define HAMT_SHARD_BITS_MAX 10
+
+typedef struct hamt_shard
+{
+   pthread_rwlock_t lock;
+   hamt t;
+} hamt_shard;
+
+struct hamt_sharded
+{
+   hamt_shard* shards;
+   int shard_bits;
+   int mode;
+   hash_fn_t hash_fn;
+};
+
+struct hamt_sharded_iterator
+{
+   hamt_sharded* s;
+   int shard;
+   hamt_iterator it;
+};
+
+hamt_sharded* hamt_sharded_init(hamt_sharded* s, hash_fn_t f, compare_fn_t c, int shard_bits, int mode)
+{
+   assert(shard_bits >= 0 && shard_bits <= HAMT_SHARD_BITS_MAX);
+   int n = 1 << shard_bits;
+
+   s->shards = (hamt_shard*)calloc(n, sizeof(hamt_shard));
+   s->shard_bits = shard_bits;
+   s->mode = mode;
+   s->hash_fn = f;
+   for (int i = 0; i < n; i++) {
+      pthread_rwlock_init(&s->shards[i].lock, 0);
+      hamt_init(&s->shards[i].t, f, c);
+   }
+   return s;
+}
+
+void hamt_sharded_destroy(hamt_sharded* s)
+{
+   for (int i = 0; i < (1 << s->shard_bits); i++) {
+      pthread_rwlock_destroy(&s->shards[i].lock);
+      hamt_destroy(&s->shards[i].t);
+   }
+   free(s->shards);
+   s->shards = 0;
+}
+
+static inline int hamt_sharded_index(hamt_sharded* s, uint32_t hash)
+{
+   return s->shard_bits ? (int)(hash >> (HAMT_T - s->shard_bits)) : 0;
+}
+
+int hamt_sharded_shard(hamt_sharded* s, void* key)
+{
+   return hamt_sharded_index(s, s->hash_fn(key, 0));
+}
+
+void hamt_sharded_insert(hamt_sharded* s, void* key, void* value)
+{
+   uint32_t hash = s->hash_fn(key, 0);
+   hamt_shard* shard = s->shards + hamt_sharded_index(s, hash);
+   hamt* t = &shard->t;
+   hamt_entry leaf = {(uintptr_t)key, hamt_leaf_p(value)};
+
+   if (s->mode == HAMT_SHARD_LOCKS) {
+      pthread_rwlock_wrlock(&shard->lock);
+   }
+
+   hamt_slot_insert(t, t->entries + HAMT_ROOT_IDX(t, hash), t->root_bits, hash, leaf, 1);
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+
+   if (s->mode == HAMT_SHARD_LOCKS) {
+      pthread_rwlock_unlock(&shard->lock);
+   }
+}
+
+void* hamt_sharded_find(hamt_sharded* s, void* key)
+{
+   uint32_t hash = s->hash_fn(key, 0);
+   hamt_shard* shard = s->shards + hamt_sharded_index(s, hash);
+   hamt* t = &shard->t;
+
+   if (s->mode == HAMT_SHARD_LOCKS) {
+      pthread_rwlock_rdlock(&shard->lock);
+   }
+
+   hamt_entry* e = hamt_slot_find(t, t->entries + HAMT_ROOT_IDX(t, hash), t->root_bits, hash, key);
+   void* result = e ? ptoptr(e->p) : 0;
+
+   if (s->mode == HAMT_SHARD_LOCKS) {
+      pthread_rwlock_unlock(&shard->lock);
+   }
+   return result;
+}
+
+void* hamt_sharded_remove(hamt_sharded* s, void* key)
+{
+   uint32_t hash = s->hash_fn(key, 0);
+   hamt_shard* shard = s->shards + hamt_sharded_index(s, hash);
+   hamt* t = &shard->t;
+
+   if (s->mode == HAMT_SHARD_LOCKS) {
+      pthread_rwlock_wrlock(&shard->lock);
+   }
+
+   void* result = hamt_slot_remove(t, t->entries + HAMT_ROOT_IDX(t, hash), t->root_bits, hash, key);
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+
+   if (s->mode == HAMT_SHARD_LOCKS) {
+      pthread_rwlock_unlock(&shard->lock);
+   }
+   return result;
+}
+
+// move on to the next shard with keys once the current one is done
+void hamt_sharded_skip_empty(hamt_sharded_iterator* it)
+{
+   int n = 1 << it->s->shard_bits;
+   while (hamt_iterator_is_end(&it->it) && it->shard + 1 < n) {
+      it->shard++;
+      hamt_iterator_begin(&it->it, &it->s->shards[it->shard].t);
+   }
+}
+
+hamt_sharded_iterator* hamt_sharded_begin(hamt_sharded_iterator* it, hamt_sharded* s)
+{
+   it->s = s;
+   it->shard = 0;
+   hamt_iterator_begin(&it->it, &s->shards[0].t);
+   hamt_sharded_skip_empty(it);
+   return it;
+}
+
+int hamt_sharded_is_end(hamt_sharded_iterator* it)
+{
+   return hamt_iterator_is_end(&it->it);
+}
+
+void hamt_sharded_next(hamt_sharded_iterator* it)
+{
+   hamt_iterator_next(&it->it);
+   hamt_sharded_skip_empty(it);
+}
+
+void* hamt_sharded_key(hamt_sharded_iterator* it)
+{
+   return hamt_key(&it->it);
+}
+
+void* hamt_sharded_value(hamt_sharded_iterator* it)
+{
+   return hamt_value(&it->it);
+}
+
+#endif
+
+// Cache
+//
+// The clock hand is a position in trie order (the order hamt_build sorts
+// by: root digit, then each level's digit) rather than a path of table
+// indices, so it stays valid while evictions shrink and inline tables
+// under it. A leaf in a table at some depth owns every position sharing
+// its prefix, and the hand moves past a leaf by stepping that prefix.
+
+struct hamt_cache
+{
+   hamt t;
+   size_t max_entries;
+   size_t max_bytes;
+   size_t count;
+   size_t value_bytes; // sum of size_fn
+   uint32_t hand;
+   hamt_size_fn_t size_fn;
+   hamt_evict_fn_t evict_fn;
+   void* evict_arg;
+};
+
+hamt_cache* hamt_cache_init(hamt_cache* c, hash_fn_t f, compare_fn_t cmp, size_t max_entries, size_t max_bytes)
+{
+   memset(c, 0, sizeof(hamt_cache));
+   hamt_init(&c->t, f, cmp);
+   c->max_entries = max_entries;
+   c->max_bytes = max_bytes;
+   return c;
+}
+
+void hamt_cache_on_evict(hamt_cache* c, hamt_size_fn_t size_fn, hamt_evict_fn_t evict_fn, void* arg)
+{
+   c->size_fn = size_fn;
+   c->evict_fn = evict_fn;
+   c->evict_arg = arg;
+}
+
+void hamt_cache_destroy(hamt_cache* c)
+{
+   hamt_destroy(&c->t);
+   memset(c, 0, sizeof(hamt_cache));
+}
+
+size_t hamt_cache_count(hamt_cache* c)
+{
+   return c->count;
+}
+
+size_t hamt_cache_bytes(hamt_cache* c)
+{
+   return c->t.live_bytes + c->value_bytes;
+}
+
+static inline size_t hamt_cache_entry_size(hamt_cache* c, hamt_entry* e)
+{
+   return c->size_fn ? c->size_fn((void*)e->korm, ptoptr(e->p)) : 0;
+}
+
+int hamt_cache_over(hamt_cache* c)
+{
+   return (c->max_entries && c->count > c->max_entries) ||
+          (c->max_bytes && hamt_cache_bytes(c) > c->max_bytes);
+}
+
+// First leaf at or after position order below the subtable e, whose digit
+// is the width bits under the top used bits of order. Sets *width to the
+// prefix width owned by the leaf.
+hamt_entry* hamt_cache_seek(hamt_entry* e, uint32_t shift_bits, uint32_t used, uint32_t order, uint32_t* at, uint32_t* width)
+{
+   // the keys of a bucket share one position, the first stands for all
+   if (hamt_is_bucket(shift_bits)) {
+      *at = order;
+      *width = HAMT_T;
+      return (hamt_entry*)ptoptr(e->p);
+   }
+
+   uint32_t bits = HAMT_T - shift_bits < HAMT_T_BITS ? HAMT_T - shift_bits : HAMT_T_BITS;
+   uint32_t below = HAMT_T - used - bits;
+   uint32_t start = (order >> below) & (((uint32_t)1 << bits) - 1);
+   uint32_t prefix = used ? order & ~(uint32_t)0 << (HAMT_T - used) : 0;
+
+   for (uint32_t idx = start; idx < ((uint32_t)1 << bits); idx++) {
+      hamt_entry* c = hamt_child(e, idx);
+      if (!c) {
+         continue;
+      }
+      uint32_t pos = prefix | (idx << below);
+      if (c->p & 0x1) {
+         *at = pos;
+         *width = used + bits;
+         return c;
+      }
+      hamt_entry* r = hamt_cache_seek(c, shift_bits + HAMT_T_BITS, used + bits, idx == start ? order : pos, at, width);
+      if (r) {
+         return r;
+      }
+   }
+   return 0;
+}
+
+// first leaf at or after the hand, wrapping around once
+hamt_entry* hamt_cache_next(hamt_cache* c, uint32_t* at, uint32_t* width, int* wrapped)
+{
+   hamt* t = &c->t;
+   uint32_t order = c->hand;
+
+   for (int pass = 0; pass < 2; pass++) {
+      *wrapped = pass;
+      uint32_t below = HAMT_T - t->root_bits;
+      for (uint32_t idx = order >> below; idx < HAMT_ROOT_SIZE(t); idx++) {
+         hamt_entry* e = t->entries + idx;
+         uint32_t pos = idx << below;
+         if (e->p & 0x1) {
+            *at = pos;
+            *width = t->root_bits;
+            return e;
+         }
+         if (e->p & 0x2) {
+            hamt_entry* r = hamt_cache_seek(e, t->root_bits, t->root_bits, (idx == order >> below) ? order : pos, at, width);
+            if (r) {
+               return r;
+            }
+         }
+      }
+      order = 0;
+   }
+   return 0;
+}
+
+// sweep until the cache is within its capacity. Each set reference bit
+// met is cleared, so two laps at most.
+void hamt_cache_evict(hamt_cache* c)
+{
+   while (c->count && hamt_cache_over(c)) {
+      uint32_t at = 0;
+      uint32_t width = 0;
+      int wrapped = 0;
+      hamt_entry* e = hamt_cache_next(c, &at, &width, &wrapped);
+      if (!e) {
+         break;
+      }
+
+      // A leaf whose prefix straddles the hand was inlined from below
+      // after the hand had passed it, so it was already seen this lap.
+      int seen = !wrapped && at < c->hand;
+
+      // step past the leaf's prefix, wrapping at the end
+      c->hand = width < HAMT_T ? at + ((uint32_t)1 << (HAMT_T - width)) : at + 1;
+
+      if (seen) {
+         continue;
+      }
+
+      if (e->p & HAMT_LEAF_REFERENCED) {
+         e->p &= ~HAMT_LEAF_REFERENCED;
+         continue;
+      }
+
+      void* key = (void*)e->korm;
+      void* value = ptoptr(e->p);
+      c->value_bytes -= hamt_cache_entry_size(c, e);
+      c->count--;
+
+      hamt* t = &c->t;
+      uint32_t hash = t->hash_fn(key, 0);
+      hamt_slot_remove(t, t->entries + HAMT_ROOT_IDX(t, hash), t->root_bits, hash, key);
+
+      if (c->evict_fn) {
+         c->evict_fn(key, value, c->evict_arg);
+      }
+   }
+}
+
+// new entries start referenced so the hand doesn't take them right away
+void hamt_cache_insert(hamt_cache* c, void* key, void* value)
+{
+   hamt* t = &c->t;
+   hamt_assert_in_place(t);
+   uint32_t hash = t->hash_fn(key, 0);
+   hamt_entry* root = t->entries + HAMT_ROOT_IDX(t, hash);
+   hamt_entry* e = hamt_slot_find(t, root, t->root_bits, hash, key);
+
+   if (e) {
+      void* old_key = (void*)e->korm;
+      void* old_value = ptoptr(e->p);
+      c->value_bytes -= hamt_cache_entry_size(c, e);
+      e->korm = (uintptr_t)key;
+      e->p = hamt_leaf_p(value) | HAMT_LEAF_REFERENCED;
+      c->value_bytes += hamt_cache_entry_size(c, e);
+      if (c->evict_fn) {
+         c->evict_fn(old_key, old_value, c->evict_arg);
+      }
+   } else {
+      hamt_entry leaf = {(uintptr_t)key, hamt_leaf_p(value) | HAMT_LEAF_REFERENCED};
+      hamt_slot_insert(t, root, t->root_bits, hash, leaf, 1);
+      c->value_bytes += hamt_cache_entry_size(c, &leaf);
+      c->count++;
+   }
+
+   hamt_cache_evict(c);
+}
+
+void* hamt_cache_find(hamt_cache* c, void* key)
+{
+   hamt* t = &c->t;
+   uint32_t hash = t->hash_fn(key, 0);
+   hamt_entry* e = hamt_slot_find(t, t->entries + HAMT_ROOT_IDX(t, hash), t->root_bits, hash, key);
+
+   if (!e) {
+      return 0;
+   }
+   if (!(e->p & HAMT_LEAF_REFERENCED)) {
+      e->p |= HAMT_LEAF_REFERENCED;
+   }
+   return ptoptr(e->p);
+}
+
+// the removed value is returned, evict_fn is not called
+void* hamt_cache_remove(hamt_cache* c, void* key)
+{
+   hamt* t = &c->t;
+   uint32_t hash = t->hash_fn(key, 0);
+   hamt_entry* root = t->entries + HAMT_ROOT_IDX(t, hash);
+   hamt_entry* e = hamt_slot_find(t, root, t->root_bits, hash, key);
+
+   if (!e) {
+      return 0;
+   }
+   c->value_bytes -= hamt_cache_entry_size(c, e);
+   c->count--;
+   return hamt_slot_remove(t, root, t->root_bits, hash, key);
+}
+
+#ifndef _MSC_VER
+
+// Concurrent hamt
+//
+// Subtables are immutable once published. A cnode is a subtable with a
+// header entry in front of it:
+//    cnode[0]      korm = bitmap
+//    cnode[1..n]   leaf:   korm = key, p = value | 0x1
+//                  branch: korm = 0,   p = inode | 0x2
+// An inode is a single entry whose p points to the current cnode (or 0 when
+// empty). The root entries are inodes. Writers copy the cnode, change the
+// copy and CAS it into the inode, so a cnode that has been read stays valid
+// until it is reclaimed. Replaced cnodes are retired and handed back to the
+// thread's size class freelists once the global epoch has moved twice past
+// the retire, after which no reader can still see them.
+//
+// Keys whose hashes are equal share a bucket cnode below the last level, as
+// in the hamt. Its entries are packed at bits 0 to count-1 and a full one
+// links the next bucket's inode from its last entry. New keys only go in
+// the last bucket of the chain, so two writers of one key meet at the same
+// inode and the CAS keeps the key unique.
+
+#define HAMT_CONCURRENT_COLLECT_BATCH 64
+
+typedef struct hamt_retired
+{
+   hamt_entry* node;
+   uint32_t len;
+   uint64_t epoch;
+} hamt_retired;
+
+struct hamt_thread
+{
+   hamt_concurrent* t;
+   hamt_thread* next;
+   uint64_t state; // (epoch << 1) | active
+   uint32_t in_use;
+   hamt_freelist_node* freelists[HAMT_T_ENTRIES+1];
+   hamt_entry_pool* pool;
+   hamt_retired* retired;
+   int retired_count;
+   int retired_capacity;
+};
+
+struct hamt_concurrent
+{
+   hamt_entry entries[HAMT_T_ENTRIES];
+   hash_fn_t hash_fn;
+   compare_fn_t compare_fn;
+   uint64_t epoch;
+   hamt_thread* threads;
+};
+
+hamt_concurrent* hamt_concurrent_init(hamt_concurrent* t, hash_fn_t f, compare_fn_t c)
+{
+   memset(t, 0, sizeof(hamt_concurrent));
+   t->hash_fn = f;
+   t->compare_fn = c;
+   return t;
+}
+
+// no thread may be attached
+void hamt_concurrent_destroy(hamt_concurrent* t)
+{
+   hamt_thread* th = t->threads;
+   while (th) {
+      hamt_thread* next = th->next;
+      hamt_entry_pool* p = th->pool;
+      while (p) {
+         hamt_entry_pool* tmp = p->next;
+         hamt_free_pool(p);
+         p = tmp;
+      }
+      free(th->retired);
+      free(th);
+      th = next;
+   }
+   memset(t, 0, sizeof(hamt_concurrent));
+}
+
+hamt_thread* hamt_thread_attach(hamt_concurrent* t)
+{
+   hamt_thread* th = __atomic_load_n(&t->threads, __ATOMIC_ACQUIRE);
+
+   // reuse a detached thread record with its pools and freelists
+   while (th) {
+      uint32_t expected = 0;
+      if (__atomic_compare_exchange_n(&th->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+         return th;
+      }
+      th = th->next;
+   }
+
+   th = (hamt_thread*)calloc(1, sizeof(hamt_thread));
+   th->t = t;
+   th->in_use = 1;
+   th->next = __atomic_load_n(&t->threads, __ATOMIC_RELAXED);
+   while (!__atomic_compare_exchange_n(&t->threads, &th->next, th, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+   }
+   return th;
+}
+
+void hamt_thread_collect(hamt_thread* th);
+
+// Flushes the retired list, as far as the other threads let the epoch move.
+// Whatever is left is collected by the next thread to reuse the record.
+void hamt_thread_detach(hamt_thread* th)
+{
+   __atomic_store_n(&th->state, 0, __ATOMIC_RELEASE);
+   for (int i = 0; i < 3 && th->retired_count; i++) {
+      hamt_thread_collect(th);
+   }
+   __atomic_store_n(&th->in_use, 0, __ATOMIC_RELEASE);
+}
+
+hamt_entry* hamt_thread_alloc_node(hamt_thread* th, int len)
+{
+   hamt_entry* result = 0;
+   hamt_freelist_node* next = th->freelists[len-1];
+
+   if (!next) {
+      size_t size = sizeof(hamt_entry)*len;
+      if (!th->pool || (size_t)(th->pool->e - th->pool->p) < size) {
+         hamt_entry_pool* newpool = hamt_alloc_pool(HAMT_ENTRY_POOL_SIZE);
+         newpool->next = th->pool;
+         th->pool = newpool;
+      }
+
+      result = (hamt_entry*)th->pool->p;
+      th->pool->p += size;
+   } else {
+      th->freelists[len-1] = next->next;
+      result = &next->entry;
+   }
+   return result;
+}
+
+void hamt_thread_free_node(hamt_thread* th, void* e, int len)
+{
+   hamt_freelist_node* n = (hamt_freelist_node*)e;
+
+   n->next = th->freelists[len-1];
+   th->freelists[len-1] = n;
+}
+
+void hamt_thread_enter(hamt_thread* th)
+{
+   uint64_t epoch = __atomic_load_n(&th->t->epoch, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&th->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void hamt_thread_exit(hamt_thread* th)
+{
+   __atomic_store_n(&th->state, 0, __ATOMIC_RELEASE);
+}
+
+// the node has been unlinked but readers may still hold it
+void hamt_thread_retire(hamt_thread* th, hamt_entry* node, int len)
+{
+   if (th->retired_count == th->retired_capacity) {
+      th->retired_capacity = th->retired_capacity ? th->retired_capacity * 2 : HAMT_CONCURRENT_COLLECT_BATCH;
+      th->retired = (hamt_retired*)realloc(th->retired, sizeof(hamt_retired) * th->retired_capacity);
+   }
+
+   hamt_retired* r = th->retired + th->retired_count++;
+   r->node = node;
+   r->len = len;
+   r->epoch = __atomic_load_n(&th->t->epoch, __ATOMIC_SEQ_CST);
+}
+
+// advance the epoch if every active thread has seen the current one
+void hamt_concurrent_try_advance(hamt_concurrent* t)
+{
+   uint64_t epoch = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+   hamt_thread* th = __atomic_load_n(&t->threads, __ATOMIC_ACQUIRE);
+
+   while (th) {
+      uint64_t state = __atomic_load_n(&th->state, __ATOMIC_SEQ_CST);
+      if ((state & 1) && (state >> 1) != epoch) {
+         return;
+      }
+      th = th->next;
+   }
+
+   __atomic_compare_exchange_n(&t->epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void hamt_thread_collect(hamt_thread* th)
+{
+   hamt_concurrent_try_advance(th->t);
+
+   uint64_t epoch = __atomic_load_n(&th->t->epoch, __ATOMIC_SEQ_CST);
+   int cnt = 0;
+
+   // retired in epoch order, so the reclaimable ones are a prefix
+   while (cnt < th->retired_count && epoch - th->retired[cnt].epoch >= 2) {
+      hamt_thread_free_node(th, th->retired[cnt].node, th->retired[cnt].len);
+      cnt++;
+   }
+
+   if (cnt) {
+      th->retired_count -= cnt;
+      memmove(th->retired, th->retired + cnt, sizeof(hamt_retired) * th->retired_count);
+   }
+}
+
+void hamt_thread_leave(hamt_thread* th)
+{
+   hamt_thread_exit(th);
+   if (th->retired_count >= HAMT_CONCURRENT_COLLECT_BATCH) {
+      hamt_thread_collect(th);
+   }
+}
+
+int hamt_concurrent_publish(hamt_thread* th, hamt_entry* inode, hamt_entry* old, int old_len, hamt_entry* n)
+{
+   uintptr_t expected = (uintptr_t)old;
+   if (__atomic_compare_exchange_n(&inode->p, &expected, (uintptr_t)n, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      if (old) {
+         hamt_thread_retire(th, old, old_len);
+      }
+      return 1;
+   }
+   return 0;
+}
+
+// copy cnode c of size table_size, leaving a hole at pos when grow is set
+// or dropping pos when grow is not set
+hamt_entry* hamt_concurrent_copy(hamt_thread* th, hamt_entry* c, int table_size, int pos, int grow)
+{
+   int len = table_size + 1 + (grow ? 1 : -1);
+   hamt_entry* n = hamt_thread_alloc_node(th, len);
+
+   n->korm = c->korm;
+   n->p = 0;
+   memcpy(n + 1, c + 1, sizeof(hamt_entry) * pos);
+   if (grow) {
+      memcpy(n + 2 + pos, c + 1 + pos, sizeof(hamt_entry) * (table_size - pos));
+   } else {
+      memcpy(n + 1 + pos, c + 2 + pos, sizeof(hamt_entry) * (table_size - pos - 1));
+   }
+   return n;
+}
+
+// The position of key in the bucket cnode c. Past that it is the link to
+// the next bucket, the free position at the end or the full last leaf,
+// which a new key splits into the next bucket.
+int hamt_concurrent_bucket_pos(hamt_concurrent* t, hamt_entry* c, void* key)
+{
+   int table_size = ctpop(c->korm);
+   for (int i = 0; i < table_size; i++) {
+      hamt_entry* e = c + 1 + i;
+      if ((e->p & 0x2) || t->compare_fn((void*)e->korm, key) == 0) {
+         return i;
+      }
+   }
+   return table_size < HAMT_T ? table_size : table_size - 1;
+}
+
+// build the inode chain that separates an existing leaf from a new key
+hamt_entry* hamt_concurrent_split(hamt_thread* th, hamt_entry* leaf, uint32_t lhash, uint32_t shift_bits, uint32_t hash, void* key, void* value)
+{
+   hamt_entry* inode = hamt_thread_alloc_node(th, 1);
+   uint32_t lidx = hamt_is_bucket(shift_bits) ? 0 : TOIDX(lhash);
+   uint32_t idx = hamt_is_bucket(shift_bits) ? 1 : TOIDX(hash);
+   hamt_entry* c = 0;
+
+   if (lidx == idx) {
+      c = hamt_thread_alloc_node(th, 2);
+      c->korm = (uintptr_t)1 << idx;
+      c[1].korm = 0;
+      c[1].p = (uintptr_t)hamt_concurrent_split(th, leaf, lhash, shift_bits + HAMT_T_BITS, hash, key, value) | 0x2;
+   } else {
+      c = hamt_thread_alloc_node(th, 3);
+      c->korm = ((uintptr_t)1 << lidx) | ((uintptr_t)1 << idx);
+      hamt_entry* le = lidx < idx ? c + 1 : c + 2;
+      hamt_entry* ke = lidx < idx ? c + 2 : c + 1;
+      le->korm = leaf->korm;
+      le->p = leaf->p;
+      ke->korm = (uintptr_t)key;
+      ke->p = hamt_leaf_p(value);
+   }
+   c->p = 0;
+
+   inode->korm = 0;
+   inode->p = (uintptr_t)c;
+   return inode;
+}
+
+// release a split chain that lost its CAS and was never visible
+void hamt_concurrent_free_split(hamt_thread* th, hamt_entry* inode)
+{
+   hamt_entry* c = (hamt_entry*)inode->p;
+   int table_size = ctpop(c->korm);
+   if (table_size == 1) {
+      hamt_concurrent_free_split(th, (hamt_entry*)ptoptr(c[1].p));
+   }
+   hamt_thread_free_node(th, c, table_size + 1);
+   hamt_thread_free_node(th, inode, 1);
+}
+
+void* hamt_concurrent_put(hamt_thread* th, void* key, void* value, int replace)
+{
+   hamt_concurrent* t = th->t;
+   uint32_t hash = t->hash_fn(key, 0);
+   void* result = value;
+
+   hamt_thread_enter(th);
+
+   hamt_entry* inode = t->entries + (hash & HAMT_T_MASK);
+   uint32_t shift_bits = HAMT_T_BITS;
+
+   for (;;) {
+      hamt_entry* c = (hamt_entry*)__atomic_load_n(&inode->p, __ATOMIC_ACQUIRE);
+      int bucket = hamt_is_bucket(shift_bits);
+      uintptr_t bit = (uintptr_t)1 << (bucket ? 0 : TOIDX(hash));
+
+      if (!c) {
+         hamt_entry* n = hamt_thread_alloc_node(th, 2);
+         n->korm = bit;
+         n->p = 0;
+         n[1].korm = (uintptr_t)key;
+         n[1].p = hamt_leaf_p(value);
+         if (hamt_concurrent_publish(th, inode, 0, 0, n)) {
+            break;
+         }
+         hamt_thread_free_node(th, n, 2);
+         continue;
+      }
+
+      if (bucket) {
+         bit = (uintptr_t)1 << hamt_concurrent_bucket_pos(t, c, key);
+      }
+      int table_size = ctpop(c->korm);
+      int pos = ctpop(c->korm & (bit-1));
+      hamt_entry* e = c + 1 + pos;
+
+      if (!(c->korm & bit)) {
+         hamt_entry* n = hamt_concurrent_copy(th, c, table_size, pos, 1);
+         n->korm |= bit;
+         n[1+pos].korm = (uintptr_t)key;
+         n[1+pos].p = hamt_leaf_p(value);
+         if (hamt_concurrent_publish(th, inode, c, table_size + 1, n)) {
+            break;
+         }
+         hamt_thread_free_node(th, n, table_size + 2);
+      } else if (e->p & 0x2) {
+         inode = (hamt_entry*)ptoptr(e->p);
+         shift_bits += HAMT_T_BITS;
+      } else if (t->compare_fn((void*)e->korm, key) == 0) {
+         if (!replace) {
+            result = ptoptr(e->p);
+            break;
+         }
+         hamt_entry* n = hamt_thread_alloc_node(th, table_size + 1);
+         memcpy(n, c, sizeof(hamt_entry) * (table_size + 1));
+         n[1+pos].korm = (uintptr_t)key;
+         n[1+pos].p = hamt_leaf_p(value);
+         if (hamt_concurrent_publish(th, inode, c, table_size + 1, n)) {
+            break;
+         }
+         hamt_thread_free_node(th, n, table_size + 1);
+      } else {
+         uint32_t ehash = t->hash_fn((void*)e->korm, 0);
+         hamt_entry* sub = hamt_concurrent_split(th, e, ehash, shift_bits + HAMT_T_BITS, hash, key, value);
+         hamt_entry* n = hamt_thread_alloc_node(th, table_size + 1);
+         memcpy(n, c, sizeof(hamt_entry) * (table_size + 1));
+         n[1+pos].korm = 0;
+         n[1+pos].p = (uintptr_t)sub | 0x2;
+         if (hamt_concurrent_publish(th, inode, c, table_size + 1, n)) {
+            break;
+         }
+         hamt_concurrent_free_split(th, sub);
+         hamt_thread_free_node(th, n, table_size + 1);
+      }
+   }
+
+   hamt_thread_leave(th);
+
+   return result;
+}
+
+void hamt_concurrent_insert(hamt_thread* th, void* key, void* value)
+{
+   hamt_concurrent_put(th, key, value, 1);
+}
+
+// insert if absent, returns the value that ends up mapped to key
+void* hamt_concurrent_intern(hamt_thread* th, void* key, void* value)
+{
+   return hamt_concurrent_put(th, key, value, 0);
+}
+
+void* hamt_concurrent_find(hamt_thread* th, void* key)
+{
+   hamt_concurrent* t = th->t;
+   uint32_t hash = t->hash_fn(key, 0);
+   void* result = 0;
+
+   hamt_thread_enter(th);
+
+   hamt_entry* inode = t->entries + (hash & HAMT_T_MASK);
+   uint32_t shift_bits = HAMT_T_BITS;
+
+   for (;;) {
+      hamt_entry* c = (hamt_entry*)__atomic_load_n(&inode->p, __ATOMIC_ACQUIRE);
+      if (!c) {
+         break;
+      }
+
+      uintptr_t bit = (uintptr_t)1 << (hamt_is_bucket(shift_bits) ? hamt_concurrent_bucket_pos(t, c, key) : TOIDX(hash));
+      if (!(c->korm & bit)) {
+         break;
+      }
+
+      hamt_entry* e = c + 1 + ctpop(c->korm & (bit-1));
+      if (e->p & 0x1) {
+         if (t->compare_fn((void*)e->korm, key) == 0) {
+            result = ptoptr(e->p);
+         }
+         break;
+      }
+
+      inode = (hamt_entry*)ptoptr(e->p);
+      shift_bits += HAMT_T_BITS;
+   }
+
+   hamt_thread_exit(th);
+
+   return result;
+}
+
+// inodes are not contracted, an emptied subtable leaves its inode at 0
+void* hamt_concurrent_remove(hamt_thread* th, void* key)
+{
+   hamt_concurrent* t = th->t;
+   uint32_t hash = t->hash_fn(key, 0);
+   void* result = 0;
+
+   hamt_thread_enter(th);
+
+   hamt_entry* inode = t->entries + (hash & HAMT_T_MASK);
+   uint32_t shift_bits = HAMT_T_BITS;
+
+   for (;;) {
+      hamt_entry* c = (hamt_entry*)__atomic_load_n(&inode->p, __ATOMIC_ACQUIRE);
+      if (!c) {
+         break;
+      }
+
+      int bucket = hamt_is_bucket(shift_bits);
+      uintptr_t bit = (uintptr_t)1 << (bucket ? hamt_concurrent_bucket_pos(t, c, key) : TOIDX(hash));
+      if (!(c->korm & bit)) {
+         break;
+      }
+
+      int table_size = ctpop(c->korm);
+      int pos = ctpop(c->korm & (bit-1));
+      hamt_entry* e = c + 1 + pos;
+
+      if (e->p & 0x2) {
+         inode = (hamt_entry*)ptoptr(e->p);
+         shift_bits += HAMT_T_BITS;
+         continue;
+      }
+
+      if (t->compare_fn((void*)e->korm, key) != 0) {
+         break;
+      }
+
+      hamt_entry* n = 0;
+      if (table_size > 1) {
+         n = hamt_concurrent_copy(th, c, table_size, pos, 0);
+         // a bucket stays packed at the low bits
+         n->korm = bucket ? ((uintptr_t)1 << (table_size - 1)) - 1 : n->korm ^ bit;
+      }
+
+      if (hamt_concurrent_publish(th, inode, c, table_size + 1, n)) {
+         result = ptoptr(e->p);
+         break;
+      }
+
+      if (n) {
+         hamt_thread_free_node(th, n, table_size);
+      }
+   }
+
+   hamt_thread_leave(th);
+
+   return result;
+}
+
+#endif
+
+#ifdef __cplusplus
+
+// Typed hamt
+//
+// hamt_map<K, V, Hash, Eq> keeps the tables, pools and compaction of hamt
+// but calls Hash and Eq directly so they inline into the traversal. A key
+// that fits in a word is stored in korm. A value is stored in p when it is
+// an aligned pointer, small enough to leave the tag bits free, or a word
+// whose top bits are sign bits. Anything larger is boxed.
+
+#include <type_traits>
+
+template <typename K, typename Enable = void>
+struct hamt_hash;
+
+template <typename K>
+struct hamt_hash<K, typename std::enable_if<std::is_integral<K>::value>::type>
+{
+   uint32_t operator()(K k) const { return hamt_int_hash((int64_t)k); }
+};
+
+template <>
+struct hamt_hash<const char*>
+{
+   uint32_t operator()(const char* k) const { return hamt_hash_key(k, (uint32_t)strlen(k), 0); }
+};
+
+template <typename K>
+struct hamt_equal
+{
+   bool operator()(const K& a, const K& b) const { return a == b; }
+};
+
+template <>
+struct hamt_equal<const char*>
+{
+   bool operator()(const char* a, const char* b) const { return strcmp(a, b) == 0; }
+};
+
+template <typename T, bool IsVoid = std::is_void<T>::value>
+struct hamt_align_of { static const size_t value = alignof(T); };
+
+template <typename T>
+struct hamt_align_of<T, true> { static const size_t value = 1; };
+
+template <typename T>
+struct hamt_is_aligned_ptr { static const bool value = false; };
+
+template <typename T>
+struct hamt_is_aligned_ptr<T*> { static const bool value = hamt_align_of<T>::value >= 4; };
+
+// keys can use every bit of korm
+template <typename T, bool Inline = (sizeof(T) <= sizeof(uintptr_t) && std::is_trivially_copyable<T>::value)>
+struct hamt_key_slot
+{
+   static uintptr_t store(const T& v) { uintptr_t r = 0; memcpy(&r, &v, sizeof(T)); return r; }
+   static T load(uintptr_t r) { T v; memcpy(&v, &r, sizeof(T)); return v; }
+   static void release(uintptr_t) {}
+};
+
+template <typename T>
+struct hamt_key_slot<T, false>
+{
+   static uintptr_t store(const T& v) { return (uintptr_t)new T(v); }
+   static const T& load(uintptr_t r) { return *(T*)r; }
+   static void release(uintptr_t r) { delete (T*)r; }
+};
+
+// values must leave the two tag bits of p and HAMT_LEAF_REFERENCED clear
+enum
+{
+   HAMT_VALUE_POINTER,
+   HAMT_VALUE_SHIFTED,
+   HAMT_VALUE_WORD,
+   HAMT_VALUE_BOXED
+};
+
+template <typename T>
+struct hamt_value_kind
+{
+   static const int value = hamt_is_aligned_ptr<T>::value ? HAMT_VALUE_POINTER :
+      !std::is_trivially_copyable<T>::value || sizeof(T) > sizeof(uintptr_t) ? HAMT_VALUE_BOXED :
+      sizeof(T) < sizeof(uintptr_t) ? HAMT_VALUE_SHIFTED :
+      HAMT_VALUE_WORD;
+};
+
+template <typename T, int Kind = hamt_value_kind<T>::value>
+struct hamt_value_slot;
+
+template <typename T>
+struct hamt_value_slot<T, HAMT_VALUE_POINTER>
+{
+   static uintptr_t store(const T& v) { return (uintptr_t)v; }
+   static T load(uintptr_t r) { return (T)ptoptr(r); }
+   static void release(uintptr_t) {}
+};
+
+template <typename T>
+struct hamt_value_slot<T, HAMT_VALUE_SHIFTED>
+{
+   static uintptr_t store(const T& v) { uintptr_t r = 0; memcpy(&r, &v, sizeof(T)); return r << 2; }
+   static T load(uintptr_t r) { T v; r >>= 2; memcpy(&v, &r, sizeof(T)); return v; }
+   static void release(uintptr_t) {}
+};
+
+// a word that sign extends from 60 bits, like a pointer or a small int, is
+// kept in bits 3 to 62 with bit 2 set. any other is boxed, and new aligns
+// the box so its bit 2 is clear.
+#define HAMT_VALUE_INLINE 0x4
+
+template <typename T>
+struct hamt_value_slot<T, HAMT_VALUE_WORD>
+{
+   static uintptr_t store(const T& v)
+   {
+      int64_t r;
+      memcpy(&r, &v, sizeof(T));
+      if (((int64_t)((uint64_t)r << 4) >> 4) != r) {
+         return (uintptr_t)new T(v);
+      }
+      return (((uint64_t)r << 3) & ~HAMT_LEAF_REFERENCED) | HAMT_VALUE_INLINE;
+   }
+   static T load(uintptr_t r)
+   {
+      if (!(r & HAMT_VALUE_INLINE)) {
+         return *(T*)ptoptr(r);
+      }
+      int64_t w = (int64_t)((uint64_t)r << 1) >> 4;
+      T v;
+      memcpy(&v, &w, sizeof(T));
+      return v;
+   }
+   static void release(uintptr_t r)
+   {
+      if (!(r & HAMT_VALUE_INLINE)) {
+         delete (T*)ptoptr(r);
+      }
+   }
+};
+
+template <typename T>
+struct hamt_value_slot<T, HAMT_VALUE_BOXED>
+{
+   static uintptr_t store(const T& v) { return (uintptr_t)new T(v); }
+   static const T& load(uintptr_t r) { return *(T*)ptoptr(r); }
+   static void release(uintptr_t r) { delete (T*)ptoptr(r); }
+};
+
+// The root lives inside h, so a map can be moved but not copied. A map
+// moved from or destroyed is left empty, ready for hamt_init, and the
+// destructor releases whatever is left.
+template <typename K, typename V, typename Hash = hamt_hash<K>, typename Eq = hamt_equal<K> >
+struct hamt_map
+{
+   typedef hamt_key_slot<K> key_slot;
+   typedef hamt_value_slot<V> value_slot;
+
+   hamt h;
+   Hash hash;
+   Eq eq;
+
+   hamt_map() { clear(); }
+   ~hamt_map() { hamt_destroy(this); }
+   hamt_map(const hamt_map&) = delete;
+   hamt_map& operator=(const hamt_map&) = delete;
+
+   hamt_map(hamt_map&& o) : hash(o.hash), eq(o.eq) { take(o); }
+
+   hamt_map& operator=(hamt_map&& o)
+   {
+      if (this != &o) {
+         hamt_destroy(this);
+         hash = o.hash;
+         eq = o.eq;
+         take(o);
+      }
+      return *this;
+   }
+
+   void clear()
+   {
+      memset(&h, 0, sizeof(hamt));
+      h.entries = h.root;
+      h.root_bits = HAMT_ROOT_BITS_DEFAULT;
+   }
+
+   void take(hamt_map& o)
+   {
+      h = o.h;
+      if (o.h.entries == o.h.root) {
+         h.entries = h.root;
+      }
+      o.clear();
+   }
+};
+
+template <typename K, typename V, typename H, typename E>
+hamt_map<K, V, H, E>* hamt_init(hamt_map<K, V, H, E>* t)
+{
+   memset(&t->h, 0, sizeof(hamt));
+   hamt_init(&t->h, 0, 0);
+   return t;
+}
+
+template <typename K, typename V, typename H, typename E>
+void hamt_destroy_entry(hamt_map<K, V, H, E>* t, hamt_entry* e)
+{
+   typedef hamt_map<K, V, H, E> map;
+   if (e->p & 0x1) {
+      map::key_slot::release(e->korm);
+      map::value_slot::release(e->p);
+   } else if (e->p & 0x2) {
+      hamt_entry* se = (hamt_entry*)ptoptr(e->p);
+      for (int i = 0; i < hamt_table_size(e->korm); i++) {
+         hamt_destroy_entry(t, se + i);
+      }
+   }
+}
+
+// release boxed keys and values and the pools
+template <typename K, typename V, typename H, typename E>
+void hamt_destroy(hamt_map<K, V, H, E>* t)
+{
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(&t->h); i++) {
+      hamt_destroy_entry(t, t->h.entries + i);
+   }
+   hamt_destroy(&t->h);
+   t->clear();
+}
+
+// the leaf of key in the bucket chain from e, or 0
+template <typename K, typename V, typename H, typename E>
+hamt_entry* hamt_bucket_find(hamt_map<K, V, H, E>* m, hamt_entry* e, const K& key)
+{
+   typedef hamt_map<K, V, H, E> map;
+   for (; e; e = hamt_bucket_next(e)) {
+      hamt_entry* table = (hamt_entry*)ptoptr(e->p);
+      int n = ctpop(hamt_datamap(e->korm));
+      for (int i = 0; i < n; i++) {
+         if (m->eq(map::key_slot::load(table[i].korm), key)) {
+            return table + i;
+         }
+      }
+   }
+   return 0;
+}
+
+template <typename K, typename V, typename H, typename E>
+void hamt_insert(hamt_map<K, V, H, E>* m, const K& key, const V& value)
+{
+   typedef hamt_map<K, V, H, E> map;
+   hamt* t = &m->h;
+   hamt_assert_in_place(t);
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash = m->hash(key);
+   uint32_t idx = HAMT_ROOT_IDX(t, hash);
+   hamt_entry* e = t->entries + idx;
+
+   if (e->p == 0) {
+      e->korm = map::key_slot::store(key);
+      e->p = map::value_slot::store(value) | 0x1;
+   } else if (e->p & 0x1) {
+      if (m->eq(map::key_slot::load(e->korm), key)) {
+         map::value_slot::release(e->p);
+         e->p = map::value_slot::store(value) | 0x1;
+      } else {
+         hamt_entry leaf = {map::key_slot::store(key), map::value_slot::store(value) | 0x1};
+         hamt_make_pair(t, e, *e, m->hash(map::key_slot::load(e->korm)), leaf, hash, shift_bits);
+      }
+   } else {
+      for (;;) {
+         if (hamt_is_bucket(shift_bits)) {
+            hamt_entry* c = hamt_bucket_find(m, e, key);
+            if (!c) {
+               hamt_entry leaf = {map::key_slot::store(key), map::value_slot::store(value) | 0x1};
+               hamt_bucket_add(t, e, leaf);
+            } else {
+               map::value_slot::release(c->p);
+               c->p = map::value_slot::store(value) | 0x1;
+            }
+            break;
+         }
+
+         idx = TOIDX(hash);
+         hamt_entry* c = hamt_child(e, idx);
+
+         if (!c) {
+            hamt_table_add(t, e, idx, map::key_slot::store(key), map::value_slot::store(value) | 0x1);
+            break;
+         }
+
+         if (c->p & 0x2) {
+            e = c;
+            shift_bits += HAMT_T_BITS;
+            continue;
+         }
+
+         if (m->eq(map::key_slot::load(c->korm), key)) {
+            map::value_slot::release(c->p);
+            c->p = map::value_slot::store(value) | 0x1;
+         } else {
+            hamt_entry leaf = {map::key_slot::store(key), map::value_slot::store(value) | 0x1};
+            hamt_entry n;
+            hamt_make_pair(t, &n, *c, m->hash(map::key_slot::load(c->korm)), leaf, hash, shift_bits + HAMT_T_BITS);
+            hamt_table_to_node(e, idx, n);
+         }
+         break;
+      }
+   }
+
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+}
+
+// returns 1 and sets *value when key is found
+template <typename K, typename V, typename H, typename E>
+int hamt_find(hamt_map<K, V, H, E>* m, const K& key, V* value)
+{
+   typedef hamt_map<K, V, H, E> map;
+   hamt* t = &m->h;
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash = m->hash(key);
+   hamt_entry* e = t->entries + HAMT_ROOT_IDX(t, hash);
+
+   if (!e->p) {
+      return 0;
+   }
+
+   while (e->p & 0x2) {
+      if (hamt_is_bucket(shift_bits)) {
+         e = hamt_bucket_find(m, e, key);
+         if (!e) {
+            return 0;
+         }
+         break;
+      }
+      e = hamt_child(e, TOIDX(hash));
+      if (!e) {
+         return 0;
+      }
+      shift_bits += HAMT_T_BITS;
+   }
+
+   if (m->eq(map::key_slot::load(e->korm), key)) {
+      if (value) {
+         *value = map::value_slot::load(e->p);
+      }
+      return 1;
+   }
+   return 0;
+}
+
+template <typename K, typename V, typename H, typename E>
+int hamt_remove_recur(hamt_map<K, V, H, E>* m, hamt_entry* e, uint32_t shift_bits, uint32_t hash, const K& key, V* value)
+{
+   typedef hamt_map<K, V, H, E> map;
+   int result = 0;
+
+   if (hamt_is_bucket(shift_bits)) {
+      hamt_entry* c = hamt_bucket_find(m, e, key);
+      if (c) {
+         if (value) {
+            *value = map::value_slot::load(c->p);
+         }
+         map::key_slot::release(c->korm);
+         map::value_slot::release(c->p);
+         hamt_bucket_remove(&m->h, e, c);
+         result = 1;
+      }
+      return result;
+   }
+
+   uint32_t idx = TOIDX(hash);
+   hamt_entry* c = hamt_child(e, idx);
+
+   if (!c) {
+      return 0;
+   }
+
+   if (c->p & 0x2) {
+      result = hamt_remove_recur(m, c, shift_bits + HAMT_T_BITS, hash, key, value);
+      if (result && hamt_is_single_leaf(c)) {
+         hamt_table_inline(&m->h, e, idx);
+      }
+   } else if (m->eq(map::key_slot::load(c->korm), key)) {
+      if (value) {
+         *value = map::value_slot::load(c->p);
+      }
+      map::key_slot::release(c->korm);
+      map::value_slot::release(c->p);
+      hamt_table_remove(&m->h, e, idx);
+      result = 1;
+   }
+
+   return result;
+}
+
+// returns 1 and sets *value (if not 0) when key was removed
+template <typename K, typename V, typename H, typename E>
+int hamt_remove(hamt_map<K, V, H, E>* m, const K& key, V* value = 0)
+{
+   typedef hamt_map<K, V, H, E> map;
+   hamt* t = &m->h;
+   uint32_t shift_bits = t->root_bits;
+   uint32_t hash = m->hash(key);
+   hamt_entry* e = t->entries + HAMT_ROOT_IDX(t, hash);
+   int result = 0;
+
+   if (e->p & 0x1) {
+      if (m->eq(map::key_slot::load(e->korm), key)) {
+         if (value) {
+            *value = map::value_slot::load(e->p);
+         }
+         map::key_slot::release(e->korm);
+         map::value_slot::release(e->p);
+         e->p = 0;
+         e->korm = 0;
+         result = 1;
+      }
+   } else if (e->p & 0x2) {
+      result = hamt_remove_recur(m, e, shift_bits, hash, key, value);
+      if (result) {
+         hamt_root_inline(t, e);
+      }
+   }
+
+   if (t->compact_budget) {
+      hamt_compact_step(t, t->compact_budget);
+   }
+   return result;
+}
+
+template <typename K, typename V, typename H, typename E, typename F>
+void hamt_for_each_entry(hamt_entry* e, F& fn)
+{
+   typedef hamt_map<K, V, H, E> map;
+   if (e->p & 0x1) {
+      fn(map::key_slot::load(e->korm), map::value_slot::load(e->p));
+   } else if (e->p & 0x2) {
+      hamt_entry* se = (hamt_entry*)ptoptr(e->p);
+      int data_count = ctpop(hamt_datamap(e->korm));
+      int table_size = hamt_table_size(e->korm);
+      for (int i = 0; i < data_count; i++) {
+         fn(map::key_slot::load(se[i].korm), map::value_slot::load(se[i].p));
+      }
+      for (int i = data_count; i < table_size; i++) {
+         hamt_for_each_entry<K, V, H, E>(se + i, fn);
+      }
+   }
+}
+
+// call fn(key, value) for every entry
+template <typename K, typename V, typename H, typename E, typename F>
+void hamt_for_each(hamt_map<K, V, H, E>* m, F fn)
+{
+   for (uint32_t i = 0; i < HAMT_ROOT_SIZE(&m->h); i++) {
+      hamt_for_each_entry<K, V, H, E>(m->h.entries + i, fn);
+   }
+}
+
+#endif
+
+#endif
+
@@ -0,0 +1,532 @@
+// Throughput and memory of hamt and hamt_int against std::unordered_map and
+// a sorted std::vector searched with lower_bound.
+//
+//   make hamt_bench && ./hamt_bench [max keys]
+//
+// Sizes go up by 10x from 1000 to max keys (default 1000000). Small sizes
+// are repeated so every timing covers about a million operations.
+
+#define HAMT_IMPLEMENATION
+#include "hamt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define BENCH_MIN_OPS 1000000
+
+static volatile uintptr_t sink;
+
+static double now_ns()
+{
+   return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// bytes allocated by the unordered_maps
+static size_t map_bytes = 0;
+
+template <typename T>
+struct counting_allocator
+{
+   typedef T value_type;
+
+   counting_allocator() {}
+   template <typename U> counting_allocator(const counting_allocator<U>&) {}
+
+   T* allocate(size_t n)
+   {
+      map_bytes += n * sizeof(T);
+      return (T*)malloc(n * sizeof(T));
+   }
+
+   void deallocate(T* p, size_t n)
+   {
+      map_bytes -= n * sizeof(T);
+      free(p);
+   }
+
+   template <typename U> bool operator==(const counting_allocator<U>&) const { return true; }
+   template <typename U> bool operator!=(const counting_allocator<U>&) const { return false; }
+};
+
+uint32_t hash_string_key(void* k, int level)
+{
+   return hamt_hash_key((const char*)k, (uint32_t)strlen((const char*)k), level);
+}
+
+// both sides hash strings with hamt_hash_key
+struct string_hash
+{
+   size_t operator()(const char* k) const { return hamt_hash_key(k, (uint32_t)strlen(k), 0); }
+};
+
+struct string_equal
+{
+   bool operator()(const char* a, const char* b) const { return strcmp(a, b) == 0; }
+};
+
+typedef std::unordered_map<const char*, void*, string_hash, string_equal,
+                           counting_allocator<std::pair<const char* const, void*> > > string_map;
+typedef std::unordered_map<int64_t, void*, std::hash<int64_t>, std::equal_to<int64_t>,
+                           counting_allocator<std::pair<const int64_t, void*> > > int_map;
+
+typedef struct bench_result
+{
+   double insert;
+   double hit;
+   double miss;
+   double iterate;
+   double remove;
+   double compact; // ms for the whole table, < 0 when not supported
+   double bytes_per_key; // everything allocated
+   double live_per_key; // without freelists and unused pool space
+} bench_result;
+
+void print_header()
+{
+   printf("%-10s %-20s %9s %9s %9s %9s %9s %11s %10s %9s\n",
+          "keys", "structure", "insert", "hit", "miss", "iterate", "remove", "compact ms", "bytes/key", "live/key");
+}
+
+void print_result(int n, const char* name, bench_result* r)
+{
+   printf("%-10i %-20s %9.1f %9.1f %9.1f %9.1f ", n, name, r->insert, r->hit, r->miss, r->iterate);
+   if (r->remove < 0) {
+      printf("%9s ", "-");
+   } else {
+      printf("%9.1f ", r->remove);
+   }
+   if (r->compact < 0) {
+      printf("%11s", "-");
+   } else {
+      printf("%11.2f", r->compact);
+   }
+   printf(" %10.1f %9.1f\n", r->bytes_per_key, r->live_per_key);
+}
+
+// n keys with distinct 32 bit hashes, so no lookup goes through a collision
+// bucket, followed by n keys that are never inserted. Each miss is a hit key
+// with a suffix, so in sorted order the misses fall between the hits.
+char** make_string_keys(int n)
+{
+   char** keys = (char**)malloc(sizeof(char*) * n * 2);
+   char* memory = (char*)malloc((size_t)n * 2 * 24);
+   std::unordered_set<uint32_t> hashes;
+   char* p = memory;
+
+   int i = 0;
+   for (uint32_t k = 0; i < n; k++) {
+      int len = sprintf(p, "key:%u", k * 2654435761u);
+      if (hashes.insert(hamt_hash_key(p, len, 0)).second) {
+         keys[i++] = p;
+         p += len + 1;
+      }
+   }
+   for (int k = 0; k < n; k++) {
+      keys[n + k] = p;
+      p += sprintf(p, "%s~", keys[k]) + 1;
+   }
+   return keys;
+}
+
+int reps_for(int n)
+{
+   return n < BENCH_MIN_OPS ? BENCH_MIN_OPS / n : 1;
+}
+
+void bench_hamt(int n, char** keys, bench_result* r)
+{
+   int reps = reps_for(n);
+   double insert = 0, hit = 0, miss = 0, iterate = 0, remove = 0, compact = 0, bytes = 0, live = 0;
+
+   for (int rep = 0; rep < reps; rep++) {
+      hamt t = {0};
+      hamt_init(&t, hash_string_key, compare_string_key);
+
+      double start = now_ns();
+      for (int i = 0; i < n; i++) {
+         hamt_insert(&t, keys[i], (void*)(uintptr_t)((i + 1) * 4));
+      }
+      double end = now_ns();
+      insert += end - start;
+
+      uintptr_t found = 0;
+      start = now_ns();
+      for (int i = 0; i < n; i++) {
+         found += (uintptr_t)hamt_find(&t, keys[i]);
+      }
+      end = now_ns();
+      hit += end - start;
+
+      start = now_ns();
+      for (int i = n; i < n * 2; i++) {
+         found += (uintptr_t)hamt_find(&t, keys[i]);
+      }
+      end = now_ns();
+      miss += end - start;
+
+      start = now_ns();
+      hamt_iterator it;
+      for (hamt_iterator_begin(&it, &t); !hamt_iterator_is_end(&it); hamt_iterator_next(&it)) {
+         found += (uintptr_t)hamt_value(&it);
+      }
+      end = now_ns();
+      iterate += end - start;
+
+      hamt_stats stats;
+      hamt_stats_memory(&t, &stats);
+      bytes += (double)(stats.pool_bytes + sizeof(hamt)) / n;
+      live += (double)(stats.live_bytes + sizeof(hamt)) / n;
+
+      start = now_ns();
+      for (int i = 0; i < n; i += 2) {
+         found += (uintptr_t)hamt_remove(&t, keys[i]);
+      }
+      end = now_ns();
+      remove += end - start;
+
+      start = now_ns();
+      hamt_compact(&t);
+      end = now_ns();
+      compact += end - start;
+
+      sink += found;
+      hamt_destroy(&t);
+   }
+
+   r->insert = insert / reps / n;
+   r->hit = hit / reps / n;
+   r->miss = miss / reps / n;
+   r->iterate = iterate / reps / n;
+   r->remove = remove / reps / ((n + 1) / 2);
+   r->compact = compact / reps / 1e6;
+   r->bytes_per_key = bytes / reps;
+   r->live_per_key = live / reps;
+}
+
+void bench_string_map(int n, char** keys, bench_result* r)
+{
+   int reps = reps_for(n);
+   double insert = 0, hit = 0, miss = 0, iterate = 0, remove = 0, bytes = 0;
+
+   for (int rep = 0; rep < reps; rep++) {
+      string_map* m = new string_map();
+
+      double start = now_ns();
+      for (int i = 0; i < n; i++) {
+         (*m)[keys[i]] = (void*)(uintptr_t)((i + 1) * 4);
+      }
+      double end = now_ns();
+      insert += end - start;
+
+      uintptr_t found = 0;
+      start = now_ns();
+      for (int i = 0; i < n; i++) {
+         string_map::iterator f = m->find(keys[i]);
+         found += f == m->end() ? 0 : (uintptr_t)f->second;
+      }
+      end = now_ns();
+      hit += end - start;
+
+      start = now_ns();
+      for (int i = n; i < n * 2; i++) {
+         string_map::iterator f = m->find(keys[i]);
+         found += f == m->end() ? 0 : (uintptr_t)f->second;
+      }
+      end = now_ns();
+      miss += end - start;
+
+      start = now_ns();
+      for (string_map::iterator it = m->begin(); it != m->end(); ++it) {
+         found += (uintptr_t)it->second;
+      }
+      end = now_ns();
+      iterate += end - start;
+
+      bytes += (double)(map_bytes + sizeof(string_map)) / n;
+
+      start = now_ns();
+      for (int i = 0; i < n; i += 2) {
+         found += m->erase(keys[i]);
+      }
+      end = now_ns();
+      remove += end - start;
+
+      sink += found;
+      delete m;
+   }
+
+   r->insert = insert / reps / n;
+   r->hit = hit / reps / n;
+   r->miss = miss / reps / n;
+   r->iterate = iterate / reps / n;
+   r->remove = remove / reps / ((n + 1) / 2);
+   r->compact = -1;
+   r->bytes_per_key = bytes / reps;
+   r->live_per_key = r->bytes_per_key;
+}
+
+// the even ids are inserted, in order like entity ids, and the odd ones
+// between them are the misses
+int64_t int_key(int n, int i)
+{
+   return i < n ? (int64_t)i * 2 : (int64_t)(i - n) * 2 + 1;
+}
+
+void bench_hamt_int(int n, bench_result* r)
+{
+   int reps = reps_for(n);
+   double insert = 0, hit = 0, miss = 0, iterate = 0, remove = 0, compact = 0, bytes = 0, live = 0;
+
+   for (int rep = 0; rep < reps; rep++) {
+      hamt_int t = {0};
+      hamt_int_init(&t);
+
+      double start = now_ns();
+      for (int i = 0; i < n; i++) {
+         hamt_int_insert(&t, int_key(n, i), (void*)(uintptr_t)((i + 1) * 4));
+      }
+      double end = now_ns();
+      insert += end - start;
+
+      uintptr_t found = 0;
+      start = now_ns();
+      for (int i = 0; i < n; i++) {
+         found += (uintptr_t)hamt_int_find(&t, int_key(n, i));
+      }
+      end = now_ns();
+      hit += end - start;
+
+      start = now_ns();
+      for (int i = n; i < n * 2; i++) {
+         found += (uintptr_t)hamt_int_find(&t, int_key(n, i));
+      }
+      end = now_ns();
+      miss += end - start;
+
+      start = now_ns();
+      hamt_iterator it;
+      for (hamt_iterator_begin(&it, &t.h); !hamt_iterator_is_end(&it); hamt_iterator_next(&it)) {
+         found += (uintptr_t)hamt_value(&it);
+      }
+      end = now_ns();
+      iterate += end - start;
+
+      hamt_stats stats;
+      hamt_stats_memory(&t.h, &stats);
+      bytes += (double)(stats.pool_bytes + sizeof(hamt_int)) / n;
+      live += (double)(stats.live_bytes + sizeof(hamt_int)) / n;
+
+      start = now_ns();
+      for (int i = 0; i < n; i += 2) {
+         found += (uintptr_t)hamt_int_remove(&t, int_key(n, i));
+      }
+      end = now_ns();
+      remove += end - start;
+
+      start = now_ns();
+      hamt_compact(&t.h);
+      end = now_ns();
+      compact += end - start;
+
+      sink += found;
+      hamt_destroy(&t.h);
+   }
+
+   r->insert = insert / reps / n;
+   r->hit = hit / reps / n;
+   r->miss = miss / reps / n;
+   r->iterate = iterate / reps / n;
+   r->remove = remove / reps / ((n + 1) / 2);
+   r->compact = compact / reps / 1e6;
+   r->bytes_per_key = bytes / reps;
+   r->live_per_key = live / reps;
+}
+
+void bench_int_map(int n, bench_result* r)
+{
+   int reps = reps_for(n);
+   double insert = 0, hit = 0, miss = 0, iterate = 0, remove = 0, bytes = 0;
+
+   for (int rep = 0; rep < reps; rep++) {
+      int_map* m = new int_map();
+
+      double start = now_ns();
+      for (int i = 0; i < n; i++) {
+         (*m)[int_key(n, i)] = (void*)(uintptr_t)((i + 1) * 4);
+      }
+      double end = now_ns();
+      insert += end - start;
+
+      uintptr_t found = 0;
+      start = now_ns();
+      for (int i = 0; i < n; i++) {
+         int_map::iterator f = m->find(int_key(n, i));
+         found += f == m->end() ? 0 : (uintptr_t)f->second;
+      }
+      end = now_ns();
+      hit += end - start;
+
+      start = now_ns();
+      for (int i = n; i < n * 2; i++) {
+         int_map::iterator f = m->find(int_key(n, i));
+         found += f == m->end() ? 0 : (uintptr_t)f->second;
+      }
+      end = now_ns();
+      miss += end - start;
+
+      start = now_ns();
+      for (int_map::iterator it = m->begin(); it != m->end(); ++it) {
+         found += (uintptr_t)it->second;
+      }
+      end = now_ns();
+      iterate += end - start;
+
+      bytes += (double)(map_bytes + sizeof(int_map)) / n;
+
+      start = now_ns();
+      for (int i = 0; i < n; i += 2) {
+         found += m->erase(int_key(n, i));
+      }
+      end = now_ns();
+      remove += end - start;
+
+      sink += found;
+      delete m;
+   }
+
+   r->insert = insert / reps / n;
+   r->hit = hit / reps / n;
+   r->miss = miss / reps / n;
+   r->iterate = iterate / reps / n;
+   r->remove = remove / reps / ((n + 1) / 2);
+   r->compact = -1;
+   r->bytes_per_key = bytes / reps;
+   r->live_per_key = r->bytes_per_key;
+}
+
+// The sorted vector is built in one sort, so insert is the bulk load cost
+// per key, and it has no remove short of shifting half the array.
+
+typedef std::pair<const char*, void*> string_item;
+typedef std::pair<int64_t, void*> int_item;
+
+struct string_item_less
+{
+   bool operator()(const string_item& a, const string_item& b) const { return strcmp(a.first, b.first) < 0; }
+   bool operator()(const string_item& a, const char* b) const { return strcmp(a.first, b) < 0; }
+};
+
+struct int_item_less
+{
+   bool operator()(const int_item& a, const int_item& b) const { return a.first < b.first; }
+   bool operator()(const int_item& a, int64_t b) const { return a.first < b; }
+};
+
+template <typename Item, typename Key, typename Less>
+void bench_sorted(int n, Key (*key_at)(char**, int, int), char** keys, bench_result* r)
+{
+   int reps = reps_for(n);
+   double insert = 0, hit = 0, miss = 0, iterate = 0, bytes = 0;
+   Less less;
+
+   for (int rep = 0; rep < reps; rep++) {
+      std::vector<Item> v;
+
+      double start = now_ns();
+      v.reserve(n);
+      for (int i = 0; i < n; i++) {
+         v.push_back(Item(key_at(keys, n, i), (void*)(uintptr_t)((i + 1) * 4)));
+      }
+      std::sort(v.begin(), v.end(), less);
+      double end = now_ns();
+      insert += end - start;
+
+      uintptr_t found = 0;
+      start = now_ns();
+      for (int i = 0; i < n; i++) {
+         typename std::vector<Item>::iterator f = std::lower_bound(v.begin(), v.end(), key_at(keys, n, i), less);
+         found += f == v.end() || less(Item(key_at(keys, n, i), 0), *f) ? 0 : (uintptr_t)f->second;
+      }
+      end = now_ns();
+      hit += end - start;
+
+      start = now_ns();
+      for (int i = n; i < n * 2; i++) {
+         typename std::vector<Item>::iterator f = std::lower_bound(v.begin(), v.end(), key_at(keys, n, i), less);
+         found += f == v.end() || less(Item(key_at(keys, n, i), 0), *f) ? 0 : (uintptr_t)f->second;
+      }
+      end = now_ns();
+      miss += end - start;
+
+      start = now_ns();
+      for (typename std::vector<Item>::iterator it = v.begin(); it != v.end(); ++it) {
+         found += (uintptr_t)it->second;
+      }
+      end = now_ns();
+      iterate += end - start;
+
+      bytes += (double)(v.capacity() * sizeof(Item) + sizeof(v)) / n;
+      sink += found;
+   }
+
+   r->insert = insert / reps / n;
+   r->hit = hit / reps / n;
+   r->miss = miss / reps / n;
+   r->iterate = iterate / reps / n;
+   r->remove = -1;
+   r->compact = -1;
+   r->bytes_per_key = bytes / reps;
+   r->live_per_key = r->bytes_per_key;
+}
+
+const char* string_key_at(char** keys, int n, int i)
+{
+   return keys[i];
+}
+
+// the same ids as bench_hamt_int
+int64_t int_key_at(char** keys, int n, int i)
+{
+   return int_key(n, i);
+}
+
+int main(int argc, char** argv)
+{
+   int max_keys = argc > 1 ? atoi(argv[1]) : 1000000;
+   bench_result r;
+
+   printf("ns per operation, iterate is ns per key, remove takes every other key\n");
+   printf("sorted vector insert is one bulk sort, per key\n\n");
+   print_header();
+
+   for (int n = 1000; n <= max_keys; n *= 10) {
+      char** keys = make_string_keys(n);
+
+      bench_hamt(n, keys, &r);
+      print_result(n, "hamt", &r);
+      bench_string_map(n, keys, &r);
+      print_result(n, "unordered_map", &r);
+      bench_sorted<string_item, const char*, string_item_less>(n, string_key_at, keys, &r);
+      print_result(n, "sorted vector", &r);
+
+      bench_hamt_int(n, &r);
+      print_result(n, "hamt_int", &r);
+      bench_int_map(n, &r);
+      print_result(n, "unordered_map<int64>", &r);
+      bench_sorted<int_item, int64_t, int_item_less>(n, int_key_at, keys, &r);
+      print_result(n, "sorted vector<int64>", &r);
+      printf("\n");
+
+      free(keys[0]);
+      free(keys);
+   }
+
+   return 0;
+}